@@ -1,7 +1,37 @@
 dnl * I/O loop function
 AC_DEFUN([DOVECOT_IOLOOP], [
   have_ioloop=no
-  
+
+  dnl * io_uring isn't part of "best", since it may be disabled at runtime
+  dnl * (e.g. kernel.io_uring_disabled sysctl or seccomp filters)
+  AS_IF([test "$ioloop" = "uring"], [
+    AC_CACHE_CHECK([whether we can use io_uring],i_cv_io_uring_works,[
+      AC_RUN_IFELSE([AC_LANG_PROGRAM([[
+        #include <string.h>
+        #include <unistd.h>
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+      ]], [[
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        if (syscall(__NR_io_uring_setup, 4, &p) < 0)
+          return 1;
+        return (p.features & IORING_FEAT_EXT_ARG) == 0 ||
+               (p.features & IORING_FEAT_NODROP) == 0;
+      ]])],[
+        i_cv_io_uring_works=yes
+      ], [
+        i_cv_io_uring_works=no
+      ],[])
+    ])
+    AS_IF([test $i_cv_io_uring_works = yes], [
+      AC_DEFINE(IOLOOP_URING,, [Implement I/O loop with Linux io_uring])
+      have_ioloop=yes
+    ], [
+      AC_MSG_ERROR([uring ioloop requested but io_uring is not available (needs Linux v5.11+)])
+    ])
+  ])
+
   AS_IF([test "$ioloop" = "best" || test "$ioloop" = "epoll"], [
     AC_CACHE_CHECK([whether we can use epoll],i_cv_epoll_works,[
       AC_RUN_IFELSE([AC_LANG_PROGRAM([[
@@ -51,4 +81,21 @@ AC_DEFUN([DOVECOT_IOLOOP], [
     AC_DEFINE(IOLOOP_SELECT,, [Implement I/O loop with select()])
     ioloop="select"
   ])
+
+  dnl * test-ioloop-uring runs the ioloop tests with the io_uring handler
+  dnl * even when it's not the one that was selected
+  AC_CACHE_CHECK([whether io_uring headers are usable],i_cv_io_uring_headers,[
+    AC_COMPILE_IFELSE([AC_LANG_PROGRAM([[
+      #include <linux/io_uring.h>
+    ]], [[
+      struct io_uring_getevents_arg arg;
+      arg.ts = 0;
+      return IORING_ENTER_EXT_ARG | IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+    ]])],[
+      i_cv_io_uring_headers=yes
+    ], [
+      i_cv_io_uring_headers=no
+    ])
+  ])
+  AM_CONDITIONAL(BUILD_IOLOOP_URING_TEST, test "$i_cv_io_uring_headers" = "yes")
 ])
@@ -0,0 +1,331 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "common.h"
+#include "ioloop.h"
+#include "net.h"
+#include "str.h"
+#include "strescape.h"
+#include "strnum.h"
+#include "guid.h"
+#include "time-util.h"
+#include "hostpid.h"
+#include "lib-signals.h"
+#include "anvil-client.h"
+#include "master-service.h"
+#include "connect-limit-shm.h"
+#include "connect-limit.h"
+#include "penalty.h"
+#include "admin-client.h"
+#include "anvil-connection.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/**
+ * Simulates a login storm with mail_max_userip_connections enabled. An
+ * anvil process is started with the real anvil protocol code, and the given
+ * number of login processes each run logins as fast as they can. Every
+ * login looks up the user's current connection count, sends CONNECT and
+ * later DISCONNECT to anvil. The lookups are done either by sending a LOOKUP
+ * query to anvil or from the anvil_connect_limit_shm_size shared memory
+ * table. Each login process waits for anvil to have handled all of its
+ * commands before finishing.
+ */
+
+#define BENCH_DEFAULT_PROCESSES 8
+#define BENCH_DEFAULT_LOGINS 20000
+#define BENCH_USER_COUNT 1000
+/* How many sessions each login process keeps connected */
+#define BENCH_SESSION_WINDOW 16
+#define BENCH_SHM_SIZE (16*1024*1024)
+#define BENCH_SOCKET_PATH "bench-anvil"
+
+struct bench_session {
+	guid_128_t guid;
+	char *cmd_suffix;
+};
+
+struct connect_limit *connect_limit;
+struct penalty *penalty;
+bool anvil_restarted = FALSE;
+
+static struct connect_limit_shm *bench_shm;
+static int bench_listen_fd;
+static struct io *bench_listen_io;
+
+void anvil_refresh_proctitle_delayed(void)
+{
+}
+
+#undef admin_cmd_send
+void admin_cmd_send(const char *service ATTR_UNUSED, pid_t pid ATTR_UNUSED,
+		    const char *cmd ATTR_UNUSED,
+		    admin_cmd_callback_t *callback, void *context)
+{
+	callback(NULL, "Not supported", context);
+}
+
+static void bench_anvil_accept(void *context ATTR_UNUSED)
+{
+	int fd;
+
+	fd = net_accept(bench_listen_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (fd < 0)
+		i_fatal("accept() failed: %m");
+	master_service_client_connection_created(master_service);
+	anvil_connection_create(fd, FALSE, FALSE);
+}
+
+static void bench_anvil_stop(struct ioloop *ioloop)
+{
+	io_loop_stop(ioloop);
+}
+
+static void bench_anvil_run(int shm_fd, int ready_fd, int stop_fd)
+{
+	struct connect_limit_shm *shm = NULL;
+	struct ioloop *ioloop;
+	struct io *stop_io;
+	const char *error;
+
+	/* don't share the parent's epoll instance */
+	ioloop = io_loop_create();
+	master_service_set_client_limit(master_service, 1024);
+	master_service_set_service_count(master_service, UINT_MAX);
+
+	if (shm_fd != -1 &&
+	    connect_limit_shm_open(shm_fd, TRUE, &shm, &error) <= 0)
+		i_fatal("connect_limit_shm_open() failed: %s", error);
+	connect_limit = connect_limit_init(shm);
+	penalty = penalty_init();
+	anvil_connections_init(".", 100);
+	admin_clients_init();
+
+	i_unlink_if_exists(BENCH_SOCKET_PATH);
+	bench_listen_fd = net_listen_unix(BENCH_SOCKET_PATH, 128);
+	if (bench_listen_fd == -1)
+		i_fatal("net_listen_unix(%s) failed: %m", BENCH_SOCKET_PATH);
+	bench_listen_io = io_add(bench_listen_fd, IO_READ,
+				 bench_anvil_accept, NULL);
+	/* the parent closes the pipe when it wants us to stop */
+	stop_io = io_add(stop_fd, IO_READ, bench_anvil_stop, ioloop);
+	if (write(ready_fd, "", 1) != 1)
+		i_fatal("write(ready fd) failed: %m");
+	i_close_fd(&ready_fd);
+
+	io_loop_run(ioloop);
+
+	io_remove(&stop_io);
+	io_remove(&bench_listen_io);
+	i_close_fd(&bench_listen_fd);
+	i_unlink(BENCH_SOCKET_PATH);
+	admin_clients_deinit();
+	anvil_connections_deinit();
+	penalty_deinit(&penalty);
+	connect_limit_deinit(&connect_limit);
+	connect_limit_shm_close(&shm);
+	io_loop_destroy(&ioloop);
+}
+
+static void bench_lookup_callback(const char *reply, const char **reply_r)
+{
+	*reply_r = reply == NULL ? "" : t_strdup(reply);
+	io_loop_stop(current_ioloop);
+}
+
+static unsigned int
+bench_anvil_lookup(struct anvil_client *client, const char *cmd_suffix)
+{
+	const char *reply = NULL;
+	unsigned int count;
+
+	(void)anvil_client_query(client, t_strconcat("LOOKUP\t", cmd_suffix,
+						     NULL),
+				 ANVIL_DEFAULT_LOOKUP_TIMEOUT_MSECS,
+				 bench_lookup_callback, &reply);
+	io_loop_run(current_ioloop);
+	if (str_to_uint(reply, &count) < 0)
+		i_fatal("Invalid LOOKUP reply: '%s'", reply);
+	return count;
+}
+
+static void bench_login_run(unsigned int login_count)
+{
+	struct bench_session sessions[BENCH_SESSION_WINDOW];
+	struct anvil_client *client;
+	unsigned int i, count, user_idx, total_count = 0;
+	struct ip_addr ip;
+	struct ioloop *ioloop;
+
+	ioloop = io_loop_create();
+	client = anvil_client_init(BENCH_SOCKET_PATH, NULL, 0);
+	if (anvil_client_connect(client, TRUE) < 0)
+		i_fatal("Couldn't connect to anvil");
+
+	i_zero(&sessions);
+	for (i = 0; i < login_count; i++) T_BEGIN {
+		struct bench_session *session =
+			&sessions[i % BENCH_SESSION_WINDOW];
+		string_t *cmd = t_str_new(128);
+
+		if (session->cmd_suffix != NULL) {
+			anvil_client_cmd(client, t_strdup_printf(
+				"DISCONNECT\t%s\t%s\t%s",
+				guid_128_to_string(session->guid), my_pid,
+				session->cmd_suffix));
+			i_free(session->cmd_suffix);
+		}
+
+		user_idx = i_rand_limit(BENCH_USER_COUNT);
+		i_zero(&ip);
+		ip.family = AF_INET;
+		ip.u.ip4.s_addr = htonl(0x0a000000 + user_idx % 100);
+		str_append_tabescaped(cmd, t_strdup_printf("user%u@example.com",
+							   user_idx));
+		str_printfa(cmd, "\timap\t%s", net_ip2addr(&ip));
+
+		if (bench_shm == NULL)
+			count = bench_anvil_lookup(client, str_c(cmd));
+		else if (!connect_limit_shm_lookup(bench_shm,
+				t_strdup_printf("user%u@example.com", user_idx),
+				"imap", &ip, &count))
+			count = bench_anvil_lookup(client, str_c(cmd));
+		total_count += count;
+
+		guid_128_generate(session->guid);
+		session->cmd_suffix = i_strdup(str_c(cmd));
+		anvil_client_cmd(client, t_strdup_printf(
+			"CONNECT\t%s\t%s\t%s\tN\t",
+			guid_128_to_string(session->guid), my_pid,
+			session->cmd_suffix));
+	} T_END;
+
+	for (i = 0; i < BENCH_SESSION_WINDOW; i++) {
+		if (sessions[i].cmd_suffix == NULL)
+			continue;
+		anvil_client_cmd(client, t_strdup_printf(
+			"DISCONNECT\t%s\t%s\t%s",
+			guid_128_to_string(sessions[i].guid), my_pid,
+			sessions[i].cmd_suffix));
+		i_free(sessions[i].cmd_suffix);
+	}
+	/* wait for anvil to finish handling our commands */
+	(void)bench_anvil_lookup(client, "user\timap\t");
+	if (total_count == 0)
+		i_fatal("Lookups didn't see any existing connections");
+
+	anvil_client_deinit(&client);
+	io_loop_destroy(&ioloop);
+}
+
+static pid_t bench_fork(void)
+{
+	pid_t pid;
+
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		i_fatal("fork() failed: %m");
+	return pid;
+}
+
+static void bench_wait(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0)
+		i_fatal("waitpid() failed: %m");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		i_fatal("Child process %ld failed", (long)pid);
+}
+
+static void
+bench_run(const char *name, int anvil_shm_fd, int login_shm_fd,
+	  unsigned int process_count, unsigned int login_count)
+{
+	pid_t anvil_pid, pids[process_count];
+	const char *error;
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+	int ready_fd[2], stop_fd[2];
+	char c;
+
+	if (pipe(ready_fd) < 0 || pipe(stop_fd) < 0)
+		i_fatal("pipe() failed: %m");
+	if ((anvil_pid = bench_fork()) == 0) {
+		i_close_fd(&ready_fd[0]);
+		i_close_fd(&stop_fd[1]);
+		bench_anvil_run(anvil_shm_fd, ready_fd[1], stop_fd[0]);
+		lib_exit(0);
+	}
+	i_close_fd(&ready_fd[1]);
+	i_close_fd(&stop_fd[0]);
+	if (read(ready_fd[0], &c, 1) != 1)
+		i_fatal("anvil process failed to start");
+	i_close_fd(&ready_fd[0]);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < process_count; i++) {
+		if ((pids[i] = bench_fork()) == 0) {
+			i_close_fd(&stop_fd[1]);
+			if (login_shm_fd != -1 &&
+			    connect_limit_shm_open(login_shm_fd, FALSE,
+						   &bench_shm, &error) <= 0)
+				i_fatal("connect_limit_shm_open() failed: %s",
+					error);
+			bench_login_run(login_count);
+			connect_limit_shm_close(&bench_shm);
+			lib_exit(0);
+		}
+	}
+	for (i = 0; i < process_count; i++)
+		bench_wait(pids[i]);
+	ts_1 = i_nanoseconds();
+
+	i_close_fd(&stop_fd[1]);
+	bench_wait(anvil_pid);
+
+	printf("%s: %u processes: %.0lf logins/sec\n", name, process_count,
+	       (double)process_count * login_count * 1e9 / (ts_1 - ts_0));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int process_count = BENCH_DEFAULT_PROCESSES;
+	unsigned int login_count = BENCH_DEFAULT_LOGINS;
+	const char *error;
+	int rw_fd, ro_fd;
+
+	master_service = master_service_init("bench-connect-limit",
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_NO_SSL_INIT, &argc, &argv, "");
+	master_service_init_finish(master_service);
+	/* the child processes create their own ioloops */
+	lib_signals_ioloop_detach();
+
+	if (argc > 3 ||
+	    (argc > 1 && (str_to_uint(argv[1], &process_count) < 0 ||
+			  process_count == 0)) ||
+	    (argc > 2 && (str_to_uint(argv[2], &login_count) < 0 ||
+			  login_count == 0))) {
+		fprintf(stderr, "Usage: %s [<processes> [<logins>]]\n",
+			argv[0]);
+		return FATAL_DEFAULT;
+	}
+	if (connect_limit_shm_create(".", BENCH_SHM_SIZE, &rw_fd, &ro_fd,
+				     &error) < 0)
+		i_fatal("connect_limit_shm_create() failed: %s", error);
+
+	bench_run("anvil LOOKUP", -1, -1, process_count, login_count);
+	bench_run("shared memory", rw_fd, ro_fd, process_count, login_count);
+
+	i_close_fd(&rw_fd);
+	i_close_fd(&ro_fd);
+	lib_signals_ioloop_attach();
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -9,6 +9,7 @@
 #include "str-table.h"
 #include "strescape.h"
 #include "ostream.h"
+#include "connect-limit-shm.h"
 #include "connect-limit.h"
 
 struct process {
@@ -87,6 +88,11 @@ struct connect_limit {
 	/* alt_username => struct session linked list. This array is resized
 	   every time a new alt_username_field index is added. */
 	HASH_TABLE_TYPE(session_alt_username) *alt_username_hashes;
+
+	/* Shared memory copy of userip_hash counts, or NULL if disabled */
+	struct connect_limit_shm *shm;
+	/* The shm table was full even after rebuilding it */
+	bool shm_full;
 };
 
 struct connect_limit_iter {
@@ -117,7 +123,67 @@ static int userip_cmp(const struct userip *userip1,
 	return strcmp(userip1->protocol, userip2->protocol);
 }
 
-struct connect_limit *connect_limit_init(void)
+static bool connect_limit_shm_can_rebuild(struct connect_limit *limit)
+{
+	return hash_table_count(limit->userip_hash) <=
+		connect_limit_shm_get_max_keys(limit->shm) / 2;
+}
+
+static void connect_limit_shm_rebuild(struct connect_limit *limit)
+{
+	struct hash_iterate_context *iter;
+	struct userip *userip;
+	void *value;
+
+	if (!connect_limit_shm_can_rebuild(limit)) {
+		/* Not enough space to make rebuilding worthwhile. Leave the
+		   table unusable until enough users have disconnected. */
+		connect_limit_shm_invalidate(limit->shm);
+		if (!limit->shm_full) {
+			i_warning("connect limit: anvil_connect_limit_shm_size "
+				  "is too small for %u user+IP pairs - "
+				  "falling back to anvil lookups",
+				  hash_table_count(limit->userip_hash));
+			limit->shm_full = TRUE;
+		}
+		return;
+	}
+
+	connect_limit_shm_reset(limit->shm);
+	iter = hash_table_iterate_init(limit->userip_hash);
+	while (hash_table_iterate(iter, limit->userip_hash, &userip, &value)) {
+		if (!connect_limit_shm_set(limit->shm, userip->username,
+					   userip->protocol, &userip->ip,
+					   POINTER_CAST_TO(value, unsigned int)))
+			i_unreached();
+	}
+	hash_table_iterate_deinit(&iter);
+	connect_limit_shm_reset_finish(limit->shm);
+	limit->shm_full = FALSE;
+}
+
+static void
+connect_limit_shm_update(struct connect_limit *limit,
+			 const struct userip *userip, unsigned int count)
+{
+	if (limit->shm == NULL)
+		return;
+
+	if (limit->shm_full) {
+		/* try again once enough users have disconnected */
+		if (connect_limit_shm_can_rebuild(limit))
+			connect_limit_shm_rebuild(limit);
+		return;
+	}
+	if (!connect_limit_shm_set(limit->shm, userip->username,
+				   userip->protocol, &userip->ip, count)) {
+		/* The table is full of keys. Most of them are likely
+		   unused by now, so just rebuild the table. */
+		connect_limit_shm_rebuild(limit);
+	}
+}
+
+struct connect_limit *connect_limit_init(struct connect_limit_shm *shm)
 {
 	struct connect_limit *limit;
 
@@ -131,6 +197,11 @@ struct connect_limit *connect_limit_init(void)
 	hash_table_create(&limit->session_hash, default_pool, 0,
 			  guid_128_hash, guid_128_cmp);
 	hash_table_create_direct(&limit->process_hash, default_pool, 0);
+	limit->shm = shm;
+	if (shm != NULL) {
+		connect_limit_shm_reset(shm);
+		connect_limit_shm_reset_finish(shm);
+	}
 	return limit;
 }
 
@@ -434,11 +505,15 @@ void connect_limit_connect(struct connect_limit *limit, pid_t pid,
 						 userip_lookup.protocol);
 		userip->ip = key->ip;
 		value = POINTER_CAST(1);
-		if (SESSION_TRACK_USERIP(session))
+		if (SESSION_TRACK_USERIP(session)) {
 			hash_table_insert(limit->userip_hash, userip, value);
+			connect_limit_shm_update(limit, userip, 1);
+		}
 	} else {
 		value = POINTER_CAST(POINTER_CAST_TO(value, unsigned int) + 1);
 		hash_table_update(limit->userip_hash, userip, value);
+		connect_limit_shm_update(limit, userip,
+					 POINTER_CAST_TO(value, unsigned int));
 	}
 	session->userip = userip;
 
@@ -471,8 +546,10 @@ userip_hash_unref(struct connect_limit *limit, struct session *session)
 	if (new_refcount > 0) {
 		value = POINTER_CAST(new_refcount);
 		hash_table_update(limit->userip_hash, userip, value);
+		connect_limit_shm_update(limit, userip, new_refcount);
 	} else {
 		hash_table_remove(limit->userip_hash, userip);
+		connect_limit_shm_update(limit, userip, 0);
 		userip_free(limit, userip);
 	}
 }
@@ -4,6 +4,8 @@
 #include "net.h"
 #include "guid.h"
 
+struct connect_limit_shm;
+
 enum kick_type {
 	/* This process doesn't support kicking users */
 	KICK_TYPE_NONE,
@@ -39,7 +41,9 @@ struct connect_limit_iter_result {
 	guid_128_t conn_guid;
 };
 
-struct connect_limit *connect_limit_init(void);
+/* If shm is non-NULL, the userip connection counts are also kept updated in
+   it for connect_limit_shm_lookup(). */
+struct connect_limit *connect_limit_init(struct connect_limit_shm *shm);
 void connect_limit_deinit(struct connect_limit **limit);
 
 /* Get the number of connections matching the given key. Note that the service
@@ -12,6 +12,7 @@
 #include "master-service-settings.h"
 #include "master-interface.h"
 #include "admin-client-pool.h"
+#include "connect-limit-shm.h"
 #include "connect-limit.h"
 #include "penalty.h"
 #include "anvil-connection.h"
@@ -27,6 +28,7 @@ bool anvil_restarted;
 
 static bool verbose_proctitle = FALSE;
 static struct io *log_fdpass_io;
+static struct connect_limit_shm *connect_limit_shm;
 static struct admin_client_pool *admin_pool;
 static struct timeout *to_refresh;
 static unsigned int prev_cmd_counter = 0;
@@ -120,6 +122,17 @@ log_fdpass_input(void *context ATTR_UNUSED)
 	}
 }
 
+static void main_init_shm(void)
+{
+	const char *error;
+
+	if (connect_limit_shm_open(MASTER_ANVIL_SHM_FD, TRUE,
+				   &connect_limit_shm, &error) < 0)
+		i_error("%s", error);
+	if (close(MASTER_ANVIL_SHM_FD) < 0)
+		i_error("close(anvil shm) failed: %m");
+}
+
 static void main_init(void)
 {
 	const struct master_service_settings *set =
@@ -134,7 +147,7 @@ static void main_init(void)
 	admin_clients_init();
 	admin_pool = admin_client_pool_init(set->base_dir,
 					    ANVIL_CLIENT_POOL_MAX_CONNECTIONS);
-	connect_limit = connect_limit_init();
+	connect_limit = connect_limit_init(connect_limit_shm);
 	penalty = penalty_init();
 	log_fdpass_io = io_add(MASTER_ANVIL_LOG_FDPASS_FD, IO_READ,
 			       log_fdpass_input, NULL);
@@ -145,6 +158,7 @@ static void main_deinit(void)
 	io_remove(&log_fdpass_io);
 	penalty_deinit(&penalty);
 	connect_limit_deinit(&connect_limit);
+	connect_limit_shm_close(&connect_limit_shm);
 	admin_client_pool_deinit(&admin_pool);
 	admin_clients_deinit();
 	anvil_connections_deinit();
@@ -166,6 +180,7 @@ int main(int argc, char *argv[])
 		i_fatal("Error reading configuration: %s", error);
 	master_service_init_log(master_service);
 
+	main_init_shm();
 	restrict_access_by_env(RESTRICT_ACCESS_FLAG_ALLOW_ROOT, NULL);
 	restrict_access_allow_coredumps(TRUE);
 
@@ -5,6 +5,7 @@
 #include "ostream.h"
 #include "str.h"
 #include "sort.h"
+#include "connect-limit-shm.h"
 #include "connect-limit.h"
 
 static guid_128_t session1_guid = {
@@ -73,7 +74,7 @@ static void test_connect_limit(void)
 	struct connect_limit *limit;
 
 	test_begin("connect limit");
-	limit = connect_limit_init();
+	limit = connect_limit_init(NULL);
 
 	/* first key */
 	struct connect_limit_key key = {
@@ -218,10 +219,126 @@ static void test_connect_limit(void)
 	test_end();
 }
 
+static bool
+test_shm_lookup(struct connect_limit_shm *shm, const char *username,
+		const char *service, const char *ip_str, unsigned int *count_r)
+{
+	struct ip_addr ip;
+
+	i_zero(&ip);
+	if (ip_str != NULL && net_addr2ip(ip_str, &ip) < 0)
+		i_unreached();
+	return connect_limit_shm_lookup(shm, username, service, &ip, count_r);
+}
+
+static void test_connect_limit_shm(void)
+{
+	struct connect_limit_shm *shm_rw, *shm_ro;
+	struct connect_limit *limit;
+	struct ip_addr dest_ip;
+	guid_128_t guid;
+	const char *error;
+	unsigned int i, count;
+	int rw_fd, ro_fd;
+
+	test_begin("connect limit shm");
+	/* 16 slots, so at most 12 keys */
+	test_assert(connect_limit_shm_create(".", 16 + 16*16,
+					     &rw_fd, &ro_fd, &error) == 0);
+	test_assert(connect_limit_shm_open(rw_fd, TRUE, &shm_rw, &error) == 1);
+	test_assert(connect_limit_shm_open(ro_fd, FALSE, &shm_ro, &error) == 1);
+	i_close_fd(&rw_fd);
+	i_close_fd(&ro_fd);
+	test_assert(connect_limit_shm_get_max_keys(shm_ro) == 12);
+
+	/* unusable until anvil has reset it */
+	test_assert(!test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				     &count));
+	limit = connect_limit_init(shm_rw);
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				    &count) && count == 0);
+
+	struct connect_limit_key key = {
+		.username = "user1",
+		.service = "imap",
+	};
+	test_assert(net_addr2ip("1.2.3.4", &key.ip) == 0);
+	i_zero(&dest_ip);
+	for (i = 0; i < 3; i++) {
+		if (i == 2)
+			key.service = "imap-hibernate";
+		guid_128_generate(guid);
+		connect_limit_connect(limit, 500, &key, guid, KICK_TYPE_NONE,
+				      &dest_ip, NULL);
+	}
+	/* proxied sessions aren't counted */
+	test_assert(net_addr2ip("1.0.0.2", &dest_ip) == 0);
+	guid_128_generate(guid);
+	connect_limit_connect(limit, 500, &key, guid, KICK_TYPE_NONE,
+			      &dest_ip, NULL);
+	i_zero(&dest_ip);
+
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				    &count) && count == 3);
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap-hibernate",
+				    "1.2.3.4", &count) && count == 3);
+	test_assert(test_shm_lookup(shm_ro, "user1", "pop3", "1.2.3.4",
+				    &count) && count == 0);
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.5",
+				    &count) && count == 0);
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", NULL,
+				    &count) && count == 0);
+	test_assert(test_shm_lookup(shm_ro, "user2", "imap", "1.2.3.4",
+				    &count) && count == 0);
+
+	/* fill the table with too many users */
+	test_expect_error_string("anvil_connect_limit_shm_size is too small");
+	for (i = 0; i < 12; i++) {
+		key.username = t_strdup_printf("fill%u", i);
+		guid_128_generate(guid);
+		connect_limit_connect(limit, 501, &key, guid, KICK_TYPE_NONE,
+				      &dest_ip, NULL);
+	}
+	test_expect_no_more_errors();
+	test_assert(!test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				     &count));
+
+	/* the table is rebuilt once the users have disconnected */
+	connect_limit_disconnect_pid(limit, 501);
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				    &count) && count == 3);
+	test_assert(test_shm_lookup(shm_ro, "fill0", "imap", "1.2.3.4",
+				    &count) && count == 0);
+
+	/* keys of disconnected users are reused after the table is full */
+	for (i = 0; i < 30; i++) {
+		key.username = t_strdup_printf("reuse%u", i);
+		guid_128_generate(guid);
+		connect_limit_connect(limit, 502, &key, guid, KICK_TYPE_NONE,
+				      &dest_ip, NULL);
+		test_assert(test_shm_lookup(shm_ro, key.username, "imap",
+					    "1.2.3.4", &count) && count == 1);
+		connect_limit_disconnect_pid(limit, 502);
+		test_assert(test_shm_lookup(shm_ro, key.username, "imap",
+					    "1.2.3.4", &count) && count == 0);
+	}
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				    &count) && count == 3);
+
+	connect_limit_disconnect_pid(limit, 500);
+	test_assert(test_shm_lookup(shm_ro, "user1", "imap", "1.2.3.4",
+				    &count) && count == 0);
+	connect_limit_deinit(&limit);
+	connect_limit_shm_close(&shm_rw);
+	connect_limit_shm_close(&shm_ro);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_connect_limit,
+		test_connect_limit_shm,
 		NULL
 	};
 	return test_run(test_functions);
@@ -6,25 +6,105 @@
 #include "str.h"
 #include "strescape.h"
 #include "var-expand.h"
+#include "crc32.h"
+#include "mmap-util.h"
+#include "ostream.h"
 #include "auth-request.h"
 #include "auth-cache.h"
 #include "auth-common.h"
 
+#include <stdio.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Positive entries are kept in a segmented LRU: new entries are added to the
+   probation segment and they're moved to the protected segment only when
+   they're looked up again. This way a burst of one-time lookups (e.g. a
+   login storm) evicts only other probation entries, while the frequently
+   used entries stay in the protected segment. Negative entries have their
+   own list with a separate size limit, so they can't push out positive
+   entries at all. */
+enum auth_cache_segment {
+	AUTH_CACHE_SEGMENT_PROBATION = 0,
+	AUTH_CACHE_SEGMENT_PROTECTED,
+	AUTH_CACHE_SEGMENT_NEGATIVE,
+
+	AUTH_CACHE_SEGMENT_COUNT
+};
+
+/* Percentage of the positive entries' size that the protected segment
+   can use. */
+#define AUTH_CACHE_PROTECTED_PERCENTAGE 80
+/* Percentage of the cache size that negative entries can use. */
+#define AUTH_CACHE_NEGATIVE_PERCENTAGE 10
+
+static const char *const auth_cache_segment_names[] = {
+	"probation", "protected", "negative"
+};
+static_assert_array_size(auth_cache_segment_names, AUTH_CACHE_SEGMENT_COUNT);
+
+/* The cache file is written in host byte order. It's only meant to survive
+   restarts of the same auth process, so a different endianness is simply
+   detected as an invalid magic. */
+#define AUTH_CACHE_FILE_MAGIC 0xa0c4ec4eU
+#define AUTH_CACHE_FILE_VERSION 1
+/* Records are padded to this alignment, so the file can be used
+   directly via mmap() */
+#define AUTH_CACHE_FILE_ALIGN 8
+
+struct auth_cache_file_header {
+	uint32_t magic;
+	uint32_t version;
+	/* Hash of the passdb/userdb configuration. The cache keys contain
+	   the passdb/userdb IDs, which aren't valid if it changes. */
+	unsigned char db_hash[MD5_RESULTLEN];
+	uint32_t record_count;
+	/* crc32 of the records following the header */
+	uint32_t records_crc32;
+	uint64_t records_size;
+};
+
+struct auth_cache_file_record {
+	int64_t created;
+	/* Sizes of the key and the value, including their trailing NULs */
+	uint32_t key_size, value_size;
+	uint8_t segment;
+	uint8_t last_success;
+	uint8_t unused[6];
+	/* key \0 value \0 and padding to AUTH_CACHE_FILE_ALIGN follow */
+};
+
+struct auth_cache_list {
+	/* head is the most recently used node, tail the least recently used */
+	struct auth_cache_node *head, *tail;
+	size_t size;
+};
 
 struct auth_cache {
 	HASH_TABLE(char *, struct auth_cache_node *) hash;
-	struct auth_cache_node *head, *tail;
+	/* username => the first node in the user's node list. The key points
+	   to the username inside the node's key, so it's terminated either by
+	   \t or \0. */
+	HASH_TABLE(const char *, struct auth_cache_node *) users;
+	struct auth_cache_list lists[AUTH_CACHE_SEGMENT_COUNT];
 	struct event *event;
 
-	size_t max_size, size_left;
+	size_t max_size, pos_max_size, protected_max_size, neg_max_size;
 	unsigned int ttl_secs, neg_ttl_secs;
 
-	unsigned int hit_count, miss_count;
+	unsigned int hit_count, miss_count, eviction_count;
 	unsigned int pos_entries, neg_entries;
 	unsigned long long pos_size, neg_size;
+
+	/* File to load when the cache is accessed for the first time,
+	   see auth_cache_load_lazy() */
+	char *lazy_load_path;
+	unsigned char lazy_load_db_hash[MD5_RESULTLEN];
 };
 
+static void auth_cache_lazy_load(struct auth_cache *cache);
+
 static bool
 auth_request_var_expand_tab_find(const char *key, unsigned int size,
 				 unsigned int *idx_r)
@@ -145,36 +225,147 @@ char *auth_cache_parse_key(pool_t pool, const char *query)
 	return p_strdup(pool, str_c(str));
 }
 
+static const char *auth_cache_key_get_username(const char *key)
+{
+	/* The cache keys begin with "P"/"U", passdb/userdb ID, optional
+	   "+" master user, "\t" and then usually followed by the username.
+	   It's too much trouble to keep track of all the cache keys, so we'll
+	   just index it as if it was the username. If e.g. '%n' is used in the
+	   cache key instead of '%u', it means that cache entries can be
+	   removed only when @domain isn't in the username parameter. */
+	if (*key != 'P' && *key != 'U')
+		return NULL;
+	key++;
+
+	while (*key >= '0' && *key <= '9')
+		key++;
+	if (*key == '+') {
+		/* skip over +master_user */
+		while (*key != '\t' && *key != '\0')
+			key++;
+	}
+	if (*key != '\t')
+		return NULL;
+	return key + 1;
+}
+
+static unsigned int auth_cache_username_hash(const char *username)
+{
+	return mem_hash(username, strcspn(username, "\t"));
+}
+
+static int auth_cache_username_cmp(const char *username1,
+				   const char *username2)
+{
+	size_t len1 = strcspn(username1, "\t");
+	size_t len2 = strcspn(username2, "\t");
+
+	if (len1 != len2)
+		return len1 < len2 ? -1 : 1;
+	return memcmp(username1, username2, len1);
+}
+
 static void
-auth_cache_node_unlink(struct auth_cache *cache, struct auth_cache_node *node)
+auth_cache_list_unlink(struct auth_cache_list *list,
+		       struct auth_cache_node *node)
 {
 	if (node->prev != NULL)
 		node->prev->next = node->next;
 	else {
 		/* unlinking tail */
-		cache->tail = node->next;
+		list->tail = node->next;
 	}
 
 	if (node->next != NULL)
 		node->next->prev = node->prev;
 	else {
 		/* unlinking head */
-		cache->head = node->prev;
+		list->head = node->prev;
 	}
+	list->size -= node->alloc_size;
 }
 
 static void
-auth_cache_node_link_head(struct auth_cache *cache,
+auth_cache_list_link_head(struct auth_cache_list *list,
 			  struct auth_cache_node *node)
 {
-	node->prev = cache->head;
+	node->prev = list->head;
 	node->next = NULL;
 
-	cache->head = node;
+	list->head = node;
 	if (node->prev != NULL)
 		node->prev->next = node;
 	else
-		cache->tail = node;
+		list->tail = node;
+	list->size += node->alloc_size;
+}
+
+static void
+auth_cache_node_link_user(struct auth_cache *cache,
+			  struct auth_cache_node *node)
+{
+	const char *username = auth_cache_key_get_username(node->data);
+	struct auth_cache_node *first;
+
+	node->user_prev = node->user_next = NULL;
+	if (username == NULL)
+		return;
+
+	/* add after the first node, so the hash key stays valid */
+	first = hash_table_lookup(cache->users, username);
+	if (first == NULL) {
+		hash_table_insert(cache->users, username, node);
+		return;
+	}
+	node->user_prev = first;
+	node->user_next = first->user_next;
+	if (node->user_next != NULL)
+		node->user_next->user_prev = node;
+	first->user_next = node;
+}
+
+static void
+auth_cache_node_unlink_user(struct auth_cache *cache,
+			    struct auth_cache_node *node)
+{
+	const char *username;
+
+	if (node->user_prev != NULL)
+		node->user_prev->user_next = node->user_next;
+	else if ((username = auth_cache_key_get_username(node->data)) != NULL) {
+		/* the hash key points to this node's data. move it to point
+		   to the next node. */
+		hash_table_remove(cache->users, username);
+		if (node->user_next != NULL) {
+			username = auth_cache_key_get_username(
+				node->user_next->data);
+			hash_table_insert(cache->users, username,
+					  node->user_next);
+		}
+	}
+	if (node->user_next != NULL)
+		node->user_next->user_prev = node->user_prev;
+}
+
+static void
+auth_cache_node_move(struct auth_cache *cache, struct auth_cache_node *node,
+		     enum auth_cache_segment segment)
+{
+	auth_cache_list_unlink(&cache->lists[node->segment], node);
+	node->segment = segment;
+	auth_cache_list_link_head(&cache->lists[segment], node);
+}
+
+static void auth_cache_protected_trim(struct auth_cache *cache)
+{
+	struct auth_cache_list *list =
+		&cache->lists[AUTH_CACHE_SEGMENT_PROTECTED];
+
+	/* move the least recently used protected nodes back to probation */
+	while (list->size > cache->protected_max_size) {
+		auth_cache_node_move(cache, list->tail,
+				     AUTH_CACHE_SEGMENT_PROBATION);
+	}
 }
 
 static void
@@ -182,13 +373,65 @@ auth_cache_node_destroy(struct auth_cache *cache, struct auth_cache_node *node)
 {
 	char *key = node->data;
 
-	auth_cache_node_unlink(cache, node);
+	auth_cache_list_unlink(&cache->lists[node->segment], node);
+	auth_cache_node_unlink_user(cache, node);
 
-	cache->size_left += node->alloc_size;
 	hash_table_remove(cache->hash, key);
 	i_free(node);
 }
 
+static void
+auth_cache_node_evict(struct auth_cache *cache, struct auth_cache_node *node)
+{
+	const char *key = node->data;
+	struct event_passthrough *e =
+		event_create_passthrough(cache->event)->
+		set_name("auth_cache_entry_evicted")->
+		add_str("cache_segment",
+			auth_cache_segment_names[node->segment]);
+	size_t id_len = strspn(key + 1, "0123456789");
+
+	/* allow counting the evictions per passdb/userdb */
+	if (id_len > 0) {
+		e->add_str(key[0] == 'U' ? "userdb_id" : "passdb_id",
+			   t_strndup(key + 1, id_len));
+	}
+	e_debug(e->event(), "Evicted %s cache entry",
+		auth_cache_segment_names[node->segment]);
+
+	cache->eviction_count++;
+	auth_cache_node_destroy(cache, node);
+}
+
+static bool
+auth_cache_make_room(struct auth_cache *cache, bool negative,
+		     size_t alloc_size)
+{
+	struct auth_cache_list *probation =
+		&cache->lists[AUTH_CACHE_SEGMENT_PROBATION];
+	struct auth_cache_list *protected =
+		&cache->lists[AUTH_CACHE_SEGMENT_PROTECTED];
+	struct auth_cache_list *neg =
+		&cache->lists[AUTH_CACHE_SEGMENT_NEGATIVE];
+
+	if (negative) {
+		if (alloc_size > cache->neg_max_size)
+			return FALSE;
+		while (neg->size + alloc_size > cache->neg_max_size)
+			auth_cache_node_evict(cache, neg->tail);
+	} else {
+		if (alloc_size > cache->pos_max_size)
+			return FALSE;
+		/* evict from probation first, protected only if it's empty */
+		while (probation->size + protected->size + alloc_size >
+		       cache->pos_max_size) {
+			auth_cache_node_evict(cache, probation->tail != NULL ?
+					      probation->tail : protected->tail);
+		}
+	}
+	return TRUE;
+}
+
 static void sig_auth_cache_clear(const siginfo_t *si ATTR_UNUSED, void *context)
 {
 	struct auth_cache *cache = context;
@@ -201,7 +444,8 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 {
 	struct auth_cache *cache = context;
 	unsigned int total_count;
-	size_t cache_used;
+	size_t cache_used = 0;
+	unsigned int i;
 
 	total_count = cache->hit_count + cache->miss_count;
 	e_info(cache->event, "Authentication cache hits %u/%u (%u%%)",
@@ -210,18 +454,25 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 
 	e_info(cache->event, "Authentication cache inserts: "
 	       "positive: %u entries %llu bytes, "
-	       "negative: %u entries %llu bytes",
+	       "negative: %u entries %llu bytes, "
+	       "evictions: %u entries",
 	       cache->pos_entries, cache->pos_size,
-	       cache->neg_entries, cache->neg_size);
+	       cache->neg_entries, cache->neg_size, cache->eviction_count);
 
-	cache_used = cache->max_size - cache->size_left;
+	for (i = 0; i < AUTH_CACHE_SEGMENT_COUNT; i++)
+		cache_used += cache->lists[i].size;
 	e_info(cache->event, "Authentication cache current size: "
-	       "%zu bytes used of %zu bytes (%u%%)",
+	       "%zu bytes used of %zu bytes (%u%%), "
+	       "probation: %zu bytes, protected: %zu bytes, "
+	       "negative: %zu bytes",
 	       cache_used, cache->max_size,
-	       (unsigned int)(cache_used * 100ULL / cache->max_size));
+	       (unsigned int)(cache_used * 100ULL / cache->max_size),
+	       cache->lists[AUTH_CACHE_SEGMENT_PROBATION].size,
+	       cache->lists[AUTH_CACHE_SEGMENT_PROTECTED].size,
+	       cache->lists[AUTH_CACHE_SEGMENT_NEGATIVE].size);
 
 	/* reset counters */
-	cache->hit_count = cache->miss_count = 0;
+	cache->hit_count = cache->miss_count = cache->eviction_count = 0;
 	cache->pos_entries = cache->neg_entries = 0;
 	cache->pos_size = cache->neg_size = 0;
 }
@@ -234,8 +485,16 @@ struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 
 	cache = i_new(struct auth_cache, 1);
 	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	hash_table_create(&cache->users, default_pool, 0,
+			  auth_cache_username_hash, auth_cache_username_cmp);
 	cache->max_size = max_size;
-	cache->size_left = max_size;
+	if (neg_ttl_secs > 0) {
+		cache->neg_max_size =
+			max_size / 100 * AUTH_CACHE_NEGATIVE_PERCENTAGE;
+	}
+	cache->pos_max_size = max_size - cache->neg_max_size;
+	cache->protected_max_size =
+		cache->pos_max_size / 100 * AUTH_CACHE_PROTECTED_PERCENTAGE;
 	cache->ttl_secs = ttl_secs;
 	cache->neg_ttl_secs = neg_ttl_secs;
 	cache->event = event_create(auth_event);
@@ -257,71 +516,37 @@ void auth_cache_free(struct auth_cache **_cache)
 
 	auth_cache_clear(cache);
 	hash_table_destroy(&cache->hash);
+	hash_table_destroy(&cache->users);
 	event_unref(&cache->event);
 	i_free(cache);
 }
 
 unsigned int auth_cache_clear(struct auth_cache *cache)
 {
-	unsigned int ret = hash_table_count(cache->hash);
+	unsigned int i, ret = hash_table_count(cache->hash);
 
-	while (cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
+	/* the file would only bring back the flushed entries */
+	i_free(cache->lazy_load_path);
+	for (i = 0; i < AUTH_CACHE_SEGMENT_COUNT; i++) {
+		while (cache->lists[i].tail != NULL)
+			auth_cache_node_destroy(cache, cache->lists[i].tail);
+	}
 	hash_table_clear(cache->hash, FALSE);
+	hash_table_clear(cache->users, FALSE);
 	return ret;
 }
 
-static bool auth_cache_node_is_user(struct auth_cache_node *node,
-				    const char *username)
-{
-	const char *data = node->data, *suffix;
-
-	/* The cache nodes begin with "P"/"U", passdb/userdb ID, optional
-	   "+" master user, "\t" and then usually followed by the username.
-	   It's too much trouble to keep track of all the cache keys, so we'll
-	   just match it as if it was the username. If e.g. '%n' is used in the
-	   cache key instead of '%u', it means that cache entries can be
-	   removed only when @domain isn't in the username parameter. */
-	if (*data != 'P' && *data != 'U')
-		return FALSE;
-	data++;
-
-	while (*data >= '0' && *data <= '9')
-		data++;
-	if (*data == '+') {
-		/* skip over +master_user */
-		while (*data != '\t' && *data != '\0')
-			data++;
-	}
-	if (*data != '\t')
-		return FALSE;
-	data++;
-
-	return str_begins(data, username, &suffix) &&
-		(suffix[0] == '\t' || suffix[0] == '\0');
-}
-
-static bool auth_cache_node_is_one_of_users(struct auth_cache_node *node,
-					    const char *const *usernames)
-{
-	unsigned int i;
-
-	for (i = 0; usernames[i] != NULL; i++) {
-		if (auth_cache_node_is_user(node, usernames[i]))
-			return TRUE;
-	}
-	return FALSE;
-}
-
 unsigned int auth_cache_clear_users(struct auth_cache *cache,
 				    const char *const *usernames)
 {
-	struct auth_cache_node *node, *next;
-	unsigned int ret = 0;
+	struct auth_cache_node *node;
+	unsigned int i, ret = 0;
 
-	for (node = cache->tail; node != NULL; node = next) {
-		next = node->next;
-		if (auth_cache_node_is_one_of_users(node, usernames)) {
+	auth_cache_lazy_load(cache);
+	for (i = 0; usernames[i] != NULL; i++) {
+		/* destroying the first node makes the next one first */
+		while ((node = hash_table_lookup(cache->users,
+						 usernames[i])) != NULL) {
 			auth_cache_node_destroy(cache, node);
 			ret++;
 		}
@@ -386,6 +611,7 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	*expired_r = FALSE;
 	*neg_expired_r = FALSE;
 
+	auth_cache_lazy_load(cache);
 	key = auth_request_expand_cache_key(request, key, request->fields.translated_username);
 	node = hash_table_lookup(cache->hash, key);
 	if (node == NULL) {
@@ -402,10 +628,14 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		cache->miss_count++;
 		*expired_r = TRUE;
 	} else {
-		/* move to head */
-		if (node != cache->head) {
-			auth_cache_node_unlink(cache, node);
-			auth_cache_node_link_head(cache, node);
+		if (node->segment == AUTH_CACHE_SEGMENT_PROBATION) {
+			/* used again - protect it */
+			auth_cache_node_move(cache, node,
+					     AUTH_CACHE_SEGMENT_PROTECTED);
+			auth_cache_protected_trim(cache);
+		} else if (node != cache->lists[node->segment].head) {
+			/* move to head */
+			auth_cache_node_move(cache, node, node->segment);
 		}
 		cache->hit_count++;
 	}
@@ -418,54 +648,80 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	return value;
 }
 
-void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
-		       const char *key, const char *value, bool last_success)
+static struct auth_cache_node *
+auth_cache_node_add(struct auth_cache *cache, const char *key,
+		    const char *value, time_t created,
+		    enum auth_cache_segment segment, bool last_success)
 {
-        struct auth_cache_node *node;
-	size_t data_size, alloc_size, key_len, value_len = strlen(value);
+	struct auth_cache_node *node;
+	size_t data_size, alloc_size, key_len, value_len;
 	char *hash_key;
 
-	if (*value == '\0' && cache->neg_ttl_secs == 0) {
-		/* we're not caching negative entries */
-		return;
-	}
-
-	key = auth_request_expand_cache_key(request, key, request->fields.translated_username);
 	key_len = strlen(key);
-
+	value_len = strlen(value);
 	data_size = key_len + 1 + value_len + 1;
 	alloc_size = sizeof(struct auth_cache_node) + data_size;
 
 	/* make sure we have enough space */
-	while (cache->size_left < alloc_size && cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
-
-	node = hash_table_lookup(cache->hash, key);
-	if (node != NULL) {
-		/* key is already in cache (probably expired), remove it */
-		auth_cache_node_destroy(cache, node);
-	}
+	if (!auth_cache_make_room(cache, *value == '\0', alloc_size))
+		return NULL;
 
 	/* @UNSAFE */
 	node = i_malloc(alloc_size);
-	node->created = time(NULL);
+	node->created = created;
 	node->alloc_size = alloc_size;
+	node->segment = segment;
 	node->last_success = last_success;
 	memcpy(node->data, key, key_len);
 	memcpy(node->data + key_len + 1, value, value_len);
 
-	auth_cache_node_link_head(cache, node);
+	auth_cache_list_link_head(&cache->lists[segment], node);
 
-	cache->size_left -= alloc_size;
 	hash_key = node->data;
 	hash_table_insert(cache->hash, hash_key, node);
+	auth_cache_node_link_user(cache, node);
+	return node;
+}
+
+void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
+		       const char *key, const char *value, bool last_success)
+{
+	struct auth_cache_node *node;
+	enum auth_cache_segment segment;
+
+	auth_cache_lazy_load(cache);
+	if (*value == '\0' && cache->neg_ttl_secs == 0) {
+		/* we're not caching negative entries */
+		return;
+	}
+
+	key = auth_request_expand_cache_key(request, key, request->fields.translated_username);
+
+	segment = *value == '\0' ? AUTH_CACHE_SEGMENT_NEGATIVE :
+		AUTH_CACHE_SEGMENT_PROBATION;
+	node = hash_table_lookup(cache->hash, key);
+	if (node != NULL) {
+		/* key is already in cache (probably expired), remove it.
+		   keep a refreshed protected entry protected. */
+		if (node->segment == AUTH_CACHE_SEGMENT_PROTECTED &&
+		    segment == AUTH_CACHE_SEGMENT_PROBATION)
+			segment = AUTH_CACHE_SEGMENT_PROTECTED;
+		auth_cache_node_destroy(cache, node);
+	}
+
+	node = auth_cache_node_add(cache, key, value, time(NULL), segment,
+				   last_success);
+	if (node == NULL)
+		return;
+	if (segment == AUTH_CACHE_SEGMENT_PROTECTED)
+		auth_cache_protected_trim(cache);
 
 	if (*value != '\0') {
 		cache->pos_entries++;
-		cache->pos_size += alloc_size;
+		cache->pos_size += node->alloc_size;
 	} else {
 		cache->neg_entries++;
-		cache->neg_size += alloc_size;
+		cache->neg_size += node->alloc_size;
 	}
 }
 
@@ -474,6 +730,7 @@ void auth_cache_remove(struct auth_cache *cache,
 {
 	struct auth_cache_node *node;
 
+	auth_cache_lazy_load(cache);
 	key = auth_request_expand_cache_key(request, key, request->fields.user);
 	node = hash_table_lookup(cache->hash, key);
 	if (node == NULL)
@@ -481,3 +738,301 @@ void auth_cache_remove(struct auth_cache *cache,
 
 	auth_cache_node_destroy(cache, node);
 }
+
+static void
+auth_cache_save_list(struct ostream *output,
+		     const struct auth_cache_list *list,
+		     uint32_t *crc32_r, uint32_t *count_r, uint64_t *size_r)
+{
+	static const unsigned char pad[AUTH_CACHE_FILE_ALIGN] = { 0 };
+	struct auth_cache_file_record rec;
+	const struct auth_cache_node *node;
+	size_t data_size, pad_size;
+
+	/* write from the least recently used node, so that loading the
+	   file gets the nodes back in the same order. */
+	for (node = list->tail; node != NULL; node = node->next) {
+		i_zero(&rec);
+		rec.created = node->created;
+		rec.key_size = strlen(node->data) + 1;
+		rec.value_size = strlen(node->data + rec.key_size) + 1;
+		rec.segment = node->segment;
+		rec.last_success = node->last_success ? 1 : 0;
+
+		/* the key and the value are already next to each other */
+		data_size = rec.key_size + rec.value_size;
+		pad_size = (AUTH_CACHE_FILE_ALIGN -
+			    data_size % AUTH_CACHE_FILE_ALIGN) %
+			AUTH_CACHE_FILE_ALIGN;
+
+		*crc32_r = crc32_data_more(*crc32_r, &rec, sizeof(rec));
+		*crc32_r = crc32_data_more(*crc32_r, node->data, data_size);
+		*crc32_r = crc32_data_more(*crc32_r, pad, pad_size);
+		o_stream_nsend(output, &rec, sizeof(rec));
+		o_stream_nsend(output, node->data, data_size);
+		o_stream_nsend(output, pad, pad_size);
+
+		*size_r += sizeof(rec) + data_size + pad_size;
+		*count_r += 1;
+	}
+}
+
+int auth_cache_save(struct auth_cache *cache, const char *path,
+		    const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN],
+		    const char **error_r)
+{
+	/* negative and probation entries first, so that if the cache is
+	   loaded with a smaller size, the protected entries survive. */
+	static const enum auth_cache_segment save_order[] = {
+		AUTH_CACHE_SEGMENT_NEGATIVE,
+		AUTH_CACHE_SEGMENT_PROBATION,
+		AUTH_CACHE_SEGMENT_PROTECTED,
+	};
+	struct auth_cache_file_header hdr;
+	struct ostream *output;
+	const char *temp_path;
+	unsigned int i;
+	int fd, ret = 0;
+
+	if (cache->lazy_load_path != NULL &&
+	    strcmp(cache->lazy_load_path, path) == 0) {
+		/* the cache hasn't been used since it was loaded from
+		   this file, so the file is still up to date */
+		return 0;
+	}
+
+	temp_path = t_strconcat(path, ".tmp", NULL);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", temp_path);
+		return -1;
+	}
+
+	i_zero(&hdr);
+	hdr.magic = AUTH_CACHE_FILE_MAGIC;
+	hdr.version = AUTH_CACHE_FILE_VERSION;
+	memcpy(hdr.db_hash, db_hash, sizeof(hdr.db_hash));
+
+	output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(output);
+	/* the header is rewritten once the records are known */
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	for (i = 0; i < N_ELEMENTS(save_order); i++) {
+		auth_cache_save_list(output, &cache->lists[save_order[i]],
+				     &hdr.records_crc32, &hdr.record_count,
+				     &hdr.records_size);
+	}
+	if (o_stream_flush(output) < 0 ||
+	    o_stream_pwrite(output, &hdr, sizeof(hdr), 0) < 0 ||
+	    o_stream_finish(output) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %s", temp_path,
+					   o_stream_get_error(output));
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+
+	if (close(fd) < 0 && ret == 0) {
+		*error_r = t_strdup_printf("close(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if (ret == 0 && rename(temp_path, path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink_if_exists(temp_path);
+	return ret;
+}
+
+static bool
+auth_cache_node_is_expired(struct auth_cache *cache,
+			   enum auth_cache_segment segment,
+			   time_t created, time_t now)
+{
+	unsigned int ttl_secs = segment == AUTH_CACHE_SEGMENT_NEGATIVE ?
+		cache->neg_ttl_secs : cache->ttl_secs;
+
+	return ttl_secs == 0 || created < now - (time_t)ttl_secs;
+}
+
+static int
+auth_cache_load_records(struct auth_cache *cache, const unsigned char *data,
+			size_t size, unsigned int record_count,
+			unsigned int *count_r, const char **error_r)
+{
+	const struct auth_cache_file_record *rec;
+	const char *key, *value;
+	enum auth_cache_segment segment;
+	size_t pos = 0, data_size;
+	unsigned int i;
+	time_t now = time(NULL);
+
+	for (i = 0; i < record_count; i++) {
+		if (size - pos < sizeof(*rec)) {
+			*error_r = "Truncated record";
+			return -1;
+		}
+		rec = CONST_PTR_OFFSET(data, pos);
+		pos += sizeof(*rec);
+
+		if (rec->key_size == 0 || rec->value_size == 0 ||
+		    rec->key_size > size - pos ||
+		    rec->value_size > size - pos - rec->key_size) {
+			*error_r = "Invalid record size";
+			return -1;
+		}
+		key = CONST_PTR_OFFSET(data, pos);
+		value = key + rec->key_size;
+		data_size = rec->key_size + rec->value_size;
+		if (memchr(key, '\0', rec->key_size) !=
+		    key + rec->key_size - 1 ||
+		    memchr(value, '\0', rec->value_size) !=
+		    value + rec->value_size - 1) {
+			*error_r = "Record key or value isn't NUL-terminated";
+			return -1;
+		}
+		if (rec->segment >= AUTH_CACHE_SEGMENT_COUNT ||
+		    (rec->segment == AUTH_CACHE_SEGMENT_NEGATIVE) !=
+		    (*value == '\0')) {
+			*error_r = "Invalid record segment";
+			return -1;
+		}
+		segment = rec->segment;
+		pos += data_size;
+		pos += I_MIN((AUTH_CACHE_FILE_ALIGN -
+			      data_size % AUTH_CACHE_FILE_ALIGN) %
+			     AUTH_CACHE_FILE_ALIGN, size - pos);
+
+		if (auth_cache_node_is_expired(cache, segment,
+					       rec->created, now) ||
+		    hash_table_lookup(cache->hash, key) != NULL)
+			continue;
+		if (auth_cache_node_add(cache, key, value, rec->created,
+					segment, rec->last_success != 0) != NULL)
+			*count_r += 1;
+	}
+	/* the file may have been written with a larger cache size */
+	auth_cache_protected_trim(cache);
+	if (pos != size) {
+		*error_r = "Trailing data after records";
+		return -1;
+	}
+	return 0;
+}
+
+static int
+auth_cache_load_mmap(struct auth_cache *cache, const void *data, size_t size,
+		     const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN],
+		     unsigned int *count_r, const char **error_r)
+{
+	const struct auth_cache_file_header *hdr = data;
+	const unsigned char *records;
+
+	if (size < sizeof(*hdr)) {
+		*error_r = "File too small";
+		return -1;
+	}
+	if (hdr->magic != AUTH_CACHE_FILE_MAGIC) {
+		*error_r = "Invalid magic";
+		return -1;
+	}
+	if (hdr->version != AUTH_CACHE_FILE_VERSION) {
+		*error_r = t_strdup_printf("Unsupported version %u",
+					   hdr->version);
+		return 0;
+	}
+	if (memcmp(hdr->db_hash, db_hash, sizeof(hdr->db_hash)) != 0) {
+		/* the cache keys refer to different passdbs/userdbs */
+		*error_r = "passdb/userdb configuration has changed";
+		return 0;
+	}
+	if (hdr->records_size != size - sizeof(*hdr)) {
+		*error_r = t_strdup_printf(
+			"Records size mismatch (%"PRIu64" != %zu)",
+			hdr->records_size, size - sizeof(*hdr));
+		return -1;
+	}
+	records = CONST_PTR_OFFSET(data, sizeof(*hdr));
+	if (crc32_data(records, hdr->records_size) != hdr->records_crc32) {
+		*error_r = "Checksum mismatch";
+		return -1;
+	}
+	if (auth_cache_load_records(cache, records, hdr->records_size,
+				    hdr->record_count, count_r, error_r) < 0)
+		return -1;
+	return 1;
+}
+
+int auth_cache_load(struct auth_cache *cache, const char *path,
+		    const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN],
+		    unsigned int *count_r, const char **error_r)
+{
+	void *mmap_base;
+	size_t mmap_size;
+	int fd, ret;
+
+	*count_r = 0;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			*error_r = "File doesn't exist";
+			return 0;
+		}
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+	mmap_base = mmap_ro_file(fd, &mmap_size);
+	if (mmap_base == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	ret = auth_cache_load_mmap(cache, mmap_base, mmap_size, db_hash,
+				   count_r, error_r);
+	if (ret < 0) {
+		*error_r = t_strdup_printf("Corrupted auth cache file %s: %s",
+					   path, *error_r);
+	}
+	if (mmap_base != NULL && munmap(mmap_base, mmap_size) < 0)
+		i_error("munmap(%s) failed: %m", path);
+	return ret;
+}
+
+void auth_cache_load_lazy(struct auth_cache *cache, const char *path,
+			  const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN])
+{
+	i_free(cache->lazy_load_path);
+	cache->lazy_load_path = i_strdup(path);
+	memcpy(cache->lazy_load_db_hash, db_hash,
+	       sizeof(cache->lazy_load_db_hash));
+}
+
+static void auth_cache_lazy_load(struct auth_cache *cache)
+{
+	const char *error;
+	unsigned int count;
+	char *path;
+	int ret;
+
+	if (cache->lazy_load_path == NULL)
+		return;
+
+	/* try loading only once, even if it fails */
+	path = cache->lazy_load_path;
+	cache->lazy_load_path = NULL;
+	ret = auth_cache_load(cache, path, cache->lazy_load_db_hash,
+			      &count, &error);
+	if (ret < 0)
+		e_error(cache->event, "Failed to load auth cache: %s", error);
+	else if (ret == 0) {
+		e_debug(cache->event, "Ignoring auth cache file %s: %s",
+			path, error);
+	} else {
+		e_debug(cache->event, "Loaded %u auth cache entries from %s",
+			count, path);
+	}
+	i_free(path);
+}
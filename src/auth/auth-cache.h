@@ -1,12 +1,18 @@
 #ifndef AUTH_CACHE_H
 #define AUTH_CACHE_H
 
+#include "md5.h"
+
 struct auth_cache_node {
 	struct auth_cache_node *prev, *next;
+	/* Other nodes with the same username in the cache key */
+	struct auth_cache_node *user_prev, *user_next;
 
 	time_t created;
 	/* Total number of bytes used by this node */
-	uint32_t alloc_size:31;
+	uint32_t alloc_size:29;
+	/* Cache segment the node is in */
+	uint32_t segment:2;
 	/* TRUE if the user gave the correct password the last time. */
 	bool last_success:1;
 
@@ -23,7 +29,8 @@ char *auth_cache_parse_key(pool_t pool, const char *query);
 /* Create a new cache. max_size specifies the maximum amount of memory in
    bytes to use for cache (it's not fully exact). ttl_secs specifies time to
    live for cache record, requests older than that are not used.
-   neg_ttl_secs specifies the TTL for negative entries. */
+   neg_ttl_secs specifies the TTL for negative entries. Negative entries
+   can use only a small part of max_size. */
 struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 				  unsigned int neg_ttl_secs);
 void auth_cache_free(struct auth_cache **cache);
@@ -31,6 +38,9 @@ void auth_cache_free(struct auth_cache **cache);
 /* Clear the cache. Returns how many entries were removed. */
 unsigned int ATTR_NOWARN_UNUSED_RESULT
 auth_cache_clear(struct auth_cache *cache);
+/* Remove all entries of the given users. The entries are indexed by the
+   username, so this doesn't need to scan through the whole cache. Returns
+   how many entries were removed. */
 unsigned int auth_cache_clear_users(struct auth_cache *cache,
 				    const char *const *usernames);
 
@@ -50,4 +60,25 @@ void auth_cache_remove(struct auth_cache *cache,
 		       const struct auth_request *request,
 		       const char *key);
 
+/* Write the cache entries to the given file, so they can be loaded with
+   auth_cache_load() after the auth process is restarted. db_hash identifies
+   the passdb/userdb configuration that the cache keys refer to. Returns 0 on
+   success, -1 on error. */
+int auth_cache_save(struct auth_cache *cache, const char *path,
+		    const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN],
+		    const char **error_r);
+/* Load entries written by auth_cache_save(). Entries whose TTL has already
+   expired are skipped. Returns 1 if the file was loaded, 0 if it was ignored
+   (doesn't exist, different db_hash or version), -1 if it was corrupted or
+   couldn't be read. error_r is set for 0 and -1. */
+int auth_cache_load(struct auth_cache *cache, const char *path,
+		    const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN],
+		    unsigned int *count_r, const char **error_r);
+/* Load the file with auth_cache_load() only when the cache is accessed the
+   first time, so loading a large file doesn't delay the process startup.
+   Until then auth_cache_save() to the same path does nothing. Clearing the
+   cache cancels the load. */
+void auth_cache_load_lazy(struct auth_cache *cache, const char *path,
+			  const unsigned char db_hash[STATIC_ARRAY MD5_RESULTLEN]);
+
 #endif
@@ -273,7 +273,9 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(SIZE, cache_size),
 	DEF(TIME, cache_ttl),
 	DEF(TIME, cache_negative_ttl),
+	DEF(STR, cache_persistent_path),
 	DEF(BOOL, cache_verify_password_with_worker),
+	DEF(UINT, worker_max_pipelined_requests),
 	DEF(STR, username_chars),
 	DEF(STR, username_translation),
 	DEF(STR, username_format),
@@ -330,7 +332,9 @@ static const struct auth_settings auth_default_settings = {
 	.cache_size = 0,
 	.cache_ttl = 60*60,
 	.cache_negative_ttl = 60*60,
+	.cache_persistent_path = "",
 	.cache_verify_password_with_worker = FALSE,
+	.worker_max_pipelined_requests = 1,
 	.username_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.-_@",
 	.username_translation = "",
 	.username_format = "%Lu",
@@ -474,6 +478,15 @@ static bool auth_settings_check(void *_set, pool_t pool,
 					   set->cache_size);
 		return FALSE;
 	}
+	if (set->cache_persistent_path[0] != '\0' &&
+	    set->cache_persistent_path[0] != '/') {
+		*error_r = "auth_cache_persistent_path must be an absolute path";
+		return FALSE;
+	}
+	if (set->worker_max_pipelined_requests == 0) {
+		*error_r = "auth_worker_max_pipelined_requests must not be 0";
+		return FALSE;
+	}
 
 	if (!auth_verify_verbose_password(set, error_r))
 		return FALSE;
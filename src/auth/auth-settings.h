@@ -44,7 +44,9 @@ struct auth_settings {
 	uoff_t cache_size;
 	unsigned int cache_ttl;
 	unsigned int cache_negative_ttl;
+	const char *cache_persistent_path;
 	bool cache_verify_password_with_worker;
+	unsigned int worker_max_pipelined_requests;
 	const char *username_chars;
 	const char *username_translation;
 	const char *username_format;
@@ -38,12 +38,19 @@ struct auth_worker_request {
 	const char *data;
 	auth_worker_callback_t *callback;
 	void *context;
+
+	/* Request with a multi-line reply (LIST). Nothing else is sent to
+	   the worker connection while it's being handled. */
+	bool exclusive;
 };
 
 struct auth_worker_connection {
 	struct connection conn;
 	struct timeout *to_lookup;
-	struct auth_worker_request *request;
+	/* Requests sent to the worker that haven't been fully replied to
+	   yet. Replies are matched by their ID, so they can come in any
+	   order. */
+	ARRAY(struct auth_worker_request *) requests;
 	unsigned int id_counter;
 
 	bool received_error:1;
@@ -51,6 +58,7 @@ struct auth_worker_connection {
 	bool shutdown:1;
 	bool timeout_pending_resume:1;
 	bool resuming:1;
+	bool destroyed:1;
 };
 
 static struct connection_list *connections = NULL;
@@ -68,7 +76,7 @@ static void auth_worker_deinit(struct auth_worker_connection **worker,
 
 static void auth_worker_idle_timeout(struct auth_worker_connection *worker)
 {
-	i_assert(worker->request == NULL);
+	i_assert(array_count(&worker->requests) == 0);
 
 	if (idle_count > 1)
 		auth_worker_deinit(&worker, NULL, FALSE);
@@ -78,7 +86,7 @@ static void auth_worker_idle_timeout(struct auth_worker_connection *worker)
 
 static void auth_worker_call_timeout(struct auth_worker_connection *worker)
 {
-	i_assert(worker->request != NULL);
+	i_assert(array_count(&worker->requests) > 0);
 
 	auth_worker_deinit(&worker, "Lookup timed out", TRUE);
 }
@@ -125,30 +133,50 @@ static bool auth_worker_request_send(struct auth_worker_connection *worker,
 
 	o_stream_nsendv(worker->conn.output, iov, 3);
 
-	i_assert(worker->request == NULL);
-	worker->request = request;
-
-	timeout_remove(&worker->to_lookup);
-	worker->to_lookup = timeout_add(AUTH_WORKER_LOOKUP_TIMEOUT_SECS * 1000,
-					auth_worker_call_timeout, worker);
+	if (array_count(&worker->requests) == 0) {
+		/* the lookup timeout is reset whenever the worker replies,
+		   so with pipelining it's the maximum time the worker may
+		   go without replying to anything. */
+		timeout_remove(&worker->to_lookup);
+		worker->to_lookup =
+			timeout_add(AUTH_WORKER_LOOKUP_TIMEOUT_SECS * 1000,
+				    auth_worker_call_timeout, worker);
 
-	i_assert(idle_count > 0);
-	idle_count--;
+		i_assert(idle_count > 0);
+		idle_count--;
+	}
+	array_push_back(&worker->requests, &request);
 	return TRUE;
 }
 
+static bool
+auth_worker_can_send(struct auth_worker_connection *worker,
+		     const struct auth_worker_request *request)
+{
+	unsigned int count = array_count(&worker->requests);
+
+	if (worker->restart || worker->shutdown || worker->destroyed)
+		return FALSE;
+	if (count == 0)
+		return TRUE;
+	if (request->exclusive ||
+	    array_idx_elem(&worker->requests, 0)->exclusive)
+		return FALSE;
+	return count < global_auth_settings->worker_max_pipelined_requests;
+}
+
 static void auth_worker_request_send_next(struct auth_worker_connection *worker)
 {
 	struct auth_worker_request *request;
 
-	do {
-		if (aqueue_count(worker_request_queue) == 0)
-			return;
-
+	while (aqueue_count(worker_request_queue) > 0) {
 		request = array_idx_elem(&worker_request_array,
 					 aqueue_idx(worker_request_queue, 0));
+		if (!auth_worker_can_send(worker, request))
+			break;
 		aqueue_delete_tail(worker_request_queue);
-	} while (!auth_worker_request_send(worker, request));
+		(void)auth_worker_request_send(worker, request);
+	}
 }
 
 static int auth_worker_handshake_args(struct connection *conn,
@@ -233,6 +261,7 @@ static struct auth_worker_connection *auth_worker_create(void)
 
 	struct auth_worker_connection *worker = i_new(struct auth_worker_connection, 1);
 
+	i_array_init(&worker->requests, 4);
 	worker->conn.event_parent = auth_event;
 	connection_init_client_unix(connections, &worker->conn,
 				    worker_socket_path);
@@ -241,6 +270,7 @@ static struct auth_worker_connection *auth_worker_create(void)
 			"Unable to connect worker: net_connect_unix(%s) failed: %m",
 			worker->conn.name);
 		connection_deinit(&worker->conn);
+		array_free(&worker->requests);
 		i_free(worker);
 		return NULL;
 	}
@@ -258,32 +288,40 @@ static void auth_worker_deinit(struct auth_worker_connection **_worker,
 			       const char *reason, bool restart)
 {
 	struct auth_worker_connection *worker = *_worker;
+	struct auth_worker_request *request;
 
 	*_worker = NULL;
 
+	/* the failure callbacks may send new requests - make sure they
+	   don't end up here */
+	worker->destroyed = TRUE;
 	if (worker->received_error) {
 		i_assert(auth_workers_with_errors > 0);
 		i_assert(auth_workers_with_errors <= connections->connections_count);
 		auth_workers_with_errors--;
 	}
 
-	if (worker->request == NULL)
+	if (array_count(&worker->requests) == 0)
 		idle_count--;
 	else {
-		e_error(worker->conn.event, "Aborted %s request for %s: %s",
-			t_strcut(worker->request->data, '\t'),
-			worker->request->username, reason);
 		const char *const args[] = {
 			"FAIL",
 			t_strdup_printf("%d", PASSDB_RESULT_INTERNAL_FAILURE),
 			NULL,
 		};
-		worker->request->callback(worker, args, worker->request->context);
+		array_foreach_elem(&worker->requests, request) {
+			e_error(worker->conn.event,
+				"Aborted %s request for %s: %s",
+				t_strcut(request->data, '\t'),
+				request->username, reason);
+			request->callback(worker, args, request->context);
+		}
 	}
 
 	timeout_remove(&worker->to_lookup);
 	connection_deinit(&worker->conn);
 
+	array_free(&worker->requests);
 	i_free(worker);
 
 	if (idle_count == 0 && restart) {
@@ -293,29 +331,46 @@ static void auth_worker_deinit(struct auth_worker_connection **_worker,
 	}
 }
 
-static struct auth_worker_connection *auth_worker_find_free(void)
+static struct auth_worker_connection *
+auth_worker_find_free(const struct auth_worker_request *request)
 {
-	if (idle_count == 0)
-		return NULL;
-
-	struct connection *conn = connections->connections;
-	while (conn != NULL) {
-		struct auth_worker_connection *worker =
-			container_of(conn, struct auth_worker_connection, conn);
-		if (worker->request == NULL)
+	struct auth_worker_connection *worker, *best = NULL;
+	struct connection *conn;
+
+	/* use the worker with the fewest requests, so the load is spread
+	   over the existing workers before new ones are created */
+	for (conn = connections->connections; conn != NULL; conn = conn->next) {
+		worker = container_of(conn, struct auth_worker_connection, conn);
+		if (!auth_worker_can_send(worker, request))
+			continue;
+		if (array_count(&worker->requests) == 0)
 			return worker;
-
-		conn = conn->next;
+		if (best == NULL ||
+		    array_count(&worker->requests) < array_count(&best->requests))
+			best = worker;
 	}
+	return best;
+}
+
+static struct auth_worker_request *
+auth_worker_request_find(struct auth_worker_connection *worker,
+			 unsigned int id, unsigned int *idx_r)
+{
+	struct auth_worker_request *const *requestp;
 
-	i_unreached();
+	array_foreach(&worker->requests, requestp) {
+		if ((*requestp)->id == id) {
+			*idx_r = array_foreach_idx(&worker->requests, requestp);
+			return *requestp;
+		}
+	}
+	return NULL;
 }
 
 static int auth_worker_request_handle(struct auth_worker_connection *worker,
-				      const char *const *args)
+				      struct auth_worker_request *_request,
+				      unsigned int idx, const char *const *args)
 {
-	struct auth_worker_request *_request = worker->request;
-
 	/* lines starting with '*' denote a multi-line request
 	   if they do, reset timeouts
 	   if they do not, mark this request as handled */
@@ -330,18 +385,27 @@ static int auth_worker_request_handle(struct auth_worker_connection *worker,
 		}
 	} else {
 		worker->resuming = FALSE;
-		worker->request = NULL;
+		array_delete(&worker->requests, idx, 1);
 		worker->timeout_pending_resume = FALSE;
 		timeout_remove(&worker->to_lookup);
-		worker->to_lookup = timeout_add(AUTH_WORKER_MAX_IDLE_SECS * 1000,
-						auth_worker_idle_timeout, worker);
-		idle_count++;
+		if (array_count(&worker->requests) > 0) {
+			worker->to_lookup =
+				timeout_add(AUTH_WORKER_LOOKUP_TIMEOUT_SECS * 1000,
+					    auth_worker_call_timeout, worker);
+		} else {
+			worker->to_lookup =
+				timeout_add(AUTH_WORKER_MAX_IDLE_SECS * 1000,
+					    auth_worker_idle_timeout, worker);
+			idle_count++;
+		}
 	}
 
 	if (!_request->callback(worker, args, _request->context)) {
+		/* wait for auth_worker_connection_resume_input() */
 		worker->timeout_pending_resume = FALSE;
 		timeout_remove(&worker->to_lookup);
-		return -1;
+		connection_input_halt(&worker->conn);
+		return 0;
 	}
 	return 1;
 }
@@ -416,25 +480,24 @@ static int worker_input_args(struct connection *conn, const char *const *args)
 		return 1;
 	}
 
-	int ret = 0;
-	if (worker->request != NULL && id == worker->request->id)
-		 ret = auth_worker_request_handle(worker, args + 1);
-	else {
-		if (worker->request != NULL) {
-			e_error(conn->event,
-				"BUG: Worker sent reply with id %u, "
-				"expected %u", id, worker->request->id);
-		} else {
-			e_error(conn->event,
-				"BUG: Worker sent reply with id %u, "
-				"none was expected", id);
-		}
+	struct auth_worker_request *request;
+	unsigned int idx;
+	int ret;
+
+	request = auth_worker_request_find(worker, id, &idx);
+	if (request == NULL) {
+		e_error(conn->event,
+			"BUG: Worker sent reply with id %u, "
+			"none was expected", id);
 		auth_worker_deinit(&worker, "Worker is buggy", TRUE);
 		return -1;
 	}
+	ret = auth_worker_request_handle(worker, request, idx, args + 1);
 
-	if (worker->request != NULL) {
-		/* there's still a pending request */
+	if (array_count(&worker->requests) > 0) {
+		/* there are still pending requests */
+		if (ret > 0)
+			auth_worker_request_send_next(worker);
 	} else if (worker->restart) {
 		auth_worker_deinit(&worker, "Max requests limit", TRUE);
 		ret = 0;
@@ -490,13 +553,14 @@ void auth_worker_call(pool_t pool, const char *username, const char *data,
 	request->data = p_strdup(pool, data);
 	request->callback = callback;
 	request->context = context;
+	request->exclusive = str_begins_with(data, "LIST\t");
 
 	if (aqueue_count(worker_request_queue) > 0) {
 		/* requests are already being queued, no chance of
 		   finding/creating a worker */
 		worker = NULL;
 	} else {
-		worker = auth_worker_find_free();
+		worker = auth_worker_find_free(request);
 		if (worker == NULL) {
 			/* no free connections, create a new one */
 			worker = auth_worker_create();
@@ -513,7 +577,7 @@ void auth_worker_call(pool_t pool, const char *username, const char *data,
 
 void auth_worker_connection_resume_input(struct auth_worker_connection *worker)
 {
-	if (worker->request == NULL) {
+	if (array_count(&worker->requests) == 0) {
 		/* request was just finished, don't try to resume it */
 		return;
 	}
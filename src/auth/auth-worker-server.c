@@ -32,7 +32,6 @@ struct auth_worker_server {
 
 	struct auth *auth;
 	struct event *event;
-	time_t cmd_start;
 
 	bool error_sent:1;
 	bool destroyed:1;
@@ -41,6 +40,7 @@ struct auth_worker_server {
 struct auth_worker_command {
 	struct auth_worker_server *server;
 	struct event *event;
+	time_t start;
 };
 
 struct auth_worker_list_context {
@@ -53,6 +53,10 @@ struct auth_worker_list_context {
 
 static struct connection_list *clients = NULL;
 static bool auth_worker_server_error = FALSE;
+/* Number of requests being handled. The auth process may pipeline several
+   requests, which are handled concurrently if the passdb/userdb lookups are
+   asynchronous. */
+static unsigned int auth_worker_requests_pending = 0;
 
 static int auth_worker_output(struct auth_worker_server *server);
 static void auth_worker_server_destroy(struct connection *conn);
@@ -114,7 +118,9 @@ auth_worker_request_finished_full(struct auth_worker_command *cmd,
 	event_unref(&cmd->event);
 	i_free(cmd);
 
-	auth_worker_refresh_proctitle(WORKER_STATE_IDLE);
+	i_assert(auth_worker_requests_pending > 0);
+	if (--auth_worker_requests_pending == 0)
+		auth_worker_refresh_proctitle(WORKER_STATE_IDLE);
 }
 
 static void auth_worker_request_finished(struct auth_worker_command *cmd,
@@ -172,7 +178,9 @@ static void auth_worker_send_reply(struct auth_worker_server *server,
 				   struct auth_request *request,
 				   string_t *str)
 {
-	time_t cmd_duration = time(NULL) - server->cmd_start;
+	struct auth_worker_command *cmd =
+		request == NULL ? NULL : request->context;
+	time_t cmd_duration = cmd == NULL ? 0 : time(NULL) - cmd->start;
 	const char *p;
 
 	if (worker_restart_request)
@@ -786,7 +794,8 @@ auth_worker_server_input_args(struct connection *conn, const char *const *args)
 	event_add_str(cmd->event, "command", args[1]);
 	event_add_int(cmd->event, "command_id", id);
 	event_set_append_log_prefix(cmd->event, t_strdup_printf("auth-worker<%u>: ", id));
-	server->cmd_start = ioloop_time;
+	cmd->start = ioloop_time;
+	auth_worker_requests_pending++;
 	server->refcount++;
 	e_debug(cmd->event, "Handling %s request", args[1]);
 
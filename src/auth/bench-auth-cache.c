@@ -0,0 +1,164 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#define AUTH_REQUEST_FIELDS_CONST
+
+#include "lib.h"
+#include "str.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "auth-request.h"
+#include "auth-cache.h"
+
+#include <stdio.h>
+
+/**
+ * Simulates an auth process restart with a warm auth cache: the cache is
+ * filled with passdb and userdb entries for the given number of users and
+ * saved to a file. Then a login storm where every user logs in once is run
+ * against a new empty cache and against a cache loaded from the saved file.
+ * Each cache miss would be a passdb/userdb (e.g. LDAP) lookup, so the miss
+ * counts show how many backend queries the restart costs.
+ */
+
+#define BENCH_DEFAULT_USERS 100000
+#define BENCH_CACHE_SIZE (512*1024*1024)
+#define BENCH_CACHE_PATH ".bench-auth-cache"
+
+const struct var_expand_table
+auth_request_var_expand_static_tab[AUTH_REQUEST_VAR_TAB_COUNT + 1] = {
+	/* these 3 must be in this order */
+	{ 'u', NULL, "user" },
+	{ 'n', NULL, "username" },
+	{ 'd', NULL, "domain" },
+	{ '\0', NULL, NULL }
+};
+
+struct event *auth_event;
+
+static struct var_expand_table bench_cache_key_tab[] = {
+	{ 'u', NULL, "user" },
+	{ '!', NULL, NULL },
+	{ '\0', NULL, NULL }
+};
+
+struct var_expand_table *
+auth_request_get_var_expand_table_full(const struct auth_request *auth_request,
+				       const char *username,
+				       auth_request_escape_func_t *escape_func ATTR_UNUSED,
+				       unsigned int *count ATTR_UNUSED)
+{
+	bench_cache_key_tab[0].value = username;
+	bench_cache_key_tab[1].value = auth_request->userdb_lookup ? "2" : "1";
+	return bench_cache_key_tab;
+}
+
+int auth_request_var_expand_with_table(string_t *dest, const char *str,
+				       const struct auth_request *auth_request ATTR_UNUSED,
+				       const struct var_expand_table *table,
+				       auth_request_escape_func_t *escape_func ATTR_UNUSED,
+				       const char **error_r)
+{
+	return var_expand(dest, str, table, error_r);
+}
+
+static void
+bench_request_init(struct auth_request *request, unsigned int user_idx,
+		   bool userdb)
+{
+	char *user = t_strdup_noconst(
+		t_strdup_printf("user%u@example.com", user_idx));
+
+	i_zero(request);
+	request->fields.user = user;
+	request->fields.translated_username = user;
+	request->userdb_lookup = userdb;
+}
+
+static void bench_fill(struct auth_cache *cache, unsigned int user_count)
+{
+	struct auth_request request;
+	unsigned int i;
+
+	for (i = 0; i < user_count; i++) T_BEGIN {
+		bench_request_init(&request, i, FALSE);
+		auth_cache_insert(cache, &request, "%u", t_strdup_printf(
+			"{SHA512-CRYPT}$6$%08x$%0100u", i, i), TRUE);
+		bench_request_init(&request, i, TRUE);
+		auth_cache_insert(cache, &request, "%u", t_strdup_printf(
+			"uid=%u\tgid=%u\thome=/home/user%u", i, i, i), TRUE);
+	} T_END;
+}
+
+static unsigned int
+bench_login_storm(struct auth_cache *cache, unsigned int user_count)
+{
+	struct auth_request request;
+	struct auth_cache_node *node;
+	unsigned int i, misses = 0;
+	bool expired, neg_expired;
+
+	for (i = 0; i < user_count; i++) T_BEGIN {
+		bench_request_init(&request, i, FALSE);
+		if (auth_cache_lookup(cache, &request, "%u", &node,
+				      &expired, &neg_expired) == NULL)
+			misses++;
+		bench_request_init(&request, i, TRUE);
+		if (auth_cache_lookup(cache, &request, "%u", &node,
+				      &expired, &neg_expired) == NULL)
+			misses++;
+	} T_END;
+	return misses;
+}
+
+int main(int argc, char *argv[])
+{
+	const unsigned char db_hash[MD5_RESULTLEN] = { 0 };
+	unsigned int user_count = BENCH_DEFAULT_USERS, count, misses;
+	struct auth_cache *cache;
+	const char *error;
+	uint64_t ts_0, ts_1;
+
+	lib_init();
+	if (argc > 2 || (argc == 2 &&
+			 (str_to_uint(argv[1], &user_count) < 0 ||
+			  user_count == 0))) {
+		fprintf(stderr, "Usage: %s [<user count>]\n", argv[0]);
+		lib_exit(1);
+	}
+	auth_event = event_create(NULL);
+
+	cache = auth_cache_new(BENCH_CACHE_SIZE, 3600, 3600);
+	bench_fill(cache, user_count);
+	ts_0 = i_nanoseconds();
+	if (auth_cache_save(cache, BENCH_CACHE_PATH, db_hash, &error) < 0)
+		i_fatal("%s", error);
+	ts_1 = i_nanoseconds();
+	auth_cache_free(&cache);
+	printf("%u users: saved cache in %.03lf ms\n",
+	       user_count, (double)(ts_1 - ts_0) / 1e6);
+
+	cache = auth_cache_new(BENCH_CACHE_SIZE, 3600, 3600);
+	ts_0 = i_nanoseconds();
+	misses = bench_login_storm(cache, user_count);
+	ts_1 = i_nanoseconds();
+	auth_cache_free(&cache);
+	printf("empty cache:  %u backend lookups for %u logins (%.03lf ms)\n",
+	       misses, user_count, (double)(ts_1 - ts_0) / 1e6);
+
+	cache = auth_cache_new(BENCH_CACHE_SIZE, 3600, 3600);
+	ts_0 = i_nanoseconds();
+	if (auth_cache_load(cache, BENCH_CACHE_PATH, db_hash,
+			    &count, &error) <= 0)
+		i_fatal("%s", error);
+	misses = bench_login_storm(cache, user_count);
+	ts_1 = i_nanoseconds();
+	auth_cache_free(&cache);
+	printf("loaded cache: %u backend lookups for %u logins "
+	       "(%.03lf ms including loading %u entries)\n",
+	       misses, user_count, (double)(ts_1 - ts_0) / 1e6, count);
+
+	i_unlink(BENCH_CACHE_PATH);
+	event_unref(&auth_event);
+	lib_deinit();
+	return 0;
+}
@@ -354,7 +354,10 @@ static void client_connected(struct master_service_connection *conn)
 static void auth_die(void)
 {
 	if (!worker) {
-		/* do nothing. auth clients should disconnect soon. */
+		/* auth clients should disconnect soon. save the cache
+		   already now, so a new auth process started meanwhile
+		   gets the latest entries when it loads the file. */
+		passdb_cache_save();
 	} else {
 		/* ask auth master to disconnect us */
 		auth_worker_server_send_shutdown();
@@ -1,6 +1,8 @@
 /* Copyright (c) 2004-2018 Dovecot authors, see the included COPYING file */
 
 #include "auth-common.h"
+#include "ioloop.h"
+#include "md5.h"
 #include "str.h"
 #include "strescape.h"
 #include "restrict-process-size.h"
@@ -9,9 +11,17 @@
 #include "passdb.h"
 #include "passdb-cache.h"
 #include "passdb-blocking.h"
+#include "userdb.h"
+
+/* How often to write the cache to auth_cache_persistent_path */
+#define PASSDB_CACHE_SAVE_INTERVAL_MSECS (10*60*1000)
 
 struct auth_cache *passdb_cache = NULL;
 
+static char *passdb_cache_path = NULL;
+static unsigned char passdb_cache_db_hash[MD5_RESULTLEN];
+static struct timeout *to_passdb_cache_save = NULL;
+
 static void
 passdb_cache_log_hit(struct auth_request *request, const char *value)
 {
@@ -186,6 +196,36 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 	return TRUE;
 }
 
+static void passdb_cache_db_hash_generate(unsigned char hash[MD5_RESULTLEN])
+{
+	unsigned char passdb_md5[MD5_RESULTLEN], userdb_md5[MD5_RESULTLEN];
+	struct md5_context ctx;
+
+	passdbs_generate_md5(passdb_md5);
+	userdbs_generate_md5(userdb_md5);
+
+	md5_init(&ctx);
+	md5_update(&ctx, passdb_md5, sizeof(passdb_md5));
+	md5_update(&ctx, userdb_md5, sizeof(userdb_md5));
+	md5_final(&ctx, hash);
+}
+
+void passdb_cache_save(void)
+{
+	const char *error;
+
+	if (passdb_cache == NULL || passdb_cache_path == NULL)
+		return;
+	if (auth_cache_save(passdb_cache, passdb_cache_path,
+			    passdb_cache_db_hash, &error) < 0)
+		i_error("Failed to save auth cache: %s", error);
+}
+
+static void passdb_cache_save_timeout(void *context ATTR_UNUSED)
+{
+	passdb_cache_save();
+}
+
 void passdb_cache_init(const struct auth_settings *set)
 {
 	rlim_t limit;
@@ -202,10 +242,23 @@ void passdb_cache_init(const struct auth_settings *set)
 	}
 	passdb_cache = auth_cache_new(set->cache_size, set->cache_ttl,
 				      set->cache_negative_ttl);
+
+	if (set->cache_persistent_path[0] != '\0') {
+		passdb_cache_path = i_strdup(set->cache_persistent_path);
+		passdb_cache_db_hash_generate(passdb_cache_db_hash);
+		auth_cache_load_lazy(passdb_cache, passdb_cache_path,
+				     passdb_cache_db_hash);
+		to_passdb_cache_save =
+			timeout_add(PASSDB_CACHE_SAVE_INTERVAL_MSECS,
+				    passdb_cache_save_timeout, NULL);
+	}
 }
 
 void passdb_cache_deinit(void)
 {
+	timeout_remove(&to_passdb_cache_save);
+	passdb_cache_save();
+	i_free(passdb_cache_path);
 	if (passdb_cache != NULL)
 		auth_cache_free(&passdb_cache);
 }
@@ -15,6 +15,9 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 				     enum passdb_result *result_r,
 				     bool use_expired);
 
+/* Write the cache to auth_cache_persistent_path, if it's set. */
+void passdb_cache_save(void);
+
 void passdb_cache_init(const struct auth_settings *set);
 void passdb_cache_deinit(void);
 
@@ -1,11 +1,16 @@
 /* Copyright (c) 2013-2018 Dovecot authors, see the included COPYING file */
 
+#define AUTH_REQUEST_FIELDS_CONST
+
 #include "lib.h"
 #include "str.h"
 #include "auth-request.h"
 #include "auth-cache.h"
 #include "test-common.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 const struct var_expand_table
 auth_request_var_expand_static_tab[AUTH_REQUEST_VAR_TAB_COUNT + 1] = {
 	/* these 3 must be in this order */
@@ -21,22 +26,30 @@ auth_request_var_expand_static_tab[AUTH_REQUEST_VAR_TAB_COUNT + 1] = {
 
 struct event *auth_event;
 
+static struct var_expand_table test_cache_key_tab[] = {
+	{ 'u', NULL, "user" },
+	{ '!', NULL, NULL },
+	{ '\0', NULL, NULL }
+};
+
 struct var_expand_table *
-auth_request_get_var_expand_table_full(const struct auth_request *auth_request ATTR_UNUSED,
-				       const char *username ATTR_UNUSED,
+auth_request_get_var_expand_table_full(const struct auth_request *auth_request,
+				       const char *username,
 				       auth_request_escape_func_t *escape_func ATTR_UNUSED,
 				       unsigned int *count ATTR_UNUSED)
 {
-	i_unreached();
+	test_cache_key_tab[0].value = username;
+	test_cache_key_tab[1].value = auth_request->userdb_lookup ? "2" : "1";
+	return test_cache_key_tab;
 }
 
 int auth_request_var_expand_with_table(string_t *dest, const char *str,
 				       const struct auth_request *auth_request ATTR_UNUSED,
-				       const struct var_expand_table *table ATTR_UNUSED,
+				       const struct var_expand_table *table,
 				       auth_request_escape_func_t *escape_func ATTR_UNUSED,
-				       const char **error_r ATTR_UNUSED)
+				       const char **error_r)
 {
-	return var_expand(dest, str, auth_request_var_expand_static_tab, error_r);
+	return var_expand(dest, str, table, error_r);
 }
 
 static void test_auth_cache_parse_key(void)
@@ -74,12 +87,286 @@ static void test_auth_cache_parse_key(void)
 	test_end();
 }
 
+static void
+test_cache_insert(struct auth_cache *cache, const char *username,
+		  bool userdb, const char *value)
+{
+	struct auth_request request;
+
+	i_zero(&request);
+	request.fields.user = t_strdup_noconst(username);
+	request.fields.translated_username = username;
+	request.userdb_lookup = userdb;
+	auth_cache_insert(cache, &request, "%u", value, TRUE);
+}
+
+static const char *
+test_cache_lookup(struct auth_cache *cache, const char *username, bool userdb)
+{
+	struct auth_request request;
+	struct auth_cache_node *node;
+	bool expired, neg_expired;
+
+	i_zero(&request);
+	request.fields.user = t_strdup_noconst(username);
+	request.fields.translated_username = username;
+	request.userdb_lookup = userdb;
+	return auth_cache_lookup(cache, &request, "%u", &node,
+				 &expired, &neg_expired);
+}
+
+static void test_auth_cache_segments(void)
+{
+	struct auth_cache *cache;
+	const char *value;
+	unsigned int i;
+
+	test_begin("auth cache segmented lru");
+	cache = auth_cache_new(4096, 3600, 3600);
+
+	/* a user looked up again is protected from one-time lookups */
+	test_cache_insert(cache, "hot", FALSE, "hotpass");
+	test_assert_strcmp(test_cache_lookup(cache, "hot", FALSE), "hotpass");
+	for (i = 0; i < 1000; i++) T_BEGIN {
+		test_cache_insert(cache, t_strdup_printf("user%u", i),
+				  FALSE, "password");
+	} T_END;
+	test_assert(test_cache_lookup(cache, "user0", FALSE) == NULL);
+	test_assert_strcmp(test_cache_lookup(cache, "user999", FALSE),
+			   "password");
+	test_assert_strcmp(test_cache_lookup(cache, "hot", FALSE), "hotpass");
+
+	/* negative entries don't evict positive entries */
+	for (i = 0; i < 1000; i++) T_BEGIN {
+		test_cache_insert(cache, t_strdup_printf("neg%u", i),
+				  FALSE, "");
+	} T_END;
+	test_assert(test_cache_lookup(cache, "neg0", FALSE) == NULL);
+	value = test_cache_lookup(cache, "neg999", FALSE);
+	test_assert(value != NULL && value[0] == '\0');
+	test_assert_strcmp(test_cache_lookup(cache, "user999", FALSE),
+			   "password");
+	test_assert_strcmp(test_cache_lookup(cache, "hot", FALSE), "hotpass");
+
+	test_assert(auth_cache_clear(cache) > 3);
+	test_assert(test_cache_lookup(cache, "hot", FALSE) == NULL);
+	auth_cache_free(&cache);
+	test_end();
+}
+
+static void test_auth_cache_clear_users(void)
+{
+	static const char *const users2[] = { "user2", "nonexistent", NULL };
+	static const char *const users1[] = { "user1", NULL };
+	struct auth_cache *cache;
+	struct auth_request request;
+
+	test_begin("auth cache clear users");
+	cache = auth_cache_new(4096, 3600, 3600);
+	test_cache_insert(cache, "user1", FALSE, "pass1");
+	test_cache_insert(cache, "user1", TRUE, "uid=1");
+	test_cache_insert(cache, "user2", FALSE, "pass2");
+	test_cache_insert(cache, "user2", TRUE, "uid=2");
+	test_cache_insert(cache, "user2x", FALSE, "pass2x");
+	test_cache_insert(cache, "user3", FALSE, "");
+
+	test_assert(auth_cache_clear_users(cache, users2) == 2);
+	test_assert(test_cache_lookup(cache, "user2", FALSE) == NULL);
+	test_assert(test_cache_lookup(cache, "user2", TRUE) == NULL);
+	test_assert_strcmp(test_cache_lookup(cache, "user2x", FALSE), "pass2x");
+	test_assert_strcmp(test_cache_lookup(cache, "user1", FALSE), "pass1");
+	test_assert_strcmp(test_cache_lookup(cache, "user1", TRUE), "uid=1");
+	test_assert_strcmp(test_cache_lookup(cache, "user3", FALSE), "");
+
+	/* removing the user's first entry keeps the rest findable */
+	i_zero(&request);
+	request.fields.user = "user1";
+	auth_cache_remove(cache, &request, "%u");
+	test_assert(test_cache_lookup(cache, "user1", FALSE) == NULL);
+	test_assert(auth_cache_clear_users(cache, users1) == 1);
+	test_assert(test_cache_lookup(cache, "user1", TRUE) == NULL);
+	test_assert_strcmp(test_cache_lookup(cache, "user2x", FALSE), "pass2x");
+
+	auth_cache_free(&cache);
+	test_end();
+}
+
+static void test_auth_cache_persistence(void)
+{
+	const char *path = ".test-auth-cache";
+	unsigned char db_hash[MD5_RESULTLEN] = { 1, 2, 3 };
+	struct auth_cache *cache;
+	unsigned int count;
+	const char *value, *error;
+	unsigned char byte;
+	int fd;
+
+	test_begin("auth cache persistence");
+	i_unlink_if_exists(path);
+
+	cache = auth_cache_new(4096, 3600, 3600);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 0);
+	test_cache_insert(cache, "user1", FALSE, "pass1");
+	test_cache_insert(cache, "user1", TRUE, "uid=1");
+	test_cache_insert(cache, "user2", FALSE, "");
+	test_assert_strcmp(test_cache_lookup(cache, "user1", FALSE), "pass1");
+	test_assert(auth_cache_save(cache, path, db_hash, &error) == 0);
+	auth_cache_free(&cache);
+
+	/* entries are restored */
+	cache = auth_cache_new(4096, 3600, 3600);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 1);
+	test_assert(count == 3);
+	test_assert_strcmp(test_cache_lookup(cache, "user1", FALSE), "pass1");
+	test_assert_strcmp(test_cache_lookup(cache, "user1", TRUE), "uid=1");
+	value = test_cache_lookup(cache, "user2", FALSE);
+	test_assert(value != NULL && value[0] == '\0');
+	auth_cache_free(&cache);
+
+	/* negative entries aren't restored if they're no longer cached */
+	cache = auth_cache_new(4096, 3600, 0);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 1);
+	test_assert(count == 2);
+	test_assert(test_cache_lookup(cache, "user2", FALSE) == NULL);
+	auth_cache_free(&cache);
+
+	/* changed passdb/userdb configuration */
+	db_hash[0]++;
+	cache = auth_cache_new(4096, 3600, 3600);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 0);
+	test_assert(count == 0);
+	test_assert(test_cache_lookup(cache, "user1", FALSE) == NULL);
+	db_hash[0]--;
+
+	/* corrupted file */
+	fd = open(path, O_RDWR);
+	test_assert(fd != -1);
+	test_assert(pread(fd, &byte, 1, 60) == 1);
+	byte ^= 0x55;
+	test_assert(pwrite(fd, &byte, 1, 60) == 1);
+	i_close_fd(&fd);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) < 0);
+	test_assert(count == 0);
+	test_assert(test_cache_lookup(cache, "user1", FALSE) == NULL);
+	auth_cache_free(&cache);
+
+	i_unlink(path);
+	test_end();
+}
+
+static void test_auth_cache_persistence_smaller(void)
+{
+	const char *path = ".test-auth-cache";
+	unsigned char db_hash[MD5_RESULTLEN] = { 1, 2, 3 };
+	struct auth_cache *cache;
+	struct auth_request request;
+	struct auth_cache_node *node;
+	unsigned int i, count, found = 0;
+	size_t node_size = 0;
+	bool expired, neg_expired;
+	const char *error;
+
+	test_begin("auth cache persistence to a smaller cache");
+	i_unlink_if_exists(path);
+
+	/* all the entries are in the protected segment */
+	cache = auth_cache_new(1024*1024, 3600, 0);
+	for (i = 0; i < 100; i++) T_BEGIN {
+		const char *user = t_strdup_printf("user%03u", i);
+
+		test_cache_insert(cache, user, FALSE, "password");
+		test_assert(test_cache_lookup(cache, user, FALSE) != NULL);
+	} T_END;
+	test_assert(auth_cache_save(cache, path, db_hash, &error) == 0);
+	auth_cache_free(&cache);
+
+	/* The loaded entries no longer fit into the protected segment. The
+	   least recently used ones are moved back to probation, so one-time
+	   lookups evict them. */
+	cache = auth_cache_new(4096, 3600, 0);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 1);
+	for (i = 0; i < 1000; i++) T_BEGIN {
+		test_cache_insert(cache, t_strdup_printf("new%05u", i),
+				  FALSE, "password");
+	} T_END;
+	for (i = 0; i < 100; i++) T_BEGIN {
+		i_zero(&request);
+		request.fields.translated_username =
+			t_strdup_printf("user%03u", i);
+		request.fields.user =
+			t_strdup_noconst(request.fields.translated_username);
+		if (auth_cache_lookup(cache, &request, "%u", &node,
+				      &expired, &neg_expired) != NULL) {
+			node_size = node->alloc_size;
+			found++;
+		}
+	} T_END;
+	test_assert(test_cache_lookup(cache, "user099", FALSE) != NULL);
+	test_assert(test_cache_lookup(cache, "user000", FALSE) == NULL);
+	test_assert(found > 0 && found * node_size <= 4096 / 100 * 80);
+	auth_cache_free(&cache);
+
+	i_unlink(path);
+	test_end();
+}
+
+static void test_auth_cache_persistence_lazy(void)
+{
+	const char *path = ".test-auth-cache";
+	unsigned char db_hash[MD5_RESULTLEN] = { 1, 2, 3 };
+	struct auth_cache *cache;
+	unsigned int count;
+	const char *error;
+
+	test_begin("auth cache persistence lazy loading");
+	i_unlink_if_exists(path);
+
+	cache = auth_cache_new(4096, 3600, 3600);
+	test_cache_insert(cache, "user1", FALSE, "pass1");
+	test_assert(auth_cache_save(cache, path, db_hash, &error) == 0);
+	auth_cache_free(&cache);
+
+	/* the file is loaded on the first access */
+	cache = auth_cache_new(4096, 3600, 3600);
+	auth_cache_load_lazy(cache, path, db_hash);
+	test_assert_strcmp(test_cache_lookup(cache, "user1", FALSE), "pass1");
+	/* loading again doesn't add anything new */
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 1);
+	test_assert(count == 0);
+	auth_cache_free(&cache);
+
+	/* saving an unused cache keeps the file */
+	cache = auth_cache_new(4096, 3600, 3600);
+	auth_cache_load_lazy(cache, path, db_hash);
+	test_assert(auth_cache_save(cache, path, db_hash, &error) == 0);
+	auth_cache_free(&cache);
+	cache = auth_cache_new(4096, 3600, 3600);
+	test_assert(auth_cache_load(cache, path, db_hash, &count, &error) == 1);
+	test_assert(count == 1);
+	auth_cache_free(&cache);
+
+	/* clearing the cache cancels the load */
+	cache = auth_cache_new(4096, 3600, 3600);
+	auth_cache_load_lazy(cache, path, db_hash);
+	test_assert(auth_cache_clear(cache) == 0);
+	test_assert(test_cache_lookup(cache, "user1", FALSE) == NULL);
+	auth_cache_free(&cache);
+
+	i_unlink(path);
+	test_end();
+}
+
 int main(void)
 {
 	lib_init();
 	auth_event = event_create(NULL);
 	static void (*const test_functions[])(void) = {
 		test_auth_cache_parse_key,
+		test_auth_cache_segments,
+		test_auth_cache_clear_users,
+		test_auth_cache_persistence,
+		test_auth_cache_persistence_smaller,
+		test_auth_cache_persistence_lazy,
 		NULL
 	};
 	int ret = test_run(test_functions);
@@ -0,0 +1,409 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-auth.h"
+#include "auth-common.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "net.h"
+#include "str.h"
+#include "strescape.h"
+#include "settings-parser.h"
+#include "auth-settings.h"
+#include "userdb.h"
+#include "auth-worker-server.h"
+#include "auth-worker-connection.h"
+
+#include <unistd.h>
+
+#define TEST_WORKER_SOCKET_PATH "auth-worker"
+#define TEST_MAX_WORKERS 4
+
+/* The auth-worker process end of a worker connection */
+struct test_worker {
+	int fd;
+	struct istream *input;
+	struct ostream *output;
+	struct io *io;
+
+	/* "<id>\t<command>\t<name>" lines received from the auth process */
+	ARRAY_TYPE(const_string) requests;
+	unsigned int request_count;
+	bool disconnected;
+};
+
+static pool_t test_pool;
+static struct auth_settings test_set;
+static int test_listen_fd;
+static struct io *test_io_listen;
+static struct test_worker test_workers[TEST_MAX_WORKERS];
+static unsigned int test_worker_count;
+static unsigned int test_process_limit;
+/* "<name>:<reply>" for each finished auth_worker_call() */
+static ARRAY_TYPE(const_string) test_results;
+static unsigned int test_result_count;
+
+static void test_worker_input(struct test_worker *worker)
+{
+	const char *line;
+
+	while ((line = i_stream_read_next_line(worker->input)) != NULL) {
+		if (str_begins_with(line, "VERSION\t") ||
+		    str_begins_with(line, "DBHASH\t"))
+			continue;
+		line = p_strdup(test_pool, line);
+		array_push_back(&worker->requests, &line);
+		worker->request_count++;
+	}
+	if (worker->input->eof) {
+		io_remove(&worker->io);
+		worker->disconnected = TRUE;
+	}
+	io_loop_stop(current_ioloop);
+}
+
+static void test_worker_accept(void *context ATTR_UNUSED)
+{
+	struct test_worker *worker;
+	int fd;
+
+	fd = net_accept(test_listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	i_assert(test_worker_count < TEST_MAX_WORKERS);
+	worker = &test_workers[test_worker_count++];
+	i_zero(worker);
+	p_array_init(&worker->requests, test_pool, 4);
+	worker->fd = fd;
+	fd_set_nonblock(fd, TRUE);
+	worker->input = i_stream_create_fd(fd, SIZE_MAX);
+	worker->output = o_stream_create_fd(fd, SIZE_MAX);
+	o_stream_set_no_error_handling(worker->output, TRUE);
+	worker->io = io_add_istream(worker->input, test_worker_input, worker);
+
+	o_stream_nsend_str(worker->output, t_strdup_printf(
+		"VERSION\t"AUTH_WORKER_NAME"\t%u\t%u\nPROCESS-LIMIT\t%u\n",
+		AUTH_WORKER_PROTOCOL_MAJOR_VERSION,
+		AUTH_WORKER_PROTOCOL_MINOR_VERSION, test_process_limit));
+	io_loop_stop(current_ioloop);
+}
+
+static void test_worker_close(struct test_worker *worker)
+{
+	if (worker->fd == -1)
+		return;
+	io_remove(&worker->io);
+	i_stream_unref(&worker->input);
+	o_stream_unref(&worker->output);
+	i_close_fd(&worker->fd);
+}
+
+static void test_wait(const unsigned int *counter, unsigned int count)
+{
+	struct timeout *to = timeout_add(5000, io_loop_stop, current_ioloop);
+	time_t start = time(NULL);
+
+	while (*counter < count && time(NULL) - start < 5)
+		io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_assert(*counter >= count);
+}
+
+static void test_wait_disconnect(struct test_worker *worker)
+{
+	struct timeout *to = timeout_add(5000, io_loop_stop, current_ioloop);
+	time_t start = time(NULL);
+
+	while (!worker->disconnected && time(NULL) - start < 5)
+		io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_assert(worker->disconnected);
+}
+
+static bool
+test_worker_callback(struct auth_worker_connection *conn ATTR_UNUSED,
+		     const char *const *args, void *context)
+{
+	const char *name = context;
+	const char *result;
+
+	/* multi-line LIST replies continue until the final line */
+	if (args[0][0] == '*')
+		return TRUE;
+
+	result = p_strdup_printf(test_pool, "%s:%s", name, args[0]);
+	array_push_back(&test_results, &result);
+	test_result_count++;
+	io_loop_stop(current_ioloop);
+	return TRUE;
+}
+
+static void test_call(const char *command, const char *name)
+{
+	auth_worker_call(test_pool, "user",
+			 t_strdup_printf("%s\t%s", command, name),
+			 test_worker_callback, p_strdup(test_pool, name));
+}
+
+/* Returns the name of the idx'th request the worker received */
+static const char *test_worker_request(struct test_worker *worker,
+				       unsigned int idx)
+{
+	const char *const *args;
+
+	if (idx >= array_count(&worker->requests))
+		return "";
+	args = t_strsplit_tabescaped(array_idx_elem(&worker->requests, idx));
+	return str_array_length(args) < 3 ? "" : args[2];
+}
+
+static void test_worker_send(struct test_worker *worker, const char *name,
+			     const char *reply)
+{
+	const char *const *args;
+	const char *line;
+
+	array_foreach_elem(&worker->requests, line) {
+		args = t_strsplit_tabescaped(line);
+		if (str_array_length(args) >= 3 && strcmp(args[2], name) == 0) {
+			o_stream_nsend_str(worker->output, t_strdup_printf(
+				"%s\t%s\n", args[0], reply));
+			return;
+		}
+	}
+	i_panic("test: request %s not found", name);
+}
+
+static void test_worker_reply(struct test_worker *worker, const char *name)
+{
+	test_worker_send(worker, name, "OK\tuser");
+}
+
+static const char *test_result(unsigned int idx)
+{
+	if (idx >= array_count(&test_results))
+		return "";
+	return array_idx_elem(&test_results, idx);
+}
+
+static void
+test_workers_init(unsigned int process_limit, unsigned int max_pipelined)
+{
+	test_pool = pool_alloconly_create("test auth worker", 4096);
+	test_set = *(const struct auth_settings *)
+		auth_setting_parser_info.defaults;
+	test_set.worker_max_pipelined_requests = max_pipelined;
+	global_auth_settings = &test_set;
+	test_process_limit = process_limit;
+	test_worker_count = 0;
+	p_array_init(&test_results, test_pool, 8);
+	test_result_count = 0;
+
+	i_unlink_if_exists(TEST_WORKER_SOCKET_PATH);
+	test_listen_fd = net_listen_unix(TEST_WORKER_SOCKET_PATH, 16);
+	if (test_listen_fd == -1)
+		i_fatal("net_listen_unix(%s) failed: %m",
+			TEST_WORKER_SOCKET_PATH);
+	test_io_listen = io_add(test_listen_fd, IO_READ,
+				test_worker_accept, NULL);
+	userdbs_init();
+	auth_worker_connection_init();
+
+	/* the process limit is known after the first worker's handshake */
+	test_call("PASSV", "init");
+	test_wait(&test_worker_count, 1);
+	test_wait(&test_workers[0].request_count, 1);
+	test_worker_reply(&test_workers[0], "init");
+	test_wait(&test_result_count, 1);
+	array_clear(&test_results);
+	test_result_count = 0;
+}
+
+static void test_workers_deinit(void)
+{
+	auth_worker_connection_deinit();
+	for (unsigned int i = 0; i < test_worker_count; i++)
+		test_worker_close(&test_workers[i]);
+	io_remove(&test_io_listen);
+	i_close_fd(&test_listen_fd);
+	i_unlink(TEST_WORKER_SOCKET_PATH);
+	userdbs_deinit();
+	global_auth_settings = NULL;
+	pool_unref(&test_pool);
+}
+
+static void test_auth_worker_out_of_order_replies(void)
+{
+	struct test_worker *worker = &test_workers[0];
+
+	test_begin("auth worker out of order replies");
+	test_workers_init(1, 3);
+
+	test_call("PASSV", "a");
+	test_call("PASSV", "b");
+	test_call("PASSV", "c");
+	test_wait(&worker->request_count, 4);
+	test_assert_strcmp(test_worker_request(worker, 1), "a");
+	test_assert_strcmp(test_worker_request(worker, 2), "b");
+	test_assert_strcmp(test_worker_request(worker, 3), "c");
+
+	/* each reply goes to the request with its ID */
+	test_worker_reply(worker, "c");
+	test_worker_reply(worker, "a");
+	test_worker_reply(worker, "b");
+	test_wait(&test_result_count, 3);
+	test_assert_strcmp(test_result(0), "c:OK");
+	test_assert_strcmp(test_result(1), "a:OK");
+	test_assert_strcmp(test_result(2), "b:OK");
+	test_assert(test_worker_count == 1);
+
+	test_workers_deinit();
+	test_end();
+}
+
+static void test_auth_worker_max_pipelined(void)
+{
+	struct test_worker *worker = &test_workers[0];
+
+	test_begin("auth worker max pipelined requests");
+	test_workers_init(1, 2);
+
+	/* the third request waits in the queue */
+	test_call("PASSV", "a");
+	test_call("PASSV", "b");
+	test_call("PASSV", "c");
+	test_wait(&worker->request_count, 3);
+	test_assert(worker->request_count == 3);
+
+	/* it's sent as soon as one of the requests finishes */
+	test_worker_reply(worker, "b");
+	test_wait(&worker->request_count, 4);
+	test_assert_strcmp(test_worker_request(worker, 3), "c");
+	test_assert_strcmp(test_result(0), "b:OK");
+
+	test_worker_reply(worker, "a");
+	test_worker_reply(worker, "c");
+	test_wait(&test_result_count, 3);
+	test_assert_strcmp(test_result(1), "a:OK");
+	test_assert_strcmp(test_result(2), "c:OK");
+	test_assert(test_worker_count == 1);
+
+	test_workers_deinit();
+	test_end();
+}
+
+static void test_auth_worker_list_exclusive(void)
+{
+	struct test_worker *worker1 = &test_workers[0];
+	struct test_worker *worker2 = &test_workers[1];
+
+	test_begin("auth worker LIST uses its own connection");
+	test_workers_init(2, 3);
+
+	/* nothing else is sent to the connection handling LIST */
+	test_call("LIST", "list");
+	test_call("PASSV", "a");
+	test_wait(&test_worker_count, 2);
+	test_wait(&worker2->request_count, 1);
+	test_call("PASSV", "b");
+	test_wait(&worker2->request_count, 2);
+	test_assert_strcmp(test_worker_request(worker1, 1), "list");
+	test_assert_strcmp(test_worker_request(worker2, 0), "a");
+	test_assert_strcmp(test_worker_request(worker2, 1), "b");
+
+	test_worker_send(worker1, "list", "*\tuser1");
+	test_worker_send(worker1, "list", "*\tuser2");
+	test_worker_reply(worker2, "a");
+	test_wait(&test_result_count, 1);
+	test_assert_strcmp(test_result(0), "a:OK");
+	test_worker_reply(worker1, "list");
+	test_worker_reply(worker2, "b");
+	test_wait(&test_result_count, 3);
+	test_assert(worker1->request_count == 2);
+	test_assert(worker2->request_count == 2);
+
+	test_workers_deinit();
+	test_end();
+}
+
+static void test_auth_worker_died(void)
+{
+	struct test_worker *worker = &test_workers[0];
+
+	test_begin("auth worker died with pending requests");
+	test_workers_init(1, 3);
+
+	test_call("PASSV", "a");
+	test_call("PASSV", "b");
+	test_wait(&worker->request_count, 3);
+
+	/* all the pending requests fail */
+	test_expect_errors(2);
+	test_worker_close(worker);
+	test_wait(&test_result_count, 2);
+	test_expect_no_more_errors();
+	test_assert_strcmp(test_result(0), "a:FAIL");
+	test_assert_strcmp(test_result(1), "b:FAIL");
+
+	/* and a new worker is connected */
+	test_wait(&test_worker_count, 2);
+	test_call("PASSV", "c");
+	test_wait(&test_workers[1].request_count, 1);
+	test_worker_reply(&test_workers[1], "c");
+	test_wait(&test_result_count, 3);
+	test_assert_strcmp(test_result(2), "c:OK");
+
+	test_workers_deinit();
+	test_end();
+}
+
+static void test_auth_worker_restart_pending(void)
+{
+	struct test_worker *worker1 = &test_workers[0];
+	struct test_worker *worker2 = &test_workers[1];
+
+	test_begin("auth worker RESTART with pending requests");
+	test_workers_init(2, 3);
+
+	test_call("PASSV", "a");
+	test_call("PASSV", "b");
+	test_wait(&worker1->request_count, 3);
+
+	/* the worker wants to restart: the pending requests are still
+	   finished, but new ones go to another worker */
+	o_stream_nsend_str(worker1->output, "RESTART\n");
+	test_worker_reply(worker1, "a");
+	test_wait(&test_result_count, 1);
+	test_call("PASSV", "c");
+	test_wait(&test_worker_count, 2);
+	test_wait(&worker2->request_count, 1);
+	test_assert_strcmp(test_worker_request(worker2, 0), "c");
+
+	/* the connection is closed after the last pending request */
+	test_worker_reply(worker1, "b");
+	test_wait(&test_result_count, 2);
+	test_wait_disconnect(worker1);
+	test_assert(worker1->request_count == 3);
+	test_assert_strcmp(test_result(0), "a:OK");
+	test_assert_strcmp(test_result(1), "b:OK");
+
+	test_worker_reply(worker2, "c");
+	test_wait(&test_result_count, 3);
+	test_assert_strcmp(test_result(2), "c:OK");
+
+	test_workers_deinit();
+	test_end();
+}
+
+void test_auth_worker_connection(void)
+{
+	struct ioloop *ioloop = io_loop_create();
+
+	test_auth_worker_out_of_order_replies();
+	test_auth_worker_max_pipelined();
+	test_auth_worker_list_exclusive();
+	test_auth_worker_died();
+	test_auth_worker_restart_pending();
+	io_loop_destroy(&ioloop);
+}
@@ -16,6 +16,7 @@ int main(int argc, const char *argv[])
 		TEST_NAMED(test_auth_request_fields)
 		TEST_NAMED(test_db_dict_parse_cache_key)
 		TEST_NAMED(test_username_filter)
+		TEST_NAMED(test_auth_worker_connection)
 #if defined(BUILTIN_LUA)
 		TEST_NAMED(test_db_lua)
 #endif
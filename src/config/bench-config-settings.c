@@ -0,0 +1,143 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "env-util.h"
+#include "ostream.h"
+#include "master-interface.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "config-parser.h"
+#include "config-dump-full.h"
+#include "old-set-parser.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/**
+ * Measures how long a service process spends reading its settings at
+ * startup with a large config. A config with the given number of local and
+ * remote filter blocks is written, parsed and dumped into the binary config
+ * file the same way the config process does it. The settings are then read
+ * from the binary file repeatedly as imap and lmtp processes would do it.
+ */
+
+#define BENCH_DEFAULT_FILTERS 1000
+#define BENCH_READ_COUNT 100
+#define BENCH_CONFIG_PATH ".bench-config"
+
+static void bench_write_config(unsigned int filter_count)
+{
+	struct ostream *output;
+	unsigned int i;
+
+	output = o_stream_create_file(BENCH_CONFIG_PATH, 0, 0600, 0);
+	o_stream_nsend_str(output,
+		"base_dir = /tmp\n"
+		"default_login_user = nobody\n"
+		"default_internal_user = root\n"
+		"default_internal_group = root\n"
+		"protocols = imap lmtp\n"
+		"mail_location = maildir:~/Maildir\n");
+	for (i = 0; i < filter_count; i++) T_BEGIN {
+		o_stream_nsend_str(output, t_strdup_printf(
+			"remote 10.%u.%u.0/24 {\n"
+			"  mail_max_userip_connections = %u\n"
+			"}\n"
+			"local 192.168.%u.%u {\n"
+			"  protocol imap {\n"
+			"    imap_idle_notify_interval = %u secs\n"
+			"  }\n"
+			"}\n"
+			"local_name host%u.example.com {\n"
+			"  mail_location = maildir:/var/mail/host%u/%%u\n"
+			"}\n",
+			(i / 256) % 256, i % 256, i + 1,
+			(i / 256) % 256, i % 256, i + 1, i, i));
+	} T_END;
+	o_stream_nsend_str(output,
+		"protocol lmtp {\n"
+		"  mail_max_lock_timeout = 30 secs\n"
+		"}\n");
+	if (o_stream_finish(output) < 0) {
+		i_fatal("write(%s) failed: %s", BENCH_CONFIG_PATH,
+			o_stream_get_error(output));
+	}
+	o_stream_unref(&output);
+}
+
+static void
+bench_settings_read(const char *service_name, const char *remote_ip)
+{
+	struct master_service_settings_input input;
+	struct master_service_settings_output output;
+	const char *error;
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+
+	i_zero(&input);
+	input.service = service_name;
+	input.local_name = "mail.example.com";
+	if (net_addr2ip(remote_ip, &input.remote_ip) < 0)
+		i_unreached();
+	if (net_addr2ip("127.0.0.1", &input.local_ip) < 0)
+		i_unreached();
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < BENCH_READ_COUNT; i++) T_BEGIN {
+		if (master_service_settings_read(master_service, &input,
+						 &output, &error) < 0)
+			i_fatal("master_service_settings_read() failed: %s",
+				error);
+	} T_END;
+	ts_1 = i_nanoseconds();
+	printf("%s: %.03lf ms per settings read\n", service_name,
+	       (double)(ts_1 - ts_0) / 1e6 / BENCH_READ_COUNT);
+}
+
+int main(int argc, char *argv[])
+{
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_NO_SSL_INIT;
+	unsigned int filter_count = BENCH_DEFAULT_FILTERS;
+	const char *import_environment, *error;
+	uint64_t ts_0, ts_1;
+	int fd;
+
+	master_service = master_service_init("bench-config", service_flags,
+					     &argc, &argv, "");
+	if (argc > 2 || (argc == 2 &&
+			 (str_to_uint(argv[1], &filter_count) < 0 ||
+			  filter_count == 0)))
+		i_fatal("Usage: %s [<filter count>]", argv[0]);
+	master_service_init_finish(master_service);
+
+	bench_write_config(filter_count);
+	ts_0 = i_nanoseconds();
+	if (config_parse_file(BENCH_CONFIG_PATH,
+			      CONFIG_PARSE_FLAG_EXPAND_VALUES, &error) <= 0)
+		i_fatal("%s", error);
+	fd = config_dump_full(CONFIG_DUMP_FULL_DEST_TEMPDIR, 0,
+			      &import_environment);
+	if (fd == -1)
+		i_fatal("config_dump_full() failed");
+	ts_1 = i_nanoseconds();
+	i_unlink(BENCH_CONFIG_PATH);
+	printf("%u filters: config parsed and dumped in %.03lf ms\n",
+	       filter_count * 3, (double)(ts_1 - ts_0) / 1e6);
+
+	env_put(DOVECOT_CONFIG_FD_ENV, dec2str(fd));
+	bench_settings_read("imap", "10.1.2.3");
+	bench_settings_read("lmtp", "10.1.2.3");
+
+	config_filter_deinit(&config_filter);
+	old_settings_deinit_global();
+	config_parser_deinit();
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include "strescape.h"
 #include "safe-mkstemp.h"
 #include "ostream.h"
+#include "master-service-settings.h"
 #include "config-parser.h"
 #include "config-request.h"
 #include "config-dump-full.h"
@@ -90,6 +91,51 @@ config_dump_full_write_filter(struct ostream *output,
 	o_stream_nsend(output, str_data(str), str_len(str));
 }
 
+static void
+config_dump_full_append_net(buffer_t *buf, const struct ip_addr *net,
+			    unsigned int bits)
+{
+	buffer_append_c(buf, bits);
+	if (bits == 0)
+		return;
+	if (IPADDR_IS_V4(net)) {
+		buffer_append_c(buf, 4);
+		buffer_append(buf, &net->u.ip4, sizeof(net->u.ip4));
+	} else {
+		buffer_append_c(buf, 6);
+		buffer_append(buf, &net->u.ip6, sizeof(net->u.ip6));
+	}
+}
+
+static buffer_t *
+config_dump_full_binary_filter(const struct config_filter *filter)
+{
+	/* The filter string is followed by the same filter in a form that
+	   can be matched without parsing it:
+
+	   <8bit flags> protocol <NUL> local_name <NUL>
+	   <8bit local_bits> [<8bit 4|6> <local_net>]
+	   <8bit remote_bits> [<8bit 4|6> <remote_net>] */
+	buffer_t *buf = t_buffer_create(64);
+	const char *service = filter->service;
+	uint8_t flags = 0;
+
+	if (service != NULL && service[0] == '!') {
+		flags |= MASTER_SERVICE_SETTINGS_FILTER_FLAG_NOT_PROTOCOL;
+		service++;
+	}
+	buffer_append_c(buf, flags);
+	if (service != NULL)
+		buffer_append(buf, service, strlen(service));
+	buffer_append_c(buf, '\0');
+	if (filter->local_name != NULL)
+		buffer_append(buf, filter->local_name, strlen(filter->local_name));
+	buffer_append_c(buf, '\0');
+	config_dump_full_append_net(buf, &filter->local_net, filter->local_bits);
+	config_dump_full_append_net(buf, &filter->remote_net, filter->remote_bits);
+	return buf;
+}
+
 static bool
 config_dump_full_sections(struct ostream *output,
 			  enum config_dump_full_dest dest,
@@ -124,6 +170,9 @@ config_dump_full_sections(struct ostream *output,
 				CONFIG_DUMP_FLAG_HIDE_LIST_DEFAULTS,
 				config_dump_full_stdout_callback, &dump_ctx);
 		} else {
+			buffer_t *buf = config_dump_full_binary_filter(
+				&(*filters)->filter);
+			o_stream_nsend(output, buf->data, buf->used);
 			export_ctx = config_export_init(
 				CONFIG_DUMP_SCOPE_SET,
 				CONFIG_DUMP_FLAG_HIDE_LIST_DEFAULTS,
@@ -218,7 +267,7 @@ int config_dump_full(enum config_dump_full_dest dest,
 	uint64_t blob_size = 0;
 	uoff_t blob_size_offset = 0;
 	if (dest != CONFIG_DUMP_FULL_DEST_STDOUT) {
-		o_stream_nsend_str(output, "DOVECOT-CONFIG\t1.0\n");
+		o_stream_nsend_str(output, "DOVECOT-CONFIG\t2.0\n");
 		blob_size_offset = output->offset;
 		o_stream_nsend(output, &blob_size, sizeof(blob_size));
 	}
@@ -240,10 +289,14 @@ int config_dump_full(enum config_dump_full_dest dest,
 
 	if (dump_ctx.delayed_output != NULL &&
 	    str_len(dump_ctx.delayed_output) > 0) {
+		buffer_t *filter_buf =
+			config_dump_full_binary_filter(&empty_filter);
 		uint64_t blob_size =
-			cpu64_to_be(sizeof(blob_size) + 1 + str_len(dump_ctx.delayed_output));
+			cpu64_to_be(sizeof(blob_size) + 1 + filter_buf->used +
+				    str_len(dump_ctx.delayed_output));
 		o_stream_nsend(output, &blob_size, sizeof(blob_size));
 		o_stream_nsend(output, "", 1);
+		o_stream_nsend(output, filter_buf->data, filter_buf->used);
 		o_stream_nsend(output, str_data(dump_ctx.delayed_output),
 			       str_len(dump_ctx.delayed_output));
 	}
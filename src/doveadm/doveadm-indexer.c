@@ -52,7 +52,7 @@ indexer_send_cmd_with_args(const char *cmd, const char *const *args)
 
 static void cmd_indexer_add(struct doveadm_cmd_context *cctx)
 {
-	const char *user, *mailbox, *line;
+	const char *user, *mailbox, *priority, *line;
 	int64_t max_recent;
 	bool head;
 
@@ -60,6 +60,8 @@ static void cmd_indexer_add(struct doveadm_cmd_context *cctx)
 		head = FALSE;
 	if (!doveadm_cmd_param_int64(cctx, "max-recent", &max_recent))
 		max_recent = 0;
+	if (!doveadm_cmd_param_str(cctx, "priority", &priority))
+		priority = NULL;
 	if (!doveadm_cmd_param_str(cctx, "user", &user) ||
 	    !doveadm_cmd_param_str(cctx, "mailbox", &mailbox))
 		help_ver2(&doveadm_cmd_indexer_add);
@@ -67,6 +69,9 @@ static void cmd_indexer_add(struct doveadm_cmd_context *cctx)
 	const char *cmd = head ? "PREPEND" : "APPEND";
 	const char *const args[] = {
 		"0", user, mailbox, dec2str(max_recent),
+		/* session ID */
+		priority == NULL ? NULL : "",
+		priority,
 		NULL
 	};
 	struct istream *input = indexer_send_cmd_with_args(cmd, args);
@@ -103,11 +108,13 @@ static void cmd_indexer_remove(struct doveadm_cmd_context *cctx)
 
 static int cmd_indexer_list_print(const char *const *args)
 {
-	if (str_array_length(args) < 7)
+	unsigned int count = str_array_length(args);
+
+	if (count < 7)
 		return -1;
 
 	/* <tag> <username> <mailbox> <session-id> <max-recent-msgs> <type>
-	   <flags> */
+	   <flags> [<priority> <wait secs>] */
 	doveadm_print(args[1]);
 	doveadm_print(args[2]);
 	doveadm_print(args[3]);
@@ -131,6 +138,8 @@ static int cmd_indexer_list_print(const char *const *args)
 		doveadm_print("working/tail-queued");
 	else
 		doveadm_print("working");
+	doveadm_print(count < 9 ? "" : args[7]);
+	doveadm_print(count < 9 ? "" : args[8]);
 	return 0;
 }
 
@@ -151,6 +160,9 @@ static void cmd_indexer_list(struct doveadm_cmd_context *cctx)
 	doveadm_print_header_simple("max_recent");
 	doveadm_print_header_simple("type");
 	doveadm_print_header_simple("status");
+	doveadm_print_header_simple("priority");
+	doveadm_print_header("wait", "wait",
+			     DOVEADM_PRINT_HEADER_FLAG_RIGHT_JUSTIFY);
 
 	alarm(30);
 	while ((line = i_stream_read_next_line(input)) != NULL) {
@@ -171,10 +183,11 @@ static void cmd_indexer_list(struct doveadm_cmd_context *cctx)
 struct doveadm_cmd_ver2 doveadm_cmd_indexer_add = {
 	.cmd = cmd_indexer_add,
 	.name = "indexer add",
-	.usage = "[-h] [-n <max recent>] <user> <mailbox>",
+	.usage = "[-h] [-n <max recent>] [-p interactive|delivery|bulk] <user> <mailbox>",
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_PARAM('h', "head", CMD_PARAM_BOOL, 0)
 DOVEADM_CMD_PARAM('n', "max-recent", CMD_PARAM_STR, 0)
+DOVEADM_CMD_PARAM('p', "priority", CMD_PARAM_STR, 0)
 DOVEADM_CMD_PARAM('\0', "user", CMD_PARAM_STR, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAM('\0', "mailbox", CMD_PARAM_STR, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
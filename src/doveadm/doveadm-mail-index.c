@@ -186,7 +186,8 @@ static void cmd_index_queue(struct index_cmd_context *ctx,
 		str_append_tabescaped(str, user->username);
 		str_append_c(str, '\t');
 		str_append_tabescaped(str, mailbox);
-		str_printfa(str, "\t%u\n", ctx->max_recent_msgs);
+		/* no session ID, bulk priority */
+		str_printfa(str, "\t%u\t\tbulk\n", ctx->max_recent_msgs);
 		o_stream_nsend(ctx->queue_output, str_data(str), str_len(str));
 		if (o_stream_flush(ctx->queue_output) < 0) {
 			i_fatal("write(indexer) failed: %s",
@@ -0,0 +1,112 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "strnum.h"
+#include "master-service.h"
+#include "imap-client.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+/**
+ * Creates the given number of hibernated IDLEing IMAP clients and reports
+ * how much memory the imap-hibernate process uses for each of them. Every
+ * user has a few clients (e.g. phone and desktop), similar to a real
+ * imap-hibernate process.
+ */
+
+#define BENCH_DEFAULT_CLIENTS 5000
+#define BENCH_CLIENTS_PER_USER 4
+
+static long bench_get_maxrss_kb(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		i_fatal("getrusage() failed: %m");
+	return usage.ru_maxrss;
+}
+
+static struct imap_client *bench_client_create(unsigned int idx)
+{
+	static const unsigned char state_data[48] = { 1, 2, 3, 4 };
+	struct imap_client_state state;
+	struct imap_client *client;
+	unsigned int user_idx = idx / BENCH_CLIENTS_PER_USER;
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		i_fatal("socketpair() failed: %m");
+	i_close_fd(&fds[1]);
+
+	i_zero(&state);
+	state.username = t_strdup_printf("user%u@example.com", user_idx);
+	state.mail_log_prefix = "%s(%u)<%{pid}><%{session}>: ";
+	state.session_id = t_strdup_printf("bench%08xsession%08x", idx, idx);
+	state.mailbox_vname = "INBOX";
+	state.userdb_fields = t_strdup_printf(
+		"uid=%u\tgid=%u\thome=/home/user%u", user_idx, user_idx,
+		user_idx);
+	state.stats = t_strdup_printf(
+		"in=%u out=%u deleted=0 expunged=0 trashed=0 hdr_count=0 "
+		"hdr_bytes=0 body_count=0 body_bytes=0", idx, idx * 3);
+	if (net_addr2ip("192.168.0.1", &state.local_ip) < 0 ||
+	    net_addr2ip("10.0.0.1", &state.remote_ip) < 0)
+		i_unreached();
+	state.local_port = 143;
+	state.remote_port = 1024 + idx % 60000;
+	state.session_created = ioloop_time;
+	state.tag = i_strdup_printf("a%u", idx);
+	state.state = state_data;
+	state.state_size = sizeof(state_data);
+	state.imap_idle_notify_interval = 120;
+	state.idle_cmd = TRUE;
+
+	client = imap_client_create(fds[0], &state);
+	imap_client_create_finish(client);
+	return client;
+}
+
+int main(int argc, char *argv[])
+{
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+		MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+		MASTER_SERVICE_FLAG_NO_SSL_INIT;
+	unsigned int i, client_count = BENCH_DEFAULT_CLIENTS;
+	long rss_before, rss_after;
+	unsigned int count;
+	size_t size;
+
+	master_service = master_service_init("imap-hibernate", service_flags,
+					     &argc, &argv, "");
+	if (argc > 2 || (argc == 2 &&
+			 (str_to_uint(argv[1], &client_count) < 0 ||
+			  client_count == 0)))
+		i_fatal("Usage: %s [<client count>]", argv[0]);
+	master_service_init_finish(master_service);
+	master_service_set_client_limit(master_service, client_count);
+	master_service_set_service_count(master_service, client_count);
+	imap_clients_init();
+
+	rss_before = bench_get_maxrss_kb();
+	for (i = 0; i < client_count; i++) T_BEGIN {
+		master_service_client_connection_created(master_service);
+		(void)bench_client_create(i);
+	} T_END;
+	rss_after = bench_get_maxrss_kb();
+
+	imap_clients_get_memory_usage(&count, &size);
+	printf("%u hibernated clients: %ld bytes RSS per client, "
+	       "%zu bytes of client state per client\n",
+	       count, (rss_after - rss_before) * 1024 / client_count,
+	       size / count);
+
+	imap_clients_deinit();
+	master_service_deinit(&master_service);
+	return 0;
+}
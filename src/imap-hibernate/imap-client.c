@@ -10,6 +10,7 @@
 #include "istream.h"
 #include "ostream.h"
 #include "llist.h"
+#include "hash.h"
 #include "priorityq.h"
 #include "base64.h"
 #include "str.h"
@@ -56,11 +57,20 @@ struct imap_client_notify {
 	struct io *io;
 };
 
+/* Strings that are commonly the same for many clients (username, userdb
+   fields) are shared between the clients. */
+struct imap_client_shared_string {
+	unsigned int refcount;
+	char str[];
+};
+
 struct imap_client {
 	struct priorityq_item item;
 
 	struct imap_client *prev, *next;
-	pool_t pool;
+	/* Size of the memory block containing the client and its strings
+	   that aren't shared with other clients. */
+	size_t alloc_size;
 	struct event *event;
 	struct imap_client_state state;
 	ARRAY(struct imap_client_notify) notifys;
@@ -70,6 +80,8 @@ struct imap_client {
 
 	int fd;
 	struct io *io;
+	/* Streams are created only when they're needed and freed again
+	   while the client is idling. See imap_client_get_input/output(). */
 	struct istream *input;
 	struct ostream *output;
 	struct timeout *to_keepalive;
@@ -84,6 +96,9 @@ struct imap_client {
 };
 
 static struct imap_client *imap_clients;
+static unsigned int imap_clients_count;
+static HASH_TABLE(const char *, struct imap_client_shared_string *)
+	imap_client_shared_strings;
 static struct priorityq *unhibernate_queue;
 static struct timeout *to_unhibernate;
 static const char imap_still_here_text[] = "* OK Still here\r\n";
@@ -102,6 +117,84 @@ static void imap_client_add_idle_keepalive_timeout(struct imap_client *client);
 static void imap_clients_unhibernate(void *context);
 static void imap_client_stop_notify_listening(struct imap_client *client);
 
+static const char *imap_client_str_share(const char *str)
+{
+	struct imap_client_shared_string *shared;
+	size_t len;
+
+	if (str == NULL)
+		return NULL;
+
+	shared = hash_table_lookup(imap_client_shared_strings, str);
+	if (shared == NULL) {
+		len = strlen(str);
+		shared = i_malloc(sizeof(*shared) + len + 1);
+		memcpy(shared->str, str, len);
+		str = shared->str;
+		hash_table_insert(imap_client_shared_strings, str, shared);
+	}
+	shared->refcount++;
+	return shared->str;
+}
+
+static void imap_client_str_unshare(const char **_str)
+{
+	const char *str = *_str;
+	struct imap_client_shared_string *shared;
+
+	if (str == NULL)
+		return;
+	*_str = NULL;
+
+	shared = hash_table_lookup(imap_client_shared_strings, str);
+	i_assert(shared != NULL && shared->str == str);
+	i_assert(shared->refcount > 0);
+	if (--shared->refcount == 0) {
+		hash_table_remove(imap_client_shared_strings, str);
+		i_free(shared);
+	}
+}
+
+static struct istream *imap_client_get_input(struct imap_client *client)
+{
+	if (client->input == NULL)
+		client->input = i_stream_create_fd(client->fd, IMAP_MAX_INBUF);
+	return client->input;
+}
+
+static struct ostream *imap_client_get_output(struct imap_client *client)
+{
+	if (client->output == NULL) {
+		client->output = o_stream_create_fd(client->fd,
+						    IMAP_MAX_OUTBUF);
+		o_stream_set_no_error_handling(client->output, TRUE);
+	}
+	return client->output;
+}
+
+static void imap_client_free_idle_streams(struct imap_client *client)
+{
+	/* Most hibernated clients don't send or receive anything for a long
+	   time, so don't keep the streams and their buffers around unless
+	   they still have some data buffered. */
+	if (client->input != NULL &&
+	    i_stream_get_data_size(client->input) == 0 &&
+	    client->next_read_threshold == 0)
+		i_stream_destroy(&client->input);
+	if (client->output != NULL &&
+	    o_stream_get_buffer_used_size(client->output) == 0)
+		o_stream_destroy(&client->output);
+}
+
+static size_t imap_client_get_memory_size(struct imap_client *client)
+{
+	size_t size = client->alloc_size;
+
+	if (array_is_created(&client->notifys))
+		size += buffer_get_size(client->notifys.arr.buffer);
+	return size;
+}
+
 static void imap_client_disconnected(struct imap_client **_client)
 {
 	struct imap_client *client = *_client;
@@ -123,13 +216,15 @@ imap_client_unhibernate_failed(struct imap_client **_client, const char *error)
 		set_name("imap_client_unhibernated")->
 		add_int("hibernation_usecs",
 			timeval_diff_usecs(&ioloop_timeval, &created))->
+		add_int("hibernation_memory_bytes",
+			imap_client_get_memory_size(client))->
 		add_str("error", error);
 	e_error(e->event(), IMAP_CLIENT_UNHIBERNATE_ERROR": %s", error);
 	imap_client_destroy(_client, IMAP_CLIENT_UNHIBERNATE_ERROR);
 }
 
 static void
-imap_client_parse_userdb_fields(struct imap_client *client,
+imap_client_parse_userdb_fields(const struct imap_client_state *state,
 				const char **auth_user_r)
 {
 	const char *const *field;
@@ -137,10 +232,10 @@ imap_client_parse_userdb_fields(struct imap_client *client,
 
 	*auth_user_r = NULL;
 
-	if (client->state.userdb_fields == NULL)
+	if (state->userdb_fields == NULL)
 		return;
 
-	field = t_strsplit_tabescaped(client->state.userdb_fields);
+	field = t_strsplit_tabescaped(state->userdb_fields);
 	for (i = 0; field[i] != NULL; i++) {
 		if (str_begins(field[i], "auth_user=", auth_user_r))
 			break;
@@ -162,6 +257,8 @@ imap_client_move_back_send_callback(void *context, struct ostream *output)
 	event_get_create_time(client->event, &created);
 	str_printfa(str, "\thibernation_started=%"PRIdTIME_T".%06u",
 		    created.tv_sec, (unsigned int)created.tv_usec);
+	str_printfa(str, "\thibernation_memory=%zu",
+		    imap_client_get_memory_size(client));
 
 	if (state->session_id != NULL) {
 		str_append(str, "\tsession=");
@@ -196,12 +293,15 @@ imap_client_move_back_send_callback(void *context, struct ostream *output)
 		str_append(str, "\tstate=");
 		base64_encode(state->state, state->state_size, str);
 	}
-	input_data = i_stream_get_data(client->input, &input_size);
-	if (input_size > 0) {
-		str_append(str, "\tclient_input=");
-		base64_encode(input_data, input_size, str);
+	if (client->input != NULL) {
+		input_data = i_stream_get_data(client->input, &input_size);
+		if (input_size > 0) {
+			str_append(str, "\tclient_input=");
+			base64_encode(input_data, input_size, str);
+		}
 	}
-	i_assert(o_stream_get_buffer_used_size(client->output) == 0);
+	i_assert(client->output == NULL ||
+		 o_stream_get_buffer_used_size(client->output) == 0);
 	if (client->idle_done) {
 		if (client->bad_done)
 			str_append(str, "\tbad-done");
@@ -256,7 +356,8 @@ static bool imap_client_try_move_back(struct imap_client *client)
 	const char *path, *error;
 	int ret;
 
-	if (o_stream_get_buffer_used_size(client->output) > 0) {
+	if (client->output != NULL &&
+	    o_stream_get_buffer_used_size(client->output) > 0) {
 		/* there is data buffered, so we have to disconnect you */
 		imap_client_destroy(&client, IMAP_CLIENT_BUFFER_FULL_ERROR);
 		return TRUE;
@@ -373,9 +474,11 @@ imap_client_input_parse(const unsigned char *data, size_t size, const char **tag
 
 static void imap_client_input_idle_cmd(struct imap_client *client)
 {
+	struct istream *input = imap_client_get_input(client);
+	struct ostream *output;
 	char *old_tag;
 	const char *new_tag;
-	const char *output;
+	const char *reply;
 	const unsigned char *data;
 	size_t size;
 	bool done = TRUE;
@@ -383,7 +486,7 @@ static void imap_client_input_idle_cmd(struct imap_client *client)
 
 	/* we should read either DONE or disconnection. also handle if client
 	   sends DONE\nIDLE simply to recreate the IDLE. */
-	ret = i_stream_read_bytes(client->input, &data, &size,
+	ret = i_stream_read_bytes(input, &data, &size,
 				  client->next_read_threshold + 1);
 	if (size == 0) {
 		if (ret < 0)
@@ -401,32 +504,33 @@ static void imap_client_input_idle_cmd(struct imap_client *client)
 		client->bad_done = TRUE;
 		break;
 	case IMAP_CLIENT_INPUT_STATE_DONE_LF:
-		i_stream_skip(client->input, 4+1);
+		i_stream_skip(input, 4+1);
 		break;
 	case IMAP_CLIENT_INPUT_STATE_DONE_CRLF:
-		i_stream_skip(client->input, 4+2);
+		i_stream_skip(input, 4+2);
 		break;
 	case IMAP_CLIENT_INPUT_STATE_DONEIDLE:
 		/* we received DONE+IDLE, so the client simply wanted to notify
 		   us that it's still there. continue hibernation. */
 		old_tag = client->state.tag;
 		client->state.tag = i_strdup(new_tag);
-		output = t_strdup_printf("%s OK Idle completed.\r\n+ idling\r\n", old_tag);
+		reply = t_strdup_printf("%s OK Idle completed.\r\n+ idling\r\n", old_tag);
 		i_free(old_tag);
-		ret = o_stream_flush(client->output);
+		output = imap_client_get_output(client);
+		ret = o_stream_flush(output);
 		if (ret > 0)
-			ret = o_stream_send_str(client->output, output);
+			ret = o_stream_send_str(output, reply);
 		if (ret < 0) {
 			imap_client_disconnected(&client);
 			return;
 		}
-		if ((size_t)ret != strlen(output)) {
+		if ((size_t)ret != strlen(reply)) {
 			/* disconnect */
 			imap_client_destroy(&client, IMAP_CLIENT_BUFFER_FULL_ERROR);
 			return;
 		} else {
 			done = FALSE;
-			i_stream_skip(client->input, size);
+			i_stream_skip(input, size);
 		}
 		break;
 	}
@@ -435,13 +539,15 @@ static void imap_client_input_idle_cmd(struct imap_client *client)
 		client->idle_done = TRUE;
 		client->input_pending = TRUE;
 		imap_client_move_back(client);
-	} else
+	} else {
+		imap_client_free_idle_streams(client);
 		imap_client_add_idle_keepalive_timeout(client);
+	}
 }
 
 static void imap_client_input_nonidle(struct imap_client *client)
 {
-	if (i_stream_read(client->input) < 0)
+	if (i_stream_read(imap_client_get_input(client)) < 0)
 		imap_client_disconnected(&client);
 	else {
 		client->input_pending = TRUE;
@@ -456,22 +562,24 @@ static void imap_client_input_notify(struct imap_client *client)
 
 static void keepalive_timeout(struct imap_client *client)
 {
+	struct ostream *output = imap_client_get_output(client);
 	ssize_t ret;
 
 	/* do not send this if there is data buffered */
-	if ((ret = o_stream_flush(client->output)) < 0) {
+	if ((ret = o_stream_flush(output)) < 0) {
 		imap_client_disconnected(&client);
 		return;
 	} else if (ret == 0)
 		return;
 
-	ret = o_stream_send_str(client->output, imap_still_here_text);
+	ret = o_stream_send_str(output, imap_still_here_text);
 	if (ret < 0) {
 		imap_client_disconnected(&client);
 		return;
 	}
 	/* ostream buffer size is definitely large enough for this text */
 	i_assert((size_t)ret == strlen(imap_still_here_text));
+	imap_client_free_idle_streams(client);
 	imap_client_add_idle_keepalive_timeout(client);
 }
 
@@ -491,19 +599,19 @@ static void imap_client_add_idle_keepalive_timeout(struct imap_client *client)
 }
 
 static const struct var_expand_table *
-imap_client_get_var_expand_table(struct imap_client *client)
+imap_client_get_var_expand_table(const struct imap_client_state *state)
 {
-	const char *username = t_strcut(client->state.username, '@');
-	const char *domain = i_strchr_to_next(client->state.username, '@');
-	const char *local_ip = client->state.local_ip.family == 0 ? NULL :
-		net_ip2addr(&client->state.local_ip);
-	const char *remote_ip = client->state.remote_ip.family == 0 ? NULL :
-		net_ip2addr(&client->state.remote_ip);
+	const char *username = t_strcut(state->username, '@');
+	const char *domain = i_strchr_to_next(state->username, '@');
+	const char *local_ip = state->local_ip.family == 0 ? NULL :
+		net_ip2addr(&state->local_ip);
+	const char *remote_ip = state->remote_ip.family == 0 ? NULL :
+		net_ip2addr(&state->remote_ip);
 
 	const char *auth_user, *auth_username, *auth_domain;
-	imap_client_parse_userdb_fields(client, &auth_user);
+	imap_client_parse_userdb_fields(state, &auth_user);
 	if (auth_user == NULL) {
-		auth_user = client->state.username;
+		auth_user = state->username;
 		auth_username = username;
 		auth_domain = domain;
 	} else {
@@ -512,7 +620,7 @@ imap_client_get_var_expand_table(struct imap_client *client)
 	}
 
 	const struct var_expand_table stack_tab[] = {
-		{ 'u', client->state.username, "user" },
+		{ 'u', state->username, "user" },
 		{ 'n', username, "username" },
 		{ 'd', domain, "domain" },
 		{ 's', "imap-hibernate", "service" },
@@ -520,9 +628,9 @@ imap_client_get_var_expand_table(struct imap_client *client)
 		{ 'l', local_ip, "lip" },
 		{ 'r', remote_ip, "rip" },
 		{ 'p', my_pid, "pid" },
-		{ 'i', dec2str(client->state.uid), "uid" },
-		{ '\0', dec2str(client->state.gid), "gid" },
-		{ '\0', client->state.session_id, "session" },
+		{ 'i', dec2str(state->uid), "uid" },
+		{ '\0', dec2str(state->gid), "gid" },
+		{ '\0', state->session_id, "session" },
 		{ '\0', auth_user, "auth_user" },
 		{ '\0', auth_username, "auth_username" },
 		{ '\0', auth_domain, "auth_domain" },
@@ -569,70 +677,111 @@ static void imap_client_io_deactivate_user(struct imap_client *client ATTR_UNUSE
 	i_set_failure_prefix("imap-hibernate: ");
 }
 
-struct imap_client *
-imap_client_create(int fd, const struct imap_client_state *state)
+static const char *
+imap_client_expand_log_prefix(const struct imap_client_state *state,
+			      struct event *event)
 {
 	const struct var_expand_func_table funcs[] = {
 		{ "userdb", imap_client_var_expand_func_userdb },
 		{ NULL, NULL }
 	};
-	struct imap_client *client;
-	pool_t pool = pool_alloconly_create("imap client", 256);
-	void *statebuf;
+	string_t *str = t_str_new(256);
 	const char *error;
+	char **fields = p_strsplit_tabescaped(unsafe_data_stack_pool,
+					      state->userdb_fields);
+
+	if (var_expand_with_funcs(str, state->mail_log_prefix,
+				  imap_client_get_var_expand_table(state),
+				  funcs, fields, &error) <= 0) {
+		e_error(event, "Failed to expand mail_log_prefix=%s: %s",
+			state->mail_log_prefix, error);
+	}
+	return str_c(str);
+}
+
+static struct imap_client *
+imap_client_alloc(const struct imap_client_state *state,
+		  const char *log_prefix)
+{
+	struct imap_client *client;
+	size_t size, log_prefix_size = strlen(log_prefix) + 1;
+	size_t session_id_size = 0, stats_size = 0;
+	unsigned char *p;
+
+	if (state->session_id != NULL)
+		session_id_size = strlen(state->session_id) + 1;
+	if (state->stats != NULL)
+		stats_size = strlen(state->stats) + 1;
+	size = sizeof(*client) + state->state_size + log_prefix_size +
+		session_id_size + stats_size;
+
+	/* Everything that isn't shared with other clients is allocated in
+	   a single memory block. */
+	client = i_malloc(size);
+	client->alloc_size = size;
+	client->state = *state;
+	p = (unsigned char *)(client + 1);
+	if (state->state_size > 0) {
+		memcpy(p, state->state, state->state_size);
+		client->state.state = p;
+		p += state->state_size;
+	}
+	client->log_prefix = memcpy(p, log_prefix, log_prefix_size);
+	p += log_prefix_size;
+	if (state->session_id != NULL) {
+		client->state.session_id =
+			memcpy(p, state->session_id, session_id_size);
+		p += session_id_size;
+	}
+	if (state->stats != NULL) {
+		client->state.stats = memcpy(p, state->stats, stats_size);
+		p += stats_size;
+	}
+	i_assert(p == (unsigned char *)client + size);
+	return client;
+}
+
+struct imap_client *
+imap_client_create(int fd, const struct imap_client_state *state)
+{
+	struct imap_client *client;
+	struct event *event;
+	const char *log_prefix;
 
 	i_assert(state->username != NULL);
 	i_assert(state->mail_log_prefix != NULL);
 
 	fd_set_nonblock(fd, TRUE); /* it should already be, but be sure */
 
-	client = p_new(pool, struct imap_client, 1);
-	client->pool = pool;
-	client->fd = fd;
-	client->input = i_stream_create_fd(fd, IMAP_MAX_INBUF);
-	client->output = o_stream_create_fd(fd, IMAP_MAX_OUTBUF);
-	o_stream_set_no_error_handling(client->output, TRUE);
-	client->state = *state;
-	client->state.username = p_strdup(pool, state->username);
-	client->state.session_id = p_strdup(pool, state->session_id);
-	client->state.userdb_fields = p_strdup(pool, state->userdb_fields);
-	client->state.stats = p_strdup(pool, state->stats);
-
-	client->event = event_create(NULL);
-	event_add_category(client->event, &event_category_imap_hibernate);
-	event_add_str(client->event, "user", state->username);
-	event_add_str(client->event, "session", state->session_id);
+	event = event_create(NULL);
+	event_add_category(event, &event_category_imap_hibernate);
+	event_add_str(event, "user", state->username);
+	event_add_str(event, "session", state->session_id);
 	if (state->mailbox_vname != NULL)
-		event_add_str(client->event, "mailbox", state->mailbox_vname);
+		event_add_str(event, "mailbox", state->mailbox_vname);
 	if (state->local_ip.family != 0)
-		event_add_ip(client->event, "local_ip", &state->local_ip);
+		event_add_ip(event, "local_ip", &state->local_ip);
 	if (state->local_port != 0)
-		event_add_int(client->event, "local_port", state->local_port);
+		event_add_int(event, "local_port", state->local_port);
 	if (state->remote_ip.family != 0)
-		event_add_ip(client->event, "remote_ip", &state->remote_ip);
+		event_add_ip(event, "remote_ip", &state->remote_ip);
 	if (state->remote_port != 0)
-		event_add_int(client->event, "remote_port", state->remote_port);
+		event_add_int(event, "remote_port", state->remote_port);
 
-	if (state->state_size > 0) {
-		client->state.state = statebuf = p_malloc(pool, state->state_size);
-		memcpy(statebuf, state->state, state->state_size);
-		client->state.state_size = state->state_size;
-	}
 	T_BEGIN {
-		string_t *str;
-		char **fields = p_strsplit_tabescaped(unsafe_data_stack_pool,
-						      client->state.userdb_fields);
-		str = t_str_new(256);
-		if (var_expand_with_funcs(str, state->mail_log_prefix,
-					  imap_client_get_var_expand_table(client),
-					  funcs, fields, &error) <= 0) {
-			e_error(client->event,
-				"Failed to expand mail_log_prefix=%s: %s",
-				state->mail_log_prefix, error);
-		}
-		client->log_prefix = p_strdup(pool, str_c(str));
+		log_prefix = imap_client_expand_log_prefix(state, event);
+		client = imap_client_alloc(state, log_prefix);
 	} T_END;
 
+	client->fd = fd;
+	client->event = event;
+	/* these are only used while creating the client */
+	client->state.mail_log_prefix = NULL;
+	client->state.mailbox_vname = NULL;
+	client->state.username = imap_client_str_share(state->username);
+	client->state.userdb_fields =
+		imap_client_str_share(state->userdb_fields);
+
 	struct master_service_anvil_session anvil_session = {
 		.username = client->state.username,
 		.service_name = master_service_get_name(master_service),
@@ -642,8 +791,8 @@ imap_client_create(int fd, const struct imap_client_state *state)
 					 TRUE, client->state.anvil_conn_guid))
 		client->state.anvil_sent = TRUE;
 
-	p_array_init(&client->notifys, pool, 2);
 	DLLIST_PREPEND(&imap_clients, client);
+	imap_clients_count++;
 	return client;
 }
 
@@ -651,6 +800,8 @@ static void imap_client_stop_notify_listening(struct imap_client *client)
 {
 	struct imap_client_notify *notify;
 
+	if (!array_is_created(&client->notifys))
+		return;
 	array_foreach_modifiable(&client->notifys, notify) {
 		io_remove(&notify->io);
 		i_close_fd(&notify->fd);
@@ -710,12 +861,18 @@ void imap_client_destroy(struct imap_client **_client, const char *reason)
 	}
 
 	DLLIST_REMOVE(&imap_clients, client);
+	i_assert(imap_clients_count > 0);
+	imap_clients_count--;
 	imap_client_stop(client);
 	i_stream_destroy(&client->input);
 	o_stream_destroy(&client->output);
 	i_close_fd(&client->fd);
+	imap_client_str_unshare(&client->state.username);
+	imap_client_str_unshare(&client->state.userdb_fields);
 	event_unref(&client->event);
-	pool_unref(&client->pool);
+	if (array_is_created(&client->notifys))
+		array_free(&client->notifys);
+	i_free(client);
 
 	master_service_client_connection_destroyed(master_service);
 }
@@ -724,6 +881,8 @@ void imap_client_add_notify_fd(struct imap_client *client, int fd)
 {
 	struct imap_client_notify *notify;
 
+	if (!array_is_created(&client->notifys))
+		i_array_init(&client->notifys, 1);
 	notify = array_append_space(&client->notifys);
 	notify->fd = fd;
 }
@@ -747,9 +906,11 @@ void imap_client_create_finish(struct imap_client *client)
 	}
 	imap_client_add_idle_keepalive_timeout(client);
 
-	array_foreach_modifiable(&client->notifys, notify) {
-		notify->io = io_add(notify->fd, IO_READ,
-				    imap_client_input_notify, client);
+	if (array_is_created(&client->notifys)) {
+		array_foreach_modifiable(&client->notifys, notify) {
+			notify->io = io_add(notify->fd, IO_READ,
+					    imap_client_input_notify, client);
+		}
 	}
 }
 
@@ -789,7 +950,7 @@ static void imap_clients_unhibernate(void *context ATTR_UNUSED)
 static void imap_client_kick(struct imap_client *client)
 {
 	imap_client_io_activate_user(client);
-	o_stream_nsend_str(client->output,
+	o_stream_nsend_str(imap_client_get_output(client),
 			   "* BYE "MASTER_SERVICE_SHUTTING_DOWN_MSG".\r\n");
 	imap_client_destroy(&client, MASTER_SERVICE_SHUTTING_DOWN_MSG);
 }
@@ -809,9 +970,32 @@ unsigned int imap_clients_kick(const char *user, const guid_128_t conn_guid)
 	return count;
 }
 
+void imap_clients_get_memory_usage(unsigned int *count_r, size_t *size_r)
+{
+	struct hash_iterate_context *iter;
+	struct imap_client_shared_string *shared;
+	struct imap_client *client;
+	const char *key;
+	size_t size = 0;
+
+	for (client = imap_clients; client != NULL; client = client->next)
+		size += imap_client_get_memory_size(client);
+
+	iter = hash_table_iterate_init(imap_client_shared_strings);
+	while (hash_table_iterate(iter, imap_client_shared_strings,
+				  &key, &shared))
+		size += sizeof(*shared) + strlen(shared->str) + 1;
+	hash_table_iterate_deinit(&iter);
+
+	*count_r = imap_clients_count;
+	*size_r = size;
+}
+
 void imap_clients_init(void)
 {
 	unhibernate_queue = priorityq_init(client_unhibernate_cmp, 64);
+	hash_table_create(&imap_client_shared_strings, default_pool, 0,
+			  str_hash, strcmp);
 }
 
 void imap_clients_deinit(void)
@@ -821,4 +1005,6 @@ void imap_clients_deinit(void)
 
 	timeout_remove(&to_unhibernate);
 	priorityq_deinit(&unhibernate_queue);
+	i_assert(hash_table_count(imap_client_shared_strings) == 0);
+	hash_table_destroy(&imap_client_shared_strings);
 }
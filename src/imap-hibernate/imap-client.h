@@ -36,6 +36,9 @@ void imap_client_create_finish(struct imap_client *client);
 void imap_client_destroy(struct imap_client **_client, const char *reason);
 
 unsigned int imap_clients_kick(const char *user, const guid_128_t conn_guid);
+/* Returns the number of hibernated clients and the memory used by them,
+   excluding the memory used by events and kernel structures. */
+void imap_clients_get_memory_usage(unsigned int *count_r, size_t *size_r);
 
 void imap_clients_init(void);
 void imap_clients_deinit(void);
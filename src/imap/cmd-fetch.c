@@ -211,7 +211,14 @@ static bool cmd_fetch_finish(struct imap_fetch_context *ctx,
 			"Some messages were already expunged.";
 	}
 
-	if (imap_fetch_end(ctx) < 0) {
+	int ret = imap_fetch_end(ctx);
+	if (ctx->prefetch_count > 0) {
+		event_add_int(cmd->event, "prefetch_count",
+			      ctx->prefetch_count);
+		event_add_int(cmd->event, "prefetch_hits",
+			      ctx->prefetch_hits);
+	}
+	if (ret < 0) {
 		const char *client_error;
 
 		if (cmd->client->output->closed) {
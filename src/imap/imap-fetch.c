@@ -404,6 +404,10 @@ void imap_fetch_begin(struct imap_fetch_context *ctx, struct mailbox *box,
 	ctx->state.search_ctx =
 		mailbox_search_init(ctx->state.trans, search_args, NULL,
 				    ctx->fetch_data, wanted_headers);
+	/* open and start reading the next mails while the current one is
+	   being sent. This does nothing for mails that are fully cached. */
+	mailbox_search_set_prefetch_count(ctx->state.search_ctx,
+		ctx->client->set->imap_fetch_prefetch_count);
 	ctx->state.cur_str = str_new(default_pool, 8192);
 	ctx->state.fetching = TRUE;
 
@@ -669,6 +673,9 @@ int imap_fetch_end(struct imap_fetch_context *ctx)
 	i_stream_unref(&state->cur_input);
 
 	if (state->search_ctx != NULL) {
+		mailbox_search_get_prefetch_stats(state->search_ctx,
+						  &ctx->prefetch_count,
+						  &ctx->prefetch_hits);
 		if (mailbox_search_deinit(&state->search_ctx) < 0)
 			state->failed = TRUE;
 	}
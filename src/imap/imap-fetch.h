@@ -91,6 +91,8 @@ struct imap_fetch_context {
 	struct imap_fetch_state state;
 	ARRAY_TYPE(seq_range) fetch_failed_uids;
 	unsigned int fetched_mails_count;
+	/* number of mails prefetched ahead / how many of them were sent */
+	unsigned int prefetch_count, prefetch_hits;
 
 	enum mail_error error;
 	const char *errstr;
@@ -34,6 +34,8 @@ struct imap_master_input {
 	const char *tag;
 	/* Timestamp when hibernation started */
 	struct timeval hibernation_start_time;
+	/* Memory used by imap-hibernate for the client */
+	uoff_t hibernation_memory_size;
 
 	dev_t peer_dev;
 	ino_t peer_ino;
@@ -144,6 +146,12 @@ imap_master_client_parse_input(const char *const *args, pool_t pool,
 					"Invalid hibernation_started value: %s", value);
 				return -1;
 			}
+		} else if (strcmp(key, "hibernation_memory") == 0) {
+			if (str_to_uoff(value, &master_input_r->hibernation_memory_size) < 0) {
+				*error_r = t_strdup_printf(
+					"Invalid hibernation_memory value: %s", value);
+				return -1;
+			}
 		} else if (strcmp(key, "userdb_fields") == 0) {
 			input_r->userdb_fields =
 				t_strsplit_tabescaped(value);
@@ -260,6 +268,10 @@ imap_master_client_input_args(struct connection *conn, const char *const *args,
 	struct event *event = event_create(imap_client->event);
 	event_set_name(event, "imap_client_unhibernated");
 	event_add_int(event, "hibernation_usecs", hibernation_usecs);
+	if (master_input.hibernation_memory_size > 0) {
+		event_add_int(event, "hibernation_memory_bytes",
+			      master_input.hibernation_memory_size);
+	}
 	imap_client->state_import_bad_idle_done =
 		master_input.state_import_bad_idle_done;
 	imap_client->state_import_idle_continue =
@@ -95,6 +95,7 @@ static const struct setting_define imap_setting_defines[] = {
 	DEF(STR, imap_logout_format),
 	DEF(STR, imap_id_send),
 	DEF(ENUM, imap_fetch_failure),
+	DEF(UINT, imap_fetch_prefetch_count),
 	DEF(BOOL, imap_metadata),
 	DEF(BOOL, imap_literal_minus),
 	DEF(TIME, imap_hibernate_timeout),
@@ -122,6 +123,7 @@ static const struct imap_settings imap_default_settings = {
 		"body_count=%{fetch_body_count} body_bytes=%{fetch_body_bytes}",
 	.imap_id_send = "name *",
 	.imap_fetch_failure = "disconnect-immediately:disconnect-after:no-after",
+	.imap_fetch_prefetch_count = 0,
 	.imap_metadata = FALSE,
 	.imap_literal_minus = FALSE,
 	.imap_hibernate_timeout = 0,
@@ -31,6 +31,7 @@ struct imap_settings {
 	const char *imap_logout_format;
 	const char *imap_id_send;
 	const char *imap_fetch_failure;
+	unsigned int imap_fetch_prefetch_count;
 	bool imap_metadata;
 	bool imap_literal_minus;
 	unsigned int imap_hibernate_timeout;
@@ -1,6 +1,7 @@
 /* Copyright (c) 2011-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "connection.h"
 #include "istream.h"
 #include "ostream.h"
@@ -41,8 +42,12 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 	struct indexer_client_request *ctx = NULL;
 	const char *session_id = NULL;
 	unsigned int tag, max_recent_msgs;
+	enum indexer_request_priority priority = append ?
+		INDEXER_REQUEST_PRIORITY_DELIVERY :
+		INDEXER_REQUEST_PRIORITY_INTERACTIVE;
 
-	/* <tag> <user> <mailbox> [<max_recent_msgs> [<session ID>]] */
+	/* <tag> <user> <mailbox> [<max_recent_msgs> [<session ID>
+	   [<priority>]]] */
 	if (str_array_length(args) < 3) {
 		*error_r = "Wrong parameter count";
 		return -1;
@@ -56,8 +61,14 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 	else if (str_to_uint(args[3], &max_recent_msgs) < 0) {
 		*error_r = "Invalid max_recent_msgs";
 		return -1;
-	} else {
-		session_id = args[4];
+	} else if (args[4] != NULL) {
+		if (args[4][0] != '\0')
+			session_id = args[4];
+		if (args[5] != NULL &&
+		    !indexer_request_priority_from_str(args[5], &priority)) {
+			*error_r = "Invalid priority";
+			return -1;
+		}
 	}
 
 	if (tag != 0) {
@@ -68,7 +79,7 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 	}
 
 	indexer_queue_append(client->queue, append, args[1], args[2],
-			     session_id, max_recent_msgs, ctx);
+			     session_id, max_recent_msgs, priority, ctx);
 	o_stream_nsend_str(client->conn.output, t_strdup_printf("%u\tOK\n", tag));
 	return 0;
 }
@@ -164,6 +175,11 @@ indexer_client_request_list_write(string_t *str,
 		str_append_c(str, 'h');
 	if (request->reindex_tail)
 		str_append_c(str, 't');
+	str_append_c(str, '\t');
+	str_append(str, indexer_request_priority_to_str(request->priority));
+	/* how long the request has been (or was) waiting in the queue */
+	str_printfa(str, "\t%ld", (long)((request->working ?
+		request->work_start_time : ioloop_time) - request->queued_time));
 }
 
 static int
@@ -4,27 +4,63 @@
 #include "array.h"
 #include "llist.h"
 #include "hash.h"
+#include "ioloop.h"
 #include "wildcard-match.h"
 #include "indexer-queue.h"
 
+struct indexer_queue_user {
+	/* Linked list of users that have queued requests in the priority
+	   class. The next request is taken from the first user, who is then
+	   moved to the end of the list. */
+	struct indexer_queue_user *prev[INDEXER_REQUEST_PRIORITY_COUNT];
+	struct indexer_queue_user *next[INDEXER_REQUEST_PRIORITY_COUNT];
+
+	char *username;
+	/* All of the user's requests */
+	struct indexer_request *requests;
+	/* The user's queued requests in each priority class */
+	struct indexer_request *head[INDEXER_REQUEST_PRIORITY_COUNT];
+	struct indexer_request *tail[INDEXER_REQUEST_PRIORITY_COUNT];
+	/* Number of the user's requests currently being worked on */
+	unsigned int working_count;
+};
+
 struct indexer_queue {
 	indexer_queue_callback_t *callback;
 	void (*listen_callback)(struct indexer_queue *);
+	bool (*user_busy_callback)(const char *username);
 
 	/* username+mailbox -> indexer_request */
 	HASH_TABLE(struct indexer_request *, struct indexer_request *) requests;
-	/* username -> indexer_request */
-	HASH_TABLE(char *, struct indexer_request *) users;
-	struct indexer_request *head, *tail;
+	/* username -> indexer_queue_user */
+	HASH_TABLE(char *, struct indexer_queue_user *) users;
+
+	/* users with queued requests in each priority class */
+	struct indexer_queue_user *users_head[INDEXER_REQUEST_PRIORITY_COUNT];
+	struct indexer_queue_user *users_tail[INDEXER_REQUEST_PRIORITY_COUNT];
+	/* queued requests in each priority class, oldest first */
+	struct indexer_request *age_head[INDEXER_REQUEST_PRIORITY_COUNT];
+	struct indexer_request *age_tail[INDEXER_REQUEST_PRIORITY_COUNT];
+	unsigned int queued_count;
 };
 
 struct indexer_queue_iter {
 	struct indexer_queue *queue;
 	struct hash_iterate_context *hash_iter;
+	enum indexer_request_priority priority;
+	struct indexer_queue_user *user;
 	struct indexer_request *next;
 	bool only_working;
 };
 
+static const char *const indexer_request_priority_names[] = {
+	"interactive",
+	"delivery",
+	"bulk",
+};
+static_assert_array_size(indexer_request_priority_names,
+			 INDEXER_REQUEST_PRIORITY_COUNT);
+
 static unsigned int
 indexer_request_hash(const struct indexer_request *request)
 {
@@ -72,6 +108,30 @@ void indexer_queue_set_listen_callback(struct indexer_queue *queue,
 	queue->listen_callback = callback;
 }
 
+void indexer_queue_set_user_busy_callback(struct indexer_queue *queue,
+					  bool (*callback)(const char *username))
+{
+	queue->user_busy_callback = callback;
+}
+
+const char *indexer_request_priority_to_str(enum indexer_request_priority priority)
+{
+	i_assert(priority < INDEXER_REQUEST_PRIORITY_COUNT);
+	return indexer_request_priority_names[priority];
+}
+
+bool indexer_request_priority_from_str(const char *str,
+				       enum indexer_request_priority *priority_r)
+{
+	for (unsigned int i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		if (strcmp(indexer_request_priority_names[i], str) == 0) {
+			*priority_r = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 static struct indexer_request *
 indexer_queue_lookup(struct indexer_queue *queue,
 		     const char *username, const char *mailbox)
@@ -93,14 +153,90 @@ static void request_add_context(struct indexer_request *request, void *context)
 	array_push_back(&request->contexts, &context);
 }
 
+static void
+indexer_queue_request_link(struct indexer_queue *queue,
+			   struct indexer_request *request, bool append)
+{
+	struct indexer_queue_user *user = request->user;
+	enum indexer_request_priority priority = request->priority;
+
+	i_assert(!request->working);
+
+	if (user->head[priority] == NULL) {
+		DLLIST2_APPEND_FULL(&queue->users_head[priority],
+				    &queue->users_tail[priority], user,
+				    prev[priority], next[priority]);
+	}
+	if (append) {
+		DLLIST2_APPEND(&user->head[priority], &user->tail[priority],
+			       request);
+	} else {
+		DLLIST2_PREPEND(&user->head[priority], &user->tail[priority],
+				request);
+	}
+	DLLIST2_APPEND_FULL(&queue->age_head[priority],
+			    &queue->age_tail[priority], request,
+			    age_prev, age_next);
+	queue->queued_count++;
+}
+
+static void
+indexer_queue_request_unlink(struct indexer_queue *queue,
+			     struct indexer_request *request)
+{
+	struct indexer_queue_user *user = request->user;
+	enum indexer_request_priority priority = request->priority;
+
+	i_assert(queue->queued_count > 0);
+
+	DLLIST2_REMOVE(&user->head[priority], &user->tail[priority], request);
+	DLLIST2_REMOVE_FULL(&queue->age_head[priority],
+			    &queue->age_tail[priority], request,
+			    age_prev, age_next);
+	if (user->head[priority] == NULL) {
+		DLLIST2_REMOVE_FULL(&queue->users_head[priority],
+				    &queue->users_tail[priority], user,
+				    prev[priority], next[priority]);
+	}
+	queue->queued_count--;
+}
+
+static void
+indexer_queue_request_set_priority(struct indexer_queue *queue,
+				   struct indexer_request *request,
+				   enum indexer_request_priority priority,
+				   bool append)
+{
+	indexer_queue_request_unlink(queue, request);
+	request->priority = priority;
+	request->priority_time = ioloop_time;
+	indexer_queue_request_link(queue, request, append);
+}
+
+static struct indexer_queue_user *
+indexer_queue_user_get(struct indexer_queue *queue, const char *username)
+{
+	struct indexer_queue_user *user;
+
+	user = hash_table_lookup(queue->users, username);
+	if (user == NULL) {
+		user = i_new(struct indexer_queue_user, 1);
+		user->username = i_strdup(username);
+		hash_table_insert(queue->users, user->username, user);
+	}
+	return user;
+}
+
 static struct indexer_request *
 indexer_queue_append_request(struct indexer_queue *queue, bool append,
 			     const char *username, const char *mailbox,
 			     const char *session_id,
-			     unsigned int max_recent_msgs, void *context)
+			     unsigned int max_recent_msgs,
+			     enum indexer_request_priority priority,
+			     void *context)
 {
-	struct indexer_request *request, *first_request;
-	char *first_username;
+	struct indexer_request *request;
+	struct indexer_queue_user *user;
 
 	request = indexer_queue_lookup(queue, username, mailbox);
 	if (request != NULL) {
@@ -109,18 +245,27 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 		request_add_context(request, context);
 		if (request->working) {
 			/* we're already indexing this mailbox. */
+			if (!request->reindex_head && !request->reindex_tail)
+				request->reindex_priority = priority;
+			else if (request->reindex_priority > priority)
+				request->reindex_priority = priority;
 			if (append)
 				request->reindex_tail = TRUE;
 			else
 				request->reindex_head = TRUE;
+		} else if (request->priority > priority) {
+			/* move the request to the higher priority class */
+			indexer_queue_request_set_priority(queue, request,
+							   priority, append);
+		} else if (append) {
+			/* keep the request in its old position */
 		} else {
-			if (append) {
-				/* keep the request in its old position */
-			} else {
-				/* move request to beginning of the queue */
-				DLLIST2_REMOVE(&queue->head, &queue->tail, request);
-				DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-			}
+			/* move request to beginning of the user's queue */
+			user = request->user;
+			DLLIST2_REMOVE(&user->head[request->priority],
+				       &user->tail[request->priority], request);
+			DLLIST2_PREPEND(&user->head[request->priority],
+					&user->tail[request->priority], request);
 		}
 		return request;
 	}
@@ -130,23 +275,17 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 	request->mailbox = i_strdup(mailbox);
 	request->session_id = i_strdup(session_id);
 	request->max_recent_msgs = max_recent_msgs;
+	request->priority = priority;
+	request->queued_time = ioloop_time;
+	request->priority_time = ioloop_time;
 	request_add_context(request, context);
 	hash_table_insert(queue->requests, request, request);
 
-	if (!hash_table_lookup_full(queue->users, username,
-				    &first_username, &first_request)) {
-		first_username = i_strdup(username);
-		hash_table_insert(queue->users, first_username, request);
-	} else {
-		DLLIST_PREPEND_FULL(&first_request, request,
-				    user_prev, user_next);
-		hash_table_update(queue->users, first_username, request);
-	}
+	user = indexer_queue_user_get(queue, username);
+	request->user = user;
+	DLLIST_PREPEND_FULL(&user->requests, request, user_prev, user_next);
 
-	if (append)
-		DLLIST2_APPEND(&queue->head, &queue->tail, request);
-	else
-		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	indexer_queue_request_link(queue, request, append);
 	return request;
 }
 
@@ -160,13 +299,14 @@ static void indexer_queue_append_finish(struct indexer_queue *queue)
 void indexer_queue_append(struct indexer_queue *queue, bool append,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
+			  enum indexer_request_priority priority,
 			  void *context)
 {
 	struct indexer_request *request;
 
 	request = indexer_queue_append_request(queue, append, username, mailbox,
 					       session_id, max_recent_msgs,
-					       context);
+					       priority, context);
 	request->type = INDEXER_REQUEST_TYPE_INDEX;
 	indexer_queue_append_finish(queue);
 }
@@ -178,23 +318,72 @@ void indexer_queue_append_optimize(struct indexer_queue *queue,
 	struct indexer_request *request;
 
 	request = indexer_queue_append_request(queue, TRUE, username, mailbox,
-					       NULL, 0, context);
+					       NULL, 0,
+					       INDEXER_REQUEST_PRIORITY_BULK,
+					       context);
 	request->type = INDEXER_REQUEST_TYPE_OPTIMIZE;
 	indexer_queue_append_finish(queue);
 }
 
-struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
+static void indexer_queue_age(struct indexer_queue *queue)
 {
-	return queue->head;
+	struct indexer_request *request;
+
+	/* Go through the classes from the highest priority, so each request
+	   moves up at most one class at a time. */
+	for (unsigned int i = 1; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		while ((request = queue->age_head[i]) != NULL &&
+		       request->priority_time + INDEXER_QUEUE_AGING_SECS <=
+		       ioloop_time) {
+			indexer_queue_request_set_priority(queue, request,
+							   i - 1, TRUE);
+		}
+	}
 }
 
-void indexer_queue_request_remove(struct indexer_queue *queue)
+static bool
+indexer_queue_user_is_busy(struct indexer_queue *queue,
+			   struct indexer_queue_user *user)
 {
-	struct indexer_request *request = queue->head;
+	if (user->working_count > 0)
+		return TRUE;
+	return queue->user_busy_callback != NULL &&
+		queue->user_busy_callback(user->username);
+}
 
-	i_assert(request != NULL);
+struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
+{
+	struct indexer_queue_user *user;
+
+	indexer_queue_age(queue);
+	for (unsigned int i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		for (user = queue->users_head[i]; user != NULL;
+		     user = user->next[i]) {
+			if (!indexer_queue_user_is_busy(queue, user))
+				return user->head[i];
+		}
+	}
+	return NULL;
+}
 
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+void indexer_queue_request_remove(struct indexer_queue *queue,
+				  struct indexer_request *request)
+{
+	struct indexer_queue_user *user = request->user;
+	enum indexer_request_priority priority = request->priority;
+
+	i_assert(!request->working);
+
+	indexer_queue_request_unlink(queue, request);
+	if (user->head[priority] != NULL) {
+		/* give the other users a turn first */
+		DLLIST2_REMOVE_FULL(&queue->users_head[priority],
+				    &queue->users_tail[priority], user,
+				    prev[priority], next[priority]);
+		DLLIST2_APPEND_FULL(&queue->users_head[priority],
+				    &queue->users_tail[priority], user,
+				    prev[priority], next[priority]);
+	}
 }
 
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
@@ -219,17 +408,13 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 	indexer_queue_request_status_int(queue, request, percentage);
 }
 
-void indexer_queue_move_head_to_tail(struct indexer_queue *queue)
-{
-	struct indexer_request *request = queue->head;
-
-	indexer_queue_request_remove(queue);
-	DLLIST2_APPEND(&queue->head, &queue->tail, request);
-}
-
 void indexer_queue_request_work(struct indexer_request *request)
 {
+	i_assert(!request->working);
+
 	request->working = TRUE;
+	request->work_start_time = ioloop_time;
+	request->user->working_count++;
 	request->working_context_idx =
 		!array_is_created(&request->contexts) ? 0 :
 		array_count(&request->contexts);
@@ -239,13 +424,17 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 				  struct indexer_request **_request,
 				  bool success)
 {
-	struct indexer_request *first_request, *request = *_request;
-	char *first_username;
+	struct indexer_request *request = *_request;
+	struct indexer_queue_user *user = request->user;
 
 	*_request = NULL;
 
 	indexer_queue_request_status_int(queue, request, success ? 100 : -1);
 
+	if (request->working) {
+		i_assert(user->working_count > 0);
+		user->working_count--;
+	}
 	if (request->reindex_head || request->reindex_tail) {
 		i_assert(request->working);
 		request->working = FALSE;
@@ -253,24 +442,21 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 			array_delete(&request->contexts, 0,
 				     request->working_context_idx);
 		}
-		if (request->reindex_head)
-			DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-		else
-			DLLIST2_APPEND(&queue->head, &queue->tail, request);
+		request->priority = request->reindex_priority;
+		request->queued_time = ioloop_time;
+		request->priority_time = ioloop_time;
+		indexer_queue_request_link(queue, request,
+					   !request->reindex_head);
 		request->reindex_head = FALSE;
 		request->reindex_tail = FALSE;
 		return;
 	}
 
-	if (!hash_table_lookup_full(queue->users, request->username,
-				    &first_username, &first_request))
-		i_unreached();
-	DLLIST_REMOVE_FULL(&first_request, request, user_prev, user_next);
-	if (first_request != NULL)
-		hash_table_update(queue->users, first_username, first_request);
-	else {
-		hash_table_remove(queue->users, first_username);
-		i_free(first_username);
+	DLLIST_REMOVE_FULL(&user->requests, request, user_prev, user_next);
+	if (user->requests == NULL) {
+		hash_table_remove(queue->users, user->username);
+		i_free(user->username);
+		i_free(user);
 	}
 	hash_table_remove(queue->requests, request);
 	if (array_is_created(&request->contexts))
@@ -291,7 +477,7 @@ indexer_queue_request_cancel(struct indexer_queue *queue,
 
 	*_request = NULL;
 	request->reindex_head = request->reindex_tail = FALSE;
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+	indexer_queue_request_unlink(queue, request);
 	indexer_queue_request_finish(queue, &request, FALSE);
 }
 
@@ -299,13 +485,16 @@ void indexer_queue_cancel(struct indexer_queue *queue, const char *username,
 			  const char *mailbox_mask)
 {
 	struct indexer_request *request, *next;
+	struct indexer_queue_user *user;
 	bool single_mailbox =
 		mailbox_mask != NULL && wildcard_is_literal(mailbox_mask);
 
 	if (single_mailbox)
 		request = indexer_queue_lookup(queue, username, mailbox_mask);
-	else
-		request = hash_table_lookup(queue->users, username);
+	else {
+		user = hash_table_lookup(queue->users, username);
+		request = user == NULL ? NULL : user->requests;
+	}
 
 	while (request != NULL) {
 		next = request->user_next;
@@ -339,13 +528,15 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 		request->reindex_head = request->reindex_tail = FALSE;
 	hash_table_iterate_deinit(&iter);
 
-	while ((request = indexer_queue_request_peek(queue)) != NULL)
-		indexer_queue_request_cancel(queue, &request);
+	for (unsigned int i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		while ((request = queue->age_head[i]) != NULL)
+			indexer_queue_request_cancel(queue, &request);
+	}
 }
 
 bool indexer_queue_is_empty(struct indexer_queue *queue)
 {
-	return queue->head == NULL;
+	return queue->queued_count == 0;
 }
 
 unsigned int indexer_queue_count(struct indexer_queue *queue)
@@ -382,11 +573,23 @@ struct indexer_request *indexer_queue_iter_next(struct indexer_queue_iter *iter)
 		hash_table_iterate_deinit(&iter->hash_iter);
 		if (iter->only_working)
 			return NULL;
-		iter->next = indexer_queue_request_peek(iter->queue);
+		iter->priority = 0;
+		iter->user = iter->queue->users_head[0];
+		iter->next = iter->user == NULL ? NULL : iter->user->head[0];
+	}
+	while (iter->next == NULL) {
+		/* go to the next user or the next priority class */
+		if (iter->user != NULL)
+			iter->user = iter->user->next[iter->priority];
+		while (iter->user == NULL) {
+			if (++iter->priority == INDEXER_REQUEST_PRIORITY_COUNT)
+				return NULL;
+			iter->user = iter->queue->users_head[iter->priority];
+		}
+		iter->next = iter->user->head[iter->priority];
 	}
 	request = iter->next;
-	if (request != NULL)
-		iter->next = request->next;
+	iter->next = request->next;
 	return request;
 }
 
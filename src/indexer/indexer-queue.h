@@ -12,11 +12,33 @@ enum indexer_request_type {
 	INDEXER_REQUEST_TYPE_OPTIMIZE,
 };
 
+/* Requests are scheduled by their priority class. Within the same class each
+   user with queued requests gets a turn in round-robin order, so a user with
+   many large mailboxes can't starve the other users. Requests that have been
+   waiting in a lower class for INDEXER_QUEUE_AGING_SECS are moved to the
+   next higher class. */
+enum indexer_request_priority {
+	/* A user is waiting for the indexing to finish (e.g. SEARCH) */
+	INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+	/* Indexing newly delivered mails (e.g. LMTP) */
+	INDEXER_REQUEST_PRIORITY_DELIVERY,
+	/* Background reindexing (e.g. doveadm index -q) */
+	INDEXER_REQUEST_PRIORITY_BULK,
+
+	INDEXER_REQUEST_PRIORITY_COUNT
+};
+#define INDEXER_QUEUE_AGING_SECS 30
+
 struct indexer_request {
-	/* Linked list of all requests - highest priority first */
+	/* Linked list of the user's queued requests in the same priority
+	   class - highest priority first */
 	struct indexer_request *prev, *next;
+	/* Linked list of all queued requests in the same priority class -
+	   oldest first */
+	struct indexer_request *age_prev, *age_next;
 	/* Linked list of the same username's requests */
 	struct indexer_request *user_prev, *user_next;
+	struct indexer_queue_user *user;
 
 	char *username;
 	char *mailbox;
@@ -24,6 +46,17 @@ struct indexer_request {
 	unsigned int max_recent_msgs;
 
 	enum indexer_request_type type;
+	enum indexer_request_priority priority;
+	/* priority to use when the request is added back to the queue after
+	   reindex_head or reindex_tail */
+	enum indexer_request_priority reindex_priority;
+
+	/* when the request was added to the queue */
+	time_t queued_time;
+	/* when the request was moved to its current priority class */
+	time_t priority_time;
+	/* when working on the request started */
+	time_t work_start_time;
 
 	/* currently indexing this mailbox */
 	bool working:1;
@@ -46,10 +79,22 @@ void indexer_queue_deinit(struct indexer_queue **queue);
 /* The callback is called whenever a new request is added to the queue. */
 void indexer_queue_set_listen_callback(struct indexer_queue *queue,
 				       void (*callback)(struct indexer_queue *));
-
+/* The callback is called to check whether the user's requests can't be
+   worked on right now, even though none of them are being worked on
+   according to the queue. */
+void indexer_queue_set_user_busy_callback(struct indexer_queue *queue,
+					  bool (*callback)(const char *username));
+
+const char *indexer_request_priority_to_str(enum indexer_request_priority priority);
+bool indexer_request_priority_from_str(const char *str,
+				       enum indexer_request_priority *priority_r);
+
+/* If append=FALSE, the request is added to the beginning of the user's
+   requests in the priority class. */
 void indexer_queue_append(struct indexer_queue *queue, bool append,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
+			  enum indexer_request_priority priority,
 			  void *context);
 void indexer_queue_append_optimize(struct indexer_queue *queue,
 				   const char *username, const char *mailbox,
@@ -64,17 +109,17 @@ void indexer_queue_cancel_all(struct indexer_queue *queue);
 bool indexer_queue_is_empty(struct indexer_queue *queue);
 unsigned int indexer_queue_count(struct indexer_queue *queue);
 
-/* Return the next request from the queue, without removing it. */
+/* Return the next request from the queue, without removing it. Users whose
+   requests are already being worked on are skipped. */
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
-/* Remove the next request from the queue. You must call
-   indexer_queue_request_finish() to free its memory. */
-void indexer_queue_request_remove(struct indexer_queue *queue);
+/* Remove the request returned by indexer_queue_request_peek() from the
+   queue. You must call indexer_queue_request_finish() to free its memory. */
+void indexer_queue_request_remove(struct indexer_queue *queue,
+				  struct indexer_request *request);
 /* Give a status update about how far the indexing is going on. */
 void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
 				  int percentage);
-/* Move the next request to the end of the queue. */
-void indexer_queue_move_head_to_tail(struct indexer_queue *queue);
 /* Start working on a request */
 void indexer_queue_request_work(struct indexer_request *request);
 /* Finish the request and free its memory. */
@@ -83,7 +128,8 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 				  bool success);
 
 /* Iterate through all requests. First it returns the requests currently being
-   worked on, followed by the queued requests in the priority order. If
+   worked on, followed by the queued requests in the priority order
+   (without aging or skipping busy users). If
    only_working=TRUE, return only the requests currently being worked on. */
 struct indexer_queue_iter *
 indexer_queue_iter_init(struct indexer_queue *queue, bool only_working);
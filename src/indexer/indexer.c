@@ -45,34 +45,24 @@ static bool worker_send_request(struct indexer_request *request)
 					 worker_status_callback,
 					 worker_avail_callback) <= 0)
 		return FALSE;
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_work(request);
 	return TRUE;
 }
 
+static bool worker_user_is_busy(const char *username)
+{
+	/* the previous worker connection for the user is still finishing */
+	return worker_connections_find_user(username) != NULL;
+}
+
 static void queue_try_send_more(struct indexer_queue *queue)
 {
-	struct worker_connection *worker;
-	struct indexer_request *request, *first_moved_request = NULL;
+	struct indexer_request *request;
 
+	/* The queue skips the users that already have a request being worked
+	   on, so each user has at most one worker at a time. */
 	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		worker = worker_connections_find_user(request->username);
-		if (worker != NULL) {
-			/* There is already a connection handling a request
-			 * for this user. Move the request to the back of the
-			 * queue and handle requests from other users.
-			 * Terminate if we went through all requests. */
-			if (request == first_moved_request) {
-				/* all requests are waiting for existing users
-				   to finish. */
-				break;
-			}
-			if (first_moved_request == NULL)
-				first_moved_request = request;
-			indexer_queue_move_head_to_tail(queue);
-			continue;
-		}
-
 		/* create a new connection to a worker */
 		if (!worker_send_request(request))
 			break;
@@ -123,6 +113,7 @@ int main(int argc, char *argv[])
 
 	queue = indexer_queue_init(indexer_client_status_callback);
 	indexer_queue_set_listen_callback(queue, queue_listen_callback);
+	indexer_queue_set_user_busy_callback(queue, worker_user_is_busy);
 	worker_connections_init();
 	master_service_init_finish(master_service);
 
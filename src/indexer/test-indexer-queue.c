@@ -1,6 +1,7 @@
 /* Copyright (c) 2022 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "test-common.h"
 #include "indexer-queue.h"
 
@@ -19,32 +20,31 @@ static void test_indexer_queue(void)
 	test_begin("indexer queue");
 	queue = indexer_queue_init(indexer_queue_status_callback);
 
-	indexer_queue_append(queue, TRUE, "user2", "mailbox3", "session3", 50, NULL);
-	indexer_queue_append(queue, TRUE, "user1", "mailbox4", "session4", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
-
-	request = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request->username, "user1");
-	test_assert_strcmp(request->mailbox, "mailbox1");
-
-	indexer_queue_move_head_to_tail(queue);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox3", "session3", 50,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox4", "session4", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
 
+	/* interactive requests first, users in the order they were added */
 	struct {
 		const char *username;
 		const char *mailbox;
 	} expected[] = {
 		{ "user2", "mailbox2" },
+		{ "user1", "mailbox1" },
 		{ "user2", "mailbox3" },
 		{ "user1", "mailbox4" },
-		{ "user1", "mailbox1" },
 	};
 	for (unsigned int i = 0; i < N_ELEMENTS(expected); i++) {
 		request = indexer_queue_request_peek(queue);
 		test_assert_strcmp_idx(request->username, expected[i].username, i);
 		test_assert_strcmp_idx(request->mailbox, expected[i].mailbox, i);
 
-		indexer_queue_request_remove(queue);
+		indexer_queue_request_remove(queue, request);
 		indexer_queue_request_finish(queue, &request, TRUE);
 	}
 	test_assert(indexer_queue_request_peek(queue) == NULL);
@@ -61,13 +61,15 @@ static void test_indexer_queue_repeated_prepend(void)
 	test_begin("indexer queue");
 	queue = indexer_queue_init(indexer_queue_status_callback);
 
-	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
 
 	test_assert_cmp(indexer_queue_count(queue), ==, 1);
 
 	request = indexer_queue_request_peek(queue);
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_finish(queue, &request, TRUE);
 
 	test_assert(indexer_queue_request_peek(queue) == NULL);
@@ -85,19 +87,22 @@ static void test_indexer_queue_reindex(void)
 	test_begin("indexer queue reindex");
 	queue = indexer_queue_init(indexer_queue_status_callback);
 
-	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0, NULL);
-	indexer_queue_append(queue, TRUE, "user1", "mailbox2", "session2", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox2", "session2", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
 
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "mailbox1");
 
 	/* start working on the request */
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_work(request);
 	test_assert(request->working);
 
 	/* prepend another request to the same mailbox */
-	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
 	test_assert(request->reindex_head);
 
 	/* finish the request, and it should now be at the head again */
@@ -107,10 +112,11 @@ static void test_indexer_queue_reindex(void)
 	test_assert(!request->working);
 
 	/* start working on the request again */
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_work(request);
 	/* append another request to the same mailbox */
-	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
 	test_assert(request->reindex_tail);
 
 	/* finish the request, and it should now be at the tail again */
@@ -118,12 +124,12 @@ static void test_indexer_queue_reindex(void)
 
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "mailbox2");
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_finish(queue, &request, TRUE);
 
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "mailbox1");
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_finish(queue, &request, TRUE);
 
 	test_assert(indexer_queue_request_peek(queue) == NULL);
@@ -140,10 +146,14 @@ static void test_indexer_queue_cancel(void)
 	test_begin("indexer queue cancel");
 	queue = indexer_queue_init(indexer_queue_status_callback);
 
-	indexer_queue_append(queue, TRUE, "user2", "mailbox3", "session3", 50, NULL);
-	indexer_queue_append(queue, TRUE, "user1", "mailbox4", "session4", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox3", "session3", 50,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox4", "session4", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
 
 	/* try to cancel nonexistent user */
 	indexer_queue_cancel(queue, "user-none", "mailbox1");
@@ -152,17 +162,17 @@ static void test_indexer_queue_cancel(void)
 
 	test_assert(indexer_queue_count(queue) == 4);
 	request = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request->mailbox, "mailbox1");
+	test_assert_strcmp(request->mailbox, "mailbox2");
 
 	/* cancel user1's all requests */
 	indexer_queue_cancel(queue, "user1", NULL);
+	test_assert(indexer_queue_count(queue) == 2);
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "mailbox2");
-	test_assert_strcmp(request->next->mailbox, "mailbox3");
-	test_assert(request->next->next == NULL);
 
 	/* cancel user2's requests one by one */
 	indexer_queue_cancel(queue, "user2", "mailbox2");
+	test_assert(indexer_queue_count(queue) == 1);
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "mailbox3");
 	test_assert(request->next == NULL);
@@ -171,11 +181,13 @@ static void test_indexer_queue_cancel(void)
 	test_assert(indexer_queue_request_peek(queue) == NULL);
 
 	/* cancelling a working request should just drop the reindex-flag */
-	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
 	request = indexer_queue_request_peek(queue);
-	indexer_queue_request_remove(queue);
+	indexer_queue_request_remove(queue, request);
 	indexer_queue_request_work(request);
-	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
 	test_assert(request->reindex_tail);
 	indexer_queue_cancel(queue, "user1", NULL);
 	test_assert(!request->reindex_tail);
@@ -183,9 +195,12 @@ static void test_indexer_queue_cancel(void)
 	test_assert(indexer_queue_request_peek(queue) == NULL);
 
 	/* test cancelling mailbox wildcards */
-	indexer_queue_append(queue, TRUE, "user1", "testbox1", "session1", 0, NULL);
-	indexer_queue_append(queue, TRUE, "user1", "testbox2", "session1", 0, NULL);
-	indexer_queue_append(queue, TRUE, "user1", "notbox", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "testbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "testbox2", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "notbox", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
 	indexer_queue_cancel(queue, "user1", "testbox*");
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "notbox");
@@ -205,22 +220,26 @@ static void test_indexer_queue_iter(void)
 	test_begin("indexer queue iter");
 	queue = indexer_queue_init(indexer_queue_status_callback);
 
-	indexer_queue_append(queue, TRUE, "user2", "mailbox3", "session3", 50, NULL);
-	indexer_queue_append(queue, TRUE, "user1", "mailbox4", "session4", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0, NULL);
-	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox3", "session3", 50,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox4", "session4", 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
 
 	/* start working on the first two requests */
 	request1 = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request1->username, "user1");
-	test_assert_strcmp(request1->mailbox, "mailbox1");
-	indexer_queue_request_remove(queue);
+	test_assert_strcmp(request1->username, "user2");
+	test_assert_strcmp(request1->mailbox, "mailbox2");
+	indexer_queue_request_remove(queue, request1);
 	indexer_queue_request_work(request1);
 
 	request2 = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request2->username, "user2");
-	test_assert_strcmp(request2->mailbox, "mailbox2");
-	indexer_queue_request_remove(queue);
+	test_assert_strcmp(request2->username, "user1");
+	test_assert_strcmp(request2->mailbox, "mailbox1");
+	indexer_queue_request_remove(queue, request2);
 	indexer_queue_request_work(request2);
 
 	/* Iteration shows the requests being worked on first. Their order
@@ -231,9 +250,12 @@ static void test_indexer_queue_iter(void)
 	test_assert((iter_request1 == request1 && iter_request2 == request2) ||
 		    (iter_request1 == request2 && iter_request2 == request1));
 
-	request = indexer_queue_request_peek(queue);
-	test_assert(indexer_queue_iter_next(iter) == request);
-	test_assert(indexer_queue_iter_next(iter) == request->next);
+	/* both users are busy, so nothing can be started */
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	request = indexer_queue_iter_next(iter);
+	test_assert_strcmp(request->mailbox, "mailbox3");
+	request = indexer_queue_iter_next(iter);
+	test_assert_strcmp(request->mailbox, "mailbox4");
 	test_assert(indexer_queue_iter_next(iter) == NULL);
 	indexer_queue_iter_deinit(&iter);
 
@@ -257,6 +279,151 @@ static void test_indexer_queue_iter(void)
 	test_end();
 }
 
+static void
+test_indexer_queue_remove_next(struct indexer_queue *queue,
+			       const char *username, const char *mailbox,
+			       unsigned int idx)
+{
+	struct indexer_request *request;
+
+	request = indexer_queue_request_peek(queue);
+	if (request == NULL) {
+		test_failed(t_strdup_printf("request %u missing", idx));
+		return;
+	}
+	test_assert_strcmp_idx(request->username, username, idx);
+	test_assert_strcmp_idx(request->mailbox, mailbox, idx);
+	indexer_queue_request_remove(queue, request);
+	indexer_queue_request_finish(queue, &request, TRUE);
+}
+
+static void test_indexer_queue_fairness(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue fairness");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	for (unsigned int i = 1; i <= 3; i++) {
+		indexer_queue_append(queue, TRUE, "user1",
+				     t_strdup_printf("mailbox%u", i), NULL, 0,
+				     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	}
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+
+	/* user1 is busy while its first request is being worked on */
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->username, "user1");
+	indexer_queue_request_remove(queue, request);
+	indexer_queue_request_work(request);
+	test_assert_strcmp(indexer_queue_request_peek(queue)->username, "user2");
+	indexer_queue_request_finish(queue, &request, TRUE);
+
+	/* the users take turns */
+	test_indexer_queue_remove_next(queue, "user2", "mailbox1", 0);
+	test_indexer_queue_remove_next(queue, "user3", "mailbox1", 1);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox2", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	test_indexer_queue_remove_next(queue, "user1", "mailbox2", 2);
+	test_indexer_queue_remove_next(queue, "user2", "mailbox2", 3);
+	test_indexer_queue_remove_next(queue, "user1", "mailbox3", 4);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_priority(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue priority");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox2", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	/* a SEARCH in a mailbox already queued for bulk indexing */
+	indexer_queue_append(queue, FALSE, "user1", "mailbox2", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	/* a lower priority request doesn't lower the priority */
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	test_assert(indexer_queue_count(queue) == 4);
+
+	test_indexer_queue_remove_next(queue, "user3", "mailbox1", 0);
+	test_indexer_queue_remove_next(queue, "user1", "mailbox2", 1);
+	test_indexer_queue_remove_next(queue, "user2", "mailbox1", 2);
+	test_indexer_queue_remove_next(queue, "user1", "mailbox1", 3);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+
+	/* reindexing uses the priority of the request that came while
+	   working */
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	request = indexer_queue_request_peek(queue);
+	indexer_queue_request_remove(queue, request);
+	indexer_queue_request_work(request);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_INTERACTIVE, NULL);
+	test_assert(request->priority == INDEXER_REQUEST_PRIORITY_BULK);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	test_indexer_queue_remove_next(queue, "user1", "mailbox1", 4);
+	test_indexer_queue_remove_next(queue, "user2", "mailbox1", 5);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_aging(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request, *bulk_request;
+
+	test_begin("indexer queue aging");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+	ioloop_time = 1000000;
+
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_BULK, NULL);
+	bulk_request = indexer_queue_request_peek(queue);
+
+	/* new deliveries keep arriving for other users */
+	ioloop_time += INDEXER_QUEUE_AGING_SECS;
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->username, "user2");
+	test_assert(bulk_request->priority == INDEXER_REQUEST_PRIORITY_DELIVERY);
+
+	ioloop_time += INDEXER_QUEUE_AGING_SECS;
+	indexer_queue_append(queue, TRUE, "user3", "mailbox1", NULL, 0,
+			     INDEXER_REQUEST_PRIORITY_DELIVERY, NULL);
+	test_indexer_queue_remove_next(queue, "user2", "mailbox1", 0);
+	test_assert(bulk_request->priority ==
+		    INDEXER_REQUEST_PRIORITY_INTERACTIVE);
+	test_assert(bulk_request->queued_time +
+		    2 * INDEXER_QUEUE_AGING_SECS == ioloop_time);
+	/* the old bulk request goes before the newer delivery */
+	test_indexer_queue_remove_next(queue, "user1", "mailbox1", 1);
+	test_indexer_queue_remove_next(queue, "user3", "mailbox1", 2);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -265,6 +432,9 @@ int main(void)
 		test_indexer_queue_reindex,
 		test_indexer_queue_cancel,
 		test_indexer_queue_iter,
+		test_indexer_queue_fairness,
+		test_indexer_queue_priority,
+		test_indexer_queue_aging,
 		NULL
 	};
 	return test_run(test_functions);
@@ -244,6 +244,86 @@ mail_cache_register_get_list(struct mail_cache *cache, pool_t *pool_r,
 	return list;
 }
 
+void mail_cache_field_set_column(struct mail_cache *cache,
+				 unsigned int field_idx)
+{
+	struct mail_cache_field_private *priv;
+	unsigned int size, align;
+	const char *ext_name;
+
+	i_assert(field_idx < cache->fields_count);
+
+	priv = &cache->fields[field_idx];
+	i_assert(priv->field.type == MAIL_CACHE_FIELD_FIXED_SIZE);
+	i_assert(priv->field.field_size > 0 &&
+		 priv->field.field_size <= UINT16_MAX);
+	if (priv->column)
+		return;
+
+	size = priv->field.field_size;
+	align = size % sizeof(uint64_t) == 0 ? sizeof(uint64_t) :
+		(size % sizeof(uint32_t) == 0 ? sizeof(uint32_t) : 1);
+	ext_name = t_strconcat("cache-column-",
+			       t_str_replace(priv->field.name, '.', '-'), NULL);
+	priv->column_ext_id =
+		mail_index_ext_register(cache->index, ext_name, 0, size, align);
+	priv->column = TRUE;
+}
+
+bool mail_cache_field_get_column(struct mail_cache *cache,
+				 unsigned int field_idx, uint32_t *ext_id_r)
+{
+	i_assert(field_idx < cache->fields_count);
+
+	if (!cache->fields[field_idx].column)
+		return FALSE;
+	*ext_id_r = cache->fields[field_idx].column_ext_id;
+	return TRUE;
+}
+
+static bool mail_cache_column_value_is_empty(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (p[i] != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+bool mail_cache_column_lookup(struct mail_cache_view *view, buffer_t *dest_buf,
+			      uint32_t seq, unsigned int field_idx)
+{
+	const struct mail_cache_field_private *priv =
+		&view->cache->fields[field_idx];
+	const void *data;
+	bool expunged;
+
+	i_assert(priv->column);
+
+	mail_index_lookup_ext(view->view, seq, priv->column_ext_id,
+			      &data, &expunged);
+	if (data == NULL ||
+	    mail_cache_column_value_is_empty(data, priv->field.field_size))
+		return FALSE;
+	buffer_append(dest_buf, data, priv->field.field_size);
+	return TRUE;
+}
+
+void mail_cache_column_update(struct mail_index_transaction *t,
+			      struct mail_cache *cache, uint32_t seq,
+			      unsigned int field_idx, const void *data)
+{
+	const struct mail_cache_field_private *priv = &cache->fields[field_idx];
+
+	i_assert(priv->column);
+
+	if (!mail_cache_column_value_is_empty(data, priv->field.field_size))
+		mail_index_update_ext(t, seq, priv->column_ext_id, data, NULL);
+}
+
 static int
 mail_cache_header_fields_get_offset(struct mail_cache *cache,
 				    uint32_t *offset_r,
@@ -417,8 +417,14 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 {
 	struct mail_cache_lookup_iterate_ctx iter;
 	struct mail_cache_iterate_field field;
+	bool column = view->cache->fields[field_idx].column;
 	int ret;
 
+	if (column && mail_cache_column_lookup(view, dest_buf, seq, field_idx)) {
+		mail_cache_decision_state_update(view, seq, field_idx);
+		return 1;
+	}
+
 	ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
 	if (ret <= 0)
@@ -439,6 +445,12 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 				break;
 			}
 		}
+		if (ret > 0 && column) {
+			/* fill the column for the next lookup */
+			mail_cache_transaction_column_update(view, seq,
+							     field_idx,
+							     field.data);
+		}
 	}
 	/* NOTE: view->cache->fields may have been reallocated by
 	   mail_cache_lookup_*(). */
@@ -114,11 +114,17 @@ struct mail_cache_field_private {
 	   decision to change from TEMP to YES. */
 	uint32_t uid_highwater;
 
+	/* Index extension containing the field's column, if column=TRUE. */
+	uint32_t column_ext_id;
+
 	/* Unused fields aren't written to cache file */
 	bool used:1;
 	/* field.decision is pending a write to cache file header. If the
 	   cache header is read from disk, don't overwrite it. */
 	bool decision_dirty:1;
+	/* The fixed size field is also stored in an index extension record,
+	   see mail_cache_field_set_column(). */
+	bool column:1;
 };
 
 struct mail_cache {
@@ -374,6 +380,20 @@ mail_cache_transaction_lookup_rec(struct mail_cache_transaction_ctx *ctx,
 				  unsigned int *trans_next_idx);
 bool mail_cache_transactions_have_changes(struct mail_cache *cache);
 
+/* Look up the field from its column. Returns TRUE and appends the value to
+   dest_buf if it was found. */
+bool mail_cache_column_lookup(struct mail_cache_view *view, buffer_t *dest_buf,
+			      uint32_t seq, unsigned int field_idx);
+/* Write the field's value to its column. All-zero values aren't written. */
+void mail_cache_column_update(struct mail_index_transaction *t,
+			      struct mail_cache *cache, uint32_t seq,
+			      unsigned int field_idx, const void *data);
+/* Same as mail_cache_column_update(), but use the cache view's transaction.
+   Does nothing if the view has no transaction. */
+void mail_cache_transaction_column_update(struct mail_cache_view *view,
+					  uint32_t seq, unsigned int field_idx,
+					  const void *data);
+
 /* Return data from the specified position in the cache file. Returns 1 if
    successful, 0 if offset/size points outside the cache file, -1 if I/O
    error. */
@@ -805,6 +805,11 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 	fixed_size = ctx->cache->fields[field_idx].field.field_size;
 	i_assert(fixed_size == UINT_MAX || fixed_size == data_size);
 
+	if (ctx->cache->fields[field_idx].column) {
+		mail_cache_column_update(ctx->trans, ctx->cache, seq,
+					 field_idx, data);
+	}
+
 	data_size32 = (uint32_t)data_size;
 	full_size = sizeof(field_idx) + ((data_size + 3) & ~3U);
 	if (fixed_size == UINT_MAX)
@@ -882,6 +887,16 @@ void mail_cache_add(struct mail_cache_transaction_ctx *ctx, uint32_t seq,
 		buffer_append_zero(ctx->cache_data, 4 - (data_size & 3));
 }
 
+void mail_cache_transaction_column_update(struct mail_cache_view *view,
+					  uint32_t seq, unsigned int field_idx,
+					  const void *data)
+{
+	if (view->transaction != NULL) {
+		mail_cache_column_update(view->transaction->trans, view->cache,
+					 seq, field_idx, data);
+	}
+}
+
 bool mail_cache_field_want_add(struct mail_cache_transaction_ctx *ctx,
 			       uint32_t seq, unsigned int field_idx)
 {
@@ -61,11 +61,24 @@ void mail_cache_set_seq_corrupted_reason(struct mail_cache_view *cache_view,
 	uint32_t uid, empty = 0;
 	struct mail_cache *cache = cache_view->cache;
 	struct mail_index_view *view = cache_view->view;
+	unsigned int i, ext_map_idx;
 
 	/* drop cache pointer */
 	struct mail_index_transaction *t =
 		mail_index_transaction_begin(view, MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
 	mail_index_update_ext(t, seq, cache->ext_id, &empty, NULL);
+	/* and the columns, which may contain the same corrupted data */
+	for (i = 0; i < cache->fields_count; i++) {
+		if (cache->fields[i].column &&
+		    mail_index_map_get_ext_idx(view->map,
+					       cache->fields[i].column_ext_id,
+					       &ext_map_idx)) {
+			mail_index_update_ext(t, seq,
+				cache->fields[i].column_ext_id,
+				t_malloc0(cache->fields[i].field.field_size),
+				NULL);
+		}
+	}
 
 	if (mail_index_transaction_commit(&t) < 0) {
 		/* I/O error (e.g. out of disk space). Ignore this for now,
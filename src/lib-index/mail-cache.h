@@ -91,6 +91,20 @@ struct mail_cache_field *
 mail_cache_register_get_list(struct mail_cache *cache, pool_t *pool_r,
 			     unsigned int *count_r);
 
+/* Store the fixed size field also in a per-message index extension record,
+   i.e. as a dense column indexed by sequence. Lookups can then read the
+   field directly from the index record without walking through the cache
+   records. Values that are all zero aren't stored in the column, so they're
+   still looked up from the cache file. Existing mails' values are added to
+   the column when they're looked up within a transaction. */
+void mail_cache_field_set_column(struct mail_cache *cache,
+				 unsigned int field_idx);
+/* Returns TRUE and the column's index extension ID if the field is stored as
+   a column. The column can then be read directly with
+   mail_index_lookup_ext(). All-zero values mean that it isn't set. */
+bool mail_cache_field_get_column(struct mail_cache *cache,
+				 unsigned int field_idx, uint32_t *ext_id_r);
+
 /* Returns TRUE if cache should be purged. */
 bool mail_cache_need_purge(struct mail_cache *cache, const char **reason_r);
 /* Set cache file to be purged later. */
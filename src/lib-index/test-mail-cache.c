@@ -806,6 +806,114 @@ static void test_mail_cache_duplicate_fields(void)
 	test_end();
 }
 
+static void test_mail_cache_columns(void)
+{
+	enum {
+		TEST_FIELD_FIXED,
+		TEST_FIELD_FIXED2,
+	};
+	struct mail_cache_field cache_fields[] = {
+		{
+			.name = "fixed",
+			.type = MAIL_CACHE_FIELD_FIXED_SIZE,
+			.field_size = 4,
+			.decision = MAIL_CACHE_DECISION_YES,
+		},
+		{
+			.name = "fixed.two",
+			.type = MAIL_CACHE_FIELD_FIXED_SIZE,
+			.field_size = 8,
+			.decision = MAIL_CACHE_DECISION_YES,
+		},
+	};
+	const uint8_t fixed_data[] = { 0x12, 0x34, 0x56, 0x78 };
+	const uint8_t fixed_zero[] = { 0, 0, 0, 0 };
+	const uint8_t fixed2_data[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	struct test_mail_cache_ctx ctx;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	const void *data;
+	bool expunged;
+	uint32_t ext_id, ext2_id, lookup_ext_id;
+	string_t *str = t_str_new(16);
+
+	test_begin("mail cache columns");
+	test_mail_cache_init(test_mail_index_init(), &ctx);
+	mail_cache_register_fields(ctx.cache, cache_fields,
+				   N_ELEMENTS(cache_fields),
+				   unsafe_data_stack_pool);
+	mail_cache_field_set_column(ctx.cache,
+				    cache_fields[TEST_FIELD_FIXED].idx);
+	ext_id = ctx.cache->fields[cache_fields[TEST_FIELD_FIXED].idx].column_ext_id;
+	test_assert(mail_index_ext_lookup(ctx.index, "cache-column-fixed",
+					  &lookup_ext_id) &&
+		    lookup_ext_id == ext_id);
+	test_assert(mail_cache_field_get_column(ctx.cache,
+			cache_fields[TEST_FIELD_FIXED].idx, &lookup_ext_id) &&
+		    lookup_ext_id == ext_id);
+	test_assert(!mail_cache_field_get_column(ctx.cache,
+			cache_fields[TEST_FIELD_FIXED2].idx, &lookup_ext_id));
+
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+
+	/* adding the field writes it to the column also */
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_cache_add(cache_trans, 1, cache_fields[TEST_FIELD_FIXED].idx,
+		       fixed_data, sizeof(fixed_data));
+	mail_cache_add(cache_trans, 2, cache_fields[TEST_FIELD_FIXED].idx,
+		       fixed_zero, sizeof(fixed_zero));
+	mail_cache_add(cache_trans, 1, cache_fields[TEST_FIELD_FIXED2].idx,
+		       fixed2_data, sizeof(fixed2_data));
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_mail_cache_view_sync(&ctx);
+
+	mail_index_lookup_ext(ctx.view, 1, ext_id, &data, &expunged);
+	test_assert(data != NULL &&
+		    memcmp(data, fixed_data, sizeof(fixed_data)) == 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+			cache_fields[TEST_FIELD_FIXED].idx) == 1);
+	test_assert(str_len(str) == sizeof(fixed_data) &&
+		    memcmp(str_data(str), fixed_data, sizeof(fixed_data)) == 0);
+
+	/* zero values are looked up from the cache file */
+	mail_index_lookup_ext(ctx.view, 2, ext_id, &data, &expunged);
+	test_assert(data != NULL &&
+		    memcmp(data, fixed_zero, sizeof(fixed_zero)) == 0);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 2,
+			cache_fields[TEST_FIELD_FIXED].idx) == 1);
+	test_assert(str_len(str) == sizeof(fixed_zero) &&
+		    memcmp(str_data(str), fixed_zero, sizeof(fixed_zero)) == 0);
+
+	/* an already cached field gets added to the column on lookup */
+	mail_cache_field_set_column(ctx.cache,
+				    cache_fields[TEST_FIELD_FIXED2].idx);
+	ext2_id = ctx.cache->fields[cache_fields[TEST_FIELD_FIXED2].idx].column_ext_id;
+	test_assert(ext2_id != ext_id);
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	str_truncate(str, 0);
+	test_assert(mail_cache_lookup_field(cache_view, str, 1,
+			cache_fields[TEST_FIELD_FIXED2].idx) == 1);
+	test_assert(str_len(str) == sizeof(fixed2_data) &&
+		    memcmp(str_data(str), fixed2_data, sizeof(fixed2_data)) == 0);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_mail_cache_view_sync(&ctx);
+
+	mail_index_lookup_ext(ctx.view, 1, ext2_id, &data, &expunged);
+	test_assert(data != NULL &&
+		    memcmp(data, fixed2_data, sizeof(fixed2_data)) == 0);
+
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -820,6 +928,7 @@ int main(void)
 		test_mail_cache_in_memory,
 		test_mail_cache_size_corruption,
 		test_mail_cache_duplicate_fields,
+		test_mail_cache_columns,
 		NULL
 	};
 	return test_run(test_functions);
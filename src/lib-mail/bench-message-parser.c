@@ -0,0 +1,122 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "message-parser.h"
+
+#include <stdio.h>
+
+/**
+ * Parses the given mail files (or a generated multipart message if none are
+ * given) repeatedly from memory and prints the parsing throughput. Header
+ * and body blocks are only iterated, not processed, so the result mainly
+ * reflects the line and MIME boundary scanning speed.
+ */
+
+#define BENCH_DEFAULT_ROUNDS 200
+
+static const char bench_msg_header[] =
+"From: user@example.com\n"
+"To: user2@example.com\n"
+"Subject: benchmark\n"
+"MIME-Version: 1.0\n"
+"Content-Type: multipart/mixed; boundary=\"bench-boundary\"\n"
+"\n";
+
+static string_t *bench_generate_message(void)
+{
+	string_t *str = str_new(default_pool, 1024*1024*2);
+	unsigned int i, j;
+
+	str_append(str, bench_msg_header);
+	for (i = 0; i < 16; i++) {
+		str_append(str, "--bench-boundary\n"
+			   "Content-Type: text/plain\n\n");
+		for (j = 0; j < 2000; j++) {
+			str_printfa(str, "line %u of part %u with some "
+				    "ordinary looking text in it\n", j, i);
+		}
+	}
+	str_append(str, "--bench-boundary--\n");
+	return str;
+}
+
+static void bench_message_parser(const char *name, const void *data,
+				 size_t size, unsigned int rounds)
+{
+	const struct message_parser_settings set = { .flags = 0 };
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts;
+	struct istream *input;
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+	pool_t pool;
+
+	pool = pool_alloconly_create("bench message parser", 10240);
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		input = i_stream_create_from_data(data, size);
+		parser = message_parser_init(pool, input, &set);
+		while (message_parser_parse_next_block(parser, &block) > 0) ;
+		message_parser_deinit(&parser, &parts);
+		i_stream_unref(&input);
+		p_clear(pool);
+	}
+	ts_1 = i_nanoseconds();
+	pool_unref(&pool);
+
+	printf("%s: %zu bytes x %u rounds in %.03lf s = %.01lf MB/s\n",
+	       name, size, rounds, (double)(ts_1 - ts_0) / 1e9,
+	       ((double)size * rounds / (1024.0*1024.0)) /
+	       ((double)(ts_1 - ts_0) / 1e9));
+}
+
+static void bench_message_parser_file(const char *path, unsigned int rounds)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_file(path, SIZE_MAX);
+	while (i_stream_read_more(input, &data, &size) > 0)
+		;
+	if (input->stream_errno != 0) {
+		i_fatal("read(%s) failed: %s", path,
+			i_stream_get_error(input));
+	}
+	data = i_stream_get_data(input, &size);
+	bench_message_parser(path, data, size, rounds);
+	i_stream_unref(&input);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int rounds = BENCH_DEFAULT_ROUNDS;
+	string_t *str;
+	int i, first = 1;
+
+	lib_init();
+	if (argc > 1 && argv[1][0] == '-') {
+		if (str_to_uint(argv[1]+1, &rounds) < 0 || rounds == 0) {
+			fprintf(stderr, "Usage: %s [-<rounds>] [<mail file> ...]\n",
+				argv[0]);
+			lib_exit(1);
+		}
+		first = 2;
+	}
+
+	if (first >= argc) {
+		str = bench_generate_message();
+		bench_message_parser("generated", str_data(str),
+				     str_len(str), rounds);
+		str_free(&str);
+	}
+	for (i = first; i < argc; i++)
+		bench_message_parser_file(argv[i], rounds);
+	lib_deinit();
+	return 0;
+}
@@ -8,6 +8,13 @@
 #include "rfc2231-parser.h"
 #include "message-parser-private.h"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#  include <immintrin.h>
+#endif
+
 message_part_header_callback_t *null_message_part_header_callback = NULL;
 
 static int parse_next_header_init(struct message_parser_ctx *ctx,
@@ -50,35 +57,163 @@ boundary_find(struct message_boundary *boundaries,
 	return best;
 }
 
+#if defined(__SSE2__) || defined(__AVX2__)
+static inline unsigned int message_parser_bitcount(uint32_t mask)
+{
+#ifdef __POPCNT__
+	return __builtin_popcount(mask);
+#else
+	/* Without the popcnt instruction __builtin_popcount() is a library
+	   call. LFs are sparse, so clearing the lowest bit is faster. */
+	unsigned int count = 0;
+
+	for (; mask != 0; mask &= mask - 1)
+		count++;
+	return count;
+#endif
+}
+#endif
+
+/* Count the number of LFs and the number of LFs not preceded by CR in the
+   data. last_chr is the character preceding the data. Returns TRUE if the
+   data contains NULs. The SIMD versions handle 16 or 32 bytes at a time by
+   comparing the LF and CR bitmasks, and the rest is handled bytewise. */
+static bool
+message_parser_count_lines(const unsigned char *data, size_t size,
+			   unsigned char last_chr, unsigned int *lines_r,
+			   unsigned int *missing_cr_count_r)
+{
+	unsigned int lines = 0, crlf_count = 0;
+	unsigned int prev_cr = last_chr == '\r' ? 1 : 0;
+	bool have_nuls = FALSE;
+	size_t i = 0;
+
+#ifdef __AVX2__
+	const __m256i lf32 = _mm256_set1_epi8('\n');
+	const __m256i cr32 = _mm256_set1_epi8('\r');
+	const __m256i nul32 = _mm256_setzero_si256();
+	uint32_t nul_mask32 = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const void *)(data + i));
+		uint32_t lf = (uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, lf32));
+		uint32_t cr = (uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, cr32));
+
+		nul_mask32 |= (uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, nul32));
+		lines += message_parser_bitcount(lf);
+		crlf_count += message_parser_bitcount(
+			lf & ((cr << 1) | prev_cr));
+		prev_cr = cr >> 31;
+	}
+	have_nuls = nul_mask32 != 0;
+#endif
+#ifdef __SSE2__
+	const __m128i lf16 = _mm_set1_epi8('\n');
+	const __m128i cr16 = _mm_set1_epi8('\r');
+	const __m128i nul16 = _mm_setzero_si128();
+	unsigned int nul_mask16 = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const void *)(data + i));
+		unsigned int lf = (unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, lf16));
+		unsigned int cr = (unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, cr16));
+
+		nul_mask16 |= (unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, nul16));
+		lines += message_parser_bitcount(lf);
+		crlf_count += message_parser_bitcount(
+			lf & ((cr << 1) | prev_cr));
+		prev_cr = (cr >> 15) & 1;
+	}
+	if (nul_mask16 != 0)
+		have_nuls = TRUE;
+#endif
+	for (; i < size; i++) {
+		if (data[i] == '\n') {
+			lines++;
+			if (prev_cr != 0)
+				crlf_count++;
+		} else if (data[i] == '\0') {
+			have_nuls = TRUE;
+		}
+		prev_cr = data[i] == '\r' ? 1 : 0;
+	}
+	*lines_r = lines;
+	*missing_cr_count_r = lines - crlf_count;
+	return have_nuls;
+}
+
+/* Returns the next LF that is followed by "--", i.e. the next line that may
+   be a boundary line. An LF followed by less than 2 bytes is also returned,
+   since it can't be known yet whether it begins a boundary. Returns NULL if
+   there are no such LFs. */
+static const unsigned char *
+message_parser_find_boundary_lf(const unsigned char *data,
+				const unsigned char *end)
+{
+	const unsigned char *next;
+	size_t i = 0, size = end - data;
+
+#ifdef __AVX2__
+	const __m256i lf32 = _mm256_set1_epi8('\n');
+	const __m256i dash32 = _mm256_set1_epi8('-');
+
+	for (; i + 32 + 2 <= size; i += 32) {
+		__m256i v0 = _mm256_loadu_si256((const void *)(data + i));
+		__m256i v1 = _mm256_loadu_si256((const void *)(data + i + 1));
+		__m256i v2 = _mm256_loadu_si256((const void *)(data + i + 2));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(v0, lf32),
+				_mm256_and_si256(_mm256_cmpeq_epi8(v1, dash32),
+						 _mm256_cmpeq_epi8(v2, dash32))));
+		if (mask != 0)
+			return data + i + __builtin_ctz(mask);
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i lf16 = _mm_set1_epi8('\n');
+	const __m128i dash16 = _mm_set1_epi8('-');
+
+	for (; i + 16 + 2 <= size; i += 16) {
+		__m128i v0 = _mm_loadu_si128((const void *)(data + i));
+		__m128i v1 = _mm_loadu_si128((const void *)(data + i + 1));
+		__m128i v2 = _mm_loadu_si128((const void *)(data + i + 2));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(v0, lf16),
+				      _mm_and_si128(_mm_cmpeq_epi8(v1, dash16),
+						    _mm_cmpeq_epi8(v2, dash16))));
+		if (mask != 0)
+			return data + i + __builtin_ctz(mask);
+	}
+#endif
+	while ((next = memchr(data + i, '\n', size - i)) != NULL) {
+		if (end - next < 3 || (next[1] == '-' && next[2] == '-'))
+			return next;
+		i = next - data + 1;
+	}
+	return NULL;
+}
+
 static void parse_body_add_block(struct message_parser_ctx *ctx,
 				 struct message_block *block)
 {
-	unsigned int missing_cr_count = 0;
-	const unsigned char *cur, *next, *data = block->data;
+	unsigned int lines, missing_cr_count;
+	const unsigned char *data = block->data;
 
 	i_assert(block->size > 0);
 
 	block->hdr = NULL;
 
-	/* check if we have NULs */
-	if (memchr(data, '\0', block->size) != NULL)
+	/* count number of lines and missing CRs, and check if we have NULs */
+	if (message_parser_count_lines(data, block->size, ctx->last_chr,
+				       &lines, &missing_cr_count))
 		ctx->part->flags |= MESSAGE_PART_FLAG_HAS_NULS;
-
-	/* count number of lines and missing CRs */
-	if (*data == '\n') {
-		ctx->part->body_size.lines++;
-		if (ctx->last_chr != '\r')
-			missing_cr_count++;
-	}
-
-	cur = data + 1;
-	while ((next = memchr(cur, '\n', block->size - (cur - data))) != NULL) {
-		ctx->part->body_size.lines++;
-		if (next[-1] != '\r')
-			missing_cr_count++;
-
-		cur = next + 1;
-	}
+	ctx->part->body_size.lines += lines;
 	ctx->last_chr = data[block->size - 1];
 	ctx->skip += block->size;
 
@@ -421,7 +556,7 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 	/* skip to beginning of the next line. the first line was
 	   handled already. */
 	cur = data; end = data + block_r->size;
-	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
+	while ((next = message_parser_find_boundary_lf(cur, end)) != NULL) {
 		cur = next + 1;
 
 		boundary_start = next - data;
@@ -443,6 +578,20 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 		}
 	}
 
+	if (next == NULL) {
+		/* The lines not beginning with "--" were skipped above.
+		   Find the last line of the block, which may still continue
+		   as a boundary line. */
+		for (next = end; next > data; ) {
+			if (*--next == '\n')
+				break;
+		}
+		boundary_start = next - data;
+		if (next > data && next[-1] == '\r')
+			boundary_start--;
+		next = NULL;
+	}
+
 	if (next != NULL) {
 		/* found / need more data */
 		i_assert(ret >= 0);
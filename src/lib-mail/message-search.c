@@ -177,6 +177,9 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 		message_search_reset(ctx);
 		ctx->prev_part = block->part;
 	}
+	if (block->hdr != NULL &&
+	    (ctx->flags & MESSAGE_SEARCH_FLAG_SKIP_HEADERS) != 0)
+		return FALSE;
 
 	return message_search_more_decoded2(ctx, block);
 }
@@ -194,6 +197,51 @@ void message_search_reset(struct message_search_context *ctx)
 int message_search_msg(struct message_search_context *ctx,
 		       struct istream *input, struct message_part *parts,
 		       const char **error_r)
+{
+	bool match;
+
+	return message_search_msg_multi(&ctx, 1, input, parts, &match,
+					error_r);
+}
+
+static bool
+message_search_more_multi(struct message_search_context *const *ctxs,
+			  unsigned int count, unsigned int primary_idx,
+			  struct message_block *raw_block, bool *matches)
+{
+	struct message_block decoded_block;
+	unsigned int i;
+	bool all_matched = TRUE;
+
+	/* the primary search decodes the block for all the searches */
+	if (message_search_more_get_decoded(ctxs[primary_idx], raw_block,
+					    &decoded_block))
+		matches[primary_idx] = TRUE;
+	if (decoded_block.hdr == NULL && decoded_block.size == 0) {
+		/* nothing to search (e.g. non-text part) */
+		for (i = 0; i < count; i++) {
+			if (!matches[i])
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (matches[i])
+			continue;
+		if (i != primary_idx &&
+		    message_search_more_decoded(ctxs[i], &decoded_block))
+			matches[i] = TRUE;
+		else
+			all_matched = FALSE;
+	}
+	return all_matched;
+}
+
+int message_search_msg_multi(struct message_search_context *const *ctxs,
+			     unsigned int count, struct istream *input,
+			     struct message_part *parts, bool *matches_r,
+			     const char **error_r)
 {
 	const struct message_parser_settings parser_set = {
 		.hdr_flags = MESSAGE_HEADER_PARSER_FLAG_CLEAN_ONELINE,
@@ -201,10 +249,24 @@ int message_search_msg(struct message_search_context *ctx,
 	struct message_parser_ctx *parser_ctx;
 	struct message_block raw_block;
 	struct message_part *new_parts;
+	unsigned int i, primary_idx = 0;
 	pool_t pool = NULL;
 	int ret;
 
-	message_search_reset(ctx);
+	i_assert(count > 0);
+
+	for (i = 0; i < count; i++) {
+		message_search_reset(ctxs[i]);
+		matches_r[i] = FALSE;
+	}
+	/* The primary search needs to see the headers if any of the
+	   searches want them. The ones skipping headers will ignore them. */
+	for (i = 0; i < count; i++) {
+		if ((ctxs[i]->flags & MESSAGE_SEARCH_FLAG_SKIP_HEADERS) == 0) {
+			primary_idx = i;
+			break;
+		}
+	}
 
 	if (parts != NULL) {
 		parser_ctx = message_parser_init_from_parts(parts,
@@ -216,7 +278,8 @@ int message_search_msg(struct message_search_context *ctx,
 
 	while ((ret = message_parser_parse_next_block(parser_ctx,
 						      &raw_block)) > 0) {
-		if (message_search_more(ctx, &raw_block)) {
+		if (message_search_more_multi(ctxs, count, primary_idx,
+					      &raw_block, matches_r)) {
 			ret = 1;
 			break;
 		}
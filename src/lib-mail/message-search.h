@@ -26,7 +26,8 @@ bool message_search_more(struct message_search_context *ctx,
 bool message_search_more_get_decoded(struct message_search_context *ctx,
 				     struct message_block *raw_block,
 				     struct message_block *decoded_block_r);
-/* The data has already passed through decoder. */
+/* The data has already passed through decoder. Headers are ignored if
+   MESSAGE_SEARCH_FLAG_SKIP_HEADERS was given. */
 bool message_search_more_decoded(struct message_search_context *ctx,
 				 struct message_block *block);
 void message_search_reset(struct message_search_context *ctx);
@@ -36,5 +37,15 @@ int message_search_msg(struct message_search_context *ctx,
 		       struct istream *input, struct message_part *parts,
 		       const char **error_r)
 	ATTR_NULL(3);
+/* Search multiple keys from a full message. The message is parsed and
+   decoded only once, and each key is matched against the decoded data.
+   matches_r[i] is set to TRUE if ctxs[i] matched. The search stops as soon
+   as all the keys have matched. Returns 1 if all keys matched, 0 if not,
+   -1 if error (if stream_error == 0, the parts contained broken data) */
+int message_search_msg_multi(struct message_search_context *const *ctxs,
+			     unsigned int count, struct istream *input,
+			     struct message_part *parts, bool *matches_r,
+			     const char **error_r)
+	ATTR_NULL(4);
 
 #endif
@@ -1369,6 +1369,110 @@ static const char input_msg[] =
 	test_end();
 }
 
+static void test_message_parser_random_body_append(string_t *str)
+{
+	static const char *const line_prefixes[] = {
+		"", "-", "--", "--b", "--bX", "---", "- -", "\r"
+	};
+	unsigned int i, j, line_count = i_rand_limit(40);
+
+	for (i = 0; i < line_count; i++) {
+		str_append(str, line_prefixes[i_rand_limit(N_ELEMENTS(line_prefixes))]);
+		if (i_rand_limit(10) == 0)
+			str_append_c(str, '\0');
+		for (j = i_rand_limit(40); j > 0; j--)
+			str_append_c(str, 'a' + i_rand_limit(26));
+		str_append(str, i_rand_limit(2) == 0 ? "\r\n" : "\n");
+	}
+}
+
+static void test_message_parser_random_bodies(void)
+{
+	const struct message_parser_settings parser_set = {
+		.flags = MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS,
+	};
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts, *parts2;
+	struct istream *input;
+	const unsigned char *data;
+	string_t *str;
+	unsigned int i, n, lines, missing_cr_count;
+	size_t size, body_offset;
+	pool_t pool;
+	int ret;
+
+	test_begin("message parser random bodies");
+	pool = pool_alloconly_create("message parser", 10240);
+	str = t_str_new(1024);
+	for (n = 0; n < 200; n++) {
+		/* single part: verify line counts against bytewise counting */
+		str_truncate(str, 0);
+		str_append(str, "Subject: test\n\n");
+		body_offset = str_len(str);
+		test_message_parser_random_body_append(str);
+		data = str_data(str);
+		size = str_len(str);
+		lines = missing_cr_count = 0;
+		for (i = body_offset; i < size; i++) {
+			if (data[i] != '\n')
+				continue;
+			lines++;
+			if (i == body_offset || data[i-1] != '\r')
+				missing_cr_count++;
+		}
+
+		input = test_istream_create_data(data, size);
+		test_assert(message_parse_stream(pool, input, &set_empty,
+						 FALSE, &parts) < 0);
+		test_assert_idx(parts->body_size.lines == lines, n);
+		test_assert_idx(parts->body_size.physical_size ==
+				size - body_offset, n);
+		test_assert_idx(parts->body_size.virtual_size ==
+				size - body_offset + missing_cr_count, n);
+		test_assert_idx(((parts->flags & MESSAGE_PART_FLAG_HAS_NULS) != 0) ==
+				(memchr(data + body_offset, '\0',
+					size - body_offset) != NULL), n);
+		i_stream_unref(&input);
+
+		/* multipart: parsing the full buffer at once must give the
+		   same result as parsing it in small blocks */
+		str_truncate(str, 0);
+		str_append(str, "Content-Type: multipart/mixed; boundary=\"b\"\n\n");
+		test_message_parser_random_body_append(str);
+		for (i = i_rand_limit(4); i > 0; i--) {
+			str_append(str, i_rand_limit(2) == 0 ? "\r\n" : "\n");
+			str_append(str, "--b\n\n");
+			test_message_parser_random_body_append(str);
+		}
+		str_append(str, "\n--b--\n");
+		test_message_parser_random_body_append(str);
+		data = str_data(str);
+		size = str_len(str);
+
+		input = test_istream_create_data(data, size);
+		test_assert(message_parse_stream(pool, input, &parser_set,
+						 FALSE, &parts) < 0);
+
+		i_stream_seek(input, 0);
+		test_istream_set_allow_eof(input, FALSE);
+		parser = message_parser_init(pool, input, &parser_set);
+		for (i = 1; i <= size; i++) {
+			test_istream_set_size(input, i);
+			if (i == size)
+				test_istream_set_allow_eof(input, TRUE);
+			while ((ret = message_parser_parse_next_block(parser,
+								      &block)) > 0) ;
+		}
+		message_parser_deinit(&parser, &parts2);
+		test_assert_idx(message_part_is_equal(parts, parts2), n);
+		i_stream_unref(&input);
+		p_clear(pool);
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -1392,6 +1496,7 @@ int main(void)
 		test_message_parser_mime_part_limit_rfc822,
 		test_message_parser_mime_version,
 		test_message_parser_mime_version_missing,
+		test_message_parser_random_bodies,
 		NULL
 	};
 	return test_run(test_functions);
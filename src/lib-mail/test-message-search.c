@@ -510,11 +510,84 @@ static void test_message_search_more_get_decoded(void)
 	test_end();
 }
 
+static void test_message_search_msg_multi(void)
+{
+	static const char input[] =
+		"Subject: Hello, World\n"
+		"MIME-Version: 1.0\n"
+		"Content-Type: multipart/mixed; boundary=\"1\"\n"
+		"\n"
+		"--1\n"
+		TEST_CASE_PLAIN_PREAMBLE
+		"\n"
+		"first part\n"
+		"--1\n"
+		"Content-Type: text/plain; charset=utf-8\n"
+		"Content-Transfer-Encoding: base64\n"
+		"\n"
+		"c2Vjb25kIHBhcnQ=\n"
+		"--1--\n";
+	static const struct {
+		const char *key;
+		enum message_search_flags flags;
+		bool expect_found;
+	} keys[] = {
+		{ "Hello", 0, TRUE },
+		{ "Hello", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, FALSE },
+		{ "first", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, TRUE },
+		{ "second part", 0, TRUE },
+		{ "third", 0, FALSE },
+		{ "multipart", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, FALSE },
+	};
+	struct message_search_context *ctxs[N_ELEMENTS(keys)];
+	bool matches[N_ELEMENTS(keys)];
+	struct istream *input_stream;
+	const char *error;
+	unsigned int i, start;
+
+	test_begin("message_search_msg_multi()");
+	for (i = 0; i < N_ELEMENTS(keys); i++)
+		ctxs[i] = message_search_init(keys[i].key, NULL, keys[i].flags);
+
+	/* try with each key being the first one, since the first context
+	   without SKIP_HEADERS does the decoding for all of them */
+	for (start = 0; start < N_ELEMENTS(keys); start++) {
+		struct message_search_context *rot_ctxs[N_ELEMENTS(keys)];
+		int ret;
+
+		for (i = 0; i < N_ELEMENTS(keys); i++)
+			rot_ctxs[i] = ctxs[(start + i) % N_ELEMENTS(keys)];
+		input_stream = test_istream_create_data(input, sizeof(input)-1);
+		ret = message_search_msg_multi(rot_ctxs, N_ELEMENTS(keys),
+					       input_stream, NULL, matches,
+					       &error);
+		test_assert_idx(ret == 0, start);
+		for (i = 0; i < N_ELEMENTS(keys); i++) {
+			unsigned int idx = (start + i) % N_ELEMENTS(keys);
+			test_assert_idx(matches[i] == keys[idx].expect_found,
+					start * 100 + idx);
+		}
+		i_stream_unref(&input_stream);
+	}
+
+	/* all keys found */
+	input_stream = test_istream_create_data(input, sizeof(input)-1);
+	test_assert(message_search_msg_multi(ctxs, 1, input_stream, NULL,
+					     matches, &error) == 1);
+	test_assert(matches[0]);
+	i_stream_unref(&input_stream);
+
+	for (i = 0; i < N_ELEMENTS(keys); i++)
+		message_search_deinit(&ctxs[i]);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_message_search,
 		test_message_search_more_get_decoded,
+		test_message_search_msg_multi,
 		NULL
 	};
 	return test_run(test_functions);
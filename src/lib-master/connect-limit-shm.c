@@ -0,0 +1,295 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "mmap-util.h"
+#include "safe-mkstemp.h"
+#include "connect-limit-shm.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define CONNECT_LIMIT_SHM_MAGIC 0x434c4d31 /* "CLM1" */
+/* Don't fill the table more than 3/4 full, so lookups stay fast */
+#define CONNECT_LIMIT_SHM_MAX_KEYS(slot_count) ((slot_count) / 4 * 3)
+
+#define FNV64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+struct connect_limit_shm_header {
+	uint32_t magic;
+	/* Power of 2 */
+	uint32_t slot_count;
+	/* Odd while the table is unusable. Readers fall back to anvil if
+	   the generation is odd or if it changes during the lookup. */
+	uint32_t generation;
+	uint32_t unused;
+};
+
+struct connect_limit_shm_slot {
+	/* 0 = unused slot */
+	uint64_t key;
+	uint32_t count;
+	uint32_t unused;
+};
+
+struct connect_limit_shm {
+	void *mmap_base;
+	size_t mmap_size;
+
+	struct connect_limit_shm_header *hdr;
+	struct connect_limit_shm_slot *slots;
+	uint32_t slot_mask;
+
+	/* Number of keys in the table. Only tracked by the writer. */
+	unsigned int used_count;
+};
+
+static uint64_t fnv64_update(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= FNV64_PRIME;
+	}
+	return hash;
+}
+
+static uint64_t
+connect_limit_shm_key(const char *username, const char *protocol,
+		      size_t protocol_len, const struct ip_addr *ip)
+{
+	uint64_t hash = FNV64_OFFSET_BASIS;
+
+	hash = fnv64_update(hash, username, strlen(username) + 1);
+	hash = fnv64_update(hash, protocol, protocol_len);
+	hash = fnv64_update(hash, "", 1);
+	if (ip->family == AF_INET6)
+		hash = fnv64_update(hash, &ip->u.ip6, sizeof(ip->u.ip6));
+	else if (ip->family != 0)
+		hash = fnv64_update(hash, &ip->u.ip4, sizeof(ip->u.ip4));
+	/* 0 means an unused slot */
+	return hash != 0 ? hash : 1;
+}
+
+int connect_limit_shm_create(const char *dir, uoff_t max_size,
+			     int *rw_fd_r, int *ro_fd_r, const char **error_r)
+{
+	struct connect_limit_shm_header hdr;
+	uoff_t slot_count;
+	string_t *path;
+	int rw_fd, ro_fd;
+
+	slot_count = (max_size - I_MIN(max_size, sizeof(hdr))) /
+		sizeof(struct connect_limit_shm_slot);
+	if (slot_count < 16) {
+		*error_r = "Size is too small";
+		return -1;
+	}
+	/* round down to power of 2 */
+	slot_count = nearest_power(I_MIN(slot_count, 0x80000000U) + 1) / 2;
+
+	path = t_str_new(128);
+	str_printfa(path, "%s/anvil-connect-limit.", dir);
+	rw_fd = safe_mkstemp(path, 0600, (uid_t)-1, (gid_t)-1);
+	if (rw_fd == -1) {
+		*error_r = t_strdup_printf("safe_mkstemp(%s) failed: %m",
+					   str_c(path));
+		return -1;
+	}
+	ro_fd = open(str_c(path), O_RDONLY);
+	if (ro_fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", str_c(path));
+		i_unlink(str_c(path));
+		i_close_fd(&rw_fd);
+		return -1;
+	}
+	i_unlink(str_c(path));
+
+	i_zero(&hdr);
+	hdr.magic = CONNECT_LIMIT_SHM_MAGIC;
+	hdr.slot_count = slot_count;
+	hdr.generation = 1;
+	if (ftruncate(rw_fd, sizeof(hdr) +
+		      slot_count * sizeof(struct connect_limit_shm_slot)) < 0) {
+		*error_r = t_strdup_printf("ftruncate(%s) failed: %m",
+					   str_c(path));
+	} else if (pwrite(rw_fd, &hdr, sizeof(hdr), 0) !=
+		   (ssize_t)sizeof(hdr)) {
+		*error_r = t_strdup_printf("pwrite(%s) failed: %m",
+					   str_c(path));
+	} else {
+		*rw_fd_r = rw_fd;
+		*ro_fd_r = ro_fd;
+		return 0;
+	}
+	i_close_fd(&rw_fd);
+	i_close_fd(&ro_fd);
+	return -1;
+}
+
+int connect_limit_shm_open(int fd, bool writable,
+			   struct connect_limit_shm **shm_r,
+			   const char **error_r)
+{
+	struct connect_limit_shm *shm;
+	const struct connect_limit_shm_header *hdr;
+	struct stat st;
+	void *base;
+	int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf(
+			"fstat(connect-limit shm) failed: %m");
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(*hdr))
+		return 0;
+
+	base = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		*error_r = t_strdup_printf(
+			"mmap(connect-limit shm) failed: %m");
+		return -1;
+	}
+	hdr = base;
+	if (hdr->magic != CONNECT_LIMIT_SHM_MAGIC ||
+	    hdr->slot_count == 0 ||
+	    (hdr->slot_count & (hdr->slot_count - 1)) != 0 ||
+	    sizeof(*hdr) + (uoff_t)hdr->slot_count *
+	    sizeof(struct connect_limit_shm_slot) > (uoff_t)st.st_size) {
+		*error_r = "connect-limit shm is corrupted";
+		if (munmap(base, st.st_size) < 0)
+			i_error("munmap(connect-limit shm) failed: %m");
+		return -1;
+	}
+
+	shm = i_new(struct connect_limit_shm, 1);
+	shm->mmap_base = base;
+	shm->mmap_size = st.st_size;
+	shm->hdr = base;
+	shm->slots = PTR_OFFSET(base, sizeof(*hdr));
+	shm->slot_mask = hdr->slot_count - 1;
+	*shm_r = shm;
+	return 1;
+}
+
+void connect_limit_shm_close(struct connect_limit_shm **_shm)
+{
+	struct connect_limit_shm *shm = *_shm;
+
+	if (shm == NULL)
+		return;
+	*_shm = NULL;
+
+	if (munmap(shm->mmap_base, shm->mmap_size) < 0)
+		i_error("munmap(connect-limit shm) failed: %m");
+	i_free(shm);
+}
+
+bool connect_limit_shm_lookup(struct connect_limit_shm *shm,
+			      const char *username, const char *service,
+			      const struct ip_addr *ip, unsigned int *count_r)
+{
+	const char *p = strchr(service, '-');
+	size_t protocol_len = p == NULL ? strlen(service) :
+		(size_t)(p - service);
+	uint64_t key = connect_limit_shm_key(username, service,
+					     protocol_len, ip);
+	uint32_t generation, i, idx;
+	unsigned int count = 0;
+
+	generation = __atomic_load_n(&shm->hdr->generation, __ATOMIC_ACQUIRE);
+	if ((generation & 1) != 0)
+		return FALSE;
+
+	idx = key & shm->slot_mask;
+	for (i = 0; i <= shm->slot_mask; i++) {
+		const struct connect_limit_shm_slot *slot = &shm->slots[idx];
+		uint64_t slot_key =
+			__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+		if (slot_key == key) {
+			count = __atomic_load_n(&slot->count,
+						__ATOMIC_RELAXED);
+			break;
+		}
+		if (slot_key == 0)
+			break;
+		idx = (idx + 1) & shm->slot_mask;
+	}
+
+	/* make sure the table wasn't reset while we were reading it */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shm->hdr->generation, __ATOMIC_RELAXED) !=
+	    generation)
+		return FALSE;
+	*count_r = count;
+	return TRUE;
+}
+
+void connect_limit_shm_invalidate(struct connect_limit_shm *shm)
+{
+	uint32_t generation = shm->hdr->generation;
+
+	if ((generation & 1) == 0) {
+		__atomic_store_n(&shm->hdr->generation, generation + 1,
+				 __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+}
+
+void connect_limit_shm_reset(struct connect_limit_shm *shm)
+{
+	connect_limit_shm_invalidate(shm);
+	memset(shm->slots, 0,
+	       (shm->slot_mask + 1) * sizeof(struct connect_limit_shm_slot));
+	shm->used_count = 0;
+}
+
+void connect_limit_shm_reset_finish(struct connect_limit_shm *shm)
+{
+	i_assert((shm->hdr->generation & 1) != 0);
+
+	__atomic_store_n(&shm->hdr->generation, shm->hdr->generation + 1,
+			 __ATOMIC_RELEASE);
+}
+
+bool connect_limit_shm_set(struct connect_limit_shm *shm,
+			   const char *username, const char *protocol,
+			   const struct ip_addr *ip, unsigned int count)
+{
+	uint64_t key = connect_limit_shm_key(username, protocol,
+					     strlen(protocol), ip);
+	struct connect_limit_shm_slot *slot;
+	uint32_t idx = key & shm->slot_mask;
+
+	for (;;) {
+		slot = &shm->slots[idx];
+		if (slot->key == key) {
+			__atomic_store_n(&slot->count, count,
+					 __ATOMIC_RELAXED);
+			return TRUE;
+		}
+		if (slot->key == 0)
+			break;
+		idx = (idx + 1) & shm->slot_mask;
+	}
+
+	if (count == 0)
+		return TRUE;
+	if (shm->used_count >= connect_limit_shm_get_max_keys(shm))
+		return FALSE;
+	/* the count must be visible before the key */
+	slot->count = count;
+	__atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+	shm->used_count++;
+	return TRUE;
+}
+
+unsigned int connect_limit_shm_get_max_keys(struct connect_limit_shm *shm)
+{
+	return CONNECT_LIMIT_SHM_MAX_KEYS(shm->slot_mask + 1);
+}
@@ -0,0 +1,58 @@
+#ifndef CONNECT_LIMIT_SHM_H
+#define CONNECT_LIMIT_SHM_H
+
+#include "net.h"
+
+/* Shared memory table of connection counts for each username+service+IP.
+   The master process creates the table and passes it to all child
+   processes. The anvil process is the only writer, so processes can look up
+   the counts without locking and without a round trip to anvil. Keys are
+   64bit hashes, so in theory different users could share the same count.
+
+   The table can be temporarily unusable (anvil isn't running, is rebuilding
+   the table or the table is full). Lookups then fail and the caller should
+   fall back to asking anvil. */
+
+struct connect_limit_shm;
+
+/* Create a new table with the given maximum size into the directory. The
+   file is unlinked immediately, so the returned fds are the only way to
+   access it. rw_fd is meant for anvil and ro_fd for the other processes.
+   The table is unusable until anvil resets it. */
+int connect_limit_shm_create(const char *dir, uoff_t max_size,
+			     int *rw_fd_r, int *ro_fd_r, const char **error_r);
+/* Map the table from the fd. Returns 1 if ok, 0 if the fd doesn't contain
+   a table (e.g. it's /dev/null), -1 on error. The fd can be closed
+   afterwards. */
+int connect_limit_shm_open(int fd, bool writable,
+			   struct connect_limit_shm **shm_r,
+			   const char **error_r);
+void connect_limit_shm_close(struct connect_limit_shm **shm);
+
+/* Get the number of connections for username+service+IP. The service is
+   truncated from the first "-" the same way as anvil does. Returns FALSE if
+   the table isn't currently usable. */
+bool connect_limit_shm_lookup(struct connect_limit_shm *shm,
+			      const char *username, const char *service,
+			      const struct ip_addr *ip, unsigned int *count_r);
+
+/* The rest of the functions are only for the anvil process (and master's
+   invalidation). */
+
+/* Mark the table unusable until the next reset. */
+void connect_limit_shm_invalidate(struct connect_limit_shm *shm);
+/* Remove all keys and mark the table unusable. Add the current counts with
+   connect_limit_shm_set() and then call connect_limit_shm_reset_finish(). */
+void connect_limit_shm_reset(struct connect_limit_shm *shm);
+void connect_limit_shm_reset_finish(struct connect_limit_shm *shm);
+/* Set the number of connections for username+service+IP, where service is
+   already truncated. Returns FALSE if the key didn't exist and there's no
+   space for it anymore. Keys are never removed from the table, so it needs
+   to be reset once it gets full. */
+bool connect_limit_shm_set(struct connect_limit_shm *shm,
+			   const char *username, const char *protocol,
+			   const struct ip_addr *ip, unsigned int count);
+/* Returns the maximum number of keys in the table. */
+unsigned int connect_limit_shm_get_max_keys(struct connect_limit_shm *shm);
+
+#endif
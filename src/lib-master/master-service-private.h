@@ -85,6 +85,7 @@ struct master_service {
 	volatile struct timeval killed_time;
 
 	struct stats_client *stats_client;
+	struct connect_limit_shm *anvil_shm;
 	struct master_service_haproxy_conn *haproxy_conns;
 	struct event_filter *process_shutdown_filter;
 
@@ -103,6 +104,7 @@ struct master_service {
 	bool init_finished:1;
 	bool killed_signal_logged:1;
 	bool io_status_waiting:1;
+	bool anvil_shm_opened:1;
 };
 
 void master_service_io_listeners_add(struct master_service *service);
@@ -8,6 +8,7 @@
 #include "fdpass.h"
 #include "write-full.h"
 #include "str.h"
+#include "wildcard-match.h"
 #include "syslog-util.h"
 #include "eacces-error.h"
 #include "env-util.h"
@@ -391,42 +392,134 @@ master_service_apply_config_overrides(struct master_service *service,
 	return 0;
 }
 
-static void
-filter_string_parse_protocol(const char *filter_string,
-			     ARRAY_TYPE(const_string) *protocols)
+static const unsigned char *
+master_service_settings_filter_net(const unsigned char *p,
+				   const unsigned char *end,
+				   struct ip_addr *net_r, unsigned int *bits_r)
 {
-	const char *p = strstr(filter_string, "protocol=\"");
+	i_zero(net_r);
+	if (p >= end)
+		return NULL;
+	*bits_r = *p++;
+	if (*bits_r == 0)
+		return p;
+	if (p >= end)
+		return NULL;
+	switch (*p++) {
+	case 4:
+		if (p + sizeof(net_r->u.ip4) > end)
+			return NULL;
+		net_r->family = AF_INET;
+		memcpy(&net_r->u.ip4, p, sizeof(net_r->u.ip4));
+		return p + sizeof(net_r->u.ip4);
+	case 6:
+		if (p + sizeof(net_r->u.ip6) > end)
+			return NULL;
+		net_r->family = AF_INET6;
+		memcpy(&net_r->u.ip6, p, sizeof(net_r->u.ip6));
+		return p + sizeof(net_r->u.ip6);
+	}
+	return NULL;
+}
+
+static bool
+master_service_settings_filter_net_match(const struct ip_addr *ip,
+					 const struct ip_addr *net,
+					 unsigned int bits)
+{
+	if (bits == 0)
+		return TRUE;
+	return ip->family != 0 && net_is_in_network(ip, net, bits);
+}
+
+int master_service_settings_filter_match(const unsigned char *mmap_base,
+					 size_t *offset, size_t end_offset,
+					 const struct master_service_settings_input *input,
+					 ARRAY_TYPE(const_string) *protocols,
+					 bool *match_r)
+{
+	const unsigned char *p = mmap_base + *offset;
+	const unsigned char *end = mmap_base + end_offset;
+	struct ip_addr local_net, remote_net;
+	unsigned int local_bits, remote_bits;
+
+	/* <flags> protocol <NUL> local_name <NUL> <local net> <remote net> */
+	if (p >= end)
+		return -1;
+	uint8_t flags = *p++;
+	const char *protocol = (const char *)p;
+	p = memchr(p, '\0', end - p);
 	if (p == NULL)
-		return;
-	const char *p2 = strchr(p + 10, '"');
-	if (p2 == NULL)
-		return;
-	const char *protocol = t_strdup_until(p + 10, p2);
-	if (p - filter_string > 4 && strcmp(p - 4, "NOT ") == 0)
-		protocol = t_strconcat("!", protocol, NULL);
-	array_push_back(protocols, &protocol);
+		return -1;
+	const char *local_name = (const char *)++p;
+	p = memchr(p, '\0', end - p);
+	if (p == NULL)
+		return -1;
+	p++;
+	p = master_service_settings_filter_net(p, end, &local_net, &local_bits);
+	if (p == NULL)
+		return -1;
+	p = master_service_settings_filter_net(p, end, &remote_net,
+					       &remote_bits);
+	if (p == NULL)
+		return -1;
+	*offset = p - mmap_base;
+
+	bool match = TRUE;
+	if (protocol[0] != '\0') {
+		bool not_protocol =
+			(flags & MASTER_SERVICE_SETTINGS_FILTER_FLAG_NOT_PROTOCOL) != 0;
+		if (not_protocol)
+			protocol = t_strconcat("!", protocol, NULL);
+		array_push_back(protocols, &protocol);
+
+		match = input->service != NULL &&
+			wildcard_match_icase(input->service,
+					     protocol + (not_protocol ? 1 : 0));
+		if (not_protocol)
+			match = !match;
+	}
+	if (local_name[0] != '\0' &&
+	    (input->local_name == NULL ||
+	     !wildcard_match_icase(input->local_name, local_name)))
+		match = FALSE;
+	if (!master_service_settings_filter_net_match(&input->local_ip,
+						      &local_net, local_bits) ||
+	    !master_service_settings_filter_net_match(&input->remote_ip,
+						      &remote_net, remote_bits))
+		match = FALSE;
+	*match_r = match;
+	return 0;
 }
 
 static int
 master_service_settings_read_mmap(struct setting_parser_context *parser,
-				  struct event *event,
+				  const struct master_service_settings_input *input,
 				  const unsigned char *mmap_base,
 				  size_t mmap_size,
 				  struct master_service_settings_output *output_r,
 				  const char **error_r)
 {
 	/*
-	   DOVECOT-CONFIG <TAB> 1.0 <LF>
+	   DOVECOT-CONFIG <TAB> 2.0 <LF>
 
 	   <64bit big-endian global settings blob size>
 	   [ key <NUL> value <NUL>, ... ]
 
 	   <64bit big-endian filter settings blob size>
 	   filter_string <NUL>
+	   <8bit flags> protocol <NUL> local_name <NUL>
+	   <8bit local_bits> [<8bit 4|6> <local_net>]
+	   <8bit remote_bits> [<8bit 4|6> <remote_net>]
 	   [ key <NUL> value <NUL>, ... ]
 
 	   ... more filters ...
 
+	   The filter_string is informational only. Filters are matched
+	   using the binary protocol, local_name and network fields that
+	   follow it, so nothing needs to be parsed when reading settings.
+	   An empty protocol or local_name and zero bits match anything.
+
 	   Settings are read until the blob size is reached. There is no
 	   padding/alignment. The mmaped data comes from a trusted source
 	   (if we can't trust the config, what can we trust?), so for
@@ -435,9 +528,6 @@ master_service_settings_read_mmap(struct setting_parser_context *parser,
 	ARRAY_TYPE(const_string) protocols;
 
 	t_array_init(&protocols, 8);
-	const struct failure_context failure_ctx = {
-		.type = LOG_TYPE_DEBUG,
-	};
 
 	const char *magic_prefix = "DOVECOT-CONFIG\t";
 	const unsigned int magic_prefix_len = strlen(magic_prefix);
@@ -448,7 +538,7 @@ master_service_settings_read_mmap(struct setting_parser_context *parser,
 		*error_r = "File header doesn't begin with DOVECOT-CONFIG line";
 		return -1;
 	}
-	if (mmap_base[magic_prefix_len] != '1' ||
+	if (mmap_base[magic_prefix_len] != '2' ||
 	    mmap_base[magic_prefix_len+1] != '.') {
 		*error_r = t_strdup_printf(
 			"Unsupported config file version '%s'",
@@ -491,20 +581,17 @@ master_service_settings_read_mmap(struct setting_parser_context *parser,
 				return -1;
 			}
 
-			struct event_filter *filter = event_filter_create();
-			const char *error;
-			filter_string_parse_protocol(filter_string, &protocols);
-			if (event_filter_parse(filter_string, filter, &error) < 0) {
+			bool match;
+			if (master_service_settings_filter_match(mmap_base,
+					&offset, end_offset, input,
+					&protocols, &match) < 0) {
 				*error_r = t_strdup_printf(
-					"Received invalid filter '%s': %s",
-					filter_string, error);
-				event_filter_unref(&filter);
+					"Filter '%s' points outside blob "
+					"(offset=%zu, end_offset=%zu, file_size=%zu)",
+					filter_string, offset, end_offset,
+					mmap_size);
 				return -1;
 			}
-			bool match = filter_string[0] == '\0' ||
-				event_filter_match(filter, event,
-						   &failure_ctx);
-			event_filter_unref(&filter);
 			if (!match) {
 				/* Filter didn't match. Jump to the next one. */
 				offset = end_offset;
@@ -607,14 +694,6 @@ int master_service_settings_read(struct master_service *service,
 			pool_alloconly_create("master service settings", 16384);
 	}
 
-	/* Create event for matching config filters */
-	struct event *event = event_create(NULL);
-	event_add_str(event, "protocol", input->service);
-	event_add_str(event, "user", input->username);
-	event_add_str(event, "local_name", input->local_name);
-	event_add_ip(event, "local_ip", &input->local_ip);
-	event_add_ip(event, "remote_ip", &input->remote_ip);
-
 	p_array_init(&all_roots, service->set_pool, 8);
 	tmp_root = &master_service_setting_parser_info;
 	array_push_back(&all_roots, &tmp_root);
@@ -636,7 +715,7 @@ int master_service_settings_read(struct master_service *service,
 	/* config_mmap_base is NULL only if
 	   MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS is used */
 	if (service->config_mmap_base != NULL) {
-		ret = master_service_settings_read_mmap(parser, event,
+		ret = master_service_settings_read_mmap(parser, input,
 			service->config_mmap_base, service->config_mmap_size,
 			output_r, error_r);
 
@@ -646,11 +725,9 @@ int master_service_settings_read(struct master_service *service,
 					fd, *error_r);
 			}
 			settings_parser_unref(&parser);
-			event_unref(&event);
 			return -1;
 		}
 	}
-	event_unref(&event);
 
 	if (array_is_created(&service->config_overrides)) {
 		if (master_service_apply_config_overrides(service, parser,
@@ -7,6 +7,13 @@ struct setting_parser_info;
 struct setting_parser_context;
 struct master_service;
 
+/* Flags in the binary form of a filter in the config file written by
+   the config process. */
+enum master_service_settings_filter_flags {
+	/* "protocol !name" */
+	MASTER_SERVICE_SETTINGS_FILTER_FLAG_NOT_PROTOCOL = 0x01,
+};
+
 struct master_service_settings {
 	/* NOTE: log process won't see any new settings unless they're
 	   explicitly sent via environment variables by master process. */
@@ -94,4 +101,11 @@ int master_service_set(struct master_service *service, const char *line);
 bool master_service_set_has_config_override(struct master_service *service,
 					    const char *key);
 
+/* for unit testing */
+int master_service_settings_filter_match(const unsigned char *mmap_base,
+					 size_t *offset, size_t end_offset,
+					 const struct master_service_settings_input *input,
+					 ARRAY_TYPE(const_string) *protocols,
+					 bool *match_r);
+
 #endif
@@ -20,6 +20,7 @@
 #include "settings-parser.h"
 #include "syslog-util.h"
 #include "stats-client.h"
+#include "connect-limit-shm.h"
 #include "master-admin-client.h"
 #include "master-instance.h"
 #include "master-service-private.h"
@@ -766,6 +767,12 @@ void master_service_init_stats_client(struct master_service *service,
 	} T_END;
 }
 
+void master_service_forked_child(struct master_service *service)
+{
+	if (service->stats_client != NULL)
+		stats_client_forked_child(service->stats_client);
+}
+
 void master_service_set_die_with_master(struct master_service *service,
 					bool set)
 {
@@ -1316,6 +1323,30 @@ void master_service_anvil_disconnect(struct master_service *service,
 	(void)master_service_anvil_send(service, str_c(cmd));
 }
 
+bool master_service_anvil_lookup(struct master_service *service,
+	const struct master_service_anvil_session *session,
+	unsigned int *count_r)
+{
+	const char *error;
+
+	if ((service->flags & MASTER_SERVICE_FLAG_STANDALONE) != 0)
+		return FALSE;
+
+	if (!service->anvil_shm_opened) {
+		service->anvil_shm_opened = TRUE;
+		if (connect_limit_shm_open(MASTER_ANVIL_SHM_FD, FALSE,
+					   &service->anvil_shm, &error) < 0)
+			e_error(service->event, "%s", error);
+		if (close(MASTER_ANVIL_SHM_FD) < 0)
+			e_error(service->event, "close(anvil shm) failed: %m");
+	}
+	if (service->anvil_shm == NULL)
+		return FALSE;
+	return connect_limit_shm_lookup(service->anvil_shm, session->username,
+					session->service_name, &session->ip,
+					count_r);
+}
+
 void master_service_client_connection_created(struct master_service *service)
 {
 	i_assert(service->master_status.available_count > 0);
@@ -1567,6 +1598,7 @@ static void master_service_free(struct master_service *service)
 	i_free(service->config_path);
 	i_free(service->current_user);
 	i_free(service->last_kick_signal_user);
+	connect_limit_shm_close(&service->anvil_shm);
 	event_unref(&service->event);
 	i_free(service);
 }
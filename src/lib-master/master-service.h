@@ -155,6 +155,10 @@ void master_service_init_log_with_pid(struct master_service *service);
    happening because the stats service isn't running. */
 void master_service_init_stats_client(struct master_service *service,
 				      bool silent_notfound_errors);
+/* Call in a child process that was fork()ed without exec()ing. The child
+   stops sending events to the stats process, because the connection is
+   still shared with the parent process. */
+void master_service_forked_child(struct master_service *service);
 
 /* If set, die immediately when connection to master is lost.
    Normally all existing clients are handled first. */
@@ -245,6 +249,13 @@ bool master_service_is_master_stopped(struct master_service *service);
 bool master_service_anvil_connect(struct master_service *service,
 	const struct master_service_anvil_session *session,
 	bool kick_supported, guid_128_t conn_guid_r);
+/* Look up the number of connections for the session's username+service+IP
+   from the shared memory table maintained by anvil. Returns FALSE if the
+   table isn't available, and the caller should send a LOOKUP to anvil
+   instead. */
+bool master_service_anvil_lookup(struct master_service *service,
+	const struct master_service_anvil_session *session,
+	unsigned int *count_r);
 /* Send DISCONNECT command to anvil process, if it's still connected.
    The conn_guid must match the guid returned by _connect(). */
 void master_service_anvil_disconnect(struct master_service *service,
@@ -399,3 +399,11 @@ void stats_client_deinit(struct stats_client **_client)
 	if (stats_clients->connections == NULL)
 		stats_global_deinit();
 }
+
+void stats_client_forked_child(struct stats_client *client ATTR_UNUSED)
+{
+	/* Don't deinit the connection list, since that would flush any
+	   output the parent process had buffered. */
+	event_unregister_callback(stats_event_callback);
+	event_category_unregister_callback(stats_category_registered);
+}
@@ -4,5 +4,8 @@
 struct stats_client *
 stats_client_init(const char *path, bool silent_notfound_errors);
 void stats_client_deinit(struct stats_client **client);
+/* Stop sending events in a fork()ed child process. The connection belongs to
+   the parent process, so it's left untouched. */
+void stats_client_forked_child(struct stats_client *client);
 
 #endif
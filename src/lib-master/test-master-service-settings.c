@@ -0,0 +1,191 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "master-service-settings.h"
+#include "test-common.h"
+
+static buffer_t *
+test_filter(uint8_t flags, const char *protocol, const char *local_name,
+	    const char *local_net, unsigned int local_bits,
+	    const char *remote_net, unsigned int remote_bits)
+{
+	const char *nets[] = { local_net, remote_net };
+	unsigned int bits[] = { local_bits, remote_bits };
+	buffer_t *buf = t_buffer_create(64);
+	struct ip_addr ip;
+
+	buffer_append_c(buf, flags);
+	buffer_append(buf, protocol, strlen(protocol) + 1);
+	buffer_append(buf, local_name, strlen(local_name) + 1);
+	for (unsigned int i = 0; i < N_ELEMENTS(nets); i++) {
+		buffer_append_c(buf, bits[i]);
+		if (bits[i] == 0)
+			continue;
+		if (net_addr2ip(nets[i], &ip) < 0)
+			i_unreached();
+		if (IPADDR_IS_V4(&ip)) {
+			buffer_append_c(buf, 4);
+			buffer_append(buf, &ip.u.ip4, sizeof(ip.u.ip4));
+		} else {
+			buffer_append_c(buf, 6);
+			buffer_append(buf, &ip.u.ip6, sizeof(ip.u.ip6));
+		}
+	}
+	return buf;
+}
+
+static bool
+test_filter_match(const buffer_t *filter, const char *service,
+		  const char *local_name, const char *local_ip,
+		  const char *remote_ip, const char **protocol_r)
+{
+	struct master_service_settings_input input;
+	ARRAY_TYPE(const_string) protocols;
+	size_t offset = 0;
+	bool match;
+
+	i_zero(&input);
+	input.service = service;
+	input.local_name = local_name;
+	if (local_ip != NULL && net_addr2ip(local_ip, &input.local_ip) < 0)
+		i_unreached();
+	if (remote_ip != NULL && net_addr2ip(remote_ip, &input.remote_ip) < 0)
+		i_unreached();
+
+	t_array_init(&protocols, 1);
+	test_assert(master_service_settings_filter_match(filter->data, &offset,
+			filter->used, &input, &protocols, &match) == 0);
+	test_assert(offset == filter->used);
+	if (protocol_r != NULL) {
+		test_assert(array_count(&protocols) == 1);
+		*protocol_r = array_count(&protocols) == 0 ? NULL :
+			array_idx_elem(&protocols, 0);
+	} else {
+		test_assert(array_count(&protocols) == 0);
+	}
+	return match;
+}
+
+static void test_master_service_settings_filter_match(void)
+{
+	const buffer_t *filter;
+	const char *protocol;
+
+	test_begin("master_service_settings_filter_match()");
+
+	/* empty filter matches everything */
+	filter = test_filter(0, "", "", NULL, 0, NULL, 0);
+	test_assert(test_filter_match(filter, NULL, NULL, NULL, NULL, NULL));
+	test_assert(test_filter_match(filter, "imap", "example.com",
+				      "127.0.0.1", "::1", NULL));
+
+	/* protocol */
+	filter = test_filter(0, "imap", "", NULL, 0, NULL, 0);
+	test_assert(test_filter_match(filter, "imap", NULL, NULL, NULL,
+				      &protocol));
+	test_assert_strcmp(protocol, "imap");
+	test_assert(test_filter_match(filter, "IMAP", NULL, NULL, NULL,
+				      &protocol));
+	test_assert(!test_filter_match(filter, "pop3", NULL, NULL, NULL,
+				       &protocol));
+	test_assert(!test_filter_match(filter, NULL, NULL, NULL, NULL,
+				       &protocol));
+
+	/* negated protocol */
+	filter = test_filter(MASTER_SERVICE_SETTINGS_FILTER_FLAG_NOT_PROTOCOL,
+			     "imap", "", NULL, 0, NULL, 0);
+	test_assert(!test_filter_match(filter, "imap", NULL, NULL, NULL,
+				       &protocol));
+	test_assert_strcmp(protocol, "!imap");
+	test_assert(test_filter_match(filter, "pop3", NULL, NULL, NULL,
+				      &protocol));
+	test_assert(test_filter_match(filter, NULL, NULL, NULL, NULL,
+				      &protocol));
+
+	/* local_name wildcard */
+	filter = test_filter(0, "", "*.example.com", NULL, 0, NULL, 0);
+	test_assert(test_filter_match(filter, "imap", "mail.example.com",
+				      NULL, NULL, NULL));
+	test_assert(!test_filter_match(filter, "imap", "example.org",
+				       NULL, NULL, NULL));
+	test_assert(!test_filter_match(filter, "imap", NULL,
+				       NULL, NULL, NULL));
+
+	/* local and remote networks */
+	filter = test_filter(0, "", "", "192.168.1.0", 24, "2001:db8::", 32);
+	test_assert(test_filter_match(filter, NULL, NULL, "192.168.1.5",
+				      "2001:db8::1", NULL));
+	test_assert(!test_filter_match(filter, NULL, NULL, "192.168.2.5",
+				       "2001:db8::1", NULL));
+	test_assert(!test_filter_match(filter, NULL, NULL, "192.168.1.5",
+				       "2001:db9::1", NULL));
+	test_assert(!test_filter_match(filter, NULL, NULL, "192.168.1.5",
+				       NULL, NULL));
+	test_assert(!test_filter_match(filter, NULL, NULL, NULL,
+				       "2001:db8::1", NULL));
+
+	/* all fields together */
+	filter = test_filter(MASTER_SERVICE_SETTINGS_FILTER_FLAG_NOT_PROTOCOL,
+			     "pop3", "mail.example.com", "10.0.0.0", 8,
+			     "10.1.2.3", 32);
+	test_assert(test_filter_match(filter, "imap", "mail.example.com",
+				      "10.2.3.4", "10.1.2.3", &protocol));
+	test_assert(!test_filter_match(filter, "pop3", "mail.example.com",
+				       "10.2.3.4", "10.1.2.3", &protocol));
+	test_assert(!test_filter_match(filter, "imap", "mail.example.com",
+				       "10.2.3.4", "10.1.2.4", &protocol));
+	test_end();
+}
+
+static void test_master_service_settings_filter_match_truncated(void)
+{
+	struct master_service_settings_input input;
+	ARRAY_TYPE(const_string) protocols;
+	buffer_t *filter;
+	size_t offset;
+	bool match;
+
+	test_begin("master_service_settings_filter_match() truncated");
+	i_zero(&input);
+	input.service = "imap";
+	input.local_name = "mail.example.com";
+	if (net_addr2ip("10.1.2.3", &input.local_ip) < 0 ||
+	    net_addr2ip("2001:db8::1", &input.remote_ip) < 0)
+		i_unreached();
+	t_array_init(&protocols, 1);
+
+	filter = test_filter(0, "imap", "mail.example.com", "10.0.0.0", 8,
+			     "2001:db8::", 32);
+	/* none of the prefixes is a valid filter, even though the mmaped
+	   data continues after it */
+	for (size_t size = 0; size < filter->used; size++) {
+		offset = 0;
+		test_assert_idx(master_service_settings_filter_match(
+			filter->data, &offset, size, &input, &protocols,
+			&match) < 0, size);
+	}
+	offset = 0;
+	test_assert(master_service_settings_filter_match(filter->data,
+			&offset, filter->used, &input, &protocols, &match) == 0);
+	test_assert(offset == filter->used && match);
+
+	/* invalid address family */
+	filter = test_filter(0, "", "", "10.0.0.0", 8, NULL, 0);
+	buffer_write(filter, 4, "\x05", 1);
+	offset = 0;
+	test_assert(master_service_settings_filter_match(filter->data,
+			&offset, filter->used, &input, &protocols, &match) < 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_master_service_settings_filter_match,
+		test_master_service_settings_filter_match_truncated,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -1,6 +1,7 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "net.h"
 #include "istream-private.h"
 #include "ostream-private.h"
 #include "iostream-openssl.h"
@@ -271,6 +272,29 @@ openssl_iostream_set(struct ssl_iostream *ssl_io,
 	return 0;
 }
 
+static bool
+openssl_iostream_can_use_socket_bio(struct istream *input,
+				    struct ostream *output)
+{
+	struct ip_addr local_ip;
+	int fd = i_stream_get_fd(input);
+
+	/* OpenSSL will read and write the fd directly, so the plain streams
+	   must not be filtering the data or have anything buffered. */
+	if (fd == -1 || o_stream_get_fd(output) != fd)
+		return FALSE;
+	if (input->real_stream->parent != NULL ||
+	    output->real_stream->parent != NULL)
+		return FALSE;
+	if (i_stream_get_data_size(input) > 0 ||
+	    o_stream_get_buffer_used_size(output) > 0)
+		return FALSE;
+	/* kTLS is supported only for TCP sockets */
+	if (net_getsockname(fd, &local_ip, NULL) < 0 || local_ip.family == 0)
+		return FALSE;
+	return TRUE;
+}
+
 static int
 openssl_iostream_create(struct ssl_iostream_context *ctx,
 			struct event *event_parent, const char *host,
@@ -281,7 +305,8 @@ openssl_iostream_create(struct ssl_iostream_context *ctx,
 {
 	struct ssl_iostream *ssl_io;
 	SSL *ssl;
-	BIO *bio_int, *bio_ext;
+	BIO *bio_int, *bio_ext = NULL;
+	bool socket_bio = FALSE;
 
 	/* Don't allow an existing io_add_istream() to be use on the input.
 	   It would seem to work, but it would also cause hangs. */
@@ -294,6 +319,25 @@ openssl_iostream_create(struct ssl_iostream_context *ctx,
 		return -1;
 	}
 
+#ifdef SSL_OP_ENABLE_KTLS
+	if (set->ktls && openssl_iostream_can_use_socket_bio(*input, *output)) {
+		/* Let OpenSSL use the socket directly. It enables kTLS after
+		   the handshake if both the kernel and the negotiated cipher
+		   support it, and otherwise keeps encrypting in userspace. */
+		bio_int = BIO_new_socket(i_stream_get_fd(*input), BIO_NOCLOSE);
+		if (bio_int == NULL) {
+			*error_r = t_strdup_printf("BIO_new_socket() failed: %s",
+						   openssl_iostream_error());
+			SSL_free(ssl);
+			return -1;
+		}
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+		/* SSL_write() retries may happen after ssl-ostream's buffer
+		   was grown */
+		SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		socket_bio = TRUE;
+	} else
+#endif
 	/* BIO pairs use default buffer sizes (17 kB in OpenSSL 0.9.8e).
 	   Each of the BIOs have one "write buffer". BIO_write() copies data
 	   to them, while BIO_read() reads from the other BIO's write buffer
@@ -312,6 +356,7 @@ openssl_iostream_create(struct ssl_iostream_context *ctx,
 	ssl_iostream_context_ref(ssl_io->ctx);
 	ssl_io->ssl = ssl;
 	ssl_io->bio_ext = bio_ext;
+	ssl_io->socket_bio = socket_bio;
 	ssl_io->plain_input = *input;
 	ssl_io->plain_output = *output;
 	ssl_io->connected_host = i_strdup(host);
@@ -566,6 +611,12 @@ int openssl_iostream_bio_sync(struct ssl_iostream *ssl_io,
 
 	i_assert(type != OPENSSL_IOSTREAM_SYNC_TYPE_NONE);
 
+	if (ssl_io->socket_bio) {
+		/* OpenSSL has already written everything it could to the
+		   socket, and it reads the socket by itself. */
+		return 1;
+	}
+
 	ret = openssl_iostream_bio_output(ssl_io);
 	if (ret >= 0 && openssl_iostream_bio_input(ssl_io, type) > 0)
 		ret = 1;
@@ -592,6 +643,18 @@ int openssl_iostream_handle_error(struct ssl_iostream *ssl_io, int ret,
 	int err;
 
 	err = SSL_get_error(ssl_io->ssl, ret);
+	if (ssl_io->socket_bio &&
+	    (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)) {
+		/* OpenSSL is waiting for the socket. Retry once it becomes
+		   readable or writable. */
+		ssl_io->want_read = err == SSL_ERROR_WANT_READ;
+		if (err == SSL_ERROR_WANT_WRITE) {
+			if (type != OPENSSL_IOSTREAM_SYNC_TYPE_WRITE)
+				ssl_io->istream_read_waiting_output = TRUE;
+			o_stream_set_flush_pending(ssl_io->plain_output, TRUE);
+		}
+		return 0;
+	}
 	switch (err) {
 	case SSL_ERROR_WANT_WRITE:
 		if (type != OPENSSL_IOSTREAM_SYNC_TYPE_NONE &&
@@ -677,6 +740,40 @@ openssl_iostream_cert_match_name(struct ssl_iostream *ssl_io,
 	return openssl_cert_match_name(ssl_io->ssl, verify_name, reason_r);
 }
 
+static void openssl_iostream_handshake_finished(struct ssl_iostream *ssl_io)
+{
+	struct event_passthrough *e;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if (ssl_io->socket_bio) {
+		ssl_io->ktls_send =
+			BIO_get_ktls_send(SSL_get_wbio(ssl_io->ssl));
+		ssl_io->ktls_recv =
+			BIO_get_ktls_recv(SSL_get_rbio(ssl_io->ssl));
+	}
+#endif
+	e = event_create_passthrough(ssl_io->event)->
+		set_name("ssl_handshake_finished")->
+		add_str("ktls_send", ssl_io->ktls_send ? "yes" : "no")->
+		add_str("ktls_recv", ssl_io->ktls_recv ? "yes" : "no");
+	e_debug(e->event(), "Handshake finished (kTLS send=%s, recv=%s)",
+		ssl_io->ktls_send ? "yes" : "no",
+		ssl_io->ktls_recv ? "yes" : "no");
+}
+
+void openssl_iostream_socket_input(struct ssl_iostream *ssl_io)
+{
+	i_assert(ssl_io->socket_bio);
+
+	/* The socket may have become readable. Let a flush that is
+	   waiting for input try again. */
+	ssl_io->want_read = FALSE;
+	if (ssl_io->ostream_flush_waiting_input) {
+		ssl_io->ostream_flush_waiting_input = FALSE;
+		o_stream_set_flush_pending(ssl_io->plain_output, TRUE);
+	}
+}
+
 static int openssl_iostream_handshake(struct ssl_iostream *ssl_io)
 {
 	const char *reason, *error = NULL;
@@ -728,6 +825,7 @@ static int openssl_iostream_handshake(struct ssl_iostream *ssl_io)
 	}
 	i_free_and_null(ssl_io->last_error);
 	ssl_io->handshaked = TRUE;
+	openssl_iostream_handshake_finished(ssl_io);
 
 	if (ssl_io->ssl_output != NULL)
 		(void)o_stream_flush(ssl_io->ssl_output);
@@ -871,10 +969,11 @@ openssl_iostream_get_security_string(struct ssl_iostream *ssl_io)
 #else
 	comp_str = "";
 #endif
-	return t_strdup_printf("%s with cipher %s (%d/%d bits)%s",
+	return t_strdup_printf("%s with cipher %s (%d/%d bits)%s%s",
 			       SSL_get_version(ssl_io->ssl),
 			       SSL_CIPHER_get_name(cipher),
-			       bits, alg_bits, comp_str);
+			       bits, alg_bits, comp_str,
+			       ssl_io->ktls_send ? " kTLS" : "");
 }
 
 static const char *
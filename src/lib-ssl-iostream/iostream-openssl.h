@@ -33,6 +33,8 @@ struct ssl_iostream {
 	struct ssl_iostream_context *ctx;
 
 	SSL *ssl;
+	/* NULL when OpenSSL reads and writes the socket directly
+	   (socket_bio=TRUE) */
 	BIO *bio_ext;
 
 	struct istream *plain_input;
@@ -66,6 +68,12 @@ struct ssl_iostream {
 	bool cert_broken:1;
 	bool want_read:1;
 	bool ostream_flush_waiting_input:1;
+	bool istream_read_waiting_output:1;
+	/* OpenSSL uses a socket BIO on the plain streams' fd, which allows
+	   it to offload the encryption to kernel (kTLS) */
+	bool socket_bio:1;
+	bool ktls_send:1;
+	bool ktls_recv:1;
 	bool closed:1;
 	bool destroyed:1;
 };
@@ -103,7 +111,7 @@ int openssl_min_protocol_to_options(const char *min_protocol, long *opt_r,
 
 /* Sync plain_input/plain_output streams with BIOs. Returns 1 if at least
    one byte was read/written, 0 if nothing was written, and -1 if an error
-   occurred. */
+   occurred. With socket_bio there is nothing to sync and 1 is returned. */
 int openssl_iostream_bio_sync(struct ssl_iostream *ssl_io,
 			      enum openssl_iostream_sync_type type);
 
@@ -114,6 +122,9 @@ int openssl_iostream_handle_error(struct ssl_iostream *ssl_io, int ret,
 				  enum openssl_iostream_sync_type type,
 				  const char *func_name);
 
+/* Called by ssl-istream before reading with socket_bio. */
+void openssl_iostream_socket_input(struct ssl_iostream *ssl_io);
+
 /* Perform clean shutdown for the connection. */
 void openssl_iostream_shutdown(struct ssl_iostream *ssl_io);
 
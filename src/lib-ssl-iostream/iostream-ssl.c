@@ -325,6 +325,7 @@ void ssl_iostream_settings_drop_stream_only(struct ssl_iostream_settings *set)
 	set->verbose = FALSE;
 	set->verbose_invalid_cert = FALSE;
 	set->allow_invalid_cert = FALSE;
+	set->ktls = FALSE;
 }
 
 const char *ssl_iostream_get_cipher(struct ssl_iostream *ssl_io,
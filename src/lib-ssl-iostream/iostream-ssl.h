@@ -34,6 +34,9 @@ struct ssl_iostream_settings {
 	bool prefer_server_ciphers; /* both */
 	bool compression; /* context-only */
 	bool tickets; /* context-only */
+	/* Let OpenSSL use the connection's socket directly, so it can
+	   enable kernel TLS offload after the handshake if supported. */
+	bool ktls; /* stream-only */
 };
 
 /* Load SSL module */
@@ -41,6 +41,8 @@ static ssize_t i_stream_ssl_read(struct istream_private *stream)
 		return -1;
 	}
 
+	if (ssl_io->socket_bio)
+		openssl_iostream_socket_input(ssl_io);
 	if (!ssl_io->handshaked) {
 		if ((ret = ssl_iostream_handshake(ssl_io)) <= 0) {
 			if (ret < 0) {
@@ -228,6 +228,68 @@ o_stream_ssl_sendv(struct ostream_private *stream,
 	return bytes_sent;
 }
 
+#ifdef SSL_OP_ENABLE_KTLS
+static enum ostream_send_istream_result
+o_stream_ssl_sendfile(struct ssl_ostream *sstream, struct istream *instream,
+		      int in_fd)
+{
+	struct ssl_iostream *ssl_io = sstream->ssl_io;
+	uoff_t in_size, abs_start_offset;
+	ossl_ssize_t ret;
+	int ret2;
+
+	if ((ret2 = i_stream_get_size(instream, TRUE, &in_size)) < 0)
+		return OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT;
+	if (ret2 == 0) {
+		/* size unknown */
+		return io_stream_copy(&sstream->ostream.ostream, instream);
+	}
+
+	abs_start_offset = i_stream_get_absolute_offset(instream) -
+		instream->v_offset;
+	while (instream->v_offset < in_size) {
+		/* the kernel encrypts the file contents while sending */
+		ret = SSL_sendfile(ssl_io->ssl, in_fd,
+				   abs_start_offset + instream->v_offset,
+				   in_size - instream->v_offset, 0);
+		if (ret <= 0) {
+			ret2 = openssl_iostream_handle_error(ssl_io, ret,
+				OPENSSL_IOSTREAM_SYNC_TYPE_WRITE,
+				"SSL_sendfile");
+			if (ret2 == 0)
+				return OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+			if (ret2 > 0)
+				continue;
+			io_stream_set_error(&sstream->ostream.iostream,
+					    "%s", ssl_io->last_error);
+			sstream->ostream.ostream.stream_errno = errno;
+			return OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+		}
+		i_stream_seek(instream, instream->v_offset + ret);
+		sstream->ostream.ostream.offset += ret;
+	}
+	instream->eof = TRUE;
+	return OSTREAM_SEND_ISTREAM_RESULT_FINISHED;
+}
+#endif
+
+static enum ostream_send_istream_result
+o_stream_ssl_send_istream(struct ostream_private *outstream,
+			  struct istream *instream)
+{
+	struct ssl_ostream *sstream = (struct ssl_ostream *)outstream;
+#ifdef SSL_OP_ENABLE_KTLS
+	int in_fd = !instream->readable_fd ? -1 : i_stream_get_fd(instream);
+
+	/* With kTLS the file can be sent without copying it through
+	   userspace, as long as nothing is buffered before it. */
+	if (sstream->ssl_io->ktls_send && in_fd != -1 && instream->seekable &&
+	    (sstream->buffer == NULL || sstream->buffer->used == 0))
+		return o_stream_ssl_sendfile(sstream, instream, in_fd);
+#endif
+	return io_stream_copy(&sstream->ostream.ostream, instream);
+}
+
 static void o_stream_ssl_switch_ioloop_to(struct ostream_private *stream,
 					  struct ioloop *ioloop)
 {
@@ -245,6 +307,15 @@ static int plain_flush_callback(struct ssl_ostream *sstream)
 	if ((ret = o_stream_flush(sstream->ssl_io->plain_output)) < 0)
 		return -1;
 
+	if (sstream->ssl_io->istream_read_waiting_output) {
+		/* SSL_read() needed to write to the socket */
+		sstream->ssl_io->istream_read_waiting_output = FALSE;
+		if (sstream->ssl_io->ssl_input != NULL) {
+			i_stream_set_input_pending(sstream->ssl_io->ssl_input,
+						   TRUE);
+		}
+	}
+
 	/* we may be able to copy more data, try it */
 	o_stream_ref(ostream);
 	if (sstream->ostream.callback != NULL)
@@ -319,6 +390,7 @@ struct ostream *openssl_o_stream_create_ssl(struct ssl_iostream *ssl_io)
 	sstream->ostream.iostream.destroy = o_stream_ssl_destroy;
 	sstream->ostream.sendv = o_stream_ssl_sendv;
 	sstream->ostream.flush = o_stream_ssl_flush;
+	sstream->ostream.send_istream = o_stream_ssl_send_istream;
 	sstream->ostream.switch_ioloop_to = o_stream_ssl_switch_ioloop_to;
 
 	sstream->ostream.get_buffer_used_size =
@@ -2,6 +2,7 @@
 
 #include "test-lib.h"
 #include "buffer.h"
+#include "net.h"
 #include "randgen.h"
 #include "istream.h"
 #include "ostream.h"
@@ -473,7 +474,24 @@ static void test_iostream_ssl_get_buffer_avail_size(void)
 	test_end();
 }
 
-static void test_iostream_ssl_small_packets(void)
+static void test_tcp_socketpair(int fd[2])
+{
+	struct ip_addr ip;
+	in_port_t port = 0;
+	int listen_fd;
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+	if ((listen_fd = net_listen(&ip, &port, 1)) < 0)
+		i_fatal("net_listen() failed: %m");
+	if ((fd[1] = net_connect_ip_blocking(&ip, port, NULL)) < 0)
+		i_fatal("net_connect_ip() failed: %m");
+	if ((fd[0] = net_accept(listen_fd, NULL, NULL)) < 0)
+		i_fatal("net_accept() failed: %m");
+	i_close_fd(&listen_fd);
+}
+
+static void test_iostream_ssl_small_packets_real(bool ktls)
 {
 	struct ssl_iostream_settings set;
 	struct test_endpoint *server, *client;
@@ -481,19 +499,26 @@ static void test_iostream_ssl_small_packets(void)
 	int fd[2];
 	const char *error;
 
-	test_begin("ssl: small packets");
-
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
-		i_fatal("socketpair() failed: %m");
+	if (!ktls) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+			i_fatal("socketpair() failed: %m");
+	} else {
+		/* kTLS needs a TCP socket. Whether the kernel actually
+		   offloads anything doesn't matter here - this tests the
+		   socket BIO that replaces the BIO pair. */
+		test_tcp_socketpair(fd);
+	}
 	fd_set_nonblock(fd[0], TRUE);
 	fd_set_nonblock(fd[1], TRUE);
 
 	ioloop = io_loop_create();
 
 	ssl_iostream_test_settings_server(&set);
+	set.ktls = ktls;
 	server = create_test_endpoint(fd[0], &set);
 	ssl_iostream_test_settings_client(&set);
 	set.allow_invalid_cert = TRUE;
+	set.ktls = ktls;
 	client = create_test_endpoint(fd[1], &set);
 	client->client = TRUE;
 
@@ -544,7 +569,19 @@ static void test_iostream_ssl_small_packets(void)
 	destroy_test_endpoint(&client);
 
 	io_loop_destroy(&ioloop);
+}
+
+static void test_iostream_ssl_small_packets(void)
+{
+	test_begin("ssl: small packets");
+	test_iostream_ssl_small_packets_real(FALSE);
+	test_end();
+}
 
+static void test_iostream_ssl_ktls_small_packets(void)
+{
+	test_begin("ssl: ktls small packets");
+	test_iostream_ssl_small_packets_real(TRUE);
 	test_end();
 }
 
@@ -554,6 +591,7 @@ int main(void)
 		test_iostream_ssl_handshake,
 		test_iostream_ssl_get_buffer_avail_size,
 		test_iostream_ssl_small_packets,
+		test_iostream_ssl_ktls_small_packets,
 		NULL
 	};
 	ssl_iostream_openssl_init();
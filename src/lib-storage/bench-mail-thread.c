@@ -0,0 +1,169 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "master-service.h"
+#include "mail-namespace.h"
+#include "mail-thread.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+
+/**
+ * Saves a number of messages with Message-ID and References headers into an
+ * sdbox INBOX and times THREAD=REFERENCES on it the way a new IMAP process
+ * would do it: the mailbox is opened again for each round, so nothing is
+ * cached in memory. Each round is run both with the saved thread tree file
+ * removed (full rebuild) and with it left in place. Finally a few messages
+ * are appended before each round to show the incremental update cost.
+ */
+
+#define BENCH_DEFAULT_MESSAGES 20000
+#define BENCH_ROUNDS 5
+#define BENCH_APPEND_COUNT 10
+
+static unsigned int bench_next_msg = 1;
+
+static void bench_append(struct mail_user *user, unsigned int count)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box = mailbox_alloc(ns->list, "INBOX", 0);
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	string_t *str = t_str_new(256);
+	unsigned int i, msg, pos;
+	int ret;
+
+	if (mailbox_open(box) < 0)
+		i_fatal("mailbox_open() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+					  __func__);
+	for (i = 0; i < count; i++) {
+		msg = bench_next_msg++;
+		str_truncate(str, 0);
+		str_printfa(str, "Message-ID: <%u@bench>\n", msg);
+		if ((pos = (msg - 1) % 10) != 0) {
+			/* reply to one of the earlier messages in the thread */
+			str_printfa(str, "References: <%u@bench> <%u@bench>\n",
+				    msg - pos, msg - pos + (msg * 31) % pos);
+		}
+		str_printfa(str, "Subject: thread %u\n\nbody\n", msg / 10);
+
+		input = i_stream_create_from_data(str_data(str), str_len(str));
+		save_ctx = mailbox_save_alloc(trans);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("mailbox_save_begin() failed");
+		do {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("mailbox_save_continue() failed");
+		} while ((ret = i_stream_read(input)) > 0);
+		i_assert(ret == -1);
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("mailbox_save_finish() failed: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&trans) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	mailbox_free(&box);
+}
+
+static uint64_t bench_thread(struct mail_user *user, bool keep_tree)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box = mailbox_alloc(ns->list, "INBOX", 0);
+	struct mail_thread_context *ctx;
+	struct mail_thread_iterate_context *iter, *child_iter;
+	const struct mail_thread_child_node *node;
+	const char *index_dir;
+	uint64_t ts_0, ts_1;
+
+	if (mailbox_open(box) < 0 || mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_open() failed");
+	if (!keep_tree) {
+		if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&index_dir) <= 0)
+			i_unreached();
+		i_unlink_if_exists(t_strdup_printf("%s/%s.thread.tree",
+						   index_dir, box->index_prefix));
+	}
+
+	ts_0 = i_nanoseconds();
+	if (mail_thread_init(box, NULL, &ctx) < 0)
+		i_fatal("mail_thread_init() failed");
+	iter = mail_thread_iterate_init(ctx, MAIL_THREAD_REFERENCES, FALSE);
+	while ((node = mail_thread_iterate_next(iter, &child_iter)) != NULL) {
+		if (child_iter != NULL)
+			(void)mail_thread_iterate_deinit(&child_iter);
+	}
+	(void)mail_thread_iterate_deinit(&iter);
+	mail_thread_deinit(&ctx);
+	ts_1 = i_nanoseconds();
+
+	/* the tree is written when the mailbox is closed */
+	mailbox_free(&box);
+	return ts_1 - ts_0;
+}
+
+static void bench_print(const char *name, uint64_t nsecs)
+{
+	printf("%-28s %8.03lf ms\n", name, (double)nsecs / 1e6 / BENCH_ROUNDS);
+}
+
+int main(int argc, char **argv)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	unsigned int i, msg_count = BENCH_DEFAULT_MESSAGES;
+	uint64_t rebuild = 0, saved = 0, appended = 0;
+
+	master_service = master_service_init("bench-mail-thread",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (argc > 2 || (argc == 2 &&
+			 (str_to_uint(argv[1], &msg_count) < 0 ||
+			  msg_count == 0))) {
+		fprintf(stderr, "Usage: %s [<message count>]\n", argv[0]);
+		return 1;
+	}
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+
+	T_BEGIN {
+		bench_append(ctx->user, msg_count);
+		(void)bench_thread(ctx->user, FALSE);
+		for (i = 0; i < BENCH_ROUNDS; i++) {
+			rebuild += bench_thread(ctx->user, FALSE);
+			saved += bench_thread(ctx->user, TRUE);
+		}
+		for (i = 0; i < BENCH_ROUNDS; i++) {
+			bench_append(ctx->user, BENCH_APPEND_COUNT);
+			appended += bench_thread(ctx->user, TRUE);
+		}
+	} T_END;
+
+	printf("%u messages, average of %u rounds:\n",
+	       msg_count, BENCH_ROUNDS);
+	bench_print("full rebuild", rebuild);
+	bench_print("saved tree", saved);
+	bench_print(t_strdup_printf("saved tree + %u new",
+				    BENCH_APPEND_COUNT), appended);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -0,0 +1,220 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "write-full.h"
+#include "master-service.h"
+#include "mail-namespace.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+
+/**
+ * Creates a synthetic maildir INBOX with the given number of files in cur/
+ * and times syncing it: the initial sync that assigns UIDs to all the files,
+ * rescanning cur/ after its mtime changed while the mailbox stays open, and
+ * rescanning it in a newly opened mailbox, which also has to read
+ * dovecot-uidlist, and selecting the unchanged mailbox and opening its last
+ * mail. The select doesn't scan the directories, but opening the mail
+ * rescans cur/ unless maildir_very_dirty_syncs is enabled with -d.
+ * With -b dovecot-uidlist is written in the binary format.
+ */
+
+#define BENCH_DEFAULT_MESSAGES 100000
+#define BENCH_ROUNDS 5
+
+static const char bench_mail[] =
+	"From: user@example.com\n"
+	"Subject: bench\n"
+	"\n"
+	"body\n";
+
+static void bench_create_files(const char *dir, unsigned int count)
+{
+	string_t *path = t_str_new(256);
+	size_t dir_len;
+	int fd;
+
+	str_printfa(path, "%s/cur/", dir);
+	dir_len = str_len(path);
+	for (unsigned int i = 0; i < count; i++) {
+		str_truncate(path, dir_len);
+		/* make the sizes and flags vary like in a real maildir */
+		str_printfa(path, "%u.M%uP%u.bench,S=%zu,W=%zu:2,%s",
+			    1700000000 + i / 100, i % 1000000, 10000 + i % 7,
+			    sizeof(bench_mail) - 1 + i % 5000,
+			    sizeof(bench_mail) + 2 + i % 5000,
+			    i % 3 == 0 ? "S" : (i % 3 == 1 ? "FS" : ""));
+		fd = creat(str_c(path), 0600);
+		if (fd == -1)
+			i_fatal("creat(%s) failed: %m", str_c(path));
+		if (write_full(fd, bench_mail, sizeof(bench_mail) - 1) < 0)
+			i_fatal("write(%s) failed: %m", str_c(path));
+		i_close_fd(&fd);
+	}
+}
+
+static void bench_touch_cur(const char *dir, unsigned int round)
+{
+	const char *path = t_strconcat(dir, "/cur", NULL);
+	struct utimbuf ut;
+
+	/* a different mtime each round forces a full rescan */
+	ut.actime = ut.modtime = time(NULL) - 3600 - round;
+	if (utime(path, &ut) < 0)
+		i_fatal("utime(%s) failed: %m", path);
+}
+
+static uint64_t bench_sync(struct mailbox *box, unsigned int count)
+{
+	struct mailbox_status status;
+	uint64_t ts_0, ts_1;
+
+	ts_0 = i_nanoseconds();
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	ts_1 = i_nanoseconds();
+
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	if (status.messages != count)
+		i_fatal("Mailbox has %u messages, expected %u",
+			status.messages, count);
+	return ts_1 - ts_0;
+}
+
+static uint64_t bench_select(struct mail_namespace *ns, unsigned int count)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	uint64_t ts_0, ts_1;
+
+	ts_0 = i_nanoseconds();
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, count);
+	if (mail_get_stream(mail, NULL, NULL, &input) < 0)
+		i_fatal("mail_get_stream() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	ts_1 = i_nanoseconds();
+
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&trans);
+	mailbox_free(&box);
+	return ts_1 - ts_0;
+}
+
+static void bench_print(const char *name, uint64_t nsecs, unsigned int rounds)
+{
+	printf("%-28s %8.03lf ms\n", name, (double)nsecs / 1e6 / rounds);
+}
+
+int main(int argc, char **argv)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+	};
+	const char *extra_input[3];
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	const char *dir;
+	unsigned int i, extra_count = 0, msg_count = BENCH_DEFAULT_MESSAGES;
+	uint64_t initial, open_rescan = 0, new_rescan = 0, select = 0;
+	bool binary = FALSE, very_dirty = FALSE;
+	int c;
+
+	master_service = master_service_init("bench-maildir-sync",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "bd");
+	while ((c = master_getopt(master_service)) > 0) {
+		switch (c) {
+		case 'b':
+			binary = TRUE;
+			break;
+		case 'd':
+			very_dirty = TRUE;
+			break;
+		default:
+			return FATAL_DEFAULT;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || (argc == 1 &&
+			 (str_to_uint(argv[0], &msg_count) < 0 ||
+			  msg_count == 0))) {
+		fprintf(stderr, "Usage: bench-maildir-sync [-b] [-d] "
+			"[<message count>]\n");
+		return 1;
+	}
+	if (binary)
+		extra_input[extra_count++] = "maildir_uidlist_binary=yes";
+	if (very_dirty)
+		extra_input[extra_count++] = "maildir_very_dirty_syncs=yes";
+	extra_input[extra_count] = NULL;
+	if (extra_count > 0)
+		set.extra_input = extra_input;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+
+	T_BEGIN {
+		box = mailbox_alloc(ns->list, "INBOX", 0);
+		if (mailbox_open(box) < 0)
+			i_fatal("mailbox_open() failed: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+					&dir) <= 0)
+			i_unreached();
+		dir = t_strdup(dir);
+		bench_create_files(dir, msg_count);
+		initial = bench_sync(box, msg_count);
+
+		for (i = 0; i < BENCH_ROUNDS; i++) {
+			bench_touch_cur(dir, i);
+			open_rescan += bench_sync(box, msg_count);
+		}
+		mailbox_free(&box);
+
+		for (i = 0; i < BENCH_ROUNDS; i++) {
+			bench_touch_cur(dir, BENCH_ROUNDS + i);
+			box = mailbox_alloc(ns->list, "INBOX", 0);
+			new_rescan += bench_sync(box, msg_count);
+			mailbox_free(&box);
+		}
+
+		for (i = 0; i < BENCH_ROUNDS; i++)
+			select += bench_select(ns, msg_count);
+	} T_END;
+
+	printf("%u messages, %s dovecot-uidlist%s:\n", msg_count,
+	       binary ? "binary" : "text",
+	       very_dirty ? ", maildir_very_dirty_syncs" : "");
+	bench_print("initial sync", initial, 1);
+	bench_print("rescan, mailbox open", open_rescan, BENCH_ROUNDS);
+	bench_print("rescan, new mailbox", new_rescan, BENCH_ROUNDS);
+	bench_print("select, open last mail", select, BENCH_ROUNDS);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -0,0 +1,197 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "write-full.h"
+#include "master-service.h"
+#include "mail-namespace.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/**
+ * Creates a synthetic mbox INBOX of the given size in megabytes and times
+ * syncing it: the initial sync that reads the whole file, syncing after a
+ * new mail was appended to the file, and syncing after another process
+ * expunged a mail near the end of the file. The last two only need to read
+ * the end of the file. Use e.g. 2048 for a 2 GB mbox.
+ */
+
+#define BENCH_DEFAULT_SIZE_MB 256
+#define BENCH_BODY_SIZE 4000
+#define BENCH_ROUNDS 5
+
+static const char *bench_mail(unsigned int i)
+{
+	string_t *str = t_str_new(BENCH_BODY_SIZE + 256);
+
+	/* all the mails have the same size, so the mail's offset is
+	   known without parsing the file */
+	str_printfa(str, "From user%07u@example.com Mon Jan  1 00:00:00 2024\n"
+		    "Message-ID: <%07u@example.com>\n"
+		    "Subject: bench\n\n", i % 10000000, i % 10000000);
+	for (unsigned int n = 0; n < BENCH_BODY_SIZE / 80; n++)
+		str_printfa(str, "%079u\n", n);
+	str_append_c(str, '\n');
+	return str_c(str);
+}
+
+static void bench_create_file(const char *path, unsigned int count)
+{
+	string_t *buf = str_new(default_pool, 1024 * 1024 + 8192);
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	for (unsigned int i = 0; i < count; i++) T_BEGIN {
+		str_append(buf, bench_mail(i));
+		if (str_len(buf) >= 1024 * 1024 || i + 1 == count) {
+			if (write_full(fd, str_data(buf), str_len(buf)) < 0)
+				i_fatal("write(%s) failed: %m", path);
+			str_truncate(buf, 0);
+		}
+	} T_END;
+	i_close_fd(&fd);
+	str_free(&buf);
+}
+
+static void bench_append(const char *path, unsigned int i)
+{
+	const char *mail = bench_mail(i);
+	int fd;
+
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, mail, strlen(mail)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void bench_remove(const char *path, uoff_t offset, size_t mail_size)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	struct stat st;
+	ssize_t ret;
+	int fd;
+
+	/* move the rest of the file over the mail like another MUA would */
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	for (uoff_t pos = offset + mail_size; pos < (uoff_t)st.st_size;
+	     pos += ret) {
+		ret = pread(fd, buf, sizeof(buf), pos);
+		if (ret <= 0)
+			i_fatal("pread(%s) failed: %m", path);
+		if (pwrite_full(fd, buf, ret, pos - mail_size) < 0)
+			i_fatal("pwrite(%s) failed: %m", path);
+	}
+	if (ftruncate(fd, st.st_size - mail_size) < 0)
+		i_fatal("ftruncate(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static uint64_t bench_sync(struct mailbox *box, unsigned int count)
+{
+	struct mailbox_status status;
+	uint64_t ts_0, ts_1;
+
+	ts_0 = i_nanoseconds();
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	ts_1 = i_nanoseconds();
+
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	if (status.messages != count)
+		i_fatal("Mailbox has %u messages, expected %u",
+			status.messages, count);
+	return ts_1 - ts_0;
+}
+
+static void bench_print(const char *name, uint64_t nsecs, unsigned int rounds)
+{
+	printf("%-28s %10.03lf ms\n", name, (double)nsecs / 1e6 / rounds);
+}
+
+int main(int argc, char **argv)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "mbox",
+	};
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	const char *path;
+	unsigned int i, size_mb = BENCH_DEFAULT_SIZE_MB, msg_count;
+	uint64_t initial, append = 0, expunge = 0;
+	size_t mail_size;
+
+	master_service = master_service_init("bench-mbox-sync",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (master_getopt(master_service) > 0)
+		return FATAL_DEFAULT;
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || (argc == 1 &&
+			 (str_to_uint(argv[0], &size_mb) < 0 ||
+			  size_mb == 0))) {
+		fprintf(stderr, "Usage: bench-mbox-sync [<size in MB>]\n");
+		return 1;
+	}
+	T_BEGIN {
+		mail_size = strlen(bench_mail(0));
+	} T_END;
+	msg_count = (uoff_t)size_mb * 1024 * 1024 / mail_size;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+
+	T_BEGIN {
+		box = mailbox_alloc(ns->list, "INBOX", 0);
+		if (mailbox_open(box) < 0)
+			i_fatal("mailbox_open() failed: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		path = t_strdup(mailbox_get_path(box));
+		bench_create_file(path, msg_count);
+		initial = bench_sync(box, msg_count);
+
+		for (i = 0; i < BENCH_ROUNDS; i++) {
+			bench_append(path, msg_count);
+			append += bench_sync(box, ++msg_count);
+		}
+		for (i = 0; i < BENCH_ROUNDS; i++) {
+			/* the file isn't rewritten while it's open, so the
+			   offsets are still the original ones */
+			bench_remove(path, (uoff_t)(msg_count / 10 * 9) *
+				     mail_size, mail_size);
+			expunge += bench_sync(box, --msg_count);
+		}
+		mailbox_free(&box);
+	} T_END;
+
+	printf("%u messages, %u MB mbox:\n", msg_count, size_mb);
+	bench_print("initial sync", initial, 1);
+	bench_print("sync after append", append, BENCH_ROUNDS);
+	bench_print("sync after expunge at 90%", expunge, BENCH_ROUNDS);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -160,9 +160,11 @@ static int mdbox_deleted_sync(struct mdbox_mailbox *mbox,
 	struct mail_index_transaction *trans;
 	struct mdbox_mail_index_record rec;
 	struct mdbox_map_mail_index_record map_rec;
+	struct mdbox_map *map;
 	enum mail_index_sync_flags sync_flags;
 	uint16_t refcount;
 	uint32_t map_seq, map_count, seq, uid = 0;
+	unsigned int shard;
 	int ret = 0;
 
 	if (mbox->mdbox_deleted_synced) {
@@ -193,19 +195,28 @@ static int mdbox_deleted_sync(struct mdbox_mailbox *mbox,
 		return -1;
 	}
 
-	map_count = mdbox_map_get_messages_count(mbox->storage->map);
-	for (map_seq = 1; map_seq <= map_count; map_seq++) {
-		if (mdbox_map_lookup_seq_full(mbox->storage->map, map_seq,
-					      &map_rec, &refcount) < 0) {
-			ret = -1;
-			break;
+	for (shard = 0; shard < mdbox_map_get_shard_count(mbox->storage->map) &&
+		     ret == 0; shard++) {
+		map = mdbox_map_get_shard(mbox->storage->map, shard);
+		if ((ret = mdbox_map_open(map)) <= 0) {
+			/* shard doesn't exist yet / internal error */
+			continue;
 		}
-		if (refcount == 0) {
-			rec.map_uid = mdbox_map_lookup_uid(mbox->storage->map,
-							   map_seq);
-			mail_index_append(trans, ++uid, &seq);
-			mail_index_update_ext(trans, seq,
-					      mbox->ext_id, &rec, NULL);
+		ret = 0;
+
+		map_count = mdbox_map_get_messages_count(map);
+		for (map_seq = 1; map_seq <= map_count; map_seq++) {
+			if (mdbox_map_lookup_seq_full(map, map_seq,
+						      &map_rec, &refcount) < 0) {
+				ret = -1;
+				break;
+			}
+			if (refcount == 0) {
+				rec.map_uid = mdbox_map_lookup_uid(map, map_seq);
+				mail_index_append(trans, ++uid, &seq);
+				mail_index_update_ext(trans, seq,
+						      mbox->ext_id, &rec, NULL);
+			}
 		}
 	}
 
@@ -22,6 +22,11 @@ struct mdbox_map {
 
 	struct mailbox_list *root_list;
 
+	/* The first shard owns all the shards, including itself. */
+	struct mdbox_map *primary;
+	struct mdbox_map *shards[MDBOX_MAP_MAX_SHARDS];
+	unsigned int shard, shard_count;
+
 	bool verify_existing_file_ids:1;
 };
 
@@ -46,18 +51,39 @@ struct mdbox_map_append_context {
 	bool failed:1;
 };
 
-struct mdbox_map_atomic_context {
-	struct mdbox_map *map;
+struct mdbox_map_atomic_shard {
 	struct mail_index_transaction *sync_trans;
 	struct mail_index_sync_ctx *sync_ctx;
 	struct mail_index_view *sync_view;
 
 	bool map_refreshed:1;
 	bool locked:1;
+	/* changes have been written while locked, so the lock can't be
+	   released before finishing the atomic */
+	bool changed:1;
+};
+
+struct mdbox_map_atomic_context {
+	struct mdbox_map *map;
+	struct mdbox_map_atomic_shard shards[MDBOX_MAP_MAX_SHARDS];
+
 	bool success:1;
 	bool failed:1;
 };
 
+/* Returns the shard where the file's messages are added by rebuild. */
+unsigned int mdbox_map_get_file_shard(struct mdbox_map *map, uint32_t file_id);
+/* Returns the first map UID and file ID that can be used in the shard. */
+uint32_t mdbox_map_get_shard_first_id(struct mdbox_map *map);
+/* Returns TRUE if the first shard has map UIDs or file IDs above its range.
+   This happens if the map was used without sharding for a long time, or
+   with a lowered shard count, before mdbox_map_shards was increased.
+   Rebuilding the storage renumbers them. */
+bool mdbox_map_has_unsharded_ids(struct mdbox_map *map,
+				 struct mail_index_view *view);
+/* Remove the index files of the shards above the configured shard count. */
+void mdbox_map_remove_unused_shards(struct mdbox_map *map);
+
 int mdbox_map_view_lookup_rec(struct mdbox_map *map,
 			      struct mail_index_view *view, uint32_t seq,
 			      struct dbox_mail_lookup_rec *rec_r);
@@ -6,6 +6,8 @@
 #include "ostream.h"
 #include "mkdir-parents.h"
 #include "unlink-old-files.h"
+#include "mail-cache.h"
+#include "mail-transaction-log.h"
 #include "mailbox-list-private.h"
 #include "mdbox-storage.h"
 #include "mdbox-file.h"
@@ -19,13 +21,16 @@
 
 struct mdbox_map_transaction_context {
 	struct mdbox_map_atomic_context *atomic;
-	struct mail_index_transaction *trans;
+	/* transactions are begun lazily for each changed shard */
+	struct mail_index_transaction *trans[MDBOX_MAP_MAX_SHARDS];
+	enum mail_index_transaction_flags flags;
+	uint32_t changed_shards;
 
-	bool changed:1;
 	bool committed:1;
 };
 
 static int mdbox_map_generate_uid_validity(struct mdbox_map *map);
+static int mdbox_map_refresh_shard(struct mdbox_map *map);
 
 void mdbox_map_set_corrupted(struct mdbox_map *map, const char *format, ...)
 {
@@ -41,8 +46,16 @@ void mdbox_map_set_corrupted(struct mdbox_map *map, const char *format, ...)
 	mdbox_storage_set_corrupted(map->storage);
 }
 
-struct mdbox_map *
-mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
+static const char *mdbox_map_get_index_prefix(unsigned int shard)
+{
+	if (shard == 0)
+		return MDBOX_GLOBAL_INDEX_PREFIX;
+	return t_strdup_printf(MDBOX_GLOBAL_SHARD_INDEX_PREFIX_FORMAT, shard);
+}
+
+static struct mdbox_map *
+mdbox_map_init_shard(struct mdbox_storage *storage,
+		     struct mailbox_list *root_list, unsigned int shard)
 {
 	struct mdbox_map *map;
 	const char *root, *index_root;
@@ -53,12 +66,13 @@ mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
 	map = i_new(struct mdbox_map, 1);
 	map->storage = storage;
 	map->set = storage->set;
+	map->shard = shard;
 	map->path = i_strconcat(root, "/"MDBOX_GLOBAL_DIR_NAME, NULL);
 	map->index_path =
 		i_strconcat(index_root, "/"MDBOX_GLOBAL_DIR_NAME, NULL);
 	map->index = mail_index_alloc(storage->storage.storage.event,
 				      map->index_path,
-				      MDBOX_GLOBAL_INDEX_PREFIX);
+				      mdbox_map_get_index_prefix(shard));
 	mail_index_set_fsync_mode(map->index,
 		MAP_STORAGE(map)->set->parsed_fsync_mode, 0);
 	mail_index_set_lock_method(map->index,
@@ -80,7 +94,26 @@ mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
 	return map;
 }
 
-void mdbox_map_deinit(struct mdbox_map **_map)
+struct mdbox_map *
+mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
+{
+	struct mdbox_map *map;
+	unsigned int i;
+
+	map = mdbox_map_init_shard(storage, root_list, 0);
+	map->shard_count = I_MIN(I_MAX(storage->set->mdbox_map_shards, 1),
+				 MDBOX_MAP_MAX_SHARDS);
+	map->primary = map;
+	map->shards[0] = map;
+	for (i = 1; i < map->shard_count; i++) {
+		map->shards[i] = mdbox_map_init_shard(storage, root_list, i);
+		map->shards[i]->primary = map;
+		map->shards[i]->shard_count = map->shard_count;
+	}
+	return map;
+}
+
+static void mdbox_map_deinit_shard(struct mdbox_map **_map)
 {
 	struct mdbox_map *map = *_map;
 
@@ -97,6 +130,110 @@ void mdbox_map_deinit(struct mdbox_map **_map)
 	i_free(map);
 }
 
+void mdbox_map_deinit(struct mdbox_map **_map)
+{
+	struct mdbox_map *map = *_map;
+	unsigned int i;
+
+	i_assert(map->primary == map);
+
+	for (i = 1; i < map->shard_count; i++)
+		mdbox_map_deinit_shard(&map->shards[i]);
+	mdbox_map_deinit_shard(_map);
+}
+
+struct mdbox_map *mdbox_map_init_forked_child(struct mdbox_map *map)
+{
+	return mdbox_map_init(map->storage, map->root_list);
+}
+
+unsigned int mdbox_map_get_shard_count(struct mdbox_map *map)
+{
+	return map->primary->shard_count;
+}
+
+struct mdbox_map *mdbox_map_get_shard(struct mdbox_map *map, unsigned int shard)
+{
+	i_assert(shard < map->primary->shard_count);
+	return map->primary->shards[shard];
+}
+
+unsigned int mdbox_map_get_uid_shard(struct mdbox_map *map, uint32_t map_uid)
+{
+	/* without sharding the UIDs may use all the bits */
+	if (map->primary->shard_count == 1)
+		return 0;
+	return map_uid >> MDBOX_MAP_SHARD_SHIFT;
+}
+
+unsigned int mdbox_map_get_mailbox_shard(struct mdbox_map *map,
+					 const char *mailbox_name)
+{
+	return str_hash(mailbox_name) % map->primary->shard_count;
+}
+
+unsigned int mdbox_map_get_file_shard(struct mdbox_map *map, uint32_t file_id)
+{
+	unsigned int shard = mdbox_map_get_uid_shard(map, file_id);
+
+	/* files of removed shards are moved to the first shard */
+	return shard < map->primary->shard_count ? shard : 0;
+}
+
+uint32_t mdbox_map_get_shard_first_id(struct mdbox_map *map)
+{
+	return (map->shard << MDBOX_MAP_SHARD_SHIFT) + 1;
+}
+
+static bool
+mdbox_map_shard_has_ids(struct mdbox_map *map, uint32_t first_id,
+			unsigned int count)
+{
+	uint64_t last_id = (uint64_t)first_id + count - 1;
+
+	if (map->primary->shard_count == 1)
+		return last_id < (uint32_t)-1;
+	/* the last ID of each shard is left unused, so the last shard won't
+	   reach (uint32_t)-1 */
+	return last_id < (((uint64_t)map->shard + 1) << MDBOX_MAP_SHARD_SHIFT) - 1;
+}
+
+static struct mdbox_map *
+mdbox_map_lookup_uid_shard(struct mdbox_map *map, uint32_t map_uid)
+{
+	unsigned int shard = mdbox_map_get_uid_shard(map, map_uid);
+
+	if (shard >= map->primary->shard_count) {
+		/* the number of shards has been lowered. rebuild moves the
+		   messages to the remaining shards. */
+		mdbox_map_set_corrupted(map->primary,
+			"map_uid=%u points to nonexistent shard %u",
+			map_uid, shard);
+		return NULL;
+	}
+	return map->primary->shards[shard];
+}
+
+void mdbox_map_remove_unused_shards(struct mdbox_map *map)
+{
+	static const char *const suffixes[] = {
+		"", MAIL_TRANSACTION_LOG_SUFFIX, MAIL_TRANSACTION_LOG_SUFFIX".2",
+		MAIL_CACHE_FILE_SUFFIX
+	};
+	const char *path;
+	unsigned int shard, i;
+
+	for (shard = map->primary->shard_count;
+	     shard < MDBOX_MAP_MAX_SHARDS; shard++) T_BEGIN {
+		path = t_strconcat(map->index_path, "/",
+				   mdbox_map_get_index_prefix(shard), NULL);
+		for (i = 0; i < N_ELEMENTS(suffixes); i++) {
+			i_unlink_if_exists(t_strconcat(path, suffixes[i],
+						       NULL));
+		}
+	} T_END;
+}
+
 static int mdbox_map_mkdir_storage(struct mdbox_map *map)
 {
 	if (mailbox_list_mkdir_root(map->root_list, map->path,
@@ -192,11 +329,17 @@ static int mdbox_map_open_internal(struct mdbox_map *map, bool create_missing)
 			mail_index_close(map->index);
 			return -1;
 		}
-		if (mdbox_map_refresh(map) < 0) {
+		if (mdbox_map_refresh_shard(map) < 0) {
 			mail_index_close(map->index);
 			return -1;
 		}
 	}
+	if (map->shard == 0 && !map->storage->rebuilding_storage &&
+	    mdbox_map_has_unsharded_ids(map, map->view)) {
+		/* the IDs would be looked up from the wrong shards */
+		mdbox_map_set_corrupted(map, "map UIDs or file IDs exceed "
+			"the first shard's range - rebuilding to renumber them");
+	}
 	return 1;
 }
 
@@ -210,7 +353,7 @@ int mdbox_map_open_or_create(struct mdbox_map *map)
 	return mdbox_map_open_internal(map, TRUE) <= 0 ? -1 : 0;
 }
 
-int mdbox_map_refresh(struct mdbox_map *map)
+static int mdbox_map_refresh_shard(struct mdbox_map *map)
 {
 	struct mail_index_view_sync_ctx *ctx;
 	bool delayed_expunges, fscked;
@@ -242,17 +385,40 @@ int mdbox_map_refresh(struct mdbox_map *map)
 	return ret;
 }
 
+int mdbox_map_refresh(struct mdbox_map *map)
+{
+	unsigned int i;
+
+	if (mdbox_map_refresh_shard(map) < 0)
+		return -1;
+	if (map->primary != map)
+		return 0;
+
+	for (i = 1; i < map->shard_count; i++) {
+		if (map->shards[i]->view != NULL &&
+		    mdbox_map_refresh_shard(map->shards[i]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
 bool mdbox_map_is_fscked(struct mdbox_map *map)
 {
 	const struct mail_index_header *hdr;
+	unsigned int i;
 
-	if (map->view == NULL) {
-		/* map isn't opened yet. don't bother. */
-		return FALSE;
-	}
+	for (i = 0; i < map->primary->shard_count; i++) {
+		map = map->primary->shards[i];
+		if (map->view == NULL) {
+			/* map isn't opened yet. don't bother. */
+			continue;
+		}
 
-	hdr = mail_index_get_header(map->view);
-	return (hdr->flags & MAIL_INDEX_HDR_FLAG_FSCKD) != 0;
+		hdr = mail_index_get_header(map->view);
+		if ((hdr->flags & MAIL_INDEX_HDR_FLAG_FSCKD) != 0)
+			return TRUE;
+	}
+	return FALSE;
 }
 
 static void
@@ -268,10 +434,26 @@ mdbox_map_get_ext_hdr(struct mdbox_map *map, struct mail_index_view *view,
 		memcpy(hdr_r, data, I_MIN(data_size, sizeof(*hdr_r)));
 }
 
+bool mdbox_map_has_unsharded_ids(struct mdbox_map *map,
+				 struct mail_index_view *view)
+{
+	struct mdbox_map_mail_index_header hdr;
+
+	i_assert(map->shard == 0);
+
+	if (map->primary->shard_count == 1)
+		return FALSE;
+	mdbox_map_get_ext_hdr(map, view, &hdr);
+	return mail_index_get_header(view)->next_uid - 1 >
+		MDBOX_MAP_SHARD_ID_MASK ||
+		hdr.highest_file_id > MDBOX_MAP_SHARD_ID_MASK;
+}
+
 uint32_t mdbox_map_get_rebuild_count(struct mdbox_map *map)
 {
 	struct mdbox_map_mail_index_header hdr;
 
+	map = map->primary;
 	mdbox_map_get_ext_hdr(map, map->view, &hdr);
 	return hdr.rebuild_count;
 }
@@ -301,7 +483,7 @@ mdbox_map_get_seq(struct mdbox_map *map, uint32_t map_uid, uint32_t *seq_r)
 {
 	if (!mail_index_lookup_seq(map->view, map_uid, seq_r)) {
 		/* not found - try again after a refresh */
-		if (mdbox_map_refresh(map) < 0)
+		if (mdbox_map_refresh_shard(map) < 0)
 			return -1;
 		if (!mail_index_lookup_seq(map->view, map_uid, seq_r))
 			return 0;
@@ -316,6 +498,8 @@ int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
 	uint32_t seq;
 	int ret;
 
+	if ((map = mdbox_map_lookup_uid_shard(map, map_uid)) == NULL)
+		return -1;
 	if (mdbox_map_open_or_create(map) < 0)
 		return -1;
 
@@ -336,6 +520,8 @@ int mdbox_map_lookup_full(struct mdbox_map *map, uint32_t map_uid,
 	uint32_t seq;
 	int ret;
 
+	if ((map = mdbox_map_lookup_uid_shard(map, map_uid)) == NULL)
+		return -1;
 	if (mdbox_map_open_or_create(map) < 0)
 		return -1;
 
@@ -415,7 +601,7 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 	struct mdbox_map_file_msg msg;
 	uint32_t seq;
 
-	if (mdbox_map_refresh(map) < 0)
+	if (mdbox_map_refresh_shard(map) < 0)
 		return -1;
 	hdr = mail_index_get_header(map->view);
 
@@ -435,40 +621,68 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 }
 
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r)
+				 ARRAY_TYPE(mdbox_map_file_usage) *files_r)
 {
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
 	const uint16_t *ref16_p;
+	struct mdbox_map_file_usage *usage;
+	HASH_TABLE(void *, void *) file_idx;
+	unsigned int i, idx, count, first_idx;
 	const void *data;
 	uint32_t seq;
-	bool expunged;
+	bool expunged, zero_ref;
 	int ret;
 
 	if ((ret = mdbox_map_open(map)) <= 0) {
 		/* no map / internal error */
 		return ret;
 	}
-	if (mdbox_map_refresh(map) < 0)
+	if (mdbox_map_refresh_shard(map) < 0)
 		return -1;
 
+	/* file_id => index+1 in files_r */
+	hash_table_create_direct(&file_idx, default_pool, 0);
+	first_idx = array_count(files_r);
 	hdr = mail_index_get_header(map->view);
 	for (seq = 1; seq <= hdr->messages_count; seq++) {
-		mail_index_lookup_ext(map->view, seq, map->ref_ext_id,
+		mail_index_lookup_ext(map->view, seq, map->map_ext_id,
 				      &data, &expunged);
-		if (data != NULL && !expunged) {
-			ref16_p = data;
-			if (*ref16_p != 0)
-				continue;
-		}
+		if (data == NULL || expunged)
+			continue;
+		rec = data;
 
-		mail_index_lookup_ext(map->view, seq, map->map_ext_id,
+		mail_index_lookup_ext(map->view, seq, map->ref_ext_id,
 				      &data, &expunged);
-		if (data != NULL && !expunged) {
-			rec = data;
-			seq_range_array_add(file_ids_r, rec->file_id);
+		ref16_p = data;
+		zero_ref = data == NULL || expunged || *ref16_p == 0;
+
+		idx = POINTER_CAST_TO(hash_table_lookup(file_idx,
+				POINTER_CAST(rec->file_id)), unsigned int);
+		if (idx == 0) {
+			usage = array_append_space(files_r);
+			usage->file_id = rec->file_id;
+			usage->shard = map->shard;
+			idx = array_count(files_r);
+			hash_table_insert(file_idx, POINTER_CAST(rec->file_id),
+					  POINTER_CAST(idx));
+		} else {
+			usage = array_idx_modifiable(files_r, idx - 1);
 		}
+		if (zero_ref)
+			usage->wasted_size += rec->size;
+		else
+			usage->used_size += rec->size;
 	}
+	hash_table_destroy(&file_idx);
+
+	/* drop the files that have nothing to purge */
+	usage = array_get_modifiable(files_r, &count);
+	for (i = idx = first_idx; i < count; i++) {
+		if (usage[i].wasted_size > 0)
+			usage[idx++] = usage[i];
+	}
+	array_delete(files_r, idx, count - idx);
 	return 0;
 }
 
@@ -477,7 +691,7 @@ struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map)
 	struct mdbox_map_atomic_context *atomic;
 
 	atomic = i_new(struct mdbox_map_atomic_context, 1);
-	atomic->map = map;
+	atomic->map = map->primary;
 	return atomic;
 }
 
@@ -501,42 +715,118 @@ mdbox_map_sync_handle(struct mdbox_map *map,
 	while (mail_index_sync_next(sync_ctx, &sync_rec)) ;
 }
 
-int mdbox_map_atomic_lock(struct mdbox_map_atomic_context *atomic,
-			  const char *reason)
+static int
+mdbox_map_atomic_lock_shard(struct mdbox_map_atomic_context *atomic,
+			    unsigned int shard, const char *reason)
 {
+	struct mdbox_map *map = atomic->map->shards[shard];
+	struct mdbox_map_atomic_shard *ashard = &atomic->shards[shard];
 	int ret;
 
-	if (atomic->locked)
-		return 0;
+	i_assert(!ashard->locked);
 
-	if (mdbox_map_open_or_create(atomic->map) < 0)
+	if (mdbox_map_open_or_create(map) < 0)
 		return -1;
 
 	/* use syncing to lock the transaction log, so that we always see
 	   log's head_offset = tail_offset */
-	ret = mail_index_sync_begin(atomic->map->index, &atomic->sync_ctx,
-				    &atomic->sync_view, &atomic->sync_trans,
+	ret = mail_index_sync_begin(map->index, &ashard->sync_ctx,
+				    &ashard->sync_view, &ashard->sync_trans,
 				    MAIL_INDEX_SYNC_FLAG_UPDATE_TAIL_OFFSET);
-	if (mail_index_reset_fscked(atomic->map->index))
-		mdbox_storage_set_corrupted(atomic->map->storage);
+	if (mail_index_reset_fscked(map->index))
+		mdbox_storage_set_corrupted(map->storage);
 	if (ret <= 0) {
 		i_assert(ret != 0);
-		mail_storage_set_index_error(MAP_STORAGE(atomic->map),
-					     atomic->map->index);
+		mail_storage_set_index_error(MAP_STORAGE(map), map->index);
 		return -1;
 	}
-	mail_index_sync_set_reason(atomic->sync_ctx, reason);
-	atomic->locked = TRUE;
+	mail_index_sync_set_reason(ashard->sync_ctx, reason);
+	ashard->locked = TRUE;
 	/* reset refresh state so that if it's wanted to be done locked,
 	   it gets the latest changes */
-	atomic->map_refreshed = FALSE;
-	mdbox_map_sync_handle(atomic->map, atomic->sync_ctx);
+	ashard->map_refreshed = FALSE;
+	mdbox_map_sync_handle(map, ashard->sync_ctx);
+	return 0;
+}
+
+static void
+mdbox_map_atomic_unlock_shard(struct mdbox_map_atomic_context *atomic,
+			      unsigned int shard)
+{
+	struct mdbox_map_atomic_shard *ashard = &atomic->shards[shard];
+
+	i_assert(ashard->locked && !ashard->changed);
+
+	mail_index_sync_rollback(&ashard->sync_ctx);
+	ashard->sync_view = NULL;
+	ashard->sync_trans = NULL;
+	ashard->locked = FALSE;
+	ashard->map_refreshed = FALSE;
+}
+
+int mdbox_map_atomic_lock(struct mdbox_map_atomic_context *atomic,
+			  const char *reason)
+{
+	return mdbox_map_atomic_lock_shards(atomic, (uint32_t)-1, reason);
+}
+
+int mdbox_map_atomic_lock_shards(struct mdbox_map_atomic_context *atomic,
+				 uint32_t shard_mask, const char *reason)
+{
+	uint32_t locked_mask = mdbox_map_atomic_get_locked_shards(atomic);
+	unsigned int shard, lowest;
+
+	/* nonexistent shards are noticed by the lookups */
+	shard_mask &= (1U << atomic->map->shard_count) - 1;
+	shard_mask &= ~locked_mask;
+	if (shard_mask == 0)
+		return 0;
+
+	/* release the higher shards so they can be locked again in the
+	   right order. the ones that were already changed can't be released,
+	   and locking a lower shard while keeping them locked could deadlock
+	   with another process. */
+	for (lowest = 0; (shard_mask & (1U << lowest)) == 0; lowest++) ;
+	for (shard = lowest + 1; shard < atomic->map->shard_count; shard++) {
+		if ((locked_mask & (1U << shard)) != 0 &&
+		    atomic->shards[shard].changed) {
+			mail_storage_set_critical(MAP_STORAGE(atomic->map),
+				"mdbox map shard %u can't be locked while "
+				"the higher shard %u has uncommitted changes",
+				lowest, shard);
+			return -1;
+		}
+	}
+	for (shard = lowest + 1; shard < atomic->map->shard_count; shard++) {
+		if ((locked_mask & (1U << shard)) != 0) {
+			mdbox_map_atomic_unlock_shard(atomic, shard);
+			shard_mask |= 1U << shard;
+		}
+	}
+
+	for (shard = lowest; shard < atomic->map->shard_count; shard++) {
+		if ((shard_mask & (1U << shard)) != 0 &&
+		    mdbox_map_atomic_lock_shard(atomic, shard, reason) < 0)
+			return -1;
+	}
 	return 0;
 }
 
 bool mdbox_map_atomic_is_locked(struct mdbox_map_atomic_context *atomic)
 {
-	return atomic->locked;
+	return mdbox_map_atomic_get_locked_shards(atomic) != 0;
+}
+
+uint32_t mdbox_map_atomic_get_locked_shards(struct mdbox_map_atomic_context *atomic)
+{
+	uint32_t locked_mask = 0;
+	unsigned int shard;
+
+	for (shard = 0; shard < atomic->map->shard_count; shard++) {
+		if (atomic->shards[shard].locked)
+			locked_mask |= 1U << shard;
+	}
+	return locked_mask;
 }
 
 void mdbox_map_atomic_set_failed(struct mdbox_map_atomic_context *atomic)
@@ -553,27 +843,39 @@ void mdbox_map_atomic_set_success(struct mdbox_map_atomic_context *atomic)
 
 void mdbox_map_atomic_unset_fscked(struct mdbox_map_atomic_context *atomic)
 {
-	mail_index_unset_fscked(atomic->sync_trans);
+	unsigned int shard;
+
+	for (shard = 0; shard < atomic->map->shard_count; shard++) {
+		if (atomic->shards[shard].locked)
+			mail_index_unset_fscked(atomic->shards[shard].sync_trans);
+	}
 }
 
 int mdbox_map_atomic_finish(struct mdbox_map_atomic_context **_atomic)
 {
 	struct mdbox_map_atomic_context *atomic = *_atomic;
+	struct mdbox_map_atomic_shard *ashard;
+	struct mdbox_map *map;
+	unsigned int shard;
 	int ret = 0;
 
 	*_atomic = NULL;
 
-	if (atomic->sync_ctx == NULL) {
-		/* not locked */
-		i_assert(!atomic->locked);
-	} else if (atomic->success) {
-		if (mail_index_sync_commit(&atomic->sync_ctx) < 0) {
-			mail_storage_set_index_error(MAP_STORAGE(atomic->map),
-						     atomic->map->index);
-			ret = -1;
+	for (shard = 0; shard < atomic->map->shard_count; shard++) {
+		ashard = &atomic->shards[shard];
+		map = atomic->map->shards[shard];
+		if (ashard->sync_ctx == NULL) {
+			/* not locked */
+			i_assert(!ashard->locked);
+		} else if (atomic->success) {
+			if (mail_index_sync_commit(&ashard->sync_ctx) < 0) {
+				mail_storage_set_index_error(MAP_STORAGE(map),
+							     map->index);
+				ret = -1;
+			}
+		} else {
+			mail_index_sync_rollback(&ashard->sync_ctx);
 		}
-	} else {
-		mail_index_sync_rollback(&atomic->sync_ctx);
 	}
 	i_free(atomic);
 	return ret;
@@ -584,47 +886,69 @@ mdbox_map_transaction_begin(struct mdbox_map_atomic_context *atomic,
 			    bool external)
 {
 	struct mdbox_map_transaction_context *ctx;
-	enum mail_index_transaction_flags flags =
-		MAIL_INDEX_TRANSACTION_FLAG_FSYNC;
-	bool success;
-
-	if (external)
-		flags |= MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL;
 
 	ctx = i_new(struct mdbox_map_transaction_context, 1);
 	ctx->atomic = atomic;
-	if (atomic->locked && atomic->map_refreshed) {
+	ctx->flags = MAIL_INDEX_TRANSACTION_FLAG_FSYNC;
+	if (external)
+		ctx->flags |= MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL;
+	return ctx;
+}
+
+static struct mail_index_transaction *
+mdbox_map_transaction_get_shard(struct mdbox_map_transaction_context *ctx,
+				struct mdbox_map *map)
+{
+	struct mdbox_map_atomic_shard *ashard =
+		&ctx->atomic->shards[map->shard];
+	bool success;
+
+	if (ctx->trans[map->shard] != NULL)
+		return ctx->trans[map->shard];
+
+	if (ashard->locked && ashard->map_refreshed) {
 		/* already refreshed within a lock, don't do it again */
 		success = TRUE;
 	} else {
-		success = mdbox_map_open(atomic->map) > 0 &&
-			mdbox_map_refresh(atomic->map) == 0;
+		success = mdbox_map_open(map) > 0 &&
+			mdbox_map_refresh_shard(map) == 0;
 	}
+	if (!success)
+		return NULL;
 
-	if (success) {
-		atomic->map_refreshed = TRUE;
-		ctx->trans = mail_index_transaction_begin(atomic->map->view,
-							  flags);
-	}
-	return ctx;
+	ashard->map_refreshed = TRUE;
+	ctx->trans[map->shard] =
+		mail_index_transaction_begin(map->view, ctx->flags);
+	return ctx->trans[map->shard];
 }
 
 int mdbox_map_transaction_commit(struct mdbox_map_transaction_context *ctx,
 				 const char *reason)
 {
+	struct mdbox_map *map;
+	unsigned int shard;
+
 	i_assert(!ctx->committed);
 
 	ctx->committed = TRUE;
-	if (!ctx->changed)
+	if (ctx->changed_shards == 0)
 		return 0;
 
-	if (mdbox_map_atomic_lock(ctx->atomic, reason) < 0)
+	if (mdbox_map_atomic_lock_shards(ctx->atomic, ctx->changed_shards,
+					 reason) < 0)
 		return -1;
 
-	if (mail_index_transaction_commit(&ctx->trans) < 0) {
-		mail_storage_set_index_error(MAP_STORAGE(ctx->atomic->map),
-					     ctx->atomic->map->index);
-		return -1;
+	for (shard = 0; shard < ctx->atomic->map->shard_count; shard++) {
+		if ((ctx->changed_shards & (1U << shard)) == 0)
+			continue;
+
+		map = ctx->atomic->map->shards[shard];
+		ctx->atomic->shards[shard].changed = TRUE;
+		if (mail_index_transaction_commit(&ctx->trans[shard]) < 0) {
+			mail_storage_set_index_error(MAP_STORAGE(map),
+						     map->index);
+			return -1;
+		}
 	}
 	mdbox_map_atomic_set_success(ctx->atomic);
 	return 0;
@@ -633,23 +957,30 @@ int mdbox_map_transaction_commit(struct mdbox_map_transaction_context *ctx,
 void mdbox_map_transaction_free(struct mdbox_map_transaction_context **_ctx)
 {
 	struct mdbox_map_transaction_context *ctx = *_ctx;
+	unsigned int shard;
 
 	*_ctx = NULL;
 
-	if (ctx->trans != NULL)
-		mail_index_transaction_rollback(&ctx->trans);
+	for (shard = 0; shard < MDBOX_MAP_MAX_SHARDS; shard++) {
+		if (ctx->trans[shard] != NULL)
+			mail_index_transaction_rollback(&ctx->trans[shard]);
+	}
 	i_free(ctx);
 }
 
 int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 			      uint32_t map_uid, int diff)
 {
-	struct mdbox_map *map = ctx->atomic->map;
+	struct mdbox_map *map;
+	struct mail_index_transaction *trans;
 	const void *data;
 	uint32_t seq;
 	int old_diff, new_diff;
 
-	if (unlikely(ctx->trans == NULL))
+	if ((map = mdbox_map_lookup_uid_shard(ctx->atomic->map, map_uid)) == NULL)
+		return -1;
+	trans = mdbox_map_transaction_get_shard(ctx, map);
+	if (unlikely(trans == NULL))
 		return -1;
 
 	if (!mail_index_lookup_seq(map->view, map_uid, &seq)) {
@@ -667,8 +998,8 @@ int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 	}
 	mail_index_lookup_ext(map->view, seq, map->ref_ext_id, &data, NULL);
 	old_diff = data == NULL ? 0 : *((const uint16_t *)data);
-	ctx->changed = TRUE;
-	new_diff = mail_index_atomic_inc_ext(ctx->trans, seq,
+	ctx->changed_shards |= 1U << map->shard;
+	new_diff = mail_index_atomic_inc_ext(trans, seq,
 					     map->ref_ext_id, diff);
 	if (old_diff + new_diff < 0) {
 		mdbox_map_set_corrupted(map, "map_uid=%u refcount too low",
@@ -693,9 +1024,6 @@ int mdbox_map_update_refcounts(struct mdbox_map_transaction_context *ctx,
 	const uint32_t *uidp;
 	unsigned int i, count;
 
-	if (unlikely(ctx->trans == NULL))
-		return -1;
-
 	count = array_count(map_uids);
 	for (i = 0; i < count; i++) {
 		uidp = array_idx(map_uids, i);
@@ -709,6 +1037,7 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 {
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_transaction_context *map_trans;
+	struct mail_index_transaction *trans;
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
 	const void *data;
@@ -721,9 +1050,12 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 	/* we need a per-file transaction, otherwise we can't refresh the map */
 	atomic = mdbox_map_atomic_begin(map);
 	map_trans = mdbox_map_transaction_begin(atomic, TRUE);
+	trans = mdbox_map_transaction_get_shard(map_trans, map);
+	if (trans == NULL)
+		ret = -1;
 
-	hdr = mail_index_get_header(map->view);
-	for (seq = 1; seq <= hdr->messages_count; seq++) {
+	hdr = trans == NULL ? NULL : mail_index_get_header(map->view);
+	for (seq = 1; ret == 0 && seq <= hdr->messages_count; seq++) {
 		mail_index_lookup_ext(map->view, seq, map->map_ext_id,
 				      &data, NULL);
 		if (data == NULL) {
@@ -734,8 +1066,8 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 
 		rec = data;
 		if (rec->file_id == file_id) {
-			map_trans->changed = TRUE;
-			mail_index_expunge(map_trans->trans, seq);
+			map_trans->changed_shards |= 1U << map->shard;
+			mail_index_expunge(trans, seq);
 		}
 	}
 	if (ret == 0)
@@ -747,25 +1079,26 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 }
 
 struct mdbox_map_append_context *
-mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic)
+mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic,
+		       unsigned int shard)
 {
 	struct mdbox_map_append_context *ctx;
 
 	ctx = i_new(struct mdbox_map_append_context, 1);
 	ctx->atomic = atomic;
-	ctx->map = atomic->map;
+	ctx->map = mdbox_map_get_shard(atomic->map, shard);
 	ctx->first_new_file_id = (uint32_t)-1;
 	i_array_init(&ctx->file_appends, 64);
 	i_array_init(&ctx->files, 64);
 	i_array_init(&ctx->appends, 128);
 
-	if (mdbox_map_open_or_create(atomic->map) < 0)
+	if (mdbox_map_open_or_create(ctx->map) < 0)
 		ctx->failed = TRUE;
 	else {
 		/* refresh the map so we can try appending to the
 		   latest files */
-		if (mdbox_map_refresh(atomic->map) == 0)
-			atomic->map_refreshed = TRUE;
+		if (mdbox_map_refresh_shard(ctx->map) == 0)
+			atomic->shards[shard].map_refreshed = TRUE;
 		else
 			ctx->failed = TRUE;
 	}
@@ -1210,7 +1543,8 @@ mdbox_find_highest_file_id(struct mdbox_map *map, uint32_t *file_id_r)
 	}
 	while ((d = readdir(dir)) != NULL) {
 		if (strncmp(d->d_name, MDBOX_MAIL_FILE_PREFIX, prefix_len) == 0 &&
-		    str_to_uint(d->d_name + prefix_len, &id) == 0) {
+		    str_to_uint(d->d_name + prefix_len, &id) == 0 &&
+		    mdbox_map_get_uid_shard(map, id) == map->shard) {
 			if (highest_id < id)
 				highest_id = id;
 		}
@@ -1225,20 +1559,33 @@ static int
 mdbox_map_assign_file_ids(struct mdbox_map_append_context *ctx,
 			  bool separate_transaction, const char *reason)
 {
+	struct mdbox_map_atomic_shard *ashard =
+		&ctx->atomic->shards[ctx->map->shard];
 	struct dbox_file_append_context *const *file_appends;
 	unsigned int i, count;
 	struct mdbox_map_mail_index_header hdr;
 	uint32_t first_file_id, file_id, existing_id;
+	bool verify_existing_file_ids = ctx->map->verify_existing_file_ids;
 
 	/* start the syncing. we'll need it even if there are no file ids to
 	   be assigned. */
-	if (mdbox_map_atomic_lock(ctx->atomic, reason) < 0)
+	if (mdbox_map_atomic_lock_shards(ctx->atomic, 1U << ctx->map->shard,
+					 reason) < 0)
 		return -1;
+	ashard->changed = TRUE;
 
-	mdbox_map_get_ext_hdr(ctx->map, ctx->atomic->sync_view, &hdr);
+	mdbox_map_get_ext_hdr(ctx->map, ashard->sync_view, &hdr);
 	file_id = hdr.highest_file_id + 1;
+	if (mdbox_map_get_uid_shard(ctx->map, hdr.highest_file_id) !=
+	    ctx->map->shard) {
+		/* a new shard, or the header was written while the map had
+		   fewer shards. find the highest file_id within this shard's
+		   range. */
+		file_id = mdbox_map_get_shard_first_id(ctx->map);
+		verify_existing_file_ids = TRUE;
+	}
 
-	if (ctx->map->verify_existing_file_ids) {
+	if (verify_existing_file_ids) {
 		/* storage/ directory had been already created but
 		   without indexes. scan to see if there exists a higher
 		   m.* file id than what is in header, so we won't
@@ -1252,6 +1599,12 @@ mdbox_map_assign_file_ids(struct mdbox_map_append_context *ctx,
 	/* assign file_ids for newly created files */
 	first_file_id = file_id;
 	file_appends = array_get(&ctx->file_appends, &count);
+	if (!mdbox_map_shard_has_ids(ctx->map, first_file_id, count)) {
+		mail_storage_set_critical(MAP_STORAGE(ctx->map),
+			"mdbox map %s: No more file IDs available",
+			ctx->map->index->filepath);
+		return -1;
+	}
 	for (i = 0; i < count; i++) {
 		struct mdbox_file *mfile =
 			(struct mdbox_file *)file_appends[i]->file;
@@ -1273,7 +1626,7 @@ mdbox_map_assign_file_ids(struct mdbox_map_append_context *ctx,
 	if (first_file_id != file_id) {
 		file_id--;
 		mail_index_update_header_ext(ctx->trans != NULL ? ctx->trans :
-					     ctx->atomic->sync_trans,
+					     ashard->sync_trans,
 					     ctx->map->map_ext_id,
 					     0, &file_id, sizeof(file_id));
 	}
@@ -1290,7 +1643,7 @@ int mdbox_map_append_assign_map_uids(struct mdbox_map_append_context *ctx,
 	unsigned int i, count;
 	ARRAY_TYPE(seq_range) uids;
 	const struct seq_range *range;
-	uint32_t seq;
+	uint32_t seq, first_uid;
 	uint16_t ref16;
 	int ret = 0;
 
@@ -1326,9 +1679,18 @@ int mdbox_map_append_assign_map_uids(struct mdbox_map_append_context *ctx,
 	}
 
 	/* assign map UIDs for appended records */
-	hdr = mail_index_get_header(ctx->atomic->sync_view);
+	hdr = mail_index_get_header(
+		ctx->atomic->shards[ctx->map->shard].sync_view);
+	first_uid = I_MAX(hdr->next_uid,
+			  mdbox_map_get_shard_first_id(ctx->map));
+	if (!mdbox_map_shard_has_ids(ctx->map, first_uid, count)) {
+		mail_storage_set_critical(MAP_STORAGE(ctx->map),
+			"mdbox map %s: No more map UIDs available",
+			ctx->map->index->filepath);
+		return -1;
+	}
 	t_array_init(&uids, 1);
-	mail_index_append_finish_uids(ctx->trans, hdr->next_uid, &uids);
+	mail_index_append_finish_uids(ctx->trans, first_uid, &uids);
 	range = array_front(&uids);
 	i_assert(range[0].seq2 - range[0].seq1 + 1 == count);
 
@@ -1358,6 +1720,8 @@ int mdbox_map_append_move(struct mdbox_map_append_context *ctx,
 	const struct mdbox_map_append *appends;
 	struct mdbox_map_mail_index_record rec;
 	struct seq_range_iter iter;
+	struct mdbox_map_atomic_shard *ashard =
+		&ctx->atomic->shards[ctx->map->shard];
 	const uint32_t *uids;
 	unsigned int i, j, map_uids_count, appends_count;
 	uint32_t uid, seq, next_uid;
@@ -1369,7 +1733,8 @@ int mdbox_map_append_move(struct mdbox_map_append_context *ctx,
 	i_zero(&rec);
 	appends = array_get(&ctx->appends, &appends_count);
 
-	next_uid = mail_index_get_header(ctx->atomic->sync_view)->next_uid;
+	next_uid = I_MAX(mail_index_get_header(ashard->sync_view)->next_uid,
+			 mdbox_map_get_shard_first_id(ctx->map));
 	uids = array_get(map_uids, &map_uids_count);
 	for (i = j = 0; i < map_uids_count; i++) {
 		struct mdbox_file *mfile =
@@ -1381,25 +1746,25 @@ int mdbox_map_append_move(struct mdbox_map_append_context *ctx,
 		rec.size = appends[j].size;
 		j++;
 
-		if (!mail_index_lookup_seq(ctx->atomic->sync_view,
+		if (!mail_index_lookup_seq(ashard->sync_view,
 					   uids[i], &seq)) {
 			/* We wrote the email to the new m.* file, but another
 			   process already expunged it and purged it. Deleting
 			   the email from the new m.* file would be problematic
 			   at this point, so just add the mail back to the map
 			   with refcount=0 and the next purge will remove it. */
-			mail_index_append(ctx->atomic->sync_trans,
+			mail_index_append(ashard->sync_trans,
 					  next_uid++, &seq);
 		}
-		mail_index_update_ext(ctx->atomic->sync_trans, seq,
+		mail_index_update_ext(ashard->sync_trans, seq,
 				      ctx->map->map_ext_id, &rec, NULL);
 	}
 
 	seq_range_array_iter_init(&iter, expunge_map_uids); i = 0;
 	while (seq_range_array_iter_nth(&iter, i++, &uid)) {
-		if (!mail_index_lookup_seq(ctx->atomic->sync_view, uid, &seq))
+		if (!mail_index_lookup_seq(ashard->sync_view, uid, &seq))
 			i_unreached();
-		mail_index_expunge(ctx->atomic->sync_trans, seq);
+		mail_index_expunge(ashard->sync_trans, seq);
 	}
 	return 0;
 }
@@ -7,6 +7,14 @@ struct dbox_file_append_context;
 struct mdbox_map_append_context;
 struct mdbox_storage;
 
+/* With mdbox_map_shards > 1 the map is split into multiple indexes, which
+   can be locked independently. The shard is stored in the highest bits of
+   map UIDs and file IDs. Shard 0 is the original dovecot.map.index, so it
+   can be enabled without converting anything. */
+#define MDBOX_MAP_MAX_SHARDS 16
+#define MDBOX_MAP_SHARD_SHIFT 28
+#define MDBOX_MAP_SHARD_ID_MASK ((1U << MDBOX_MAP_SHARD_SHIFT) - 1)
+
 enum mdbox_map_append_flags {
 	DBOX_MAP_APPEND_FLAG_ALT	= 0x01
 };
@@ -30,23 +38,49 @@ struct mdbox_map_file_msg {
 };
 ARRAY_DEFINE_TYPE(mdbox_map_file_msg, struct mdbox_map_file_msg);
 
+struct mdbox_map_file_usage {
+	uint32_t file_id;
+	/* map shard containing the file's messages */
+	unsigned int shard;
+	/* sum of the sizes of messages with nonzero/zero refcount */
+	uoff_t used_size, wasted_size;
+};
+ARRAY_DEFINE_TYPE(mdbox_map_file_usage, struct mdbox_map_file_usage);
+
 struct mdbox_map *
 mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list);
 void mdbox_map_deinit(struct mdbox_map **map);
+/* Returns a new map for a forked child process. The old map is left as it is,
+   because its file descriptors and locks are shared with the parent. */
+struct mdbox_map *mdbox_map_init_forked_child(struct mdbox_map *map);
+
+/* Returns the number of map shards. */
+unsigned int mdbox_map_get_shard_count(struct mdbox_map *map);
+/* Returns the map of the given shard. Shard 0 is the map itself. */
+struct mdbox_map *mdbox_map_get_shard(struct mdbox_map *map, unsigned int shard);
+/* Returns the shard containing the map UID. The shard may not exist if the
+   number of shards has been lowered. */
+unsigned int mdbox_map_get_uid_shard(struct mdbox_map *map, uint32_t map_uid);
+/* Returns the shard where new mails saved to the mailbox are written. */
+unsigned int mdbox_map_get_mailbox_shard(struct mdbox_map *map,
+					 const char *mailbox_name);
 
 /* Open the map. Returns 1 if ok, 0 if map doesn't exist, -1 if error. */
 int mdbox_map_open(struct mdbox_map *map);
 /* Open or create the map. This is done automatically for most operations.
    Returns 0 if ok, -1 if error. */
 int mdbox_map_open_or_create(struct mdbox_map *map);
-/* Refresh the map. Returns 0 if ok, -1 if error. */
+/* Refresh the map and its opened shards. Returns 0 if ok, -1 if error. */
 int mdbox_map_refresh(struct mdbox_map *map);
-/* Returns TRUE if map has been fsck'd. */
+/* Returns TRUE if map or any of its shards has been fsck'd. */
 bool mdbox_map_is_fscked(struct mdbox_map *map);
 
 /* Return the current rebuild counter */
 uint32_t mdbox_map_get_rebuild_count(struct mdbox_map *map);
 
+/* The lookups by map UID are done from the UID's shard. The lookups by
+   sequence are done from the given shard's map. */
+
 /* Look up file_id and offset for given map UID. Returns 1 if ok, 0 if UID
    is already expunged, -1 if error. */
 int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
@@ -61,21 +95,30 @@ int mdbox_map_lookup_seq_full(struct mdbox_map *map, uint32_t seq,
 			      uint16_t *refcount_r);
 /* Return map UID for the map sequence. */
 uint32_t mdbox_map_lookup_uid(struct mdbox_map *map, uint32_t seq);
-/* Returns the total number of messages in the map. */
+/* Returns the total number of messages in the map shard. */
 unsigned int mdbox_map_get_messages_count(struct mdbox_map *map);
 
-/* Get all messages from file */
+/* Get all messages from file. The map must be the file's shard. */
 int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 			    ARRAY_TYPE(mdbox_map_file_msg) *recs);
 
 /* Begin atomic context. There can be multiple transactions/appends within the
    same atomic context. */
 struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map);
-/* Lock the map immediately. */
+/* Lock all the map shards immediately. */
 int mdbox_map_atomic_lock(struct mdbox_map_atomic_context *atomic,
 			  const char *reason);
-/* Returns TRUE if map is locked */
+/* Lock the map shards in the bitmask immediately. The shards are always
+   locked in ascending order to avoid deadlocks. If a lower shard than an
+   already locked one is wanted, the higher locks are released and locked
+   again in the right order. This fails if any of the higher shards already
+   has uncommitted changes. */
+int mdbox_map_atomic_lock_shards(struct mdbox_map_atomic_context *atomic,
+				 uint32_t shard_mask, const char *reason);
+/* Returns TRUE if any of the map shards is locked */
 bool mdbox_map_atomic_is_locked(struct mdbox_map_atomic_context *atomic);
+/* Returns a bitmask of the locked map shards */
+uint32_t mdbox_map_atomic_get_locked_shards(struct mdbox_map_atomic_context *atomic);
 /* When finish() is called, rollback the changes. If data was already written
    to map's transaction log, this desyncs the map and causes a rebuild */
 void mdbox_map_atomic_set_failed(struct mdbox_map_atomic_context *atomic);
@@ -88,6 +131,8 @@ void mdbox_map_atomic_unset_fscked(struct mdbox_map_atomic_context *atomic);
 /* Commit/rollback changes within this atomic context. */
 int mdbox_map_atomic_finish(struct mdbox_map_atomic_context **atomic);
 
+/* The transaction may change multiple shards. Each shard is refreshed when
+   it's first changed within the transaction. */
 struct mdbox_map_transaction_context *
 mdbox_map_transaction_begin(struct mdbox_map_atomic_context *atomic,
 			    bool external);
@@ -101,14 +146,18 @@ int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 			      uint32_t map_uid, int diff);
 int mdbox_map_update_refcounts(struct mdbox_map_transaction_context *ctx,
 			       const ARRAY_TYPE(uint32_t) *map_uids, int diff);
+/* Remove the file's messages from the file's shard. */
 int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id);
 
-/* Return all files containing messages with zero refcount. */
+/* Append the space usage of all files containing messages with zero
+   refcount in the map shard. Returns 0 if ok, -1 if error. */
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r);
+				 ARRAY_TYPE(mdbox_map_file_usage) *files_r);
 
+/* Begin appending messages to the given shard. */
 struct mdbox_map_append_context *
-mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic);
+mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic,
+		       unsigned int shard);
 /* Request file for saving a new message with given size (if available). If an
    existing file can be used, the record is locked and updated in index.
    Returns 0 if ok, -1 if error. */
@@ -6,6 +6,12 @@
 #include "ostream.h"
 #include "str.h"
 #include "hash.h"
+#include "hostpid.h"
+#include "sleep.h"
+#include "time-util.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "master-service.h"
 #include "dbox-attachment.h"
 #include "mdbox-storage.h"
 #include "mdbox-storage-rebuild.h"
@@ -14,6 +20,14 @@
 #include "mdbox-sync.h"
 
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Don't let the I/O budget that was left unused while e.g. waiting for
+   locks be spent as a burst longer than this. */
+#define MDBOX_PURGE_THROTTLE_MAX_BURST_USECS 1000000
+/* Worker process exit code when it found corrupted files */
+#define MDBOX_PURGE_WORKER_EXIT_CORRUPTED 2
 
 /*
    Altmoving works like:
@@ -23,6 +37,13 @@
    2. mdbox_purge() is called, which checks if map UID's refcount equals
       to its alt-refcount. If it does, it's moved to alt storage. Moving to
       primary storage is done if _ALT flag was removed from any message.
+
+   Files are purged in the order of the largest share of space used by
+   expunged messages. Each file's purge is committed to the map separately,
+   so an interrupted purge continues with the remaining files the next time
+   it's run. With mdbox_purge_processes > 1 the files are divided between
+   forked worker processes, which report the results of each file back to
+   the parent process.
 */
 
 enum mdbox_msg_action {
@@ -39,17 +60,76 @@ struct mdbox_purge_context {
 	   up while there is no locking, so it may not be accurate anymore by
 	   the time it's used. */
 	ARRAY_TYPE(seq_range) primary_file_ids;
-	/* list of file_ids that we need to purge */
+	/* list of file_ids that we need to altmove */
 	ARRAY_TYPE(seq_range) purge_file_ids;
+	ARRAY_TYPE(mdbox_map_file_usage) altmove_files;
+	/* files to purge, in the order they're purged */
+	ARRAY_TYPE(mdbox_map_file_usage) purge_files;
 
 	/* uint32_t map_uid => enum mdbox_msg_action action */
 	HASH_TABLE(void *, void *) altmoves;
 	bool have_altmoves;
 
+	/* map shard of the file being purged */
+	struct mdbox_map *file_map;
+	unsigned int file_shard;
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_append_context *append_ctx;
+
+	/* I/O budget of this process. 0 = unlimited. */
+	uoff_t max_bytes_per_sec;
+	unsigned int max_iops;
+	uint64_t throttle_start_usecs;
+	uint64_t throttle_bytes, throttle_ops;
+};
+
+/* Sent by worker processes to the parent process, so it must fit in
+   PIPE_BUF to be written atomically. */
+struct mdbox_purge_file_result {
+	uint32_t file_id;
+	/* index of the worker process that purged the file, 0 if there are
+	   no worker processes */
+	uint32_t worker_idx;
+	/* mdbox_file_purge() return value */
+	int32_t ret;
+	uint32_t copied_mails, expunged_mails;
+	uint64_t copied_bytes, reclaimed_bytes;
+	uint64_t usecs;
 };
 
+static void
+mdbox_purge_throttle(struct mdbox_purge_context *ctx,
+		     uoff_t bytes, unsigned int ops)
+{
+	uint64_t now_usecs, elapsed_usecs, wanted_usecs = 0;
+
+	if (ctx->max_bytes_per_sec == 0 && ctx->max_iops == 0)
+		return;
+
+	ctx->throttle_bytes += bytes;
+	ctx->throttle_ops += ops;
+	if (ctx->max_bytes_per_sec != 0) {
+		wanted_usecs = ctx->throttle_bytes * 1000000 /
+			ctx->max_bytes_per_sec;
+	}
+	if (ctx->max_iops != 0) {
+		wanted_usecs = I_MAX(wanted_usecs,
+				     ctx->throttle_ops * 1000000 /
+				     ctx->max_iops);
+	}
+
+	now_usecs = i_microseconds();
+	elapsed_usecs = now_usecs - ctx->throttle_start_usecs;
+	if (elapsed_usecs < wanted_usecs)
+		i_sleep_usecs(wanted_usecs - elapsed_usecs);
+	else if (elapsed_usecs > wanted_usecs +
+		 MDBOX_PURGE_THROTTLE_MAX_BURST_USECS) {
+		ctx->throttle_start_usecs = now_usecs;
+		ctx->throttle_bytes = 0;
+		ctx->throttle_ops = 0;
+	}
+}
+
 static int mdbox_map_file_msg_offset_cmp(const struct mdbox_map_file_msg *m1,
 					 const struct mdbox_map_file_msg *m2)
 {
@@ -195,7 +275,8 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	int ret;
 
 	if (ctx->append_ctx == NULL)
-		ctx->append_ctx = mdbox_map_append_begin(ctx->atomic);
+		ctx->append_ctx = mdbox_map_append_begin(ctx->atomic,
+							 ctx->file_shard);
 
 	append_flags = !mdbox_purge_want_altpath(ctx, file, msg->map_uid) ? 0 :
 		DBOX_MAP_APPEND_FLAG_ALT;
@@ -239,14 +320,15 @@ static int
 mdbox_file_purge_check_refcounts(struct mdbox_purge_context *ctx,
 				 const ARRAY_TYPE(mdbox_map_file_msg) *msgs_arr)
 {
-	struct mdbox_map *map = ctx->storage->map;
+	struct mdbox_map *map = ctx->file_map;
 	struct mdbox_map_mail_index_record rec;
 	uint16_t refcount;
 	const struct mdbox_map_file_msg *msgs;
 	unsigned int i, count;
 	int ret;
 
-	if (mdbox_map_atomic_lock(ctx->atomic, "purging check") < 0)
+	if (mdbox_map_atomic_lock_shards(ctx->atomic, 1U << ctx->file_shard,
+					 "purging check") < 0)
 		return -1;
 
 	msgs = array_get(msgs_arr, &count);
@@ -289,9 +371,8 @@ mdbox_purge_attachments(struct mdbox_purge_context *ctx,
 
 static int
 mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
-		 uint32_t file_id)
+		 uint32_t file_id, struct mdbox_purge_file_result *result)
 {
-	struct mdbox_storage *dstorage = (struct mdbox_storage *)file->storage;
 	struct stat st;
 	ARRAY_TYPE(mdbox_map_file_msg) msgs_arr;
 	const struct mdbox_map_file_msg *msgs;
@@ -324,7 +405,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	/* get list of map UIDs that exist in this file (again has to be done
 	   after locking) */
 	i_array_init(&msgs_arr, 128);
-	if (mdbox_map_get_file_msgs(dstorage->map, file_id,
+	if (mdbox_map_get_file_msgs(ctx->file_map, file_id,
 				    &msgs_arr) < 0) {
 		array_free(&msgs_arr);
 		dbox_file_unlock(file);
@@ -366,6 +447,8 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 				break;
 			seq_range_array_add(&expunged_map_uids,
 					    msgs[i].map_uid);
+			result->expunged_mails++;
+			mdbox_purge_throttle(ctx, 0, 1);
 		} else {
 			/* non-expunged message. write it to output file. */
 			i_stream_seek(file->input, offset);
@@ -373,6 +456,11 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 			if (ret <= 0)
 				break;
 			array_push_back(&copied_map_uids, &msgs[i].map_uid);
+			result->copied_mails++;
+			result->copied_bytes += file->input->v_offset - offset;
+			/* read + write */
+			mdbox_purge_throttle(ctx,
+				(file->input->v_offset - offset) * 2, 2);
 		}
 		offset = file->input->v_offset;
 	}
@@ -424,8 +512,9 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	   temporarily vanished */
 	if (ret > 0) {
 		(void)dbox_file_unlink(file);
-		if (mdbox_map_remove_file_id(ctx->storage->map, file_id) < 0)
+		if (mdbox_map_remove_file_id(ctx->file_map, file_id) < 0)
 			ret = -1;
+		result->reclaimed_bytes = st.st_size - result->copied_bytes;
 	} else {
 		dbox_file_unlock(file);
 	}
@@ -476,6 +565,8 @@ mdbox_purge_alloc(struct mdbox_storage *storage)
 	ctx->lowest_primary_file_id = (uint32_t)-1;
 	i_array_init(&ctx->primary_file_ids, 64);
 	i_array_init(&ctx->purge_file_ids, 64);
+	i_array_init(&ctx->altmove_files, 64);
+	i_array_init(&ctx->purge_files, 64);
 	hash_table_create_direct(&ctx->altmoves, pool, 0);
 	return ctx;
 }
@@ -489,6 +580,8 @@ static void mdbox_purge_free(struct mdbox_purge_context **_ctx)
 	hash_table_destroy(&ctx->altmoves);
 	array_free(&ctx->primary_file_ids);
 	array_free(&ctx->purge_file_ids);
+	array_free(&ctx->altmove_files);
+	array_free(&ctx->purge_files);
 	pool_unref(&ctx->pool);
 }
 
@@ -564,6 +657,21 @@ static int uint32_t_cmp(const uint32_t *u1, const uint32_t *u2)
 	return 0;
 }
 
+static void
+mdbox_altmove_add_file(struct mdbox_purge_context *ctx, uint32_t file_id,
+		       uint32_t map_uid)
+{
+	struct mdbox_map_file_usage *file;
+
+	if (seq_range_exists(&ctx->purge_file_ids, file_id))
+		return;
+	seq_range_array_add(&ctx->purge_file_ids, file_id);
+
+	file = array_append_space(&ctx->altmove_files);
+	file->file_id = file_id;
+	file->shard = mdbox_map_get_uid_shard(ctx->storage->map, map_uid);
+}
+
 static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 {
 	struct mdbox_storage *dstorage = ctx->storage;
@@ -605,8 +713,8 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 			hash_table_insert(ctx->altmoves,
 					  POINTER_CAST(cur_map_uid),
 					  POINTER_CAST(action));
-			seq_range_array_add(&ctx->purge_file_ids,
-					    cur_rec.file_id);
+			mdbox_altmove_add_file(ctx, cur_rec.file_id,
+					       cur_map_uid);
 		}
 	}
 
@@ -638,25 +746,265 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 		action = MDBOX_MSG_ACTION_MOVE_FROM_ALT;
 		hash_table_update(ctx->altmoves, POINTER_CAST(cur_map_uid),
 				  POINTER_CAST(action));
-		seq_range_array_add(&ctx->purge_file_ids, cur_rec.file_id);
+		mdbox_altmove_add_file(ctx, cur_rec.file_id, cur_map_uid);
 	}
 	ctx->have_altmoves = hash_table_count(ctx->altmoves) > 0;
 	return ret;
 }
 
+static double
+mdbox_purge_file_wasted_ratio(const struct mdbox_map_file_usage *file)
+{
+	uoff_t total = file->used_size + file->wasted_size;
+
+	return total == 0 ? 0 : (double)file->wasted_size / total;
+}
+
+static int
+mdbox_purge_file_cmp(const struct mdbox_map_file_usage *f1,
+		     const struct mdbox_map_file_usage *f2)
+{
+	double ratio1 = mdbox_purge_file_wasted_ratio(f1);
+	double ratio2 = mdbox_purge_file_wasted_ratio(f2);
+
+	if (ratio1 != ratio2)
+		return ratio1 > ratio2 ? -1 : 1;
+	if (f1->wasted_size != f2->wasted_size)
+		return f1->wasted_size > f2->wasted_size ? -1 : 1;
+	if (f1->file_id < f2->file_id)
+		return -1;
+	return f1->file_id > f2->file_id ? 1 : 0;
+}
+
+static void mdbox_purge_add_altmove_files(struct mdbox_purge_context *ctx)
+{
+	const struct mdbox_map_file_usage *file;
+
+	/* files that don't have any expunged messages are purged last */
+	array_foreach(&ctx->purge_files, file)
+		seq_range_array_remove(&ctx->purge_file_ids, file->file_id);
+	array_foreach(&ctx->altmove_files, file) {
+		if (seq_range_exists(&ctx->purge_file_ids, file->file_id))
+			array_push_back(&ctx->purge_files, file);
+	}
+}
+
+static void
+mdbox_purge_file_event(struct mdbox_storage *storage,
+		       const struct mdbox_purge_file_result *result)
+{
+	struct event_passthrough *e;
+
+	if (result->ret == 0) {
+		/* file was already purged or it's being purged by another
+		   process */
+		return;
+	}
+
+	e = event_create_passthrough(storage->storage.storage.event)->
+		set_name("mdbox_purge_file_finished")->
+		add_int("file_id", result->file_id)->
+		add_int("purge_worker", result->worker_idx)->
+		add_int("copied_mails", result->copied_mails)->
+		add_int("expunged_mails", result->expunged_mails)->
+		add_int("copied_bytes", result->copied_bytes)->
+		add_int("reclaimed_bytes", result->reclaimed_bytes)->
+		add_int("purge_usecs", result->usecs);
+	if (result->ret < 0) {
+		e->add_str("error", "Purging failed");
+		e_debug(e->event(), "Purging "MDBOX_MAIL_FILE_PREFIX"%u failed",
+			result->file_id);
+	} else {
+		e_debug(e->event(), "Purged "MDBOX_MAIL_FILE_PREFIX"%u "
+			"in %"PRIu64" ms: Reclaimed %"PRIu64" bytes, "
+			"copied %u mails (%"PRIu64" bytes)",
+			result->file_id, result->usecs / 1000,
+			result->reclaimed_bytes, result->copied_mails,
+			result->copied_bytes);
+	}
+}
+
+static int
+mdbox_purge_file_id(struct mdbox_purge_context *ctx,
+		    const struct mdbox_map_file_usage *file_usage,
+		    struct mdbox_purge_file_result *result_r)
+{
+	uint32_t file_id = file_usage->file_id;
+	struct dbox_file *file;
+	uint64_t start_usecs = i_microseconds();
+	bool deleted;
+	int ret;
+
+	i_zero(result_r);
+	result_r->file_id = file_id;
+
+	ctx->file_shard = file_usage->shard;
+	ctx->file_map = mdbox_map_get_shard(ctx->storage->map,
+					    file_usage->shard);
+
+	file = mdbox_file_init(ctx->storage, file_id);
+	if (dbox_file_open(file, &deleted) > 0 && !deleted)
+		ret = mdbox_file_purge(ctx, file, file_id, result_r);
+	else if (mdbox_map_remove_file_id(ctx->file_map, file_id) < 0)
+		ret = -1;
+	else
+		ret = 0;
+	dbox_file_unref(&file);
+	ctx->file_map = NULL;
+
+	result_r->ret = ret;
+	result_r->usecs = i_microseconds() - start_usecs;
+	return ret;
+}
+
+/* Purge every step'th file starting from first_idx. The results are written
+   to result_fd, or sent as events if it's -1. */
+static int
+mdbox_purge_files(struct mdbox_purge_context *ctx, unsigned int first_idx,
+		  unsigned int step, int result_fd)
+{
+	struct mdbox_purge_file_result result;
+	const struct mdbox_map_file_usage *files;
+	unsigned int i, count;
+	int ret = 0;
+
+	ctx->throttle_start_usecs = i_microseconds();
+	files = array_get(&ctx->purge_files, &count);
+	for (i = first_idx; i < count && ret == 0; i += step) {
+		/* stop between files, so the next purge can continue from
+		   where this one was left */
+		if (master_service_is_killed(master_service))
+			break;
+
+		T_BEGIN {
+			if (mdbox_purge_file_id(ctx, &files[i], &result) < 0)
+				ret = -1;
+		} T_END;
+		result.worker_idx = first_idx;
+		mdbox_purge_throttle(ctx, 0, 2);
+
+		if (result_fd == -1)
+			mdbox_purge_file_event(ctx->storage, &result);
+		else if (write_full(result_fd, &result, sizeof(result)) < 0) {
+			/* parent process is gone */
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void ATTR_NORETURN
+mdbox_purge_worker_run(struct mdbox_purge_context *ctx,
+		       unsigned int worker_idx, unsigned int worker_count,
+		       int result_fd)
+{
+	struct mdbox_storage *storage = ctx->storage;
+	int ret;
+
+	master_service_forked_child(master_service);
+	/* the new files' temporary names contain the PID */
+	hostpid_init();
+	/* Don't use the map index or the files opened by the parent process.
+	   Their file offsets and locks are shared with it. */
+	array_clear(&storage->open_files);
+	storage->map = mdbox_map_init_forked_child(storage->map);
+
+	if (mdbox_map_open(storage->map) <= 0)
+		ret = -1;
+	else
+		ret = mdbox_purge_files(ctx, worker_idx, worker_count, result_fd);
+	/* Nothing is cleaned up, because everything is shared with the
+	   parent process. Especially atexit() callbacks must not be run. */
+	_exit(storage->corrupted ? MDBOX_PURGE_WORKER_EXIT_CORRUPTED :
+	      (ret < 0 ? EXIT_FAILURE : 0));
+}
+
+static int
+mdbox_purge_parallel(struct mdbox_purge_context *ctx,
+		     unsigned int worker_count)
+{
+	struct mdbox_storage *storage = ctx->storage;
+	struct mail_storage *_storage = &storage->storage.storage;
+	struct mdbox_purge_file_result result;
+	unsigned int i, started_count;
+	pid_t *pids;
+	int fd[2], status, ret = 0;
+
+	if (pipe(fd) < 0) {
+		mail_storage_set_critical(_storage, "pipe() failed: %m");
+		return -1;
+	}
+
+	pids = t_new(pid_t, worker_count);
+	for (i = 0; i < worker_count; i++) {
+		if ((pids[i] = fork()) == (pid_t)-1) {
+			mail_storage_set_critical(_storage,
+						  "fork() failed: %m");
+			ret = -1;
+			break;
+		}
+		if (pids[i] == 0) {
+			i_close_fd(&fd[0]);
+			mdbox_purge_worker_run(ctx, i, worker_count, fd[1]);
+		}
+	}
+	started_count = i;
+	i_close_fd(&fd[1]);
+
+	while ((status = read_full(fd[0], &result, sizeof(result))) > 0)
+		mdbox_purge_file_event(storage, &result);
+	if (status < 0) {
+		mail_storage_set_critical(_storage,
+			"read(purge worker pipe) failed: %m");
+		ret = -1;
+	}
+	i_close_fd(&fd[0]);
+
+	for (i = 0; i < started_count; i++) {
+		while (waitpid(pids[i], &status, 0) < 0) {
+			if (errno != EINTR) {
+				mail_storage_set_critical(_storage,
+					"waitpid(%ld) failed: %m",
+					(long)pids[i]);
+				status = -1;
+				break;
+			}
+		}
+		if (status == 0)
+			continue;
+
+		if (status == -1) {
+			/* waitpid() failed */
+		} else if (WIFSIGNALED(status)) {
+			mail_storage_set_critical(_storage,
+				"Purge worker process %ld killed with signal %d",
+				(long)pids[i], WTERMSIG(status));
+		} else {
+			/* the worker process already logged the error */
+			if (WIFEXITED(status) && WEXITSTATUS(status) ==
+			    MDBOX_PURGE_WORKER_EXIT_CORRUPTED)
+				mdbox_storage_set_corrupted(storage);
+			mail_storage_set_internal_error(_storage);
+		}
+		ret = -1;
+	}
+	return ret;
+}
+
 int mdbox_purge(struct mail_storage *_storage)
 {
 	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
 	struct mdbox_purge_context *ctx;
-	struct dbox_file *file;
-	struct seq_range_iter iter;
-	unsigned int i = 0;
-	uint32_t file_id;
-	bool deleted;
+	unsigned int i, process_count;
 	int ret;
 
 	ctx = mdbox_purge_alloc(storage);
-	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
+	for (i = 0, ret = 0; i < mdbox_map_get_shard_count(storage->map); i++) {
+		if (mdbox_map_get_zero_ref_files(
+			mdbox_map_get_shard(storage->map, i),
+			&ctx->purge_files) < 0)
+			ret = -1;
+	}
 	if (storage->alt_storage_dir != NULL) {
 		if (mdbox_purge_get_primary_files(ctx) < 0)
 			ret = -1;
@@ -666,19 +1014,26 @@ int mdbox_purge(struct mail_storage *_storage)
 				ret = -1;
 		}
 	}
+	mdbox_purge_add_altmove_files(ctx);
+	array_sort(&ctx->purge_files, mdbox_purge_file_cmp);
+
+	process_count = I_MIN(I_MAX(storage->set->mdbox_purge_processes, 1),
+			      array_count(&ctx->purge_files));
+	if (process_count > 0) {
+		/* the I/O budget is shared by all the processes */
+		ctx->max_bytes_per_sec =
+			storage->set->mdbox_purge_max_bytes_per_sec == 0 ? 0 :
+			I_MAX(storage->set->mdbox_purge_max_bytes_per_sec /
+			      process_count, 1);
+		ctx->max_iops = storage->set->mdbox_purge_max_iops == 0 ? 0 :
+			I_MAX(storage->set->mdbox_purge_max_iops /
+			      process_count, 1);
+	}
 
-	seq_range_array_iter_init(&iter, &ctx->purge_file_ids); i = 0;
-	while (ret == 0 &&
-	       seq_range_array_iter_nth(&iter, i++, &file_id)) T_BEGIN {
-		file = mdbox_file_init(storage, file_id);
-		if (dbox_file_open(file, &deleted) > 0 && !deleted) {
-			if (mdbox_file_purge(ctx, file, file_id) < 0)
-				ret = -1;
-		} else {
-			if (mdbox_map_remove_file_id(storage->map, file_id) < 0)
-				ret = -1;
-		}
-		dbox_file_unref(&file);
+	if (ret == 0 && process_count == 1)
+		ret = mdbox_purge_files(ctx, 0, 1, -1);
+	else if (ret == 0 && process_count > 1) T_BEGIN {
+		ret = mdbox_purge_parallel(ctx, process_count);
 	} T_END;
 	mdbox_purge_free(&ctx);
 
@@ -37,6 +37,8 @@ struct mdbox_save_context {
 	struct dbox_file *cur_file;
 	struct dbox_file_append_context *cur_file_append;
 	struct mdbox_map_append_context *append_ctx;
+	/* map shard where the new mails are appended */
+	unsigned int map_shard;
 
 	ARRAY_TYPE(uint32_t) copy_map_uids;
 	struct mdbox_map_atomic_context *atomic;
@@ -120,7 +122,9 @@ mdbox_save_alloc(struct mailbox_transaction_context *t)
 	ctx->ctx.trans = t->itrans;
 	ctx->mbox = mbox;
 	ctx->atomic = mdbox_map_atomic_begin(mbox->storage->map);
-	ctx->append_ctx = mdbox_map_append_begin(ctx->atomic);
+	ctx->map_shard = mdbox_map_get_mailbox_shard(mbox->storage->map,
+						     t->box->name);
+	ctx->append_ctx = mdbox_map_append_begin(ctx->atomic, ctx->map_shard);
 	i_array_init(&ctx->mails, 32);
 	t->save_ctx = &ctx->ctx.ctx;
 	return t->save_ctx;
@@ -280,6 +284,24 @@ mdbox_save_set_map_uids(struct mdbox_save_context *ctx,
 	i_assert(next_map_uid == last_map_uid + 1);
 }
 
+static uint32_t mdbox_save_get_map_shards(struct mdbox_save_context *ctx)
+{
+	struct mdbox_map *map = ctx->mbox->storage->map;
+	const uint32_t *map_uidp;
+	uint32_t shard_mask = 0;
+
+	/* the appends' shard is needed only if something else than
+	   refcounted copies were saved */
+	if (!array_is_created(&ctx->copy_map_uids) ||
+	    array_count(&ctx->copy_map_uids) < array_count(&ctx->mails))
+		shard_mask |= 1U << ctx->map_shard;
+	if (array_is_created(&ctx->copy_map_uids)) {
+		array_foreach(&ctx->copy_map_uids, map_uidp)
+			shard_mask |= 1U << mdbox_map_get_uid_shard(map, *map_uidp);
+	}
+	return shard_mask;
+}
+
 int mdbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 {
 	struct mdbox_save_context *ctx = MDBOX_SAVECTX(_ctx);
@@ -295,8 +317,10 @@ int mdbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 		return -1;
 	}
 
-	/* make sure the map gets locked */
-	if (mdbox_map_atomic_lock(ctx->atomic, "saving") < 0) {
+	/* make sure the needed map shards get locked */
+	if (mdbox_map_atomic_lock_shards(ctx->atomic,
+					 mdbox_save_get_map_shards(ctx),
+					 "saving") < 0) {
 		mdbox_transaction_save_rollback(_ctx);
 		return -1;
 	}
@@ -5,6 +5,10 @@ struct mdbox_settings {
 	bool mdbox_preallocate_space;
 	uoff_t mdbox_rotate_size;
 	unsigned int mdbox_rotate_interval;
+	unsigned int mdbox_purge_processes;
+	uoff_t mdbox_purge_max_bytes_per_sec;
+	unsigned int mdbox_purge_max_iops;
+	unsigned int mdbox_map_shards;
 };
 
 const struct setting_parser_info *mdbox_get_setting_parser_info(void);
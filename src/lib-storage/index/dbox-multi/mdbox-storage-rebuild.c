@@ -54,7 +54,12 @@ struct mdbox_storage_rebuild_context {
 	ARRAY_TYPE(seq_range) seen_file_ids;
 
 	uint32_t rebuild_count;
-	uint32_t highest_file_id;
+	/* highest file_id within each shard's file_id range */
+	uint32_t highest_file_ids[MDBOX_MAP_MAX_SHARDS];
+	uint32_t next_map_uids[MDBOX_MAP_MAX_SHARDS];
+	/* The first shard has IDs above its range. Its map is reset and all
+	   of its messages are added back with new map UIDs. */
+	bool reset_first_shard;
 
 	struct mailbox_list *default_list;
 
@@ -236,23 +241,35 @@ static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
 		return 1;
 }
 
+static uint32_t *
+rebuild_get_highest_file_id(struct mdbox_storage_rebuild_context *ctx,
+			    uint32_t file_id)
+{
+	unsigned int shard = mdbox_map_get_uid_shard(ctx->storage->map,
+						     file_id);
+
+	return &ctx->highest_file_ids[shard];
+}
+
 static int
 rebuild_rename_file(struct mdbox_storage_rebuild_context *ctx,
 		    const char *dir, const char **fname_p, uint32_t *file_id_r)
 {
 	struct event *event = ctx->storage->storage.storage.event;
 	const char *old_path, *new_path, *fname = *fname_p;
+	uint32_t *highest_file_id =
+		rebuild_get_highest_file_id(ctx, *file_id_r);
 
 	old_path = t_strconcat(dir, "/", fname, NULL);
 	do {
 		new_path = t_strdup_printf("%s/"MDBOX_MAIL_FILE_FORMAT,
-					   dir, ++ctx->highest_file_id);
+					   dir, ++*highest_file_id);
 		/* use link()+unlink() instead of rename() to make sure we
 		   don't overwrite any files. */
 		if (link(old_path, new_path) == 0) {
 			i_unlink(old_path);
 			*fname_p = strrchr(new_path, '/') + 1;
-			*file_id_r = ctx->highest_file_id;
+			*file_id_r = *highest_file_id;
 			return 0;
 		}
 	} while (errno == EEXIST);
@@ -266,7 +283,7 @@ static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 {
 	struct event *event = ctx->storage->storage.storage.event;
 	struct dbox_file *file;
-	uint32_t file_id;
+	uint32_t file_id, *highest_file_id;
 	const char *id_str, *ext;
 	bool deleted;
 	int ret = 0;
@@ -285,8 +302,9 @@ static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 		return 0;
 	}
 	if (!seq_range_exists(&ctx->seen_file_ids, file_id)) {
-		if (ctx->highest_file_id < file_id)
-			ctx->highest_file_id = file_id;
+		highest_file_id = rebuild_get_highest_file_id(ctx, file_id);
+		if (*highest_file_id < file_id)
+			*highest_file_id = file_id;
 	} else {
 		/* duplicate file. either readdir() returned it twice
 		   (unlikely) or it exists in both alt and primary storage.
@@ -307,12 +325,12 @@ static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 }
 
 static void
-rebuild_add_missing_map_uids(struct mdbox_storage_rebuild_context *ctx,
-			     uint32_t next_uid)
+rebuild_add_missing_map_uids(struct mdbox_storage_rebuild_context *ctx)
 {
 	struct mdbox_rebuild_msg **msgs;
 	struct mdbox_map_mail_index_record rec;
-	unsigned int i, count;
+	struct mdbox_map *map;
+	unsigned int i, count, shard;
 	uint32_t seq;
 
 	i_zero(&rec);
@@ -325,31 +343,42 @@ rebuild_add_missing_map_uids(struct mdbox_storage_rebuild_context *ctx,
 		rec.offset = msgs[i]->offset;
 		rec.size = msgs[i]->rec_size;
 
-		msgs[i]->map_uid = next_uid++;
-		mail_index_append(ctx->atomic->sync_trans,
+		/* the messages of removed shards are added to the first
+		   shard */
+		shard = mdbox_map_get_file_shard(ctx->storage->map,
+						 msgs[i]->file_id);
+		map = mdbox_map_get_shard(ctx->storage->map, shard);
+		msgs[i]->map_uid = ctx->next_map_uids[shard]++;
+		mail_index_append(ctx->atomic->shards[shard].sync_trans,
 				  msgs[i]->map_uid, &seq);
-		mail_index_update_ext(ctx->atomic->sync_trans, seq,
-				      ctx->storage->map->map_ext_id,
-				      &rec, NULL);
+		mail_index_update_ext(ctx->atomic->shards[shard].sync_trans,
+				      seq, map->map_ext_id, &rec, NULL);
 	}
 }
 
-static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
+static void
+rebuild_apply_map_shard(struct mdbox_storage_rebuild_context *ctx,
+			struct mdbox_map *map)
 {
-	struct mdbox_map *map = ctx->storage->map;
+	struct mdbox_map_atomic_shard *ashard =
+		&ctx->atomic->shards[map->shard];
 	const struct mail_index_header *hdr;
 	struct mdbox_rebuild_msg **pos;
 	struct mdbox_rebuild_msg search_msg, *search_msgp = &search_msg;
 	struct dbox_mail_lookup_rec rec;
 	uint32_t seq;
 
-	array_sort(&ctx->msgs, mdbox_rebuild_msg_offset_cmp);
-	/* msgs now contains a list of all messages that exists in m.* files,
-	   sorted by file_id,offset */
-
-	hdr = mail_index_get_header(ctx->atomic->sync_view);
+	hdr = mail_index_get_header(ashard->sync_view);
+	if (map->shard == 0 && ctx->reset_first_shard) {
+		mail_index_reset(ashard->sync_trans);
+		mail_index_update_header(ashard->sync_trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&hdr->uid_validity, sizeof(hdr->uid_validity), TRUE);
+		ctx->next_map_uids[0] = mdbox_map_get_shard_first_id(map);
+		return;
+	}
 	for (seq = 1; seq <= hdr->messages_count; seq++) {
-		if (mdbox_map_view_lookup_rec(map, ctx->atomic->sync_view,
+		if (mdbox_map_view_lookup_rec(map, ashard->sync_view,
 					      seq, &rec) < 0) {
 			/* map or ref extension is missing from the index.
 			   Just ignore the file entirely. (Don't try to
@@ -366,10 +395,12 @@ static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
 		search_msg.rec_size = rec.rec.size;
 		pos = array_bsearch(&ctx->msgs, &search_msgp,
 				    mdbox_rebuild_msg_offset_cmp);
-		if (pos == NULL || (*pos)->map_uid != 0) {
+		if (pos == NULL || (*pos)->map_uid != 0 ||
+		    mdbox_map_get_uid_shard(map, rec.map_uid) != map->shard) {
 			/* map record points to nonexistent or
-			   a duplicate message. */
-			mail_index_expunge(ctx->atomic->sync_trans, seq);
+			   a duplicate message, or its map_uid is outside
+			   the shard. */
+			mail_index_expunge(ashard->sync_trans, seq);
 		} else {
 			/* remember this message's map_uid */
 			(*pos)->map_uid = rec.map_uid;
@@ -377,7 +408,22 @@ static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
 				(*pos)->seen_zero_ref_in_map = TRUE;
 		}
 	}
-	rebuild_add_missing_map_uids(ctx, hdr->next_uid);
+	ctx->next_map_uids[map->shard] =
+		I_MAX(hdr->next_uid, mdbox_map_get_shard_first_id(map));
+}
+
+static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
+{
+	struct mdbox_map *map = ctx->storage->map;
+	unsigned int shard;
+
+	array_sort(&ctx->msgs, mdbox_rebuild_msg_offset_cmp);
+	/* msgs now contains a list of all messages that exists in m.* files,
+	   sorted by file_id,offset */
+
+	for (shard = 0; shard < mdbox_map_get_shard_count(map); shard++)
+		rebuild_apply_map_shard(ctx, mdbox_map_get_shard(map, shard));
+	rebuild_add_missing_map_uids(ctx);
 
 	/* afterwards we're interested in looking up map_uids.
 	   re-sort the messages to make it easier. */
@@ -806,33 +852,41 @@ static int rebuild_handle_zero_refs(struct mdbox_storage_rebuild_context *ctx)
 	return 0;
 }
 
-static void rebuild_update_refcounts(struct mdbox_storage_rebuild_context *ctx)
+static void
+rebuild_update_shard_refcounts(struct mdbox_storage_rebuild_context *ctx,
+			       struct mdbox_map *map,
+			       struct mdbox_rebuild_msg *const *msgs,
+			       unsigned int count)
 {
+	struct mdbox_map_atomic_shard *ashard =
+		&ctx->atomic->shards[map->shard];
 	const struct mail_index_header *hdr;
 	const void *data;
-	struct mdbox_rebuild_msg **msgs;
 	const uint16_t *ref16_p;
 	uint32_t seq, map_uid;
-	unsigned int i, count;
+	unsigned int i;
 
 	/* update refcounts for existing map records */
-	msgs = array_get_modifiable(&ctx->msgs, &count);
-	hdr = mail_index_get_header(ctx->atomic->sync_view);
-	for (seq = 1, i = 0; seq <= hdr->messages_count && i < count; seq++) {
-		mail_index_lookup_uid(ctx->atomic->sync_view, seq, &map_uid);
+	hdr = mail_index_get_header(ashard->sync_view);
+	seq = 1;
+	if (map->shard == 0 && ctx->reset_first_shard) {
+		/* all the records are new */
+		seq = hdr->messages_count + 1;
+	}
+	for (i = 0; seq <= hdr->messages_count && i < count; seq++) {
+		mail_index_lookup_uid(ashard->sync_view, seq, &map_uid);
 		if (map_uid != msgs[i]->map_uid) {
 			/* we've already expunged this map record */
 			i_assert(map_uid < msgs[i]->map_uid);
 			continue;
 		}
 
-		mail_index_lookup_ext(ctx->atomic->sync_view, seq,
-				      ctx->storage->map->ref_ext_id,
-				      &data, NULL);
+		mail_index_lookup_ext(ashard->sync_view, seq,
+				      map->ref_ext_id, &data, NULL);
 		ref16_p = data;
 		if (ref16_p == NULL || *ref16_p != msgs[i]->refcount) {
-			mail_index_update_ext(ctx->atomic->sync_trans, seq,
-					      ctx->storage->map->ref_ext_id,
+			mail_index_update_ext(ashard->sync_trans, seq,
+					      map->ref_ext_id,
 					      &msgs[i]->refcount, NULL);
 		}
 		i++;
@@ -840,15 +894,39 @@ static void rebuild_update_refcounts(struct mdbox_storage_rebuild_context *ctx)
 
 	/* update refcounts for newly created map records */
 	for (; i < count; i++, seq++) {
-		mail_index_update_ext(ctx->atomic->sync_trans, seq,
-				      ctx->storage->map->ref_ext_id,
+		mail_index_update_ext(ashard->sync_trans, seq,
+				      map->ref_ext_id,
 				      &msgs[i]->refcount, NULL);
 	}
 }
 
+static void rebuild_update_refcounts(struct mdbox_storage_rebuild_context *ctx)
+{
+	struct mdbox_map *map = ctx->storage->map;
+	struct mdbox_rebuild_msg **msgs;
+	unsigned int i, end, count, shard;
+
+	/* msgs are sorted by map_uid, so each shard's messages are
+	   together */
+	msgs = array_get_modifiable(&ctx->msgs, &count);
+	for (shard = 0, i = 0; shard < mdbox_map_get_shard_count(map); shard++) {
+		for (end = i; end < count; end++) {
+			if (mdbox_map_get_uid_shard(map, msgs[end]->map_uid) != shard)
+				break;
+		}
+		rebuild_update_shard_refcounts(ctx,
+			mdbox_map_get_shard(map, shard), msgs + i, end - i);
+		i = end;
+	}
+	i_assert(i == count);
+}
+
 static int rebuild_finish(struct mdbox_storage_rebuild_context *ctx)
 {
+	struct mdbox_map *map = ctx->storage->map;
 	struct mdbox_map_mail_index_header map_hdr;
+	unsigned int shard;
+	uint32_t hdr_flags;
 
 	i_assert(ctx->default_list != NULL);
 
@@ -856,14 +934,31 @@ static int rebuild_finish(struct mdbox_storage_rebuild_context *ctx)
 		return -1;
 	rebuild_update_refcounts(ctx);
 
-	/* update map header */
+	/* update map headers */
 	map_hdr = ctx->orig_map_hdr;
-	map_hdr.highest_file_id = ctx->highest_file_id;
 	map_hdr.rebuild_count = ++ctx->rebuild_count;
+	for (shard = 0; shard < mdbox_map_get_shard_count(map); shard++) {
+		struct mdbox_map_atomic_shard *ashard =
+			&ctx->atomic->shards[shard];
+
+		map_hdr.highest_file_id = ctx->highest_file_ids[shard];
+		mail_index_update_header_ext(ashard->sync_trans,
+					     mdbox_map_get_shard(map, shard)->map_ext_id,
+					     0, &map_hdr, sizeof(map_hdr));
+
+		/* mail_index_fsck() set the fsck'd flag after the sync view
+		   was created, so mail_index_unset_fscked() wouldn't see it.
+		   without clearing it the next sync would rebuild again. */
+		hdr_flags = mail_index_get_header(ashard->sync_view)->flags &
+			ENUM_NEGATE(MAIL_INDEX_HDR_FLAG_FSCKD);
+		mail_index_update_header(ashard->sync_trans,
+			offsetof(struct mail_index_header, flags),
+			&hdr_flags, sizeof(hdr_flags), FALSE);
+	}
 
-	mail_index_update_header_ext(ctx->atomic->sync_trans,
-				     ctx->storage->map->map_ext_id,
-				     0, &map_hdr, sizeof(map_hdr));
+	/* the messages of the shards above mdbox_map_shards were moved to
+	   the first shard */
+	mdbox_map_remove_unused_shards(map);
 	return 0;
 }
 
@@ -906,34 +1001,54 @@ mdbox_storage_rebuild_scan_dir(struct mdbox_storage_rebuild_context *ctx,
 static int
 mdbox_storage_rebuild_scan_prepare(struct mdbox_storage_rebuild_context *ctx)
 {
+	struct mdbox_map *map;
+	struct mdbox_map_mail_index_header map_hdr;
 	const void *data;
 	size_t data_size;
+	unsigned int shard;
 
 	if (mdbox_map_open_or_create(ctx->storage->map) < 0)
 		return -1;
 
-	/* begin by locking the map, so that other processes can't try to
-	   rebuild at the same time. */
+	/* begin by locking all the map shards, so that other processes can't
+	   try to rebuild at the same time. */
 	if (mdbox_map_atomic_lock(ctx->atomic, "mdbox storage rebuild") < 0)
 		return -1;
 
-	/* fsck the map just in case its UIDs are broken */
-	if (mail_index_fsck(ctx->storage->map->index) < 0) {
-		mail_storage_set_index_error(&ctx->storage->storage.storage,
-					     ctx->storage->map->index);
-		return -1;
-	}
-
-	/* get old map header */
-	mail_index_get_header_ext(ctx->atomic->sync_view,
-				  ctx->storage->map->map_ext_id,
-				  &data, &data_size);
-	i_zero(&ctx->orig_map_hdr);
-	if (data_size > 0) {
-		memcpy(&ctx->orig_map_hdr, data,
-		       I_MIN(data_size, sizeof(ctx->orig_map_hdr)));
+	for (shard = 0; shard < mdbox_map_get_shard_count(ctx->storage->map);
+	     shard++) {
+		map = mdbox_map_get_shard(ctx->storage->map, shard);
+		/* fsck the map just in case its UIDs are broken */
+		if (mail_index_fsck(map->index) < 0) {
+			mail_storage_set_index_error(&ctx->storage->storage.storage,
+						     map->index);
+			return -1;
+		}
+		/* this rebuild handles it. don't let the next map refresh
+		   mark the storage corrupted again. */
+		(void)mail_index_reset_fscked(map->index);
+
+		/* get old map header */
+		mail_index_get_header_ext(ctx->atomic->shards[shard].sync_view,
+					  map->map_ext_id, &data, &data_size);
+		i_zero(&map_hdr);
+		if (data_size > 0) {
+			memcpy(&map_hdr, data,
+			       I_MIN(data_size, sizeof(map_hdr)));
+		}
+		if (shard == 0 && mdbox_map_has_unsharded_ids(map,
+				ctx->atomic->shards[shard].sync_view)) {
+			e_warning(ctx->storage->storage.storage.event,
+				  "rebuild: Renumbering map UIDs and file IDs "
+				  "above the first shard's range");
+			ctx->reset_first_shard = TRUE;
+			/* found again from the files */
+			map_hdr.highest_file_id = 0;
+		}
+		if (shard == 0)
+			ctx->orig_map_hdr = map_hdr;
+		ctx->highest_file_ids[shard] = map_hdr.highest_file_id;
 	}
-	ctx->highest_file_id = ctx->orig_map_hdr.highest_file_id;
 
 	/* get storage rebuild counter after locking */
 	ctx->rebuild_count = mdbox_map_get_rebuild_count(ctx->storage->map);
@@ -3,7 +3,8 @@
 /*
    Expunging works like:
 
-   1. Lock map index by beginning a map sync.
+   1. Lock the map index shards containing the expunged messages by
+      beginning a map sync.
    2. Write map UID refcount changes to map index (=> tail != head).
    3. Expunge messages from mailbox index.
    4. Finish map sync, which updates tail=head and unlocks map index.
@@ -196,10 +197,44 @@ static int mdbox_sync_index(struct mdbox_sync_context *ctx)
 		(ctx->mbox->storage->corrupted ? 0 : -1);
 }
 
+static uint32_t mdbox_sync_get_expunge_shards(struct mdbox_sync_context *ctx)
+{
+	struct mdbox_map *map = ctx->mbox->storage->map;
+	const struct mdbox_mail_index_record *dbox_rec;
+	struct mail_index_sync_rec sync_rec;
+	const void *data;
+	unsigned int shard;
+	uint32_t seq, seq1, seq2, shard_mask = 0;
+
+	while (mail_index_sync_next(ctx->index_sync_ctx, &sync_rec)) {
+		if (sync_rec.type != MAIL_INDEX_SYNC_TYPE_EXPUNGE ||
+		    !mail_index_lookup_seq_range(ctx->sync_view,
+						 sync_rec.uid1, sync_rec.uid2,
+						 &seq1, &seq2))
+			continue;
+
+		for (seq = seq1; seq <= seq2; seq++) {
+			mail_index_lookup_ext(ctx->sync_view, seq,
+					      ctx->mbox->ext_id, &data, NULL);
+			dbox_rec = data;
+			if (dbox_rec == NULL || dbox_rec->map_uid == 0) {
+				/* the error is handled by the actual sync */
+				continue;
+			}
+			shard = mdbox_map_get_uid_shard(map, dbox_rec->map_uid);
+			if (shard < mdbox_map_get_shard_count(map))
+				shard_mask |= 1U << shard;
+		}
+	}
+	mail_index_sync_reset(ctx->index_sync_ctx);
+	return shard_mask;
+}
+
 static int mdbox_sync_try_begin(struct mdbox_sync_context *ctx,
 				enum mail_index_sync_flags sync_flags)
 {
 	struct mdbox_mailbox *mbox = ctx->mbox;
+	uint32_t shard_mask;
 	int ret;
 
 	ret = index_storage_expunged_sync_begin(&mbox->box, &ctx->index_sync_ctx,
@@ -209,15 +244,25 @@ static int mdbox_sync_try_begin(struct mdbox_sync_context *ctx,
 	if (ret <= 0)
 		return ret; /* error / nothing to do */
 
-	if (!mdbox_map_atomic_is_locked(ctx->atomic) &&
-	    mail_index_sync_has_expunges(ctx->index_sync_ctx)) {
-		/* we have expunges, so we need to write to map.
-		   it needs to be locked before mailbox index. */
+	if (!mail_index_sync_has_expunges(ctx->index_sync_ctx))
+		return 1;
+
+	/* we have expunges, so we need to write to the map shards containing
+	   the messages. they need to be locked before mailbox index. */
+	shard_mask = mdbox_sync_get_expunge_shards(ctx);
+	if (!mdbox_map_atomic_is_locked(ctx->atomic) ||
+	    (shard_mask & ~mdbox_map_atomic_get_locked_shards(ctx->atomic)) != 0) {
 		mail_index_sync_set_reason(ctx->index_sync_ctx, "mdbox expunge check");
 		mail_index_sync_rollback(&ctx->index_sync_ctx);
 		index_storage_expunging_deinit(&ctx->mbox->box);
 
-		if (mdbox_map_atomic_lock(ctx->atomic, "mdbox syncing with expunges") < 0)
+		if (shard_mask == 0) {
+			/* the expunged messages are already gone. lock the
+			   first shard to get the sync done. */
+			shard_mask = 1;
+		}
+		if (mdbox_map_atomic_lock_shards(ctx->atomic, shard_mask,
+						 "mdbox syncing with expunges") < 0)
 			return -1;
 		return mdbox_sync_try_begin(ctx, sync_flags);
 	}
@@ -238,6 +283,13 @@ int mdbox_sync_begin(struct mdbox_mailbox *mbox, enum mdbox_sync_flags flags,
 
 	*ctx_r = NULL;
 
+	/* with multiple shards the map is opened already here, so that IDs
+	   above the first shard's range get renumbered before they're looked
+	   up from the wrong shards */
+	if (mdbox_map_get_shard_count(mbox->storage->map) > 1 &&
+	    mdbox_map_open(mbox->storage->map) < 0)
+		return -1;
+
 	/* avoid race conditions with mailbox creation, don't check for dbox
 	   headers until syncing has locked the mailbox */
 	rebuild = mbox->storage->corrupted ||
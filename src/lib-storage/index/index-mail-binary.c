@@ -587,9 +587,20 @@ int index_mail_get_binary_stream(struct mail *_mail,
 		i_stream_seek(mail->data.stream, part->physical_pos +
 			      (include_hdr ? 0 :
 			       part->header_size.physical_size));
-		input = i_stream_create_crlf(mail->data.stream);
-		*stream_r = i_stream_create_limit(input, *size_r);
-		i_stream_unref(&input);
+		if (part->body_size.physical_size ==
+		    part->body_size.virtual_size &&
+		    (!include_hdr || part->header_size.physical_size ==
+				     part->header_size.virtual_size)) {
+			/* already has CRLF linefeeds. don't add a crlf
+			   stream, so the mail's fd stays readable and
+			   the literal can be sent with sendfile() */
+			*stream_r = i_stream_create_limit(mail->data.stream,
+							  *size_r);
+		} else {
+			input = i_stream_create_crlf(mail->data.stream);
+			*stream_r = i_stream_create_limit(input, *size_r);
+			i_stream_unref(&input);
+		}
 		mail_storage_free_binary_cache(_mail->box->storage);
 	} else {
 		*stream_r = cache->input;
@@ -214,7 +214,8 @@ static void index_mailbox_vsize_notify_indexer(struct mailbox *box)
 	str_append_tabescaped(str, box->storage->user->username);
 	str_append_c(str, '\t');
 	str_append_tabescaped(str, box->vname);
-	str_append_c(str, '\n');
+	/* no max_recent_msgs or session ID, bulk priority */
+	str_append(str, "\t0\t\tbulk\n");
 
 	if (write_full(fd, str_data(str), str_len(str)) < 0) {
 		mailbox_set_critical(box,
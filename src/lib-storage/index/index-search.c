@@ -61,6 +61,9 @@ struct search_body_context {
         struct index_search_context *index_ctx;
 	struct istream *input;
 	struct message_part *part;
+
+	ARRAY(struct mail_search_arg *) args;
+	ARRAY(struct message_search_context *) msg_search_ctxs;
 };
 
 static void search_parse_msgset_args(unsigned int messages_count,
@@ -136,6 +139,10 @@ static void search_init_arg(struct mail_search_arg *arg,
 	case SEARCH_MAILBOX_GLOB:
 		ctx->have_mailbox_args = TRUE;
 		break;
+	case SEARCH_BODY:
+	case SEARCH_TEXT:
+		ctx->have_body_args = TRUE;
+		break;
 	case SEARCH_ALL:
 		if (!arg->match_not)
 			arg->match_always = TRUE;
@@ -713,12 +720,10 @@ static void search_header(struct message_header_line *hdr,
 	}
 }
 
-static void search_body(struct mail_search_arg *arg,
-			struct search_body_context *ctx)
+static void search_body_add(struct mail_search_arg *arg,
+			    struct search_body_context *ctx)
 {
 	struct message_search_context *msg_search_ctx;
-	const char *error;
-	int ret;
 
 	switch (arg->type) {
 	case SEARCH_BODY:
@@ -733,15 +738,42 @@ static void search_body(struct mail_search_arg *arg,
 		ARG_SET_RESULT(arg, 0);
 		return;
 	}
+	array_push_back(&ctx->args, &arg);
+	array_push_back(&ctx->msg_search_ctxs, &msg_search_ctx);
+}
+
+static int search_body(struct mail_search_arg *args,
+		       struct search_body_context *ctx)
+{
+	struct message_search_context *const *msg_search_ctxs;
+	struct mail_search_arg *const *argp;
+	const char *error;
+	bool *matches;
+	unsigned int i, count;
+	int ret;
+
+	/* Search all the body/text keys with a single pass over the message,
+	   so it's parsed and decoded only once. */
+	t_array_init(&ctx->args, 8);
+	t_array_init(&ctx->msg_search_ctxs, 8);
+	(void)mail_search_args_foreach(args, search_body_add, ctx);
+
+	msg_search_ctxs = array_get(&ctx->msg_search_ctxs, &count);
+	if (count == 0)
+		return mail_search_args_foreach(args, search_none, NULL);
+	matches = t_new(bool, count);
 
 	i_stream_seek(ctx->input, 0);
-	ret = message_search_msg(msg_search_ctx, ctx->input, ctx->part, &error);
+	ret = message_search_msg_multi(msg_search_ctxs, count, ctx->input,
+				       ctx->part, matches, &error);
 	if (ret < 0 && ctx->input->stream_errno == 0) {
 		/* try again without cached parts */
 		index_mail_set_message_parts_corrupted(ctx->index_ctx->cur_mail, error);
 
 		i_stream_seek(ctx->input, 0);
-		ret = message_search_msg(msg_search_ctx, ctx->input, NULL, &error);
+		ret = message_search_msg_multi(msg_search_ctxs, count,
+					       ctx->input, NULL, matches,
+					       &error);
 		i_assert(ret >= 0 || ctx->input->stream_errno != 0);
 	}
 	if (ctx->input->stream_errno != 0) {
@@ -750,7 +782,11 @@ static void search_body(struct mail_search_arg *arg,
 			i_stream_get_error(ctx->input));
 	}
 
-	ARG_SET_RESULT(arg, ret);
+	array_foreach(&ctx->args, argp) {
+		i = array_foreach_idx(&ctx->args, argp);
+		ARG_SET_RESULT(*argp, ret < 0 ? -1 : (matches[i] ? 1 : 0));
+	}
+	return mail_search_args_foreach(args, search_none, NULL);
 }
 
 static int search_arg_match_text(struct mail_search_arg *args,
@@ -885,7 +921,10 @@ static int search_arg_match_text(struct mail_search_arg *args,
 	(void)mail_get_parts(ctx->cur_mail, &body_ctx.part);
 	ctx->cur_mail->lookup_abort = MAIL_LOOKUP_ABORT_NEVER;
 
-	return mail_search_args_foreach(args, search_body, &body_ctx);
+	T_BEGIN {
+		ret = search_body(args, &body_ctx);
+	} T_END;
+	return ret;
 }
 
 static bool
@@ -1308,6 +1347,44 @@ wanted_sort_fields_get(struct mailbox *box,
 	}
 }
 
+static void search_init_sort_order(struct index_search_context *ctx,
+				   const struct mail_search_arg *args)
+{
+	uint32_t first_new_seq;
+
+	/* The sort order of a search matching all messages is stored, so
+	   only the messages saved after it need to be searched and sorted. */
+	if (ctx->mail_ctx.sort_program == NULL ||
+	    args == NULL || args->type != SEARCH_ALL ||
+	    args->next != NULL || args->match_not)
+		return;
+	if (!index_sort_program_init_stored(ctx->mail_ctx.sort_program,
+					    &first_new_seq))
+		return;
+
+	if (ctx->seq1 < first_new_seq)
+		ctx->seq1 = first_new_seq;
+	if (ctx->seq1 > ctx->seq2) {
+		/* no new messages */
+		ctx->seq1 = 1;
+		ctx->seq2 = 0;
+	}
+}
+
+static void search_init_prefetch(struct index_search_context *ctx)
+{
+	const struct mail_storage_settings *set = ctx->box->storage->set;
+
+	if (!ctx->have_body_args)
+		return;
+
+	/* BODY/TEXT searches need to read the mails. Keep more of them
+	   prefetched so the kernel reads them in parallel while the earlier
+	   ones are being matched. The results are still returned in order. */
+	mailbox_search_set_prefetch_count(&ctx->mail_ctx,
+					  set->mail_search_prefetch_count);
+}
+
 struct mail_search_context *
 index_storage_search_init(struct mailbox_transaction_context *t,
 			  struct mail_search_args *args,
@@ -1359,7 +1436,9 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->mail_ctx.wanted_fields |= wanted_fields;
 
 	search_get_seqset(ctx, status.messages, args->args);
+	search_init_sort_order(ctx, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
+	search_init_prefetch(ctx);
 
 	/* Need to reset results for match_always cases */
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
@@ -1773,10 +1852,14 @@ static int search_more_with_prefetching(struct index_search_context *ctx,
 			*mail_r = mail;
 			return 1;
 		}
-		if (mail_prefetch(mail) && ctx->mail_ctx.unused_mail_idx == 0) {
-			/* no prefetching done, return it immediately */
-			*mail_r = mail;
-			return 1;
+		if (mail_prefetch(mail)) {
+			if (ctx->mail_ctx.unused_mail_idx == 0) {
+				/* no prefetching done, return it immediately */
+				*mail_r = mail;
+				return 1;
+			}
+		} else {
+			ctx->mail_ctx.prefetch_count++;
 		}
 		ctx->mail_ctx.unused_mail_idx++;
 	}
@@ -1851,6 +1934,11 @@ static int search_more(struct index_search_context *ctx,
 			break;
 		}
 	}
+	if (ret > 0) {
+		imail = INDEX_MAIL(*mail_r);
+		if (imail->data.prefetch_sent)
+			ctx->mail_ctx.prefetch_hits++;
+	}
 	return ret;
 }
 
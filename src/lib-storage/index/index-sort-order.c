@@ -0,0 +1,391 @@
+/* Copyright (c) 2006-2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "byteorder.h"
+#include "crc32.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "mail-index-private.h"
+#include "index-storage.h"
+#include "index-sort-private.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define MAIL_SORT_ORDER_IO_RECORD_COUNT 1024
+
+static void
+index_sort_order_header_export(const struct mail_sort_order_header *hdr,
+			       struct mail_sort_order_header *disk_hdr_r)
+{
+	i_zero(disk_hdr_r);
+	disk_hdr_r->version = hdr->version;
+	disk_hdr_r->header_size = cpu16_to_le(hdr->header_size);
+	disk_hdr_r->record_size = cpu16_to_le(hdr->record_size);
+	disk_hdr_r->uid_validity = cpu32_to_le(hdr->uid_validity);
+	disk_hdr_r->last_uid = cpu32_to_le(hdr->last_uid);
+	disk_hdr_r->uid_count = cpu32_to_le(hdr->uid_count);
+	disk_hdr_r->crc32 = cpu32_to_le(hdr->crc32);
+}
+
+static void
+index_sort_order_header_import(const struct mail_sort_order_header *disk_hdr,
+			       struct mail_sort_order_header *hdr_r)
+{
+	i_zero(hdr_r);
+	hdr_r->version = disk_hdr->version;
+	hdr_r->header_size = le16_to_cpu(disk_hdr->header_size);
+	hdr_r->record_size = le16_to_cpu(disk_hdr->record_size);
+	hdr_r->uid_validity = le32_to_cpu(disk_hdr->uid_validity);
+	hdr_r->last_uid = le32_to_cpu(disk_hdr->last_uid);
+	hdr_r->uid_count = le32_to_cpu(disk_hdr->uid_count);
+	hdr_r->crc32 = le32_to_cpu(disk_hdr->crc32);
+}
+
+static int
+index_sort_order_file_write(int fd, struct mail_sort_order_header *hdr,
+			    const ARRAY_TYPE(uint32_t) *uids)
+{
+	uint32_t recs[MAIL_SORT_ORDER_IO_RECORD_COUNT];
+	struct mail_sort_order_header disk_hdr;
+	const uint32_t *uidp;
+	uint32_t i, j, count, crc;
+	off_t offset = sizeof(disk_hdr);
+
+	hdr->version = MAIL_SORT_ORDER_VERSION;
+	hdr->header_size = sizeof(struct mail_sort_order_header);
+	hdr->record_size = sizeof(uint32_t);
+	hdr->uid_count = array_count(uids);
+	hdr->crc32 = 0;
+	index_sort_order_header_export(hdr, &disk_hdr);
+	crc = crc32_data(&disk_hdr, sizeof(disk_hdr));
+
+	/* the header contains the CRC, so write it last */
+	uidp = array_front(uids);
+	for (i = 0; i < hdr->uid_count; i += count) {
+		count = I_MIN(hdr->uid_count - i, N_ELEMENTS(recs));
+		for (j = 0; j < count; j++)
+			recs[j] = cpu32_to_le(uidp[i + j]);
+		crc = crc32_data_more(crc, recs, sizeof(recs[0]) * count);
+		if (pwrite_full(fd, recs, sizeof(recs[0]) * count, offset) < 0)
+			return -1;
+		offset += sizeof(recs[0]) * count;
+	}
+	hdr->crc32 = crc;
+	disk_hdr.crc32 = cpu32_to_le(crc);
+	return pwrite_full(fd, &disk_hdr, sizeof(disk_hdr), 0);
+}
+
+static int
+index_sort_order_file_read(int fd, struct mail_sort_order_header *hdr_r,
+			   ARRAY_TYPE(uint32_t) *uids, const char **error_r)
+{
+	uint32_t recs[MAIL_SORT_ORDER_IO_RECORD_COUNT];
+	struct mail_sort_order_header disk_hdr;
+	struct stat st;
+	uint32_t i, j, count, crc, uid;
+	int ret;
+
+	*error_r = NULL;
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if ((ret = pread_full(fd, &disk_hdr, sizeof(disk_hdr), 0)) <= 0) {
+		if (ret == 0)
+			*error_r = "File is truncated (header missing)";
+		return ret;
+	}
+	index_sort_order_header_import(&disk_hdr, hdr_r);
+	if (hdr_r->version != MAIL_SORT_ORDER_VERSION) {
+		/* old version - just rebuild */
+		return 0;
+	}
+	if (hdr_r->header_size != sizeof(struct mail_sort_order_header) ||
+	    hdr_r->record_size != sizeof(uint32_t)) {
+		*error_r = t_strdup_printf(
+			"Invalid header_size=%u or record_size=%u",
+			hdr_r->header_size, hdr_r->record_size);
+		return 0;
+	}
+	if ((uoff_t)st.st_size != sizeof(disk_hdr) +
+	    (uoff_t)hdr_r->uid_count * sizeof(recs[0])) {
+		*error_r = t_strdup_printf(
+			"File size %"PRIuUOFF_T" doesn't match uid_count=%u",
+			(uoff_t)st.st_size, hdr_r->uid_count);
+		return 0;
+	}
+
+	disk_hdr.crc32 = 0;
+	crc = crc32_data(&disk_hdr, sizeof(disk_hdr));
+
+	for (i = 0; i < hdr_r->uid_count; i += count) {
+		count = I_MIN(hdr_r->uid_count - i, N_ELEMENTS(recs));
+		ret = pread_full(fd, recs, sizeof(recs[0]) * count,
+				 sizeof(disk_hdr) + (off_t)i * sizeof(recs[0]));
+		if (ret <= 0) {
+			if (ret == 0)
+				*error_r = "File is truncated";
+			return ret;
+		}
+		crc = crc32_data_more(crc, recs, sizeof(recs[0]) * count);
+		for (j = 0; j < count; j++) {
+			uid = le32_to_cpu(recs[j]);
+			if (uid == 0 || uid > hdr_r->last_uid) {
+				*error_r = t_strdup_printf(
+					"UID %u is outside last_uid=%u",
+					uid, hdr_r->last_uid);
+				return 0;
+			}
+			array_push_back(uids, &uid);
+		}
+	}
+	if (crc != hdr_r->crc32) {
+		*error_r = "CRC32 doesn't match";
+		return 0;
+	}
+	return 1;
+}
+
+static bool
+index_sort_order_is_stable(const enum mail_sort_type *sort_program)
+{
+	for (unsigned int i = 0; sort_program[i] != MAIL_SORT_END; i++) {
+		switch (sort_program[i] & MAIL_SORT_MASK) {
+		case MAIL_SORT_RELEVANCY:
+			/* depends on the search query */
+		case MAIL_SORT_POP3_ORDER:
+			/* can change without the mail changing */
+			return FALSE;
+		default:
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static bool
+index_sort_order_uids_to_seqs(struct mail_search_sort_program *program,
+			      const struct mail_sort_order_header *hdr,
+			      const ARRAY_TYPE(uint32_t) *uids,
+			      const char **error_r)
+{
+	struct mail_index_view *view = program->t->view;
+	buffer_t *seen;
+	const uint32_t *uidp;
+	uint32_t seq, seq1, seq2, old_count;
+	unsigned char *bits;
+
+	*error_r = NULL;
+	if (!mail_index_lookup_seq_range(view, 1, hdr->last_uid, &seq1, &seq2))
+		old_count = 0;
+	else
+		old_count = seq2;
+
+	seen = t_buffer_create(old_count / 8 + 1);
+	buffer_append_zero(seen, old_count / 8 + 1);
+	bits = buffer_get_modifiable_data(seen, NULL);
+
+	i_array_init(&program->order_seqs, old_count + 1);
+	array_foreach(uids, uidp) {
+		if (!mail_index_lookup_seq(view, *uidp, &seq)) {
+			/* expunged */
+			program->order_changed = TRUE;
+			continue;
+		}
+		if ((bits[seq / 8] & (1 << (seq % 8))) != 0) {
+			*error_r = t_strdup_printf("UID %u is duplicated",
+						   *uidp);
+			return FALSE;
+		}
+		bits[seq / 8] |= 1 << (seq % 8);
+		array_push_back(&program->order_seqs, &seq);
+	}
+	if (array_count(&program->order_seqs) != old_count) {
+		/* some messages are missing from the file - rebuild */
+		return FALSE;
+	}
+	return TRUE;
+}
+
+bool index_sort_order_read(struct mail_search_sort_program *program,
+			   uint32_t *first_new_seq_r)
+{
+	struct mailbox *box = program->t->box;
+	const struct mail_index_header *idx_hdr;
+	struct mail_sort_order_header hdr;
+	ARRAY_TYPE(uint32_t) uids;
+	const char *error;
+	string_t *str;
+	unsigned int i;
+	int fd, ret;
+	bool success;
+
+	*first_new_seq_r = 1;
+	if (mail_index_is_in_memory(box->index) ||
+	    !index_sort_order_is_stable(program->sort_program))
+		return FALSE;
+
+	str = t_str_new(128);
+	str_printfa(str, "%s"MAIL_SORT_ORDER_SUFFIX, box->index->filepath);
+	for (i = 0; program->sort_program[i] != MAIL_SORT_END; i++) {
+		if (i > 0)
+			str_append_c(str, '-');
+		str_printfa(str, "%04x", program->sort_program[i]);
+	}
+	program->order_path = i_strdup(str_c(str));
+	/* write the file when the sort finishes, unless it's found to be
+	   up to date */
+	program->order_changed = TRUE;
+
+	fd = open(program->order_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			mailbox_set_critical(box, "open(%s) failed: %m",
+					     program->order_path);
+		}
+		return FALSE;
+	}
+	t_array_init(&uids, 128);
+	ret = index_sort_order_file_read(fd, &hdr, &uids, &error);
+	if (ret < 0) {
+		mailbox_set_critical(box, "read(%s) failed: %m",
+				     program->order_path);
+	}
+	i_close_fd(&fd);
+	if (ret <= 0) {
+		if (error != NULL)
+			goto corrupted;
+		return FALSE;
+	}
+
+	idx_hdr = mail_index_get_header(program->t->view);
+	if (hdr.uid_validity != idx_hdr->uid_validity ||
+	    hdr.last_uid == 0 || hdr.last_uid >= idx_hdr->next_uid) {
+		/* the mailbox was recreated - just rebuild */
+		return FALSE;
+	}
+
+	program->order_changed = FALSE;
+	success = index_sort_order_uids_to_seqs(program, &hdr, &uids, &error);
+	if (!success) {
+		array_free(&program->order_seqs);
+		program->order_changed = TRUE;
+		if (error != NULL)
+			goto corrupted;
+		return FALSE;
+	}
+	*first_new_seq_r = array_count(&program->order_seqs) + 1;
+	return TRUE;
+
+corrupted:
+	mailbox_set_critical(box, "Corrupted sort order file %s: %s",
+			     program->order_path, error);
+	i_unlink_if_exists(program->order_path);
+	return FALSE;
+}
+
+void index_sort_order_merge(struct mail_search_sort_program *program)
+{
+	ARRAY_TYPE(uint32_t) merged;
+	const uint32_t *old_seqs, *seqp;
+	unsigned int i, new_count, old_count, pos, left, right, idx;
+
+	if (!array_is_created(&program->order_seqs))
+		return;
+
+	/* program->seqs may have been created with a larger element size by
+	   the sort function, so access it only with array_idx() */
+	new_count = array_count(&program->seqs);
+	old_seqs = array_get(&program->order_seqs, &old_count);
+	i_array_init(&merged, old_count + new_count);
+	for (i = pos = 0; i < new_count; i++) {
+		seqp = array_idx(&program->seqs, i);
+		/* find the first old message sorting after the new one. the
+		   new messages were sorted already, so continue from the
+		   previous position. */
+		left = pos; right = old_count;
+		while (left < right) {
+			idx = left + (right - left) / 2;
+			if (index_sort_node_cmp_type(program,
+						     program->sort_program,
+						     old_seqs[idx], *seqp) < 0)
+				left = idx + 1;
+			else
+				right = idx;
+		}
+		array_append(&merged, old_seqs + pos, left - pos);
+		array_push_back(&merged, seqp);
+		pos = left;
+	}
+	array_append(&merged, old_seqs + pos, old_count - pos);
+	if (new_count > 0)
+		program->order_changed = TRUE;
+
+	array_free(&program->seqs);
+	array_free(&program->order_seqs);
+	program->seqs = merged;
+}
+
+void index_sort_order_write(struct mail_search_sort_program *program)
+{
+	struct mailbox *box = program->t->box;
+	const struct mailbox_permissions *perm = mailbox_get_permissions(box);
+	struct mail_sort_order_header hdr;
+	ARRAY_TYPE(uint32_t) uids;
+	const uint32_t *seqp;
+	const char *temp_path;
+	unsigned int i, count;
+	uint32_t uid;
+	string_t *str;
+	int fd;
+
+	if (program->order_path == NULL || !program->order_changed ||
+	    program->failed)
+		return;
+
+	i_zero(&hdr);
+	hdr.uid_validity =
+		mail_index_get_header(program->t->view)->uid_validity;
+	count = array_count(&program->seqs);
+	t_array_init(&uids, count + 1);
+	for (i = 0; i < count; i++) {
+		seqp = array_idx(&program->seqs, i);
+		mail_index_lookup_uid(program->t->view, *seqp, &uid);
+		array_push_back(&uids, &uid);
+		if (hdr.last_uid < uid)
+			hdr.last_uid = uid;
+	}
+	if (hdr.last_uid == 0)
+		return;
+
+	str = t_str_new(256);
+	str_append(str, program->order_path);
+	fd = safe_mkstemp_hostpid_group(str, perm->file_create_mode,
+					perm->file_create_gid,
+					perm->file_create_gid_origin);
+	temp_path = str_c(str);
+	if (fd == -1) {
+		mailbox_set_critical(box, "safe_mkstemp(%s) failed: %m",
+				     temp_path);
+		return;
+	}
+	if (index_sort_order_file_write(fd, &hdr, &uids) < 0) {
+		mailbox_set_critical(box, "write(%s) failed: %m", temp_path);
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return;
+	}
+	if (close(fd) < 0) {
+		mailbox_set_critical(box, "close(%s) failed: %m", temp_path);
+		i_unlink(temp_path);
+	} else if (rename(temp_path, program->order_path) < 0) {
+		mailbox_set_critical(box, "rename(%s, %s) failed: %m",
+				     temp_path, program->order_path);
+		i_unlink(temp_path);
+	} else {
+		program->order_changed = FALSE;
+	}
+}
@@ -3,11 +3,36 @@
 
 #include "index-sort.h"
 
+#define MAIL_SORT_ORDER_SUFFIX ".sort."
+
+/* The result of a SORT .. ALL search is saved to a MAIL_SORT_ORDER_SUFFIX
+   file named after the sort program, so the next sort with the same program
+   only needs to sort the messages saved after last_uid and merge them in.
+   All the fields are written in little endian byte order. */
+struct mail_sort_order_header {
+#define MAIL_SORT_ORDER_VERSION 1
+	uint8_t version;
+	uint8_t unused[3];
+	/* sizeof(struct mail_sort_order_header) and sizeof(uint32_t) */
+	uint16_t header_size;
+	uint16_t record_size;
+
+	uint32_t uid_validity;
+	/* All the messages up to this UID are in the file */
+	uint32_t last_uid;
+	uint32_t uid_count;
+	/* CRC32 of the header (with this field as 0) and the UIDs */
+	uint32_t crc32;
+	/* uint32_t uids[uid_count] follow in the sort order */
+};
+
 struct mail_search_sort_program {
 	struct mailbox_transaction_context *t;
 	enum mail_sort_type sort_program[MAX_SORT_PROGRAM_SIZE];
 	struct mail *temp_mail;
 	unsigned int slow_mails_left;
+	/* date.received and date.sent cache columns, if they're enabled */
+	uint32_t arrival_column_ext_id, date_column_ext_id;
 
 	void (*sort_list_add)(struct mail_search_sort_program *program,
 			      struct mail *mail);
@@ -17,7 +42,15 @@ struct mail_search_sort_program {
 	ARRAY_TYPE(uint32_t) seqs;
 	unsigned int iter_idx;
 
+	/* MAIL_SORT_ORDER_SUFFIX file path, if the sort order is stored */
+	char *order_path;
+	/* Sequences of the messages read from the order_path file */
+	ARRAY_TYPE(uint32_t) order_seqs;
+
 	bool failed;
+	bool arrival_column;
+	bool date_column;
+	bool order_changed;
 };
 
 /* Returns 1 on success, 0 if mail is already expunged, -1 on other errors. */
@@ -27,6 +60,16 @@ int index_sort_node_cmp_type(struct mail_search_sort_program *program,
 			     const enum mail_sort_type *sort_program,
 			     uint32_t seq1, uint32_t seq2);
 
+/* Returns TRUE if the sort order was read from the MAIL_SORT_ORDER_SUFFIX
+   file. Only the messages starting from first_new_seq_r then need to be
+   added to the sort list. */
+bool index_sort_order_read(struct mail_search_sort_program *program,
+			   uint32_t *first_new_seq_r);
+/* Merge the sorted new messages into the sort order that was read. */
+void index_sort_order_merge(struct mail_search_sort_program *program);
+/* Write the sort order file if it has changed. */
+void index_sort_order_write(struct mail_search_sort_program *program);
+
 void index_sort_list_init_string(struct mail_search_sort_program *program);
 void index_sort_list_add_string(struct mail_search_sort_program *program,
 				struct mail *mail);
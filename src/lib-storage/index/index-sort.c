@@ -7,6 +7,7 @@
 #include "message-address.h"
 #include "message-header-decode.h"
 #include "imap-base-subject.h"
+#include "mail-cache.h"
 #include "index-storage.h"
 #include "index-sort-private.h"
 
@@ -36,6 +37,10 @@ struct sort_cmp_context {
 
 static struct sort_cmp_context static_node_cmp_context;
 
+static void
+index_sort_set_seq(struct mail_search_sort_program *program,
+		   struct mail *mail, uint32_t seq);
+
 static void
 index_sort_program_set_mail_failed(struct mail_search_sort_program *program,
 				   struct mail *mail)
@@ -71,6 +76,82 @@ index_sort_program_set_date_failed(struct mail_search_sort_program *program,
 	}
 }
 
+static bool
+index_sort_column_lookup(struct mail_search_sort_program *program,
+			 uint32_t ext_id, uint32_t seq, uint32_t *time_r)
+{
+	const void *data;
+	bool expunged;
+
+	mail_index_lookup_ext(program->t->view, seq, ext_id, &data, &expunged);
+	if (data == NULL || expunged)
+		return FALSE;
+	/* both date.received and date.sent begin with the 32bit timestamp */
+	memcpy(time_r, data, sizeof(*time_r));
+	return *time_r != 0;
+}
+
+static time_t
+index_sort_get_date(struct mail_search_sort_program *program,
+		    struct mail *mail, uint32_t seq,
+		    enum mail_sort_type sort_type)
+{
+	uint32_t time32;
+	time_t date;
+	int tz;
+
+	/* With the columns enabled the date can be read directly from the
+	   index record without setting up the mail. Missing values are
+	   looked up the slow way, which also fills the column. */
+	if (sort_type == MAIL_SORT_ARRIVAL ? program->arrival_column :
+	    program->date_column) {
+		if (index_sort_column_lookup(program,
+				sort_type == MAIL_SORT_ARRIVAL ?
+				program->arrival_column_ext_id :
+				program->date_column_ext_id, seq, &time32))
+			return (time_t)time32;
+	}
+
+	if (mail->seq != seq)
+		index_sort_set_seq(program, mail, seq);
+	if (sort_type == MAIL_SORT_ARRIVAL) {
+		if (mail_get_received_date(mail, &date) < 0)
+			return index_sort_program_set_date_failed(program, mail);
+	} else {
+		if (mail_get_date(mail, &date, &tz) < 0)
+			return index_sort_program_set_date_failed(program, mail);
+		if (date == 0 && mail_get_received_date(mail, &date) < 0)
+			return index_sort_program_set_date_failed(program, mail);
+	}
+	return date;
+}
+
+static bool
+index_sort_get_column(struct mail_cache *cache, const char *field_name,
+		      uint32_t *ext_id_r)
+{
+	unsigned int field_idx;
+
+	field_idx = mail_cache_register_lookup(cache, field_name);
+	return field_idx != UINT_MAX &&
+		mail_cache_field_get_column(cache, field_idx, ext_id_r);
+}
+
+static void
+index_sort_program_init_columns(struct mail_search_sort_program *program)
+{
+	struct mail_cache *cache = program->t->box->cache;
+
+	/* Use the mail_cache_column_fields columns for the date sorts, if
+	   they're enabled. */
+	program->arrival_column =
+		index_sort_get_column(cache, "date.received",
+				      &program->arrival_column_ext_id);
+	program->date_column =
+		index_sort_get_column(cache, "date.sent",
+				      &program->date_column_ext_id);
+}
+
 static void
 index_sort_list_add_arrival(struct mail_search_sort_program *program,
 			    struct mail *mail)
@@ -80,8 +161,8 @@ index_sort_list_add_arrival(struct mail_search_sort_program *program,
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_received_date(mail, &node->date) < 0)
-		node->date = index_sort_program_set_date_failed(program, mail);
+	node->date = index_sort_get_date(program, mail, mail->seq,
+					 MAIL_SORT_ARRIVAL);
 }
 
 static void
@@ -90,16 +171,11 @@ index_sort_list_add_date(struct mail_search_sort_program *program,
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
-	int tz;
 
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_date(mail, &node->date, &tz) < 0)
-		node->date = index_sort_program_set_date_failed(program, mail);
-	else if (node->date == 0) {
-		if (mail_get_received_date(mail, &node->date) < 0)
-			node->date = index_sort_program_set_date_failed(program, mail);
-	}
+	node->date = index_sort_get_date(program, mail, mail->seq,
+					 MAIL_SORT_DATE);
 }
 
 static void
@@ -288,6 +364,10 @@ void index_sort_list_finish(struct mail_search_sort_program *program)
 
 	struct event_reason *reason = event_reason_begin("mailbox:sort");
 	program->sort_list_finish(program);
+	T_BEGIN {
+		index_sort_order_merge(program);
+		index_sort_order_write(program);
+	} T_END;
 	event_reason_end(&reason);
 }
 
@@ -403,6 +483,8 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 	if (i == MAX_SORT_PROGRAM_SIZE)
 		i_panic("index_sort_program_init(): Invalid sort program");
 
+	index_sort_program_init_columns(program);
+
 	switch (program->sort_program[0] & MAIL_SORT_MASK) {
 	case MAIL_SORT_ARRIVAL:
 	case MAIL_SORT_DATE: {
@@ -466,16 +548,31 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 	return program;
 }
 
+bool index_sort_program_init_stored(struct mail_search_sort_program *program,
+				    uint32_t *first_new_seq_r)
+{
+	bool ret;
+
+	T_BEGIN {
+		ret = index_sort_order_read(program, first_new_seq_r);
+	} T_END;
+	return ret;
+}
+
 int index_sort_program_deinit(struct mail_search_sort_program **_program)
 {
 	struct mail_search_sort_program *program = *_program;
 
 	*_program = NULL;
 
+	/* don't store the partial sort order of an unfinished search */
+	i_free(program->order_path);
 	if (program->context != NULL)
 		index_sort_list_finish(program);
 	mail_free(&program->temp_mail);
 	array_free(&program->seqs);
+	if (array_is_created(&program->order_seqs))
+		array_free(&program->order_seqs);
 
 	int ret = program->failed ? -1 : 0;
 	i_free(program);
@@ -622,7 +719,7 @@ int index_sort_node_cmp_type(struct mail_search_sort_program *program,
 	time_t time1, time2;
 	uoff_t size1, size2;
 	float float1, float2;
-	int tz, ret = 0;
+	int ret = 0;
 
 	sort_type = *sort_program & MAIL_SORT_MASK;
 	switch (sort_type) {
@@ -646,34 +743,9 @@ int index_sort_node_cmp_type(struct mail_search_sort_program *program,
 		} T_END;
 		break;
 	case MAIL_SORT_ARRIVAL:
-		index_sort_set_seq(program, mail, seq1);
-		if (mail_get_received_date(mail, &time1) < 0)
-			time1 = index_sort_program_set_date_failed(program, mail);
-
-		index_sort_set_seq(program, mail, seq2);
-		if (mail_get_received_date(mail, &time2) < 0)
-			time2 = index_sort_program_set_date_failed(program, mail);
-
-		ret = time1 < time2 ? -1 :
-			(time1 > time2 ? 1 : 0);
-		break;
 	case MAIL_SORT_DATE:
-		index_sort_set_seq(program, mail, seq1);
-		if (mail_get_date(mail, &time1, &tz) < 0)
-			time1 = index_sort_program_set_date_failed(program, mail);
-		else if (time1 == 0) {
-			if (mail_get_received_date(mail, &time1) < 0)
-				time1 = index_sort_program_set_date_failed(program, mail);
-		}
-
-		index_sort_set_seq(program, mail, seq2);
-		if (mail_get_date(mail, &time2, &tz) < 0)
-			time2 = index_sort_program_set_date_failed(program, mail);
-		else if (time2 == 0) {
-			if (mail_get_received_date(mail, &time2) < 0)
-				time2 = index_sort_program_set_date_failed(program, mail);
-		}
-
+		time1 = index_sort_get_date(program, mail, seq1, sort_type);
+		time2 = index_sort_get_date(program, mail, seq2, sort_type);
 		ret = time1 < time2 ? -1 :
 			(time1 > time2 ? 1 : 0);
 		break;
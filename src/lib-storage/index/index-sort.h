@@ -7,6 +7,12 @@ struct mail_search_sort_program *
 index_sort_program_init(struct mailbox_transaction_context *t,
 			const enum mail_sort_type *sort_program);
 int index_sort_program_deinit(struct mail_search_sort_program **program);
+/* The search matches all messages, so the sort order can be stored and
+   updated incrementally. Returns TRUE if the stored sort order was found, in
+   which case only the messages starting from first_new_seq_r need to be
+   added to the sort list. */
+bool index_sort_program_init_stored(struct mail_search_sort_program *program,
+				    uint32_t *first_new_seq_r);
 
 void index_sort_list_add(struct mail_search_sort_program *program,
 			 struct mail *mail);
@@ -78,6 +78,33 @@ static void set_cache_decisions(struct mailbox *box,
 	}
 }
 
+static void set_cache_columns(struct mailbox *box, const char *fields)
+{
+	struct mail_cache *cache = box->cache;
+	const struct mail_cache_field *field;
+	const char *const *arr;
+	unsigned int idx;
+
+	for (arr = t_strsplit_spaces(fields, " ,"); *arr != NULL; arr++) {
+		idx = mail_cache_register_lookup(cache, *arr);
+		if (idx == UINT_MAX) {
+			e_error(box->event,
+				"mail_cache_column_fields: "
+				"Unknown cache field name '%s', ignoring", *arr);
+			continue;
+		}
+		field = mail_cache_register_get_field(cache, idx);
+		if (field->type != MAIL_CACHE_FIELD_FIXED_SIZE) {
+			e_error(box->event,
+				"mail_cache_column_fields: "
+				"Cache field '%s' isn't fixed size, ignoring",
+				*arr);
+			continue;
+		}
+		mail_cache_field_set_column(cache, idx);
+	}
+}
+
 static void index_cache_register_defaults(struct mailbox *box)
 {
 	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(box);
@@ -106,6 +133,7 @@ static void index_cache_register_defaults(struct mailbox *box)
 			    set->mail_never_cache_fields,
 			    MAIL_CACHE_DECISION_NO |
 			    MAIL_CACHE_DECISION_FORCED);
+	set_cache_columns(box, set->mail_cache_column_fields);
 }
 
 void index_storage_lock_notify(struct mailbox *box,
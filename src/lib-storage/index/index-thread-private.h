@@ -6,6 +6,7 @@
 #include "mail-index-strmap.h"
 
 #define MAIL_THREAD_INDEX_SUFFIX ".thread"
+#define MAIL_THREAD_TREE_SUFFIX ".thread.tree"
 
 /* After initially building the index, assign first_invalid_msgid_idx to
    the next unused index + SKIP_COUNT. When more messages are added and
@@ -44,6 +45,44 @@ ARRAY_DEFINE_TYPE(mail_thread_node, struct mail_thread_node);
 #define MAIL_THREAD_NODE_EXISTS(node) \
 	((node)->uid != 0)
 
+/* The thread tree built for a THREAD .. ALL search is saved to the
+   MAIL_THREAD_TREE_SUFFIX file, so the next process can continue from it
+   instead of linking all the messages again. All the fields are written
+   in little endian byte order. */
+struct mail_thread_tree_header {
+#define MAIL_THREAD_TREE_VERSION 2
+	uint8_t version;
+	uint8_t unused[3];
+	/* sizeof(struct mail_thread_tree_header) and
+	   sizeof(struct mail_thread_tree_record) */
+	uint16_t header_size;
+	uint16_t record_size;
+
+	uint32_t uid_validity;
+	uint32_t last_uid;
+	/* CRC32 of the strmap records up to last_uid. If they have changed
+	   since the tree was saved (expunges, string index renumbering),
+	   the saved tree can't be used. */
+	uint32_t msgid_map_crc32;
+	uint32_t first_invalid_msgid_str_idx;
+	uint32_t next_invalid_msgid_str_idx;
+	uint32_t node_count;
+	/* CRC32 of the header (with this field as 0) and the records */
+	uint32_t crc32;
+	/* struct mail_thread_tree_record records[node_count] */
+};
+
+/* struct mail_thread_node as it's written to the tree file */
+struct mail_thread_tree_record {
+#define MAIL_THREAD_TREE_RECORD_REFCOUNT_MASK		0x3fffffff
+#define MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS	0x40000000
+#define MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS 0x80000000
+	uint32_t uid;
+	uint32_t parent_idx;
+	/* parent_link_refcount and MAIL_THREAD_TREE_RECORD_FLAG_* */
+	uint32_t refcount_flags;
+};
+
 struct mail_thread_cache {
 	uint32_t last_uid;
 	/* indexes used for invalid Message-IDs. that means no other messages
@@ -79,4 +118,17 @@ mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 
 void index_thread_mailbox_opened(struct mailbox *box);
 
+/* Write the tree file header and nodes to fd. The header is given in host
+   byte order. Its version, sizes and crc32 are filled here. Returns 0
+   on success, -1 with errno set on write error. */
+int mail_thread_tree_file_write(int fd, struct mail_thread_tree_header *hdr,
+				const struct mail_thread_node *nodes);
+/* Read the tree file written by mail_thread_tree_file_write(). The header is
+   returned in host byte order. Returns 1 if ok, 0 if the file is corrupted
+   (error_r is set) or it's of another version (error_r is NULL), -1 with
+   errno set on read error. */
+int mail_thread_tree_file_read(int fd, struct mail_thread_tree_header *hdr_r,
+			       ARRAY_TYPE(mail_thread_node) *nodes,
+			       const char **error_r);
+
 #endif
@@ -6,13 +6,21 @@
 #include "array.h"
 #include "bsearch-insert-pos.h"
 #include "hash2.h"
+#include "str.h"
+#include "byteorder.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
 #include "message-id.h"
+#include "mail-index-private.h"
 #include "mail-search.h"
 #include "mail-search-build.h"
 #include "mailbox-search-result-private.h"
 #include "index-storage.h"
 #include "index-thread-private.h"
 
+#include <stdio.h>
+
 
 #define MAIL_THREAD_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, mail_thread_storage_module)
@@ -30,6 +38,7 @@ struct mail_thread_context {
 
 	bool failed:1;
 	bool corrupted:1;
+	bool search_all:1;
 };
 
 struct mail_thread_mailbox {
@@ -46,6 +55,13 @@ struct mail_thread_mailbox {
 
 	/* set only temporarily while needed */
 	struct mail_thread_context *ctx;
+
+	/* tree file state: what's currently on disk and what the cache
+	   would be saved with */
+	char *tree_path;
+	uint32_t tree_saved_last_uid, tree_saved_crc32;
+	uint32_t tree_msgid_map_crc32;
+	bool tree_save:1;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(mail_thread_storage_module,
@@ -479,6 +495,317 @@ mail_thread_cache_fix_invalid_indexes(struct mail_thread_mailbox *tbox)
 	}
 }
 
+static uint32_t
+mail_thread_msgid_map_crc32(struct mail_thread_mailbox *tbox,
+			    uint32_t last_uid)
+{
+	const struct mail_index_strmap_rec *msgid_map;
+	unsigned int i, count;
+
+	msgid_map = array_get(tbox->msgid_map, &count);
+	for (i = 0; i < count && msgid_map[i].uid <= last_uid; i++) ;
+	return crc32_data(msgid_map, sizeof(*msgid_map) * i);
+}
+
+static void
+mail_thread_tree_set_syscall_error(struct mail_thread_mailbox *tbox,
+				   struct mailbox *box, const char *function)
+{
+	mailbox_set_critical(box, "%s(%s) failed: %m",
+			     function, tbox->tree_path);
+}
+
+#define MAIL_THREAD_TREE_IO_RECORD_COUNT 1024
+
+static void
+mail_thread_tree_header_export(const struct mail_thread_tree_header *hdr,
+			       struct mail_thread_tree_header *disk_hdr_r)
+{
+	i_zero(disk_hdr_r);
+	disk_hdr_r->version = hdr->version;
+	disk_hdr_r->header_size = cpu16_to_le(hdr->header_size);
+	disk_hdr_r->record_size = cpu16_to_le(hdr->record_size);
+	disk_hdr_r->uid_validity = cpu32_to_le(hdr->uid_validity);
+	disk_hdr_r->last_uid = cpu32_to_le(hdr->last_uid);
+	disk_hdr_r->msgid_map_crc32 = cpu32_to_le(hdr->msgid_map_crc32);
+	disk_hdr_r->first_invalid_msgid_str_idx =
+		cpu32_to_le(hdr->first_invalid_msgid_str_idx);
+	disk_hdr_r->next_invalid_msgid_str_idx =
+		cpu32_to_le(hdr->next_invalid_msgid_str_idx);
+	disk_hdr_r->node_count = cpu32_to_le(hdr->node_count);
+	disk_hdr_r->crc32 = cpu32_to_le(hdr->crc32);
+}
+
+static void
+mail_thread_tree_header_import(const struct mail_thread_tree_header *disk_hdr,
+			       struct mail_thread_tree_header *hdr_r)
+{
+	i_zero(hdr_r);
+	hdr_r->version = disk_hdr->version;
+	hdr_r->header_size = le16_to_cpu(disk_hdr->header_size);
+	hdr_r->record_size = le16_to_cpu(disk_hdr->record_size);
+	hdr_r->uid_validity = le32_to_cpu(disk_hdr->uid_validity);
+	hdr_r->last_uid = le32_to_cpu(disk_hdr->last_uid);
+	hdr_r->msgid_map_crc32 = le32_to_cpu(disk_hdr->msgid_map_crc32);
+	hdr_r->first_invalid_msgid_str_idx =
+		le32_to_cpu(disk_hdr->first_invalid_msgid_str_idx);
+	hdr_r->next_invalid_msgid_str_idx =
+		le32_to_cpu(disk_hdr->next_invalid_msgid_str_idx);
+	hdr_r->node_count = le32_to_cpu(disk_hdr->node_count);
+	hdr_r->crc32 = le32_to_cpu(disk_hdr->crc32);
+}
+
+static void
+mail_thread_tree_record_export(const struct mail_thread_node *node,
+			       struct mail_thread_tree_record *rec_r)
+{
+	uint32_t refcount_flags = node->parent_link_refcount;
+
+	if (node->expunge_rebuilds)
+		refcount_flags |= MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS;
+	if (node->child_unref_rebuilds)
+		refcount_flags |= MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS;
+	rec_r->uid = cpu32_to_le(node->uid);
+	rec_r->parent_idx = cpu32_to_le(node->parent_idx);
+	rec_r->refcount_flags = cpu32_to_le(refcount_flags);
+}
+
+static void
+mail_thread_tree_record_import(const struct mail_thread_tree_record *rec,
+			       struct mail_thread_node *node_r)
+{
+	uint32_t refcount_flags = le32_to_cpu(rec->refcount_flags);
+
+	node_r->uid = le32_to_cpu(rec->uid);
+	node_r->parent_idx = le32_to_cpu(rec->parent_idx);
+	node_r->parent_link_refcount =
+		refcount_flags & MAIL_THREAD_TREE_RECORD_REFCOUNT_MASK;
+	node_r->expunge_rebuilds = (refcount_flags &
+		MAIL_THREAD_TREE_RECORD_FLAG_EXPUNGE_REBUILDS) != 0;
+	node_r->child_unref_rebuilds = (refcount_flags &
+		MAIL_THREAD_TREE_RECORD_FLAG_CHILD_UNREF_REBUILDS) != 0;
+}
+
+int mail_thread_tree_file_write(int fd, struct mail_thread_tree_header *hdr,
+				const struct mail_thread_node *nodes)
+{
+	struct mail_thread_tree_record recs[MAIL_THREAD_TREE_IO_RECORD_COUNT];
+	struct mail_thread_tree_header disk_hdr;
+	uint32_t i, j, count, crc;
+	off_t offset = sizeof(disk_hdr);
+
+	hdr->version = MAIL_THREAD_TREE_VERSION;
+	hdr->header_size = sizeof(struct mail_thread_tree_header);
+	hdr->record_size = sizeof(struct mail_thread_tree_record);
+	hdr->crc32 = 0;
+	mail_thread_tree_header_export(hdr, &disk_hdr);
+	crc = crc32_data(&disk_hdr, sizeof(disk_hdr));
+
+	/* the header contains the CRC, so write it last */
+	for (i = 0; i < hdr->node_count; i += count) {
+		count = I_MIN(hdr->node_count - i, N_ELEMENTS(recs));
+		for (j = 0; j < count; j++)
+			mail_thread_tree_record_export(&nodes[i + j], &recs[j]);
+		crc = crc32_data_more(crc, recs, sizeof(recs[0]) * count);
+		if (pwrite_full(fd, recs, sizeof(recs[0]) * count, offset) < 0)
+			return -1;
+		offset += sizeof(recs[0]) * count;
+	}
+	hdr->crc32 = crc;
+	disk_hdr.crc32 = cpu32_to_le(crc);
+	return pwrite_full(fd, &disk_hdr, sizeof(disk_hdr), 0);
+}
+
+int mail_thread_tree_file_read(int fd, struct mail_thread_tree_header *hdr_r,
+			       ARRAY_TYPE(mail_thread_node) *nodes,
+			       const char **error_r)
+{
+	struct mail_thread_tree_record recs[MAIL_THREAD_TREE_IO_RECORD_COUNT];
+	struct mail_thread_tree_header disk_hdr;
+	struct mail_thread_node *node;
+	struct stat st;
+	uint32_t i, j, count, crc;
+	int ret;
+
+	*error_r = NULL;
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if ((ret = pread_full(fd, &disk_hdr, sizeof(disk_hdr), 0)) <= 0) {
+		if (ret == 0)
+			*error_r = "File is truncated (header missing)";
+		return ret;
+	}
+	mail_thread_tree_header_import(&disk_hdr, hdr_r);
+	if (hdr_r->version != MAIL_THREAD_TREE_VERSION) {
+		/* old version - just rebuild */
+		return 0;
+	}
+	if (hdr_r->header_size != sizeof(struct mail_thread_tree_header) ||
+	    hdr_r->record_size != sizeof(struct mail_thread_tree_record)) {
+		*error_r = t_strdup_printf(
+			"Invalid header_size=%u or record_size=%u",
+			hdr_r->header_size, hdr_r->record_size);
+		return 0;
+	}
+	if (hdr_r->node_count == 0 ||
+	    hdr_r->first_invalid_msgid_str_idx >
+	    hdr_r->next_invalid_msgid_str_idx ||
+	    hdr_r->next_invalid_msgid_str_idx > hdr_r->node_count) {
+		*error_r = t_strdup_printf(
+			"Invalid node_count=%u or invalid msgid indexes %u..%u",
+			hdr_r->node_count, hdr_r->first_invalid_msgid_str_idx,
+			hdr_r->next_invalid_msgid_str_idx);
+		return 0;
+	}
+	if ((uoff_t)st.st_size != sizeof(disk_hdr) +
+	    (uoff_t)hdr_r->node_count * sizeof(recs[0])) {
+		*error_r = t_strdup_printf(
+			"File size %"PRIuUOFF_T" doesn't match node_count=%u",
+			(uoff_t)st.st_size, hdr_r->node_count);
+		return 0;
+	}
+
+	disk_hdr.crc32 = 0;
+	crc = crc32_data(&disk_hdr, sizeof(disk_hdr));
+
+	array_clear(nodes);
+	for (i = 0; i < hdr_r->node_count; i += count) {
+		count = I_MIN(hdr_r->node_count - i, N_ELEMENTS(recs));
+		ret = pread_full(fd, recs, sizeof(recs[0]) * count,
+				 sizeof(disk_hdr) + (off_t)i * sizeof(recs[0]));
+		if (ret <= 0) {
+			if (ret == 0)
+				*error_r = "File is truncated";
+			return ret;
+		}
+		crc = crc32_data_more(crc, recs, sizeof(recs[0]) * count);
+		for (j = 0; j < count; j++) {
+			node = array_append_space(nodes);
+			mail_thread_tree_record_import(&recs[j], node);
+			if (node->parent_idx >= hdr_r->node_count) {
+				*error_r = t_strdup_printf(
+					"Node %u has invalid parent_idx=%u",
+					i + j, node->parent_idx);
+				return 0;
+			}
+		}
+	}
+	if (crc != hdr_r->crc32) {
+		*error_r = "CRC32 doesn't match";
+		return 0;
+	}
+	return 1;
+}
+
+static bool
+mail_thread_tree_read(struct mail_thread_mailbox *tbox, struct mailbox *box)
+{
+	struct mail_thread_cache *cache = tbox->cache;
+	const struct mail_index_header *idx_hdr;
+	struct mail_thread_tree_header hdr;
+	const char *error;
+	int fd, ret;
+
+	if (tbox->tree_path == NULL)
+		return FALSE;
+
+	fd = open(tbox->tree_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			mail_thread_tree_set_syscall_error(tbox, box, "open");
+		return FALSE;
+	}
+	ret = mail_thread_tree_file_read(fd, &hdr, &cache->thread_nodes,
+					 &error);
+	if (ret < 0)
+		mail_thread_tree_set_syscall_error(tbox, box, "read");
+	else if (ret == 0 && error != NULL) {
+		mailbox_set_critical(box, "Corrupted thread tree file %s: %s",
+				     tbox->tree_path, error);
+		i_unlink_if_exists(tbox->tree_path);
+	}
+	i_close_fd(&fd);
+	if (ret <= 0) {
+		array_clear(&cache->thread_nodes);
+		return FALSE;
+	}
+
+	idx_hdr = mail_index_get_header(box->view);
+	if (hdr.uid_validity != idx_hdr->uid_validity ||
+	    hdr.last_uid == 0 || hdr.last_uid >= idx_hdr->next_uid ||
+	    hdr.msgid_map_crc32 !=
+	    mail_thread_msgid_map_crc32(tbox, hdr.last_uid)) {
+		/* messages have been expunged, the strmap was recreated or
+		   the mailbox was recreated - just rebuild */
+		array_clear(&cache->thread_nodes);
+		return FALSE;
+	}
+
+	cache->last_uid = hdr.last_uid;
+	cache->first_invalid_msgid_str_idx = hdr.first_invalid_msgid_str_idx;
+	cache->next_invalid_msgid_str_idx = hdr.next_invalid_msgid_str_idx;
+	tbox->tree_saved_last_uid = hdr.last_uid;
+	tbox->tree_saved_crc32 = hdr.msgid_map_crc32;
+	return TRUE;
+}
+
+static void
+mail_thread_tree_write(struct mail_thread_mailbox *tbox, struct mailbox *box)
+{
+	struct mail_thread_cache *cache = tbox->cache;
+	const struct mailbox_permissions *perm = mailbox_get_permissions(box);
+	struct mail_thread_tree_header hdr;
+	const struct mail_thread_node *nodes;
+	unsigned int count;
+	const char *temp_path;
+	string_t *str;
+	int fd;
+
+	nodes = array_get(&cache->thread_nodes, &count);
+	i_zero(&hdr);
+	hdr.uid_validity = mail_index_get_header(box->view)->uid_validity;
+	hdr.last_uid = cache->last_uid;
+	hdr.msgid_map_crc32 = tbox->tree_msgid_map_crc32;
+	hdr.first_invalid_msgid_str_idx = cache->first_invalid_msgid_str_idx;
+	hdr.next_invalid_msgid_str_idx = cache->next_invalid_msgid_str_idx;
+	hdr.node_count = count;
+	if (hdr.next_invalid_msgid_str_idx > count) {
+		/* there are no invalid nodes, so the array wasn't grown up
+		   to them */
+		hdr.first_invalid_msgid_str_idx =
+			hdr.next_invalid_msgid_str_idx = count;
+	}
+
+	str = t_str_new(256);
+	str_append(str, tbox->tree_path);
+	fd = safe_mkstemp_hostpid_group(str, perm->file_create_mode,
+					perm->file_create_gid,
+					perm->file_create_gid_origin);
+	temp_path = str_c(str);
+	if (fd == -1) {
+		mailbox_set_critical(box, "safe_mkstemp(%s) failed: %m",
+				     temp_path);
+		return;
+	}
+	if (mail_thread_tree_file_write(fd, &hdr, nodes) < 0) {
+		mailbox_set_critical(box, "write(%s) failed: %m", temp_path);
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return;
+	}
+	if (close(fd) < 0) {
+		mailbox_set_critical(box, "close(%s) failed: %m", temp_path);
+		i_unlink(temp_path);
+	} else if (rename(temp_path, tbox->tree_path) < 0) {
+		mailbox_set_critical(box, "rename(%s, %s) failed: %m",
+				     temp_path, tbox->tree_path);
+		i_unlink(temp_path);
+	} else {
+		tbox->tree_saved_last_uid = hdr.last_uid;
+		tbox->tree_saved_crc32 = hdr.msgid_map_crc32;
+	}
+}
+
 static void mail_thread_cache_sync_remove(struct mail_thread_mailbox *tbox,
 					  struct mail_thread_context *ctx)
 {
@@ -499,6 +826,41 @@ static void mail_thread_cache_sync_remove(struct mail_thread_mailbox *tbox,
 	mailbox_search_result_free(&cache->search_result);
 }
 
+static void
+mail_thread_cache_add_after_tree(struct mail_thread_mailbox *tbox,
+				 struct mail_thread_context *ctx)
+{
+	struct mail_thread_cache *cache = tbox->cache;
+	struct mail_search_result *result;
+	const struct mail_index_strmap_rec *msgid_map;
+	unsigned int i, count;
+	uint32_t seq, uid, tree_last_uid = cache->last_uid;
+
+	/* The saved tree contains all the messages up to its last_uid, so
+	   with the ALL search the result can be filled directly from the
+	   index without going through the messages. */
+	result = mailbox_search_result_alloc(ctx->box, ctx->search_args,
+					     MAILBOX_SEARCH_RESULT_FLAG_UPDATE |
+					     MAILBOX_SEARCH_RESULT_FLAG_QUEUE_SYNC);
+	count = mail_index_view_get_messages_count(ctx->t->view);
+	for (seq = 1; seq <= count; seq++) {
+		mail_index_lookup_uid(ctx->t->view, seq, &uid);
+		mailbox_search_result_add(result, uid);
+	}
+	mailbox_search_result_initial_done(result);
+	cache->search_result = result;
+
+	/* add only the messages that are newer than the tree. all of them
+	   are in msgid_map already. */
+	(void)array_bsearch_insert_pos(tbox->msgid_map, &tree_last_uid,
+				       msgid_map_cmp, &i);
+	msgid_map = array_get(tbox->msgid_map, &count);
+	while (i < count && msgid_map[i].uid <= tree_last_uid)
+		i++;
+	while (i < count)
+		mail_thread_add(cache, msgid_map+i, &i);
+}
+
 static void mail_thread_cache_sync_add(struct mail_thread_mailbox *tbox,
 				       struct mail_thread_context *ctx,
 				       struct mail_search_context *search_ctx)
@@ -523,6 +885,13 @@ static void mail_thread_cache_sync_add(struct mail_thread_mailbox *tbox,
 		THREAD_INVALID_MSGID_STR_IDX_SKIP_COUNT;
 	array_clear(&cache->thread_nodes);
 
+	/* continue from the saved tree if possible */
+	if (ctx->search_all && mail_thread_tree_read(tbox, ctx->box)) {
+		mail_thread_cache_fix_invalid_indexes(tbox);
+		mail_thread_cache_add_after_tree(tbox, ctx);
+		return;
+	}
+
 	cache->search_result =
 		mailbox_search_result_save(search_ctx,
 			MAILBOX_SEARCH_RESULT_FLAG_UPDATE |
@@ -563,11 +932,15 @@ int mail_thread_init(struct mailbox *box, struct mail_search_args *args,
 	ctx = i_new(struct mail_thread_context, 1);
 	ctx->box = box;
 	ctx->search_args = args;
+	ctx->search_all = args->args != NULL &&
+		args->args->type == SEARCH_ALL && args->args->next == NULL &&
+		!args->args->match_not;
 	ctx->t = mailbox_transaction_begin(ctx->box, 0, __func__);
 	/* perform search first, so we don't break if there are INTHREAD keys */
 	search_ctx = mailbox_search_init(ctx->t, args, NULL, 0, NULL);
 
 	tbox->ctx = ctx;
+	tbox->tree_save = FALSE;
 
 	mail_thread_cache_sync_remove(tbox, ctx);
 	ret = mail_thread_index_map_build(ctx);
@@ -585,6 +958,12 @@ int mail_thread_init(struct mailbox *box, struct mail_search_args *args,
 		mail_thread_deinit(&ctx);
 		return -1;
 	} else {
+		if (ctx->search_all && tbox->tree_path != NULL) {
+			tbox->tree_save = TRUE;
+			tbox->tree_msgid_map_crc32 =
+				mail_thread_msgid_map_crc32(tbox,
+					tbox->cache->last_uid);
+		}
 		i_zero(&ctx->added_uids);
 		*ctx_r = ctx;
 		return 0;
@@ -626,6 +1005,13 @@ static void mail_thread_mailbox_close(struct mailbox *box)
 
 	i_assert(tbox->ctx == NULL);
 
+	if (tbox->tree_save && tbox->cache->search_result != NULL &&
+	    (tbox->cache->last_uid != tbox->tree_saved_last_uid ||
+	     tbox->tree_msgid_map_crc32 != tbox->tree_saved_crc32)) T_BEGIN {
+		mail_thread_tree_write(tbox, box);
+	} T_END;
+	tbox->tree_save = FALSE;
+
 	if (tbox->strmap_view != NULL)
 		mail_index_strmap_view_close(&tbox->strmap_view);
 	if (tbox->cache->search_result != NULL)
@@ -642,6 +1028,7 @@ static void mail_thread_mailbox_free(struct mailbox *box)
 
 	array_free(&tbox->cache->thread_nodes);
 	i_free(tbox->cache);
+	i_free(tbox->tree_path);
 	i_free(tbox);
 }
 
@@ -661,6 +1048,10 @@ void index_thread_mailbox_opened(struct mailbox *box)
 
 	tbox->strmap = mail_index_strmap_init(box->index,
 					      MAIL_THREAD_INDEX_SUFFIX);
+	if (!mail_index_is_in_memory(box->index)) {
+		tbox->tree_path = i_strconcat(box->index->filepath,
+					      MAIL_THREAD_TREE_SUFFIX, NULL);
+	}
 	tbox->next_msgid_idx = 1;
 
 	tbox->cache = i_new(struct mail_thread_cache, 1);
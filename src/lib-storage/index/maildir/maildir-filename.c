@@ -58,23 +58,24 @@ bool maildir_filename_get_size(const char *fname, char type, uoff_t *size_r)
 	return TRUE;
 }
 
-/* a char* hash function from ASU -- from glib */
+/* FNV-1a. The old ASU hash shifts each character 4 bits further and folds
+   the overflowing bits back into only bits 4..7, so the characters before
+   the last seven barely affect the hash value. Maildir filenames differ
+   mainly in the timestamp and counter near the beginning and tend to end
+   with the same hostname and ,S=/,W= sizes, so many of them got equal hash
+   values, which no table size can spread into different buckets. The hash
+   is only used for in-memory hash tables, so it can be changed. */
 unsigned int ATTR_NO_SANITIZE_INTEGER
 maildir_filename_base_hash(const char *s)
 {
-	unsigned int g, h = 0;
-
-	while (*s != MAILDIR_INFO_SEP && *s != '\0') {
-		i_assert(*s != '/');
-		h = (h << 4) + *s;
-		if ((g = h & 0xf0000000UL) != 0) {
-			h = h ^ (g >> 24);
-			h = h ^ g;
-		}
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned int h = 2166136261U;
 
-		s++;
+	while (*p != MAILDIR_INFO_SEP && *p != '\0') {
+		i_assert(*p != '/');
+		h = (h ^ *p) * 16777619U;
+		p++;
 	}
-
 	return h;
 }
 
@@ -22,6 +22,22 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Version 4 format is a binary format, which is written only when
+   maildir_uidlist_binary=yes. Older Dovecot versions can't read it. It
+   contains the same data as version 3, but it can be read without parsing
+   text and without copying the filenames. The file is mmap()ed and the
+   records point directly to it. The format is:
+
+   header: struct maildir_uidlist_bin_header <header extensions>\0
+   entry: struct maildir_uidlist_bin_record <extensions> <filename>\0
+
+   The header and the entries are padded to 32bit alignment and all the
+   integers are little endian. The records written when the file is
+   created are sorted by UID and their count is in the header. New records
+   are appended after them the same way as with version 3.
 */
 
 #include "lib.h"
@@ -30,6 +46,9 @@
 #include "istream.h"
 #include "ostream.h"
 #include "str.h"
+#include "byteorder.h"
+#include "read-full.h"
+#include "mmap-util.h"
 #include "file-dotlock.h"
 #include "nfs-workarounds.h"
 #include "eacces-error.h"
@@ -45,6 +64,7 @@
 #define UIDLIST_ESTALE_RETRY_COUNT NFS_ESTALE_RETRY_COUNT
 
 #define UIDLIST_VERSION 3
+#define UIDLIST_VERSION_BINARY 4
 #define UIDLIST_COMPRESS_PERCENTAGE 75
 
 #define UIDLIST_IS_LOCKED(uidlist) \
@@ -58,6 +78,33 @@ struct maildir_uidlist_rec {
 };
 ARRAY_DEFINE_TYPE(maildir_uidlist_rec_p, struct maildir_uidlist_rec *);
 
+struct maildir_uidlist_bin_header {
+	/* "4 " followed by NULs, so older versions see it as an unsupported
+	   version 4 file */
+	unsigned char version[4];
+	/* size of this header + header extensions + padding */
+	uint32_t hdr_size;
+	uint32_t uid_validity;
+	uint32_t next_uid;
+	guid_128_t mailbox_guid;
+	/* number of records written when the file was created */
+	uint32_t records_count;
+};
+
+struct maildir_uidlist_bin_record {
+	uint32_t uid;
+	/* size of extensions, including the terminating empty string.
+	   0 if there are no extensions. */
+	uint32_t ext_size;
+	/* size of the filename, including NUL */
+	uint32_t filename_size;
+};
+
+struct maildir_uidlist_mmap {
+	void *base;
+	size_t size;
+};
+
 HASH_TABLE_DEFINE_TYPE(path_to_maildir_uidlist_rec,
 		       char *, struct maildir_uidlist_rec *);
 
@@ -80,6 +127,10 @@ struct maildir_uidlist {
 	ARRAY_TYPE(maildir_uidlist_rec_p) records;
 	HASH_TABLE_TYPE(path_to_maildir_uidlist_rec) files;
 	unsigned int change_counter;
+	/* mmap()ed binary uidlist files. The records read from them point to
+	   the mapped memory, so they're unmapped when the records are
+	   dropped, i.e. when the uidlist is reset or swapped. */
+	ARRAY(struct maildir_uidlist_mmap) mmaps;
 
 	unsigned int version;
 	unsigned int uid_validity, next_uid, prev_read_uid, last_seen_uid;
@@ -99,6 +150,10 @@ struct maildir_uidlist {
 	bool unsorted:1;
 	bool have_mailbox_guid:1;
 	bool opened_readonly:1;
+	bool binary:1;
+	/* Records read from a binary uidlist haven't been added to the files
+	   hash yet. See maildir_uidlist_hash_files(). */
+	bool files_unhashed:1;
 };
 
 struct maildir_uidlist_sync_ctx {
@@ -254,6 +309,16 @@ static bool dotlock_callback(unsigned int secs_left, bool stale, void *context)
 	return TRUE;
 }
 
+static void
+maildir_uidlist_files_hash_create(struct maildir_uidlist *uidlist,
+				  unsigned int initial_size)
+{
+	hash_table_create(&uidlist->files, default_pool,
+			  I_MAX(initial_size, 4096),
+			  maildir_filename_base_hash,
+			  maildir_filename_base_cmp);
+}
+
 struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 {
 	struct mailbox *box = &mbox->box;
@@ -270,11 +335,10 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 	uidlist->fd = -1;
 	uidlist->path = i_strconcat(control_dir, "/"MAILDIR_UIDLIST_NAME, NULL);
 	i_array_init(&uidlist->records, 128);
-	hash_table_create(&uidlist->files, default_pool, 4096,
-			  maildir_filename_base_hash,
-			  maildir_filename_base_cmp);
+	maildir_uidlist_files_hash_create(uidlist, 0);
 	uidlist->next_uid = 1;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
+	uidlist->binary = mbox->storage->set->maildir_uidlist_binary;
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
 	uidlist->dotlock_settings.use_excl_lock =
@@ -306,6 +370,22 @@ static void maildir_uidlist_close(struct maildir_uidlist *uidlist)
 	uidlist->read_line_count = 0;
 }
 
+static void maildir_uidlist_mmaps_free(struct maildir_uidlist *uidlist)
+{
+	struct maildir_uidlist_mmap *map;
+
+	if (!array_is_created(&uidlist->mmaps))
+		return;
+
+	array_foreach_modifiable(&uidlist->mmaps, map) {
+		if (munmap(map->base, map->size) < 0) {
+			mailbox_set_critical(uidlist->box,
+				"munmap(%s) failed: %m", uidlist->path);
+		}
+	}
+	array_clear(&uidlist->mmaps);
+}
+
 static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
 {
 	maildir_uidlist_close(uidlist);
@@ -315,6 +395,9 @@ static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
 
 	hash_table_clear(uidlist->files, FALSE);
 	array_clear(&uidlist->records);
+	uidlist->files_unhashed = FALSE;
+	/* the file is read again from the beginning, which maps it again */
+	maildir_uidlist_mmaps_free(uidlist);
 }
 
 void maildir_uidlist_deinit(struct maildir_uidlist **_uidlist)
@@ -329,6 +412,9 @@ void maildir_uidlist_deinit(struct maildir_uidlist **_uidlist)
 
 	hash_table_destroy(&uidlist->files);
 	pool_unref(&uidlist->record_pool);
+	maildir_uidlist_mmaps_free(uidlist);
+	if (array_is_created(&uidlist->mmaps))
+		array_free(&uidlist->mmaps);
 
 	array_free(&uidlist->records);
 	str_free(&uidlist->hdr_extensions);
@@ -364,17 +450,27 @@ maildir_uidlist_set_corrupted(struct maildir_uidlist *uidlist,
 	va_end(args);
 }
 
+static unsigned int
+maildir_uidlist_wanted_version(struct maildir_uidlist *uidlist)
+{
+	return uidlist->binary ? UIDLIST_VERSION_BINARY : UIDLIST_VERSION;
+}
+
 static void maildir_uidlist_update_hdr(struct maildir_uidlist *uidlist,
 				       const struct stat *st)
 {
 	struct maildir_index_header *mhdr = uidlist->mhdr;
 
-	if (mhdr->uidlist_mtime == 0 && uidlist->version != UIDLIST_VERSION) {
+	if (mhdr->uidlist_mtime == 0 && uidlist->version < UIDLIST_VERSION) {
 		/* upgrading from older version. don't update the
 		   uidlist times until it uses the new format */
 		uidlist->recreate = TRUE;
 		return;
 	}
+	if (uidlist->version != maildir_uidlist_wanted_version(uidlist)) {
+		/* migrating between the text and binary formats */
+		uidlist->recreate = TRUE;
+	}
 	mhdr->uidlist_mtime = st->st_mtime;
 	mhdr->uidlist_mtime_nsecs = ST_MTIME_NSEC(*st);
 	mhdr->uidlist_size = st->st_size;
@@ -444,42 +540,46 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
-static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
-				 const char *line)
+/* The sorted records of a binary uidlist aren't added to the files hash
+   while reading it, because opening mails only needs to look them up by
+   UID. Add them once something needs to look up records by filename. */
+static void maildir_uidlist_hash_files(struct maildir_uidlist *uidlist)
 {
-	struct event *event = uidlist->box->event;
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
-	uint32_t uid;
+	struct maildir_uidlist_rec *rec;
 
-	uid = 0;
-	while (*line >= '0' && *line <= '9') {
-		uid = uid*10 + (*line - '0');
-		line++;
-	}
+	if (!uidlist->files_unhashed)
+		return;
+	uidlist->files_unhashed = FALSE;
 
-	if (uid == 0 || *line != ' ') {
-		/* invalid file */
-		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
-					      line);
-		return FALSE;
-	}
+	i_assert(hash_table_count(uidlist->files) == 0);
+	hash_table_destroy(&uidlist->files);
+	maildir_uidlist_files_hash_create(uidlist,
+					  array_count(&uidlist->records));
+	array_foreach_elem(&uidlist->records, rec)
+		hash_table_update(uidlist->files, rec->filename, rec);
+}
+
+/* Returns 1 if a record with the UID should be added, 0 if it already
+   exists, -1 if the file is broken. */
+static int
+maildir_uidlist_next_uid(struct maildir_uidlist *uidlist, uint32_t uid)
+{
 	if (uid <= uidlist->prev_read_uid) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UIDs not ordered (%u >= %u)",
 					      uid, uidlist->prev_read_uid);
-		return FALSE;
+		return -1;
 	}
 	if (uid >= (uint32_t)-1) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UID too high (%u)", uid);
-		return FALSE;
+		return -1;
 	}
 	uidlist->prev_read_uid = uid;
 
 	if (uid <= uidlist->last_seen_uid) {
 		/* we already have this */
-		return TRUE;
+		return 0;
 	}
         uidlist->last_seen_uid = uid;
 
@@ -487,41 +587,27 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		maildir_uidlist_set_corrupted(uidlist,
 			"UID larger than next_uid (%u >= %u)",
 			uid, uidlist->next_uid);
-		return FALSE;
-	}
-
-	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
-	rec->uid = uid;
-	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
-
-	while (*line == ' ') line++;
-
-	if (uidlist->version == UIDLIST_VERSION) {
-		/* read extended fields */
-		bool ret;
-
-		T_BEGIN {
-			ret = maildir_uidlist_read_extended(uidlist, &line,
-							    rec);
-		} T_END;
-		if (!ret) {
-			maildir_uidlist_set_corrupted(uidlist,
-				"Invalid extended fields: %s", line);
-			return FALSE;
-		}
+		return -1;
 	}
+	return 1;
+}
 
-	if (strchr(line, '/') != NULL) {
-		maildir_uidlist_set_corrupted(uidlist,
-			"%s: Broken filename at line %u: %s",
-			uidlist->path, uidlist->read_line_count, line);
-		return FALSE;
-	}
+/* Add a record read from the file. If filename_stable is TRUE, the
+   filename stays valid as long as the record_pool, so it's not copied. */
+static bool
+maildir_uidlist_next_rec(struct maildir_uidlist *uidlist,
+			 struct maildir_uidlist_rec *rec,
+			 const char *filename, bool filename_stable)
+{
+	struct event *event = uidlist->box->event;
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
 
-	old_rec = hash_table_lookup(uidlist->files, line);
+	maildir_uidlist_hash_files(uidlist);
+	old_rec = hash_table_lookup(uidlist->files, filename);
 	if (old_rec == NULL) {
 		/* no conflicts */
-	} else if (old_rec->uid == uid) {
+	} else if (old_rec->uid == rec->uid) {
 		/* most likely this is a record we saved ourself, but couldn't
 		   update last_seen_uid because uidlist wasn't refreshed while
 		   it was locked.
@@ -543,8 +629,8 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		e_warning(event,
 			  "%s: Duplicate file entry at line %u: "
 			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
-			  old_rec->uid, uid, uidlist->retry_rewind ?
+			  uidlist->path, uidlist->read_line_count, filename,
+			  old_rec->uid, rec->uid, uidlist->retry_rewind ?
 			  " - retrying by re-reading from beginning" : "");
 		if (uidlist->retry_rewind)
 			return FALSE;
@@ -557,18 +643,71 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 	}
 
 	recs = array_get(&uidlist->records, &count);
-	if (count > 0 && recs[count-1]->uid > uid) {
+	if (count > 0 && recs[count-1]->uid > rec->uid) {
 		/* we most likely have some records in the array that we saved
 		   ourself without refreshing uidlist */
 		uidlist->unsorted = TRUE;
 	}
 
-	rec->filename = p_strdup(uidlist->record_pool, line);
+	rec->filename = filename_stable ? (char *)filename :
+		p_strdup(uidlist->record_pool, filename);
 	hash_table_update(uidlist->files, rec->filename, rec);
 	array_push_back(&uidlist->records, &rec);
 	return TRUE;
 }
 
+static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
+				 const char *line)
+{
+	struct maildir_uidlist_rec *rec;
+	uint32_t uid;
+	int uid_ret;
+
+	uid = 0;
+	while (*line >= '0' && *line <= '9') {
+		uid = uid*10 + (*line - '0');
+		line++;
+	}
+
+	if (uid == 0 || *line != ' ') {
+		/* invalid file */
+		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
+					      line);
+		return FALSE;
+	}
+	if ((uid_ret = maildir_uidlist_next_uid(uidlist, uid)) <= 0)
+		return uid_ret == 0;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+	while (*line == ' ') line++;
+
+	if (uidlist->version == UIDLIST_VERSION) {
+		/* read extended fields */
+		bool ret;
+
+		T_BEGIN {
+			ret = maildir_uidlist_read_extended(uidlist, &line,
+							    rec);
+		} T_END;
+		if (!ret) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid extended fields: %s", line);
+			return FALSE;
+		}
+	}
+
+	if (strchr(line, '/') != NULL) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"%s: Broken filename at line %u: %s",
+			uidlist->path, uidlist->read_line_count, line);
+		return FALSE;
+	}
+	return maildir_uidlist_next_rec(uidlist, rec, line, FALSE);
+}
+
 static int
 maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 			       const char *line,
@@ -696,17 +835,331 @@ static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
 	uidlist->unsorted = FALSE;
 }
 
+static void
+maildir_uidlist_read_records_begin(struct maildir_uidlist *uidlist,
+				   uoff_t last_read_offset, bool try_retry)
+{
+	uidlist->prev_read_uid = 0;
+	uidlist->change_counter++;
+	uidlist->retry_rewind = last_read_offset != 0 && try_retry;
+}
+
+static int
+maildir_uidlist_read_text(struct maildir_uidlist *uidlist, int fd,
+			  uoff_t last_read_offset, bool try_retry,
+			  bool *retry_r, bool *hdr_read_r,
+			  uoff_t *read_offset_r)
+{
+	struct istream *input;
+	const char *line;
+	int ret;
+
+	input = i_stream_create_fd(fd, SIZE_MAX);
+	i_stream_seek(input, last_read_offset);
+
+	ret = input->v_offset != 0 ? 1 :
+		maildir_uidlist_read_header(uidlist, input);
+	if (ret > 0) {
+		*hdr_read_r = TRUE;
+		maildir_uidlist_read_records_begin(uidlist, last_read_offset,
+						   try_retry);
+		while ((line = i_stream_read_next_line(input)) != NULL) {
+			uidlist->read_records_count++;
+			uidlist->read_line_count++;
+			if (!maildir_uidlist_next(uidlist, line)) {
+				if (!uidlist->retry_rewind)
+					ret = 0;
+				else {
+					ret = -1;
+					*retry_r = TRUE;
+				}
+				break;
+			}
+                }
+		uidlist->retry_rewind = FALSE;
+		if (input->stream_errno != 0)
+                        ret = -1;
+	}
+
+	if (ret < 0 && !*retry_r) {
+                /* I/O error */
+                if (input->stream_errno == ESTALE && try_retry)
+			*retry_r = TRUE;
+		else {
+			mailbox_set_critical(uidlist->box,
+				"read(%s) failed: %s", uidlist->path,
+				i_stream_get_error(input));
+		}
+	}
+	*read_offset_r = input->v_offset;
+	i_stream_destroy(&input);
+	return ret;
+}
+
+static bool maildir_uidlist_fd_is_binary(int fd)
+{
+	unsigned char version[2];
+
+	/* text files begin with "<version> " too, so this is enough to
+	   see the difference. read errors are handled by the text parser. */
+	return pread_full(fd, version, sizeof(version), 0) > 0 &&
+		version[0] == '0' + UIDLIST_VERSION_BINARY &&
+		version[1] == ' ';
+}
+
+static int
+maildir_uidlist_read_bin_header(struct maildir_uidlist *uidlist,
+				const unsigned char *data, size_t size,
+				size_t *hdr_size_r)
+{
+	const struct maildir_uidlist_bin_header *hdr = (const void *)data;
+	const char *hdr_ext;
+	uint32_t hdr_size, uid_validity, next_uid;
+
+	uidlist->read_line_count = 1;
+	if (size < sizeof(*hdr)) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (file too small)");
+		return 0;
+	}
+	hdr_size = le32_to_cpu(hdr->hdr_size);
+	if (hdr_size <= sizeof(*hdr) || hdr_size > size ||
+	    hdr_size % sizeof(uint32_t) != 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (invalid size %u)", hdr_size);
+		return 0;
+	}
+	hdr_ext = CONST_PTR_OFFSET(data, sizeof(*hdr));
+	if (memchr(hdr_ext, '\0', hdr_size - sizeof(*hdr)) == NULL) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (extensions not terminated)");
+		return 0;
+	}
+
+	uid_validity = le32_to_cpu(hdr->uid_validity);
+	next_uid = le32_to_cpu(hdr->next_uid);
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->version = UIDLIST_VERSION_BINARY;
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	if (!guid_128_is_empty(hdr->mailbox_guid)) {
+		guid_128_copy(uidlist->mailbox_guid, hdr->mailbox_guid);
+		uidlist->have_mailbox_guid = TRUE;
+	}
+	str_truncate(uidlist->hdr_extensions, 0);
+	str_append(uidlist->hdr_extensions, hdr_ext);
+	*hdr_size_r = hdr_size;
+	return 1;
+}
+
+static bool
+maildir_uidlist_bin_ext_is_valid(const unsigned char *ext, size_t size)
+{
+	const unsigned char *p = ext, *end = ext + size;
+
+	/* <key><value>\0[<key><value>\0 ...]\0 */
+	while (p < end && *p != '\0') {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p))
+			return FALSE;
+		p = memchr(p, '\0', end - p);
+		if (p == NULL)
+			return FALSE;
+		p++;
+	}
+	return p + 1 == end;
+}
+
+/* Read the records from data, which must stay valid as long as the
+   record_pool. A record that is only partially written is left unread.
+   Returns FALSE if the file is broken. */
+static bool
+maildir_uidlist_read_bin_records(struct maildir_uidlist *uidlist,
+				 const unsigned char *data, size_t size,
+				 unsigned int count, size_t *size_r)
+{
+	const struct maildir_uidlist_bin_record *brec;
+	struct maildir_uidlist_rec *recs = NULL, *rec;
+	const unsigned char *ext;
+	const char *filename;
+	uint32_t uid, ext_size, filename_size;
+	size_t pos = 0, rec_size;
+	unsigned int recs_left = 0, sorted_left = 0;
+	int ret;
+
+	/* The first count records were written sorted and without duplicates
+	   by whoever created the file, so when reading into an empty uidlist
+	   they can be added without checking the files hash. */
+	if (array_count(&uidlist->records) == 0 &&
+	    hash_table_count(uidlist->files) == 0)
+		sorted_left = count;
+
+	*size_r = 0;
+	while (size - pos >= sizeof(*brec)) {
+		brec = CONST_PTR_OFFSET(data, pos);
+		uid = le32_to_cpu(brec->uid);
+		ext_size = le32_to_cpu(brec->ext_size);
+		filename_size = le32_to_cpu(brec->filename_size);
+		if (ext_size > size - pos || filename_size > size - pos)
+			break;
+		rec_size = sizeof(*brec) + ext_size + filename_size;
+		rec_size = (rec_size + sizeof(uint32_t) - 1) &
+			~(sizeof(uint32_t) - 1);
+		if (rec_size > size - pos)
+			break;
+
+		uidlist->read_records_count++;
+		uidlist->read_line_count++;
+		ext = CONST_PTR_OFFSET(data, pos + sizeof(*brec));
+		filename = CONST_PTR_OFFSET(ext, ext_size);
+		if (uid == 0 || filename_size < 2 ||
+		    memchr(filename, '\0', filename_size) !=
+		    filename + filename_size - 1 ||
+		    memchr(filename, '/', filename_size) != NULL) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid record (uid=%u)", uid);
+			return FALSE;
+		}
+		if (ext_size > 0 &&
+		    !maildir_uidlist_bin_ext_is_valid(ext, ext_size)) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid extended fields (uid=%u)", uid);
+			return FALSE;
+		}
+		if ((ret = maildir_uidlist_next_uid(uidlist, uid)) < 0)
+			return FALSE;
+		pos += rec_size;
+		*size_r = pos;
+		if (ret == 0)
+			continue;
+
+		if (recs_left == 0) {
+			/* allocate the records of the sorted part of the
+			   file with a single allocation */
+			recs_left = I_MAX(count, 16);
+			recs = p_new(uidlist->record_pool,
+				     struct maildir_uidlist_rec, recs_left);
+			count = 0;
+		}
+		rec = recs++;
+		recs_left--;
+		rec->uid = uid;
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+		if (ext_size > 0)
+			rec->extensions = (unsigned char *)ext;
+		if (sorted_left > 0) {
+			sorted_left--;
+			rec->filename = (char *)filename;
+			array_push_back(&uidlist->records, &rec);
+			uidlist->files_unhashed = TRUE;
+		} else if (!maildir_uidlist_next_rec(uidlist, rec, filename,
+						     TRUE))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int
+maildir_uidlist_read_binary(struct maildir_uidlist *uidlist, int fd,
+			    const struct stat *st, uoff_t last_read_offset,
+			    bool try_retry, bool *retry_r, bool *hdr_read_r,
+			    uoff_t *read_offset_r)
+{
+	struct maildir_uidlist_mmap *map;
+	const struct maildir_uidlist_bin_header *hdr;
+	const unsigned char *data;
+	size_t size, hdr_size = 0, records_size;
+	unsigned int count = 0;
+	int ret;
+
+	*read_offset_r = last_read_offset;
+	if ((uoff_t)st->st_size <= last_read_offset)
+		return 1;
+	if ((uoff_t)st->st_size > SSIZE_T_MAX) {
+		mailbox_set_critical(uidlist->box,
+			"%s: File too large", uidlist->path);
+		return -1;
+	}
+	size = st->st_size - last_read_offset;
+
+	if (last_read_offset == 0 && !uidlist->box->storage->set->mmap_disable) {
+		/* Reading the whole file. Map it, so the records can point
+		   directly to it. Appended records are read to memory. */
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			mailbox_set_critical(uidlist->box,
+				"mmap(%s, size=%zu) failed: %m",
+				uidlist->path, size);
+			return -1;
+		}
+		if (!array_is_created(&uidlist->mmaps))
+			i_array_init(&uidlist->mmaps, 2);
+		map = array_append_space(&uidlist->mmaps);
+		map->base = (void *)data;
+		map->size = size;
+	} else {
+		data = p_malloc(uidlist->record_pool, size);
+		if ((ret = pread_full(fd, (void *)data, size,
+				      last_read_offset)) <= 0) {
+			if (ret < 0 && errno == ESTALE && try_retry)
+				*retry_r = TRUE;
+			else if (ret < 0) {
+				mailbox_set_critical(uidlist->box,
+					"read(%s) failed: %m", uidlist->path);
+			} else {
+				mailbox_set_critical(uidlist->box,
+					"read(%s) failed: Unexpected EOF",
+					uidlist->path);
+			}
+			return -1;
+		}
+	}
+
+	if (last_read_offset == 0) {
+		if (maildir_uidlist_read_bin_header(uidlist, data, size,
+						    &hdr_size) == 0)
+			return 0;
+		hdr = (const void *)data;
+		count = le32_to_cpu(hdr->records_count);
+	}
+	*hdr_read_r = TRUE;
+	maildir_uidlist_read_records_begin(uidlist, last_read_offset,
+					   try_retry);
+	if (!maildir_uidlist_read_bin_records(uidlist, data + hdr_size,
+					      size - hdr_size, count,
+					      &records_size)) {
+		ret = uidlist->retry_rewind ? -1 : 0;
+		*retry_r = uidlist->retry_rewind;
+	} else {
+		ret = 1;
+	}
+	uidlist->retry_rewind = FALSE;
+	*read_offset_r = last_read_offset + hdr_size + records_size;
+	return ret;
+}
+
 static int
 maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 			    bool *retry_r, bool try_retry)
 {
-	const char *line;
 	uint32_t orig_next_uid, orig_uid_validity;
-	struct istream *input;
 	struct stat st;
-	uoff_t last_read_offset;
+	uoff_t last_read_offset, read_offset;
 	int fd, ret;
-	bool readonly = FALSE;
+	bool readonly = FALSE, binary, hdr_read = FALSE;
 
 	*retry_r = FALSE;
 
@@ -762,36 +1215,21 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 							    st.st_size/8));
 	}
 
-	input = i_stream_create_fd(fd, SIZE_MAX);
-	i_stream_seek(input, last_read_offset);
-
+	binary = last_read_offset == 0 ? maildir_uidlist_fd_is_binary(fd) :
+		uidlist->version == UIDLIST_VERSION_BINARY;
 	orig_uid_validity = uidlist->uid_validity;
 	orig_next_uid = uidlist->next_uid;
-	ret = input->v_offset != 0 ? 1 :
-		maildir_uidlist_read_header(uidlist, input);
-	if (ret > 0) {
-		uidlist->prev_read_uid = 0;
-		uidlist->change_counter++;
-		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
-
-		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
-			uidlist->read_records_count++;
-			uidlist->read_line_count++;
-			if (!maildir_uidlist_next(uidlist, line)) {
-				if (!uidlist->retry_rewind)
-					ret = 0;
-				else {
-					ret = -1;
-					*retry_r = TRUE;
-				}
-				break;
-			}
-                }
-		uidlist->retry_rewind = FALSE;
-		if (input->stream_errno != 0)
-                        ret = -1;
-
+	if (binary) {
+		ret = maildir_uidlist_read_binary(uidlist, fd, &st,
+						  last_read_offset, try_retry,
+						  retry_r, &hdr_read,
+						  &read_offset);
+	} else {
+		ret = maildir_uidlist_read_text(uidlist, fd, last_read_offset,
+						try_retry, retry_r, &hdr_read,
+						&read_offset);
+	}
+	if (hdr_read) {
 		if (uidlist->unsorted) {
 			uidlist->recreate_on_change = TRUE;
 			maildir_uidlist_records_sort_by_uid(uidlist);
@@ -822,21 +1260,13 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		uidlist->fd_dev = st.st_dev;
 		uidlist->fd_ino = st.st_ino;
 		uidlist->fd_size = st.st_size;
-		uidlist->last_read_offset = input->v_offset;
+		uidlist->last_read_offset = read_offset;
 		maildir_uidlist_update_hdr(uidlist, &st);
-        } else if (!*retry_r) {
+        } else {
                 /* I/O error */
-                if (input->stream_errno == ESTALE && try_retry)
-			*retry_r = TRUE;
-		else {
-			mailbox_set_critical(uidlist->box,
-				"read(%s) failed: %s", uidlist->path,
-				i_stream_get_error(input));
-		}
 		uidlist->last_read_offset = 0;
 	}
 
-	i_stream_destroy(&input);
 	if (ret <= 0) {
 		if (close(fd) < 0) {
 			mailbox_set_critical(uidlist->box,
@@ -1236,6 +1666,72 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
+static void maildir_uidlist_append_padding(string_t *str)
+{
+	size_t size = str_len(str);
+
+	if (size % sizeof(uint32_t) != 0) {
+		buffer_append_zero(str, sizeof(uint32_t) -
+				   size % sizeof(uint32_t));
+	}
+}
+
+static void
+maildir_uidlist_append_bin_header(struct maildir_uidlist *uidlist,
+				  string_t *str)
+{
+	struct maildir_uidlist_bin_header hdr;
+
+	i_zero(&hdr);
+	hdr.version[0] = '0' + UIDLIST_VERSION_BINARY;
+	hdr.version[1] = ' ';
+	hdr.uid_validity = cpu32_to_le(uidlist->uid_validity);
+	hdr.next_uid = cpu32_to_le(uidlist->next_uid);
+	guid_128_copy(hdr.mailbox_guid, uidlist->mailbox_guid);
+	hdr.records_count = cpu32_to_le(array_count(&uidlist->records));
+
+	buffer_append(str, &hdr, sizeof(hdr));
+	str_append_str(str, uidlist->hdr_extensions);
+	str_append_c(str, '\0');
+	maildir_uidlist_append_padding(str);
+
+	hdr.hdr_size = cpu32_to_le(str_len(str));
+	buffer_write(str, 0, &hdr, sizeof(hdr));
+}
+
+static void
+maildir_uidlist_append_bin_rec(string_t *str, struct maildir_uidlist_rec *rec)
+{
+	struct maildir_uidlist_bin_record brec;
+	const unsigned char *p;
+	const char *strp;
+	size_t ext_size = 0, fname_len;
+
+	if (rec->extensions != NULL) {
+		for (p = rec->extensions; *p != '\0'; ) {
+			i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+			p += strlen((const char *)p) + 1;
+		}
+		ext_size = p - rec->extensions + 1;
+		if (ext_size == 1) {
+			/* no extensions */
+			ext_size = 0;
+		}
+	}
+	strp = strchr(rec->filename, *MAILDIR_INFO_SEP_S);
+	fname_len = strp == NULL ? strlen(rec->filename) :
+		(size_t)(strp - rec->filename);
+
+	brec.uid = cpu32_to_le(rec->uid);
+	brec.ext_size = cpu32_to_le(ext_size);
+	brec.filename_size = cpu32_to_le(fname_len + 1);
+	buffer_append(str, &brec, sizeof(brec));
+	buffer_append(str, rec->extensions, ext_size);
+	str_append_data(str, rec->filename, fname_len);
+	str_append_c(str, '\0');
+	maildir_uidlist_append_padding(str);
+}
+
 static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 				    const char *path, unsigned int first_idx,
 				    uoff_t *file_size_r)
@@ -1257,7 +1753,7 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 
 	if (output->offset == 0) {
 		i_assert(first_idx == 0);
-		uidlist->version = UIDLIST_VERSION;
+		uidlist->version = maildir_uidlist_wanted_version(uidlist);
 
 		if (uidlist->uid_validity == 0)
 			maildir_uidlist_generate_uid_validity(uidlist);
@@ -1265,18 +1761,22 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 			guid_128_generate(uidlist->mailbox_guid);
 
 		i_assert(uidlist->next_uid > 0);
-		str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
-			    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
-			    uidlist->uid_validity,
-			    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
-			    uidlist->next_uid,
-			    MAILDIR_UIDLIST_HDR_EXT_GUID,
-			    guid_128_to_string(uidlist->mailbox_guid));
-		if (str_len(uidlist->hdr_extensions) > 0) {
-			str_append_c(str, ' ');
-			str_append_str(str, uidlist->hdr_extensions);
+		if (uidlist->version == UIDLIST_VERSION_BINARY)
+			maildir_uidlist_append_bin_header(uidlist, str);
+		else {
+			str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
+				    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
+				    uidlist->uid_validity,
+				    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
+				    uidlist->next_uid,
+				    MAILDIR_UIDLIST_HDR_EXT_GUID,
+				    guid_128_to_string(uidlist->mailbox_guid));
+			if (str_len(uidlist->hdr_extensions) > 0) {
+				str_append_c(str, ' ');
+				str_append_str(str, uidlist->hdr_extensions);
+			}
+			str_append_c(str, '\n');
 		}
-		str_append_c(str, '\n');
 		o_stream_nsend(output, str_data(str), str_len(str));
 	}
 
@@ -1287,6 +1787,11 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
 		uidlist->read_records_count++;
 		str_truncate(str, 0);
+		if (uidlist->version == UIDLIST_VERSION_BINARY) {
+			maildir_uidlist_append_bin_rec(str, rec);
+			o_stream_nsend(output, str_data(str), str_len(str));
+			continue;
+		}
 		str_printfa(str, "%u", rec->uid);
 		if (rec->extensions != NULL) {
 			for (p = rec->extensions; *p != '\0'; ) {
@@ -1360,7 +1865,10 @@ maildir_uidlist_records_drop_expunges(struct maildir_uidlist *uidlist)
 		rec = mail_index_lookup(view, seq);
 		if (recs[i]->uid < rec->uid) {
 			/* expunged entry */
-			hash_table_remove(uidlist->files, recs[i]->filename);
+			if (!uidlist->files_unhashed) {
+				hash_table_remove(uidlist->files,
+						  recs[i]->filename);
+			}
 			i++;
 		} else if (recs[i]->uid > rec->uid) {
 			/* index isn't up to date. we're probably just
@@ -1374,7 +1882,8 @@ maildir_uidlist_records_drop_expunges(struct maildir_uidlist *uidlist)
 
 	/* drop messages expunged at the end of index */
 	while (i < count && recs[i]->uid < hdr->next_uid) {
-		hash_table_remove(uidlist->files, recs[i]->filename);
+		if (!uidlist->files_unhashed)
+			hash_table_remove(uidlist->files, recs[i]->filename);
 		i++;
 	}
 	/* view might not be completely up-to-date, so preserve any
@@ -1517,8 +2026,8 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
-	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
-	    !uidlist->have_mailbox_guid)
+	if (uidlist->fd == -1 || !uidlist->have_mailbox_guid ||
+	    uidlist->version != maildir_uidlist_wanted_version(uidlist))
 		return TRUE;
 	return maildir_uidlist_want_compress(ctx);
 }
@@ -1657,7 +2166,10 @@ int maildir_uidlist_sync_init(struct maildir_uidlist *uidlist,
 
 	ctx->record_pool = pool_alloconly_create(MEMPOOL_GROWING
 						 "maildir_uidlist_sync", 16384);
-	hash_table_create(&ctx->files, ctx->record_pool, 4096,
+	/* the maildir most likely still has about as many files as the
+	   uidlist, so avoid growing the hash table while scanning */
+	hash_table_create(&ctx->files, ctx->record_pool,
+			  I_MAX(array_count(&uidlist->records), 4096),
 			  maildir_filename_base_hash,
 			  maildir_filename_base_cmp);
 
@@ -1675,6 +2187,7 @@ maildir_uidlist_sync_next_partial(struct maildir_uidlist_sync_ctx *ctx,
 	struct maildir_uidlist_rec *rec, *const *recs;
 	unsigned int count;
 
+	maildir_uidlist_hash_files(uidlist);
 	/* we'll update uidlist directly */
 	rec = hash_table_lookup(uidlist->files, filename);
 	if (rec == NULL) {
@@ -1735,19 +2248,17 @@ maildir_uidlist_sync_next_partial(struct maildir_uidlist_sync_ctx *ctx,
 static unsigned char *ext_dup(pool_t pool, const unsigned char *extensions)
 {
 	unsigned char *ret;
+	unsigned int len;
 
 	if (extensions == NULL)
 		return NULL;
 
-	T_BEGIN {
-		unsigned int len;
-
-		for (len = 0; extensions[len] != '\0'; len++) {
-			while (extensions[len] != '\0') len++;
-		}
-		ret = p_malloc(pool, len + 1);
-		memcpy(ret, extensions, len);
-	} T_END;
+	/* the extensions are NUL-separated and end with an empty string */
+	for (len = 0; extensions[len] != '\0'; len++) {
+		while (extensions[len] != '\0') len++;
+	}
+	ret = p_malloc(pool, len + 1);
+	memcpy(ret, extensions, len);
 	return ret;
 }
 
@@ -1774,12 +2285,13 @@ int maildir_uidlist_sync_next_uid(struct maildir_uidlist_sync_ctx *ctx,
 
 	if (ctx->failed)
 		return -1;
-	for (p = filename; *p != '\0'; p++) {
-		if (*p == 13 || *p == 10) {
-			e_warning(event, "Ignoring a file with #0x%x: %s",
-				  *p, filename);
-			return 1;
-		}
+	/* this is called for every file in the maildir, so let libc's
+	   vectorized strpbrk() do the scanning */
+	p = strpbrk(filename, "\r\n");
+	if (unlikely(p != NULL)) {
+		e_warning(event, "Ignoring a file with #0x%x: %s",
+			  *p, filename);
+		return 1;
 	}
 
 	if (ctx->partial) {
@@ -1803,6 +2315,7 @@ int maildir_uidlist_sync_next_uid(struct maildir_uidlist_sync_ctx *ctx,
 		if (strcmp(rec->filename, filename) != 0)
 			rec->filename = p_strdup(ctx->record_pool, filename);
 	} else {
+		maildir_uidlist_hash_files(uidlist);
 		old_rec = hash_table_lookup(uidlist->files, filename);
 		i_assert(old_rec != NULL || UIDLIST_IS_LOCKED(uidlist));
 
@@ -1844,6 +2357,7 @@ void maildir_uidlist_sync_remove(struct maildir_uidlist_sync_ctx *ctx,
 	i_assert(ctx->partial);
 	i_assert(ctx->uidlist->locked_refresh);
 
+	maildir_uidlist_hash_files(ctx->uidlist);
 	rec = hash_table_lookup(ctx->uidlist->files, filename);
 	i_assert(rec != NULL);
 	i_assert(rec->uid != (uint32_t)-1);
@@ -1892,6 +2406,7 @@ bool maildir_uidlist_get_uid(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
+	maildir_uidlist_hash_files(uidlist);
 	rec = hash_table_lookup(uidlist->files, filename);
 	if (rec == NULL)
 		return FALSE;
@@ -1905,6 +2420,7 @@ void maildir_uidlist_update_fname(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
+	maildir_uidlist_hash_files(uidlist);
 	rec = hash_table_lookup(uidlist->files, filename);
 	if (rec == NULL)
 		return;
@@ -1920,6 +2436,7 @@ maildir_uidlist_get_full_filename(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
+	maildir_uidlist_hash_files(uidlist);
 	rec = hash_table_lookup(uidlist->files, filename);
 	return rec == NULL ? NULL : rec->filename;
 }
@@ -1988,11 +2505,14 @@ static void maildir_uidlist_swap(struct maildir_uidlist_sync_ctx *ctx)
 
 	hash_table_destroy(&uidlist->files);
 	uidlist->files = ctx->files;
+	uidlist->files_unhashed = FALSE;
 	i_zero(&ctx->files);
 
 	pool_unref(&uidlist->record_pool);
 	uidlist->record_pool = ctx->record_pool;
 	ctx->record_pool = NULL;
+	/* the new records were all copied to the sync context's pool */
+	maildir_uidlist_mmaps_free(uidlist);
 
 	if (ctx->new_files_count != 0) {
 		ctx->first_new_pos = array_count(&uidlist->records) -
@@ -2072,6 +2592,7 @@ void maildir_uidlist_add_flags(struct maildir_uidlist *uidlist,
 {
 	struct maildir_uidlist_rec *rec;
 
+	maildir_uidlist_hash_files(uidlist);
 	rec = hash_table_lookup(uidlist->files, filename);
 	i_assert(rec != NULL);
 
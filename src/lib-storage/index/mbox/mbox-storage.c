@@ -428,6 +428,9 @@ mbox_mailbox_open_finish(struct mbox_mailbox *mbox, bool move_to_memory)
 	mbox->md5hdr_ext_idx =
 		mail_index_ext_register(mbox->box.index, "header-md5",
 					0, 16, 1);
+	mbox->from_crc_ext_idx =
+		mail_index_ext_register(mbox->box.index, "mbox-from-crc",
+					0, sizeof(uint32_t), sizeof(uint32_t));
 	return 0;
 }
 
@@ -53,7 +53,8 @@ struct mbox_mailbox {
 	bool mbox_writeonly;
 	unsigned int external_transactions;
 
-	uint32_t mbox_ext_idx, md5hdr_ext_idx, mbox_list_index_ext_id;
+	uint32_t mbox_ext_idx, md5hdr_ext_idx, from_crc_ext_idx;
+	uint32_t mbox_list_index_ext_id;
 	struct mbox_index_header mbox_hdr;
 	const struct mailbox_update *sync_hdr_update;
 
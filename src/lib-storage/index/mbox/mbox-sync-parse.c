@@ -452,6 +452,36 @@ static int mbox_sync_bsearch_header_func_cmp(const void *p1, const void *p2)
 	return strcasecmp(key, func->header);
 }
 
+static void mbox_sync_parse_hdr_md5(struct mbox_sync_mail_context *ctx)
+{
+	struct mbox_mailbox *mbox = ctx->sync_ctx->mbox;
+	struct message_header_parser_ctx *hdr_ctx;
+	struct message_header_line *hdr;
+	struct mbox_md5_context *mbox_md5_ctx;
+	struct istream *input;
+	int ret;
+
+	/* the headers that are included in the MD5 sum are in ctx->header
+	   exactly as they were in the mbox file. */
+	input = i_stream_create_from_data(str_data(ctx->header),
+					  str_len(ctx->header));
+	mbox_md5_ctx = mbox->md5_v.init();
+	hdr_ctx = message_parse_header_init(input, NULL, 0);
+	while ((ret = message_parse_header_next(hdr_ctx, &hdr)) > 0) {
+		if (hdr->eoh)
+			break;
+		if (bsearch(hdr->name, header_funcs,
+			    N_ELEMENTS(header_funcs), sizeof(*header_funcs),
+			    mbox_sync_bsearch_header_func_cmp) == NULL)
+			mbox->md5_v.more(mbox_md5_ctx, hdr);
+	}
+	i_assert(ret != 0);
+	message_parse_header_deinit(&hdr_ctx);
+	i_stream_unref(&input);
+
+	mbox->md5_v.finish(mbox_md5_ctx, ctx->hdr_md5_sum);
+}
+
 int mbox_sync_parse_next_mail(struct istream *input,
 			      struct mbox_sync_mail_context *ctx)
 {
@@ -475,7 +505,12 @@ int mbox_sync_parse_next_mail(struct istream *input,
 	ctx->content_length = UOFF_T_MAX;
 	str_truncate(ctx->header, 0);
 
-        mbox_md5_ctx = ctx->sync_ctx->mbox->md5_v.init();
+	/* The MD5 sum is needed only if we're storing them to the index or
+	   if the mail doesn't have a valid X-UID header. The latter isn't
+	   known until all the headers are parsed, so in that case the MD5
+	   sum is calculated afterwards. */
+	mbox_md5_ctx = !sync_ctx->mbox->mbox_save_md5 ? NULL :
+		sync_ctx->mbox->md5_v.init();
 
         line_start_pos = 0;
 	hdr_ctx = message_parse_header_init(input, NULL, 0);
@@ -514,7 +549,8 @@ int mbox_sync_parse_next_mail(struct istream *input,
 			buffer_append(ctx->header, hdr->full_value,
 				      hdr->full_value_len);
 		} else {
-			ctx->sync_ctx->mbox->md5_v.more(mbox_md5_ctx, hdr);
+			if (mbox_md5_ctx != NULL)
+				sync_ctx->mbox->md5_v.more(mbox_md5_ctx, hdr);
 			buffer_append(ctx->header, hdr->value,
 				      hdr->value_len);
 		}
@@ -527,7 +563,10 @@ int mbox_sync_parse_next_mail(struct istream *input,
 	i_assert(ret != 0);
 	message_parse_header_deinit(&hdr_ctx);
 
-	ctx->sync_ctx->mbox->md5_v.finish(mbox_md5_ctx, ctx->hdr_md5_sum);
+	if (mbox_md5_ctx != NULL)
+		sync_ctx->mbox->md5_v.finish(mbox_md5_ctx, ctx->hdr_md5_sum);
+	else if (ctx->mail.uid == 0 && !ctx->mail.pseudo)
+		mbox_sync_parse_hdr_md5(ctx);
 
 	if ((ctx->seq == 1 && !ctx->seen_imapbase) ||
 	    (ctx->seq > 1 && sync_ctx->dest_first_mail)) {
@@ -82,6 +82,8 @@ struct mbox_sync_mail_context {
 	string_t *header;
 
 	unsigned char hdr_md5_sum[16];
+	/* checksum of the From-line's sender and received time */
+	uint32_t from_crc;
 
 	uoff_t content_length;
 
@@ -133,6 +135,8 @@ struct mbox_sync_context {
 
 	uint32_t prev_msg_uid, next_uid, idx_next_uid;
 	uint32_t seq, idx_seq, need_space_seq;
+	/* number of mails read from the file, including restarted syncs */
+	unsigned int parsed_mails;
 	uint32_t last_nonrecent_uid;
 	off_t expunged_space, space_diff;
 
@@ -29,12 +29,19 @@
    - Rewriting is done by moving message body forward, rewriting message's
      header and doing the same for previous message, until all of them are
      rewritten.
+
+   Partial syncs that notice the file has grown or shrunk only need to read
+   the messages after the last one that is still where the index says it is.
+   Each message's From-line offset is stored in the index together with a
+   checksum of the From-line, so that message can be found by binary searching
+   the offsets instead of reading the file from the beginning.
 */
 
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
 #include "buffer.h"
+#include "crc32.h"
 #include "hostpid.h"
 #include "istream.h"
 #include "file-set-size.h"
@@ -65,6 +72,10 @@
 "If deleted, important folder data will be lost, and it will be re-created\n" \
 "with the data reset to initial values.\n"
 
+/* From-lines longer than this aren't trusted when looking for the changed
+   part of the mbox. They're still handled normally when reading the mails. */
+#define MBOX_SYNC_FROM_LINE_MAX_SIZE 1024
+
 void mbox_sync_set_critical(struct mbox_sync_context *sync_ctx,
 			    const char *fmt, ...)
 {
@@ -126,6 +137,14 @@ void mbox_sync_file_updated(struct mbox_sync_context *sync_ctx, bool dirty)
 	i_stream_sync(sync_ctx->input);
 }
 
+static uint32_t mbox_sync_from_crc(const char *sender, time_t received_time)
+{
+	uint32_t crc;
+
+	crc = crc32_str(sender);
+	return crc32_data_more(crc, &received_time, sizeof(received_time));
+}
+
 static int
 mbox_sync_read_next_mail(struct mbox_sync_context *sync_ctx,
 			 struct mbox_sync_mail_context *mail_ctx)
@@ -150,11 +169,15 @@ mbox_sync_read_next_mail(struct mbox_sync_context *sync_ctx,
 			"Couldn't get header offset for seq=%u", mail_ctx->seq);
 		return -1;
 	}
+	mail_ctx->from_crc = mbox_sync_from_crc(
+		istream_raw_mbox_get_sender(sync_ctx->input),
+		istream_raw_mbox_get_received_time(sync_ctx->input));
 
 	if (mbox_sync_parse_next_mail(sync_ctx->input, mail_ctx) < 0)
 		return -1;
 	if (istream_raw_mbox_is_corrupted(sync_ctx->input))
 		return -1;
+	sync_ctx->parsed_mails++;
 
 	i_assert(sync_ctx->input->v_offset != mail_ctx->mail.from_offset ||
 		 sync_ctx->input->eof);
@@ -334,6 +357,22 @@ mbox_sync_update_md5_if_changed(struct mbox_sync_mail_context *mail_ctx)
 	}
 }
 
+static void
+mbox_sync_update_from_crc_if_changed(struct mbox_sync_mail_context *mail_ctx)
+{
+	struct mbox_sync_context *sync_ctx = mail_ctx->sync_ctx;
+	const void *ext_data;
+
+	mail_index_lookup_ext(sync_ctx->sync_view, sync_ctx->idx_seq,
+			      sync_ctx->mbox->from_crc_ext_idx, &ext_data, NULL);
+	if (ext_data == NULL ||
+	    *((const uint32_t *)ext_data) != mail_ctx->from_crc) {
+		mail_index_update_ext(sync_ctx->t, sync_ctx->idx_seq,
+				      sync_ctx->mbox->from_crc_ext_idx,
+				      &mail_ctx->from_crc, NULL);
+	}
+}
+
 static void mbox_sync_get_dirty_flags(struct mbox_sync_mail_context *mail_ctx,
 				      const struct mail_index_record *rec)
 {
@@ -441,6 +480,9 @@ static void mbox_sync_update_index(struct mbox_sync_mail_context *mail_ctx,
 				sync_ctx->mbox->md5hdr_ext_idx,
 				mail_ctx->hdr_md5_sum, NULL);
 		}
+		mail_index_update_ext(sync_ctx->t, sync_ctx->idx_seq,
+				      sync_ctx->mbox->from_crc_ext_idx,
+				      &mail_ctx->from_crc, NULL);
 	} else {
 		if ((rec->flags & MAIL_FLAGS_NONRECENT) !=
 		    (mbox_flags & MAIL_FLAGS_NONRECENT)) {
@@ -468,6 +510,7 @@ static void mbox_sync_update_index(struct mbox_sync_mail_context *mail_ctx,
 		/* see if we need to update md5 sum. */
 		if (sync_ctx->mbox->mbox_save_md5)
 			mbox_sync_update_md5_if_changed(mail_ctx);
+		mbox_sync_update_from_crc_if_changed(mail_ctx);
 	}
 
 	if (!mail_ctx->recent) {
@@ -921,6 +964,94 @@ mbox_sync_seek_to_uid(struct mbox_sync_context *sync_ctx, uint32_t uid)
 	return mbox_sync_seek_to_seq(sync_ctx, seq1);
 }
 
+static bool
+mbox_sync_from_offset_is_valid(struct mbox_sync_context *sync_ctx,
+			       uint32_t seq)
+{
+	struct mbox_mailbox *mbox = sync_ctx->mbox;
+	struct istream *input = sync_ctx->file_input;
+	const unsigned char *data;
+	const void *ext_data;
+	size_t size, skip;
+	uoff_t offset;
+	time_t received_time;
+	char *sender;
+	uint32_t crc;
+	int tz;
+	bool ret;
+
+	mail_index_lookup_ext(sync_ctx->sync_view, seq, mbox->mbox_ext_idx,
+			      &ext_data, NULL);
+	if (ext_data == NULL)
+		return FALSE;
+	offset = *((const uint64_t *)ext_data);
+
+	/* Parse the From-line directly from the file. Seeking the raw mbox
+	   stream to an invalid offset would log an error. */
+	i_stream_seek(input, offset);
+	(void)i_stream_read_bytes(input, &data, &size,
+				  MBOX_SYNC_FROM_LINE_MAX_SIZE);
+	if (offset == 0)
+		skip = 0;
+	else
+		skip = size > 0 && data[0] == '\r' ? 2 : 1;
+	if (size < skip + 5 || (skip > 0 && data[skip - 1] != '\n') ||
+	    memcmp(data + skip, "From ", 5) != 0 ||
+	    mbox_from_parse(data + skip + 5, size - skip - 5,
+			    &received_time, &tz, &sender) < 0)
+		return FALSE;
+
+	mail_index_lookup_ext(sync_ctx->sync_view, seq,
+			      mbox->from_crc_ext_idx, &ext_data, NULL);
+	crc = ext_data == NULL ? 0 : *((const uint32_t *)ext_data);
+	/* 0 means the checksum hasn't been written yet. Then it's enough
+	   that the From-line is still where we expected it. */
+	ret = crc == 0 || crc == mbox_sync_from_crc(sender, received_time);
+	i_free(sender);
+	return ret;
+}
+
+static int
+mbox_sync_seek_to_tail(struct mbox_sync_context *sync_ctx, uint32_t last_seq)
+{
+	uoff_t old_offset;
+	uint32_t first_seq, seq, good_seq = 0;
+
+	/* Usually new mails were just appended and the last message is
+	   still where the index says it is. If it isn't, something was
+	   expunged, added or modified in the middle of the file, but
+	   everything before that is likely still in place. Binary search
+	   the last message whose From-line is still at its indexed offset
+	   and continue reading from there instead of from the current
+	   message. */
+	old_offset = istream_raw_mbox_get_start_offset(sync_ctx->input);
+	first_seq = sync_ctx->idx_seq;
+	if (first_seq <= last_seq &&
+	    mbox_sync_from_offset_is_valid(sync_ctx, last_seq))
+		good_seq = first_seq = last_seq;
+	while (first_seq < last_seq) {
+		seq = first_seq + (last_seq - first_seq) / 2;
+		if (mbox_sync_from_offset_is_valid(sync_ctx, seq)) {
+			good_seq = seq;
+			first_seq = seq + 1;
+		} else {
+			last_seq = seq;
+		}
+	}
+
+	if (istream_raw_mbox_seek(sync_ctx->mbox->mbox_stream,
+				  old_offset) < 0) {
+		mbox_sync_set_critical(sync_ctx,
+			"Error seeking back to original offset %s",
+			dec2str(old_offset));
+		return -1;
+	}
+	if (good_seq <= sync_ctx->idx_seq)
+		return 0;
+	/* this still verifies that the message's X-UID or MD5 sum matches */
+	return mbox_sync_seek_to_seq(sync_ctx, good_seq);
+}
+
 static int mbox_sync_partial_seek_next(struct mbox_sync_context *sync_ctx,
 				       uint32_t next_uid, bool *partial,
 				       bool *skipped_mails)
@@ -967,7 +1098,7 @@ static int mbox_sync_partial_seek_next(struct mbox_sync_context *sync_ctx,
 		messages_count =
 			mail_index_view_get_messages_count(sync_ctx->sync_view);
 		if (sync_ctx->seq + 1 != messages_count) {
-			ret = mbox_sync_seek_to_seq(sync_ctx, messages_count);
+			ret = mbox_sync_seek_to_tail(sync_ctx, messages_count);
 			*skipped_mails = TRUE;
 		} else {
 			ret = 1;
@@ -1687,6 +1818,11 @@ static int mbox_sync_do(struct mbox_sync_context *sync_ctx,
 
 	if (mbox_sync_update_index_header(sync_ctx) < 0)
 		return -1;
+
+	e_debug(event_create_passthrough(sync_ctx->mbox->box.event)->
+		set_name("mbox_sync_finished")->
+		add_int("parsed_mails", sync_ctx->parsed_mails)->event(),
+		"Synced mbox, read %u mails", sync_ctx->parsed_mails);
 	return ret;
 }
 
@@ -704,6 +704,7 @@ struct mail_search_context {
 	ARRAY(struct mail *) mails;
 	unsigned int unused_mail_idx;
 	unsigned int max_mails;
+	unsigned int prefetch_count, prefetch_hits;
 
 	ARRAY(union mail_search_module_context *) module_contexts;
 
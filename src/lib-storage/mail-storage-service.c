@@ -1685,6 +1685,30 @@ void mail_storage_service_init_settings(struct mail_storage_service_ctx *ctx,
 	mail_storage_service_first_init(ctx, set_parser, user_set, ctx->flags);
 }
 
+int mail_storage_service_prewarm(struct mail_storage_service_ctx *ctx,
+				 const char **error_r)
+{
+	struct mail_storage_service_input input;
+	const struct mail_user_settings *user_set;
+	struct setting_parser_context *set_parser;
+
+	i_zero(&input);
+	input.service = master_service_get_name(ctx->service);
+	if (mail_storage_service_read_settings(ctx, &input,
+					       &set_parser, error_r) < 0)
+		return -1;
+	user_set = settings_parser_get_root_set(set_parser,
+						&mail_user_setting_parser_info);
+	if (!user_set->mail_prewarm)
+		return 0;
+
+	if (ctx->conn == NULL)
+		mail_storage_service_first_init(ctx, set_parser, user_set,
+						ctx->flags);
+	return mail_storage_service_load_modules(ctx, set_parser, user_set,
+						 error_r);
+}
+
 static int
 mail_storage_service_all_iter_deinit(struct mail_storage_service_ctx *ctx)
 {
@@ -99,6 +99,12 @@ int mail_storage_service_read_settings(struct mail_storage_service_ctx *ctx,
 void mail_storage_service_init_settings(struct mail_storage_service_ctx *ctx,
 					const struct mail_storage_service_input *input)
 	ATTR_NULL(2);
+/* If mail_prewarm=yes, read the service's settings and load the global
+   mail_plugins already before any user has been looked up. This makes the
+   first login faster in processes kept waiting by process_min_avail.
+   Returns 0 if ok or prewarming is disabled, -1 on error. */
+int mail_storage_service_prewarm(struct mail_storage_service_ctx *ctx,
+				 const char **error_r);
 /* Returns 1 if ok, 0 if user wasn't found, -1 if fatal error,
    -2 if error is user-specific (e.g. invalid settings). */
 int mail_storage_service_lookup(struct mail_storage_service_ctx *ctx,
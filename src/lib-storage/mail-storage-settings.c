@@ -39,9 +39,11 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(STR, mail_attachment_detection_options),
 	DEF(STR_VARS, mail_attribute_dict),
 	DEF(UINT, mail_prefetch_count),
+	DEF(UINT, mail_search_prefetch_count),
 	DEF(STR, mail_cache_fields),
 	DEF(STR, mail_always_cache_fields),
 	DEF(STR, mail_never_cache_fields),
+	DEF(STR, mail_cache_column_fields),
 	DEF(STR, mail_server_comment),
 	DEF(STR, mail_server_admin),
 	DEF(TIME_HIDDEN, mail_cache_unaccessed_field_drop),
@@ -97,9 +99,11 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_attachment_detection_options = "",
 	.mail_attribute_dict = "",
 	.mail_prefetch_count = 0,
+	.mail_search_prefetch_count = 0,
 	.mail_cache_fields = "flags",
 	.mail_always_cache_fields = "",
 	.mail_never_cache_fields = "imap.envelope",
+	.mail_cache_column_fields = "",
 	.mail_server_comment = "",
 	.mail_server_admin = "",
 	.mail_cache_min_mail_count = 0,
@@ -293,6 +297,7 @@ static const struct setting_define mail_user_setting_defines[] = {
 
 	DEF(STR, mail_plugins),
 	DEF(STR, mail_plugin_dir),
+	DEF(BOOL, mail_prewarm),
 
 	DEF(STR, mail_log_prefix),
 
@@ -326,6 +331,7 @@ static const struct mail_user_settings mail_user_default_settings = {
 
 	.mail_plugins = "",
 	.mail_plugin_dir = MODULEDIR,
+	.mail_prewarm = FALSE,
 
 	.mail_log_prefix = "%s(%u)<%{pid}><%{session}>: ",
 
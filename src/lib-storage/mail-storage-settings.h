@@ -19,9 +19,11 @@ struct mail_storage_settings {
 	uoff_t mail_attachment_min_size;
 	const char *mail_attribute_dict;
 	unsigned int mail_prefetch_count;
+	unsigned int mail_search_prefetch_count;
 	const char *mail_cache_fields;
 	const char *mail_always_cache_fields;
 	const char *mail_never_cache_fields;
+	const char *mail_cache_column_fields;
 	const char *mail_server_comment;
 	const char *mail_server_admin;
 	unsigned int mail_cache_min_mail_count;
@@ -131,6 +133,7 @@ struct mail_user_settings {
 
 	const char *mail_plugins;
 	const char *mail_plugin_dir;
+	bool mail_prewarm;
 
 	const char *mail_log_prefix;
 
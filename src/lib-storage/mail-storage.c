@@ -2567,6 +2567,23 @@ bool mailbox_search_seen_lost_data(struct mail_search_context *ctx)
 	return ctx->seen_lost_data;
 }
 
+void mailbox_search_set_prefetch_count(struct mail_search_context *ctx,
+				       unsigned int count)
+{
+	i_assert(ctx->seq == 0);
+
+	if (count < UINT_MAX && ctx->max_mails < count + 1)
+		ctx->max_mails = count + 1;
+}
+
+void mailbox_search_get_prefetch_stats(struct mail_search_context *ctx,
+				       unsigned int *prefetched_r,
+				       unsigned int *hits_r)
+{
+	*prefetched_r = ctx->prefetch_count;
+	*hits_r = ctx->prefetch_hits;
+}
+
 void mailbox_search_mail_detach(struct mail_search_context *ctx,
 				struct mail *mail)
 {
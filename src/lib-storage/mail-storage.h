@@ -743,6 +743,16 @@ bool mailbox_search_next_nonblock(struct mail_search_context *ctx,
    determine correctly if those messages should have been returned in this
    search. */
 bool mailbox_search_seen_lost_data(struct mail_search_context *ctx);
+/* Prefetch up to count messages ahead of the one currently returned, if this
+   is more than what mail_prefetch_count would do. This must be called before
+   the first mailbox_search_next*() call. */
+void mailbox_search_set_prefetch_count(struct mail_search_context *ctx,
+				       unsigned int count);
+/* Returns the number of messages whose prefetching was started and how many
+   of them were returned by the search so far. */
+void mailbox_search_get_prefetch_stats(struct mail_search_context *ctx,
+				       unsigned int *prefetched_r,
+				       unsigned int *hits_r);
 /* Detach the given mail from the search context. This allows the mail to live
    even after mail_search_context has been freed. */
 void mailbox_search_mail_detach(struct mail_search_context *ctx,
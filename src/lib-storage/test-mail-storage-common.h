@@ -17,6 +17,9 @@ struct test_mail_storage_settings {
 	const char *driver_opts;
 	const char *hierarchy_sep;
 	const char *const *extra_input;
+	/* Keep the existing home directory, so the same mails can be
+	   accessed again with different settings. */
+	bool keep_home;
 };
 
 struct test_mail_storage_ctx *test_mail_storage_init(void);
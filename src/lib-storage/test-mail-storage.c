@@ -1,10 +1,27 @@
 /* Copyright (c) 2017-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "lib-event-private.h"
+#include "event-filter.h"
 #include "ioloop.h"
+#include "istream.h"
+#include "str.h"
+#include "seq-range-array.h"
+#include "time-util.h"
+#include "read-full.h"
+#include "write-full.h"
 #include "test-common.h"
 #include "master-service.h"
 #include "test-mail-storage-common.h"
+#include "index/index-thread-private.h"
+#include "mail-index.h"
+#include "mdbox-storage.h"
+#include "mdbox-map-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 /* globally used test date and appropriate time_t value */
 static struct test_globals {
@@ -607,6 +624,894 @@ static void test_mailbox_list_maildir(void)
 	test_mail_storage_deinit(&ctx);
 }
 
+static void test_maildir_create_file(const char *path, const char *fname)
+{
+	const char *fpath = t_strdup_printf("%s/cur/%s", path, fname);
+	int fd;
+
+	fd = creat(fpath, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", fpath);
+	if (write_full(fd, "Subject: test\n\nbody\n", 20) < 0)
+		i_fatal("write(%s) failed: %m", fpath);
+	i_close_fd(&fd);
+}
+
+static char test_maildir_uidlist_version(const char *uidlist_path)
+{
+	char version[2];
+	int fd;
+
+	fd = open(uidlist_path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", uidlist_path);
+	if (read_full(fd, version, sizeof(version)) <= 0)
+		i_fatal("read(%s) failed: %m", uidlist_path);
+	i_close_fd(&fd);
+	test_assert(version[1] == ' ');
+	return version[0];
+}
+
+static void
+test_maildir_uidlist_sync(struct mail_namespace *ns,
+			  const uint32_t *uids, unsigned int count)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mailbox_status status;
+	struct mail *mail;
+	struct istream *input;
+	uoff_t vsize;
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_get_open_status(box, STATUS_MESSAGES | STATUS_UIDVALIDITY,
+				&status);
+	test_assert(status.uidvalidity == 1234);
+	test_assert(status.messages == count);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (unsigned int i = 0; i < count && i < status.messages; i++) {
+		mail_set_seq(mail, i + 1);
+		test_assert_idx(mail->uid == uids[i], i);
+		test_assert_idx(mail_get_stream(mail, NULL, NULL, &input) == 0, i);
+		if (mail->uid == 7) {
+			/* W=<vsize> extension field */
+			test_assert(mail_get_virtual_size(mail, &vsize) == 0 &&
+				    vsize == 25);
+		}
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mailbox_free(&box);
+}
+
+static void
+test_maildir_uidlist_binary_run(const char *const *extra_input)
+{
+	static const char uidlist_v3[] =
+		"3 V1234 N20 G0123456789abcdef0123456789abcdef\n"
+		"5 :100.M1P1.test\n"
+		"7 W25 :101.M2P1.test\n";
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.extra_input = extra_input,
+	};
+	const uint32_t uids[] = { 5, 7, 20, 21, 22, 23 };
+	struct test_mail_storage_ctx *ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	const char *path, *uidlist_path;
+	int fd;
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+				&path) <= 0 ||
+	    mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_CONTROL,
+				&uidlist_path) <= 0)
+		i_unreached();
+	path = t_strdup(path);
+	uidlist_path = t_strconcat(uidlist_path, "/dovecot-uidlist", NULL);
+	mailbox_free(&box);
+
+	/* a text uidlist is converted when a new mail is added */
+	test_maildir_create_file(path, "100.M1P1.test:2,S");
+	test_maildir_create_file(path, "101.M2P1.test:2,");
+	test_maildir_create_file(path, "102.M3P1.test:2,F");
+	fd = creat(uidlist_path, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", uidlist_path);
+	if (write_full(fd, uidlist_v3, sizeof(uidlist_v3) - 1) < 0)
+		i_fatal("write(%s) failed: %m", uidlist_path);
+	i_close_fd(&fd);
+	test_maildir_uidlist_sync(ns, uids, 3);
+	test_assert(test_maildir_uidlist_version(uidlist_path) == '4');
+
+	/* new mails are appended to the binary uidlist */
+	test_maildir_create_file(path, "103.M4P1.test:2,");
+	test_maildir_uidlist_sync(ns, uids, 4);
+	test_assert(test_maildir_uidlist_version(uidlist_path) == '4');
+	/* read it again from the beginning */
+	test_maildir_uidlist_sync(ns, uids, 4);
+	test_mail_storage_deinit_user(ctx);
+
+	/* the binary uidlist is converted back to text when the setting is
+	   disabled */
+	set.extra_input = NULL;
+	set.keep_home = TRUE;
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	test_maildir_uidlist_sync(ns, uids, 4);
+	test_maildir_create_file(path, "104.M5P1.test:2,");
+	test_maildir_uidlist_sync(ns, uids, 5);
+	test_assert(test_maildir_uidlist_version(uidlist_path) == '3');
+	test_mail_storage_deinit_user(ctx);
+
+	/* and to binary again */
+	set.extra_input = extra_input;
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	test_maildir_uidlist_sync(ns, uids, 5);
+	test_maildir_create_file(path, "105.M6P1.test:2,");
+	test_maildir_uidlist_sync(ns, uids, 6);
+	test_assert(test_maildir_uidlist_version(uidlist_path) == '4');
+	test_maildir_uidlist_sync(ns, uids, 6);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+}
+
+static void test_maildir_uidlist_binary(void)
+{
+	static const char *const binary_input[] = {
+		"maildir_uidlist_binary=yes", NULL
+	};
+	static const char *const binary_nommap_input[] = {
+		"maildir_uidlist_binary=yes", "mmap_disable=yes", NULL
+	};
+
+	test_begin("maildir uidlist binary format");
+	test_maildir_uidlist_binary_run(binary_input);
+	test_end();
+
+	test_begin("maildir uidlist binary format (mmap_disable)");
+	test_maildir_uidlist_binary_run(binary_nommap_input);
+	test_end();
+}
+
+#define TEST_THREAD_TREE_PATH ".test-thread-tree"
+
+static int test_thread_tree_file_read(ARRAY_TYPE(mail_thread_node) *nodes,
+				      struct mail_thread_tree_header *hdr_r,
+				      const char **error_r)
+{
+	int fd, ret;
+
+	fd = open(TEST_THREAD_TREE_PATH, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_THREAD_TREE_PATH);
+	ret = mail_thread_tree_file_read(fd, hdr_r, nodes, error_r);
+	i_close_fd(&fd);
+	return ret;
+}
+
+static void test_thread_tree_file_patch(off_t offset, const void *data,
+					size_t size)
+{
+	int fd;
+
+	fd = open(TEST_THREAD_TREE_PATH, O_WRONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_THREAD_TREE_PATH);
+	if (pwrite_full(fd, data, size, offset) < 0)
+		i_fatal("pwrite(%s) failed: %m", TEST_THREAD_TREE_PATH);
+	i_close_fd(&fd);
+}
+
+static void test_thread_tree_file_write(const struct mail_thread_node *nodes,
+					unsigned int count)
+{
+	struct mail_thread_tree_header hdr = {
+		.uid_validity = 1234,
+		.last_uid = 4,
+		.msgid_map_crc32 = 0x12345678,
+		.first_invalid_msgid_str_idx = count - 1,
+		.next_invalid_msgid_str_idx = count,
+		.node_count = count,
+	};
+	int fd;
+
+	fd = open(TEST_THREAD_TREE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_THREAD_TREE_PATH);
+	test_assert(mail_thread_tree_file_write(fd, &hdr, nodes) == 0);
+	i_close_fd(&fd);
+}
+
+static void test_mail_thread_tree_file(void)
+{
+	const struct mail_thread_node nodes[] = {
+		{ .uid = 0 },
+		{ .uid = 1, .parent_idx = 0, .parent_link_refcount = 1 },
+		{ .uid = 2, .parent_idx = 1, .parent_link_refcount = 3,
+		  .expunge_rebuilds = TRUE },
+		{ .uid = 0, .parent_idx = 0,
+		  .parent_link_refcount = MAIL_THREAD_TREE_RECORD_REFCOUNT_MASK,
+		  .child_unref_rebuilds = TRUE },
+		{ .uid = 4, .parent_idx = 3, .parent_link_refcount = 2,
+		  .expunge_rebuilds = TRUE, .child_unref_rebuilds = TRUE },
+		{ .uid = 0, .parent_idx = 4 },
+	};
+	const unsigned int count = N_ELEMENTS(nodes);
+	const size_t file_size = sizeof(struct mail_thread_tree_header) +
+		count * sizeof(struct mail_thread_tree_record);
+	ARRAY_TYPE(mail_thread_node) read_nodes;
+	const struct mail_thread_node *node;
+	struct mail_thread_tree_header hdr;
+	uint8_t byte, version = MAIL_THREAD_TREE_VERSION + 1;
+	uint32_t parent_idx = cpu32_to_le(count);
+	struct mail_thread_tree_record rec;
+	const char *error;
+	struct stat st;
+	int fd;
+
+	test_begin("mail thread tree file");
+	i_array_init(&read_nodes, 8);
+
+	/* write and read back */
+	test_thread_tree_file_write(nodes, count);
+	if (stat(TEST_THREAD_TREE_PATH, &st) < 0)
+		i_fatal("stat(%s) failed: %m", TEST_THREAD_TREE_PATH);
+	test_assert((size_t)st.st_size == file_size);
+	test_assert(test_thread_tree_file_read(&read_nodes, &hdr, &error) == 1);
+	test_assert(hdr.version == MAIL_THREAD_TREE_VERSION);
+	test_assert(hdr.uid_validity == 1234);
+	test_assert(hdr.last_uid == 4);
+	test_assert(hdr.msgid_map_crc32 == 0x12345678);
+	test_assert(hdr.first_invalid_msgid_str_idx == count - 1);
+	test_assert(hdr.next_invalid_msgid_str_idx == count);
+	test_assert(hdr.node_count == count);
+	test_assert(array_count(&read_nodes) == count);
+	for (unsigned int i = 0; i < count && i < array_count(&read_nodes); i++) {
+		node = array_idx(&read_nodes, i);
+		test_assert_idx(node->uid == nodes[i].uid, i);
+		test_assert_idx(node->parent_idx == nodes[i].parent_idx, i);
+		test_assert_idx(node->parent_link_refcount ==
+				nodes[i].parent_link_refcount, i);
+		test_assert_idx(node->expunge_rebuilds ==
+				nodes[i].expunge_rebuilds, i);
+		test_assert_idx(node->child_unref_rebuilds ==
+				nodes[i].child_unref_rebuilds, i);
+	}
+
+	/* the records are little endian regardless of the CPU */
+	fd = open(TEST_THREAD_TREE_PATH, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_THREAD_TREE_PATH);
+	test_assert(pread_full(fd, &rec, sizeof(rec),
+			       sizeof(hdr) + 4 * sizeof(rec)) == 1);
+	test_assert(memcmp(&rec, "\x04\0\0\0\x03\0\0\0\x02\0\0\xc0",
+			   sizeof(rec)) == 0);
+	i_close_fd(&fd);
+
+	/* truncated files are rejected */
+	for (size_t size = 0; size < file_size; size += 5) {
+		test_thread_tree_file_write(nodes, count);
+		if (truncate(TEST_THREAD_TREE_PATH, size) < 0)
+			i_fatal("truncate(%s) failed: %m", TEST_THREAD_TREE_PATH);
+		test_assert_idx(test_thread_tree_file_read(&read_nodes, &hdr,
+							   &error) == 0 &&
+				error != NULL, size);
+	}
+
+	/* any changed byte after the header's version is detected */
+	for (size_t offset = 4; offset < file_size; offset++) {
+		test_thread_tree_file_write(nodes, count);
+		byte = 0x55;
+		test_thread_tree_file_patch(offset, &byte, 1);
+		test_assert_idx(test_thread_tree_file_read(&read_nodes, &hdr,
+							   &error) == 0 &&
+				error != NULL, offset);
+	}
+
+	/* invalid parent_idx is detected even if the CRC matches */
+	test_thread_tree_file_write(nodes, count);
+	test_thread_tree_file_patch(sizeof(hdr) +
+		sizeof(struct mail_thread_tree_record) + sizeof(uint32_t),
+		&parent_idx, sizeof(parent_idx));
+	test_assert(test_thread_tree_file_read(&read_nodes, &hdr,
+					       &error) == 0 &&
+		    error != NULL && strstr(error, "parent_idx") != NULL);
+
+	/* other versions are silently ignored */
+	test_thread_tree_file_write(nodes, count);
+	test_thread_tree_file_patch(0, &version, 1);
+	test_assert(test_thread_tree_file_read(&read_nodes, &hdr,
+					       &error) == 0 && error == NULL);
+
+	i_unlink(TEST_THREAD_TREE_PATH);
+	array_free(&read_nodes);
+	test_end();
+}
+
+#define TEST_MDBOX_PURGE_MAILS 30
+#define TEST_MDBOX_PURGE_WORKERS 3
+/* per worker */
+#define TEST_MDBOX_PURGE_IOPS 200
+
+static struct {
+	unsigned int files, expunged_mails, copied_mails;
+	unsigned int worker_files[TEST_MDBOX_PURGE_WORKERS];
+	/* I/O operations counted by the throttling */
+	unsigned int worker_ops[TEST_MDBOX_PURGE_WORKERS];
+	ARRAY_TYPE(seq_range) file_ids;
+} test_mdbox_purge_events;
+
+static intmax_t
+test_mdbox_purge_event_int(struct event *event, const char *key)
+{
+	const struct event_field *field =
+		event_find_field_nonrecursive(event, key);
+
+	if (field == NULL ||
+	    field->value_type != EVENT_FIELD_VALUE_TYPE_INTMAX) {
+		test_failed(t_strdup_printf("Missing event field %s", key));
+		return 0;
+	}
+	return field->value.intmax;
+}
+
+static bool
+test_mdbox_purge_event_callback(struct event *event,
+				enum event_callback_type type,
+				struct failure_context *ctx ATTR_UNUSED,
+				const char *fmt ATTR_UNUSED,
+				va_list args ATTR_UNUSED)
+{
+	intmax_t file_id, worker, expunged, copied;
+
+	if (type != EVENT_CALLBACK_TYPE_SEND ||
+	    null_strcmp(event->sending_name, "mdbox_purge_file_finished") != 0)
+		return TRUE;
+
+	test_assert(event_find_field_nonrecursive(event, "error") == NULL);
+	file_id = test_mdbox_purge_event_int(event, "file_id");
+	test_assert(seq_range_array_add(&test_mdbox_purge_events.file_ids,
+					file_id) == FALSE);
+	worker = test_mdbox_purge_event_int(event, "purge_worker");
+	expunged = test_mdbox_purge_event_int(event, "expunged_mails");
+	copied = test_mdbox_purge_event_int(event, "copied_mails");
+	test_assert(expunged > 0);
+	test_assert(test_mdbox_purge_event_int(event, "reclaimed_bytes") > 0);
+	test_assert((test_mdbox_purge_event_int(event, "copied_bytes") > 0) ==
+		    (copied > 0));
+	(void)test_mdbox_purge_event_int(event, "purge_usecs");
+
+	test_mdbox_purge_events.files++;
+	test_mdbox_purge_events.expunged_mails += expunged;
+	test_mdbox_purge_events.copied_mails += copied;
+	if (worker >= 0 && worker < TEST_MDBOX_PURGE_WORKERS) {
+		test_mdbox_purge_events.worker_files[worker]++;
+		/* 1 per expunged mail, 2 per copied mail, 2 per file */
+		test_mdbox_purge_events.worker_ops[worker] +=
+			expunged + copied * 2 + 2;
+	} else {
+		test_failed("Invalid purge_worker");
+	}
+	return TRUE;
+}
+
+static void test_mdbox_purge_events_reset(void)
+{
+	if (array_is_created(&test_mdbox_purge_events.file_ids))
+		array_free(&test_mdbox_purge_events.file_ids);
+	i_zero(&test_mdbox_purge_events);
+	i_array_init(&test_mdbox_purge_events.file_ids, 16);
+}
+
+static void test_mdbox_purge_save(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	const char *data;
+	int ret;
+
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (unsigned int i = 0; i < TEST_MDBOX_PURGE_MAILS; i++) {
+		data = t_strdup_printf("Subject: mail %u\n\n%0200u\n", i, i);
+		input = i_stream_create_from_data(data, strlen(data));
+		save_ctx = mailbox_save_alloc(trans);
+		ret = mailbox_save_begin(&save_ctx, input);
+		while (ret == 0 && i_stream_read(input) > 0)
+			ret = mailbox_save_continue(save_ctx);
+		if (ret == 0)
+			ret = mailbox_save_finish(&save_ctx);
+		else
+			mailbox_save_cancel(&save_ctx);
+		test_assert(ret == 0);
+		i_stream_unref(&input);
+	}
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+static void test_mdbox_purge_expunge(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+
+	/* keep every third mail */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (uint32_t seq = 1; seq <= TEST_MDBOX_PURGE_MAILS; seq++) {
+		mail_set_seq(mail, seq);
+		if ((seq - 1) % 3 != 0)
+			mail_expunge(mail);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+static void test_mdbox_purge_verify(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	const char *body;
+	size_t size;
+	unsigned int i;
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (i = 0; i < TEST_MDBOX_PURGE_MAILS / 3; i++) {
+		mail_set_seq(mail, i + 1);
+		body = t_strdup_printf("Subject: mail %u\n\n%0200u\n",
+				       i * 3, i * 3);
+		test_assert_idx(mail_get_stream(mail, NULL, NULL, &input) == 0, i);
+		test_assert_idx(i_stream_read_bytes(input, &data, &size,
+						    strlen(body)) > 0, i);
+		test_assert_idx(size == strlen(body) &&
+				memcmp(data, body, size) == 0, i);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static unsigned int test_mdbox_purge_count_files(const char *dir)
+{
+	struct dirent *d;
+	unsigned int count = 0;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	while ((d = readdir(dirp)) != NULL) {
+		if (str_begins_with(d->d_name, "m."))
+			count++;
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", dir);
+	return count;
+}
+
+static void
+test_mdbox_purge_run(const char *const *extra_input, unsigned int workers)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "mdbox",
+		.extra_input = extra_input,
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct event_filter *filter;
+	const char *storage_dir, *error;
+	unsigned int i, files_count;
+	uint64_t start_usecs, usecs;
+
+	filter = event_filter_create();
+	if (event_filter_parse("event=mdbox_purge_file_finished",
+			       filter, &error) < 0)
+		i_fatal("event_filter_parse() failed: %s", error);
+	event_set_global_debug_send_filter(filter);
+	event_filter_unref(&filter);
+	event_register_callback(test_mdbox_purge_event_callback);
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	storage_dir = t_strconcat(mailbox_list_get_root_forced(ns->list,
+		MAILBOX_LIST_PATH_TYPE_DIR), "/storage", NULL);
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mdbox_purge_save(box);
+	test_mdbox_purge_expunge(box);
+	files_count = test_mdbox_purge_count_files(storage_dir);
+	test_assert(files_count > TEST_MDBOX_PURGE_WORKERS);
+
+	test_mdbox_purge_events_reset();
+	start_usecs = i_microseconds();
+	test_assert(mail_storage_purge(box->storage) == 0);
+	usecs = i_microseconds() - start_usecs;
+	test_assert(test_mdbox_purge_count_files(storage_dir) < files_count);
+	test_mdbox_purge_verify(box);
+
+	/* every expunged mail was purged exactly once */
+	test_assert(test_mdbox_purge_events.files > 0);
+	test_assert(test_mdbox_purge_events.expunged_mails ==
+		    TEST_MDBOX_PURGE_MAILS / 3 * 2);
+	test_assert(test_mdbox_purge_events.copied_mails <=
+		    TEST_MDBOX_PURGE_MAILS / 3);
+	for (i = 0; i < TEST_MDBOX_PURGE_WORKERS; i++) {
+		if (i >= workers) {
+			test_assert_idx(
+				test_mdbox_purge_events.worker_files[i] == 0, i);
+			continue;
+		}
+		/* each worker purged some of the files */
+		test_assert_idx(test_mdbox_purge_events.worker_files[i] > 0, i);
+		if (workers > 1) {
+			/* and it had to wait for its share of the I/O budget */
+			test_assert_idx(usecs >=
+				(uint64_t)test_mdbox_purge_events.worker_ops[i] *
+				1000000 / TEST_MDBOX_PURGE_IOPS, i);
+		}
+	}
+
+	/* nothing is left to purge */
+	test_mdbox_purge_events_reset();
+	files_count = test_mdbox_purge_count_files(storage_dir);
+	test_assert(mail_storage_purge(box->storage) == 0);
+	test_assert(test_mdbox_purge_count_files(storage_dir) == files_count);
+	test_assert(test_mdbox_purge_events.files == 0);
+	test_mdbox_purge_verify(box);
+	mailbox_free(&box);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+
+	event_unregister_callback(test_mdbox_purge_event_callback);
+	event_unset_global_debug_send_filter();
+	array_free(&test_mdbox_purge_events.file_ids);
+}
+
+static void test_mdbox_purge(void)
+{
+	static const char *const purge_input[] = {
+		"mdbox_rotate_size=1k", NULL
+	};
+	/* the budget is divided between the workers */
+	static const char *const purge_parallel_input[] = {
+		"mdbox_rotate_size=1k", "mdbox_purge_processes=3",
+		"mdbox_purge_max_bytes_per_sec=100M",
+		"mdbox_purge_max_iops=600", NULL
+	};
+
+	test_begin("mdbox purge");
+	test_mdbox_purge_run(purge_input, 1);
+	test_end();
+
+	test_begin("mdbox purge (parallel, throttled)");
+	test_mdbox_purge_run(purge_parallel_input, TEST_MDBOX_PURGE_WORKERS);
+	test_end();
+}
+
+static const char *const test_mdbox_shard_boxes[] = {
+	"INBOX", "a", "b", "c", "d", "e"
+};
+
+static void test_mdbox_shards_copy(struct mailbox *src, struct mailbox *dest)
+{
+	struct mailbox_transaction_context *src_trans, *dest_trans;
+	struct mail_save_context *save_ctx;
+	struct mail *mail;
+	uint32_t seq;
+
+	src_trans = mailbox_transaction_begin(src, 0, __func__);
+	dest_trans = mailbox_transaction_begin(dest,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	mail = mail_alloc(src_trans, 0, NULL);
+	for (seq = 1; seq <= TEST_MDBOX_PURGE_MAILS / 3; seq++) {
+		mail_set_seq(mail, seq);
+		save_ctx = mailbox_save_alloc(dest_trans);
+		test_assert_idx(mailbox_copy(&save_ctx, mail) == 0, seq);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&dest_trans) == 0);
+	test_assert(mailbox_transaction_commit(&src_trans) == 0);
+}
+
+static unsigned int test_mdbox_shards_count_indexes(const char *dir)
+{
+	unsigned int shard, count = 0;
+	struct stat st;
+
+	for (shard = 1; shard < 16; shard++) {
+		if (stat(t_strdup_printf("%s/dovecot.map.%u.index.log",
+					 dir, shard), &st) == 0)
+			count++;
+	}
+	return count;
+}
+
+static void test_mdbox_shards_verify_all(struct mail_namespace *ns)
+{
+	struct mailbox *box;
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(test_mdbox_shard_boxes); i++) {
+		box = mailbox_alloc(ns->list, test_mdbox_shard_boxes[i], 0);
+		test_assert_idx(mailbox_open(box) == 0, i);
+		test_mdbox_purge_verify(box);
+		mailbox_free(&box);
+	}
+	box = mailbox_alloc(ns->list, "copy", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mdbox_purge_verify(box);
+	mailbox_free(&box);
+}
+
+static void
+test_mdbox_shards_resync(struct mail_namespace *ns, unsigned int shard_count)
+{
+	struct mailbox *box;
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	/* "rebuilding indexes" + "fscking index file" for each shard */
+	test_expect_errors(1 + shard_count);
+	test_assert(mailbox_sync(box, MAILBOX_SYNC_FLAG_FORCE_RESYNC) == 0);
+	test_expect_no_more_errors();
+	mailbox_free(&box);
+}
+
+static void
+test_mdbox_shards_renumber(struct mail_namespace *ns, unsigned int shard_count)
+{
+	struct mailbox *box;
+
+	/* "corrupted", "renumbering", "rebuilding indexes" and "fscking index
+	   file" for each shard */
+	test_expect_errors(3 + shard_count);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_expect_no_more_errors();
+	mailbox_free(&box);
+}
+
+static void
+test_mdbox_shards_reinit_user(struct test_mail_storage_ctx *ctx,
+			      struct test_mail_storage_settings *set)
+{
+	/* keep the existing mails, so the storage is reopened with new
+	   settings */
+	test_mail_storage_deinit_user(ctx);
+	set->keep_home = TRUE;
+	test_mail_storage_init_user(ctx, set);
+}
+
+static void test_mdbox_shards_lock_order(struct mail_namespace *ns)
+{
+	struct mdbox_storage *storage = MDBOX_STORAGE(ns->storage);
+	struct mdbox_map_atomic_context *atomic;
+
+	atomic = mdbox_map_atomic_begin(storage->map);
+	test_assert(mdbox_map_atomic_lock_shards(atomic, 1U << 2, "test") == 0);
+	/* a lower shard can't be locked after a higher one was changed */
+	atomic->shards[2].changed = TRUE;
+	test_expect_error_string("higher shard 2 has uncommitted changes");
+	test_assert(mdbox_map_atomic_lock_shards(atomic, 1U << 0, "test") < 0);
+	test_expect_no_more_errors();
+	test_assert(atomic->shards[2].locked && !atomic->shards[0].locked);
+	/* unchanged higher shards are relocked in the right order */
+	atomic->shards[2].changed = FALSE;
+	test_assert(mdbox_map_atomic_lock_shards(atomic, 1U << 0, "test") == 0);
+	test_assert(atomic->shards[2].locked && atomic->shards[0].locked);
+	mdbox_map_atomic_set_failed(atomic);
+	test_assert(mdbox_map_atomic_finish(&atomic) == 0);
+}
+
+static void test_mdbox_shards(void)
+{
+	const char *const shards4_input[] = {
+		"mdbox_rotate_size=1k", "mdbox_map_shards=4", NULL
+	};
+	const char *const shards1_input[] = {
+		"mdbox_rotate_size=1k", NULL
+	};
+	struct test_mail_storage_settings set = {
+		.username = "shards",
+		.driver = "mdbox",
+		.extra_input = shards4_input,
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box, *copy_box;
+	const char *storage_dir;
+	unsigned int i, files_count;
+
+	test_begin("mdbox map shards");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	storage_dir = t_strconcat(mailbox_list_get_root_forced(ns->list,
+		MAILBOX_LIST_PATH_TYPE_DIR), "/storage", NULL);
+
+	copy_box = mailbox_alloc(ns->list, "copy", 0);
+	test_assert(mailbox_create(copy_box, NULL, FALSE) == 0);
+	test_assert(mailbox_open(copy_box) == 0);
+	for (i = 0; i < N_ELEMENTS(test_mdbox_shard_boxes); i++) {
+		box = mailbox_alloc(ns->list, test_mdbox_shard_boxes[i], 0);
+		if (i > 0)
+			test_assert_idx(mailbox_create(box, NULL, FALSE) == 0, i);
+		test_assert_idx(mailbox_open(box) == 0, i);
+		test_mdbox_purge_save(box);
+		test_mdbox_purge_expunge(box);
+		/* copies reference the source mailbox's shard */
+		if (i == 1)
+			test_mdbox_shards_copy(box, copy_box);
+		mailbox_free(&box);
+	}
+	mailbox_free(&copy_box);
+	test_assert(test_mdbox_shards_count_indexes(storage_dir) > 0);
+
+	files_count = test_mdbox_purge_count_files(storage_dir);
+	test_assert(mail_storage_purge(ns->storage) == 0);
+	test_assert(test_mdbox_purge_count_files(storage_dir) < files_count);
+	test_mdbox_shards_verify_all(ns);
+	/* rebuilding keeps the messages in their shards */
+	test_mdbox_shards_resync(ns, 4);
+	test_mdbox_shards_verify_all(ns);
+	test_assert(test_mdbox_shards_count_indexes(storage_dir) > 0);
+	test_mdbox_shards_lock_order(ns);
+
+	/* lowering the shard count moves all the messages to the first
+	   shard */
+	set.extra_input = shards1_input;
+	test_mdbox_shards_reinit_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	test_mdbox_shards_resync(ns, 1);
+	test_assert(test_mdbox_shards_count_indexes(storage_dir) == 0);
+	test_mdbox_shards_verify_all(ns);
+
+	/* raising it again renumbers the IDs that the first shard got from
+	   the other shards' files and allocates new IDs from the shards' own
+	   ranges */
+	set.extra_input = shards4_input;
+	test_mdbox_shards_reinit_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	test_mdbox_shards_renumber(ns, 4);
+	test_mdbox_shards_verify_all(ns);
+	box = mailbox_alloc(ns->list, "f", 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mdbox_purge_save(box);
+	test_mdbox_purge_expunge(box);
+	test_assert(mail_storage_purge(ns->storage) == 0);
+	test_mdbox_purge_verify(box);
+	mailbox_free(&box);
+	test_mdbox_shards_verify_all(ns);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static void test_mdbox_shards_raise_ids(const char *storage_dir)
+{
+	struct mdbox_map_mail_index_header hdr;
+	struct mail_index *index;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t ext_id, next_id = MDBOX_MAP_SHARD_ID_MASK + 100;
+
+	/* the map has been used without sharding long enough to have IDs
+	   above the first shard's range */
+	index = mail_index_alloc(NULL, storage_dir, "dovecot.map.index");
+	ext_id = mail_index_ext_register(index, "map", sizeof(hdr),
+		sizeof(struct mdbox_map_mail_index_record), sizeof(uint32_t));
+	test_assert(mail_index_open(index, 0) == 1);
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &trans,
+		MAIL_INDEX_SYNC_FLAG_UPDATE_TAIL_OFFSET) == 1);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, next_uid),
+		&next_id, sizeof(next_id), FALSE);
+	mail_index_update_header_ext(trans, ext_id,
+		offsetof(struct mdbox_map_mail_index_header, highest_file_id),
+		&next_id, sizeof(next_id));
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static void test_mdbox_shards_unsharded_ids(void)
+{
+	const char *const shards4_input[] = {
+		"mdbox_rotate_size=1k", "mdbox_map_shards=4", NULL
+	};
+	const char *const shards1_input[] = {
+		"mdbox_rotate_size=1k", NULL
+	};
+	struct test_mail_storage_settings set = {
+		.username = "shards-ids",
+		.driver = "mdbox",
+		.extra_input = shards1_input,
+	};
+	const char *const boxes[] = { "INBOX", "a", "b" };
+	struct test_mail_storage_ctx *ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	const char *storage_dir;
+	unsigned int i;
+
+	test_begin("mdbox map shards with unsharded IDs");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	storage_dir = t_strconcat(mailbox_list_get_root_forced(ns->list,
+		MAILBOX_LIST_PATH_TYPE_DIR), "/storage", NULL);
+	box = mailbox_alloc(ns->list, boxes[0], 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mdbox_purge_save(box);
+	test_mdbox_purge_expunge(box);
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+
+	test_mdbox_shards_raise_ids(storage_dir);
+	set.keep_home = TRUE;
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	box = mailbox_alloc(ns->list, boxes[1], 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mdbox_purge_save(box);
+	test_mdbox_purge_expunge(box);
+	mailbox_free(&box);
+
+	/* increasing the shard count renumbers the IDs */
+	set.extra_input = shards4_input;
+	test_mdbox_shards_reinit_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	test_mdbox_shards_renumber(ns, 4);
+
+	box = mailbox_alloc(ns->list, boxes[2], 0);
+	test_assert(mailbox_create(box, NULL, FALSE) == 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mdbox_purge_save(box);
+	test_mdbox_purge_expunge(box);
+	mailbox_free(&box);
+	test_assert(mail_storage_purge(ns->storage) == 0);
+
+	/* reopening doesn't find anything to fix anymore */
+	test_mdbox_shards_reinit_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+	for (i = 0; i < N_ELEMENTS(boxes); i++) {
+		box = mailbox_alloc(ns->list, boxes[i], 0);
+		test_assert_idx(mailbox_open(box) == 0, i);
+		test_mdbox_purge_verify(box);
+		mailbox_free(&box);
+	}
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
 static void test_mailbox_list_mbox(void)
 {
 	struct test_mail_storage_ctx *ctx;
@@ -639,6 +1544,217 @@ static void test_mailbox_list_mbox(void)
 }
 
 
+#define TEST_MBOX_SYNC_MAILS 50
+
+static void test_mbox_sync_write(const char *path, const char *data,
+				 size_t size)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, data, size) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_mbox_sync_append(const char *path, unsigned int first,
+				  unsigned int count)
+{
+	string_t *str = t_str_new(1024);
+	int fd;
+
+	for (unsigned int i = first; i < first + count; i++) {
+		str_printfa(str, "From user%u@example.com "
+			    "Mon Jan  1 00:%02u:%02u 2024\n"
+			    "Message-ID: <%u@example.com>\n"
+			    "Subject: mail %u\n\nbody %u\n\n",
+			    i, i / 60, i % 60, i, i, i);
+	}
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, str_data(str), str_len(str)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_mbox_sync_remove(const char *path, unsigned int seq)
+{
+	buffer_t *buf = t_buffer_create(8192);
+	const char *data, *start, *end;
+	struct stat st;
+	int fd;
+
+	/* remove the seq'th message behind the mailbox's back */
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (read_full(fd, buffer_append_space_unsafe(buf, st.st_size),
+		      st.st_size) <= 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	buffer_append_c(buf, '\0');
+
+	data = buf->data;
+	start = data;
+	for (unsigned int i = 1; i < seq; i++) {
+		start = strstr(start + 1, "\nFrom ");
+		i_assert(start != NULL);
+	}
+	end = strstr(start + 1, "\nFrom ");
+	i_assert(end != NULL);
+	buffer_delete(buf, start - data, end - start);
+	test_mbox_sync_write(path, buf->data, buf->used - 1);
+}
+
+static void test_mbox_sync_verify(struct mailbox *box, const uint32_t *uids,
+				  unsigned int count)
+{
+	struct mailbox_transaction_context *trans;
+	struct mailbox_status status;
+	struct mail *mail;
+	const char *subject;
+	unsigned int seq;
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	test_assert(status.messages == count);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (seq = 1; seq <= count && seq <= status.messages; seq++) {
+		mail_set_seq(mail, seq);
+		test_assert_idx(mail->uid == uids[seq - 1], seq);
+		test_assert_idx(mail_get_first_header(mail, "Subject",
+						      &subject) > 0, seq);
+		test_assert_idx(strcmp(subject, t_strdup_printf("mail %u",
+			uids[seq - 1] - 1)) == 0, seq);
+	}
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static unsigned int test_mbox_sync_parsed_mails;
+
+static bool
+test_mbox_sync_event_callback(struct event *event,
+			      enum event_callback_type type,
+			      struct failure_context *ctx ATTR_UNUSED,
+			      const char *fmt ATTR_UNUSED,
+			      va_list args ATTR_UNUSED)
+{
+	const struct event_field *field;
+
+	if (type != EVENT_CALLBACK_TYPE_SEND ||
+	    null_strcmp(event->sending_name, "mbox_sync_finished") != 0)
+		return TRUE;
+
+	field = event_find_field_nonrecursive(event, "parsed_mails");
+	if (field == NULL ||
+	    field->value_type != EVENT_FIELD_VALUE_TYPE_INTMAX)
+		test_failed("Missing event field parsed_mails");
+	else
+		test_mbox_sync_parsed_mails += field->value.intmax;
+	return TRUE;
+}
+
+static unsigned int
+test_mbox_sync_verify_parsed(struct mailbox *box, const uint32_t *uids,
+			     unsigned int count)
+{
+	test_mbox_sync_parsed_mails = 0;
+	test_mbox_sync_verify(box, uids, count);
+	return test_mbox_sync_parsed_mails;
+}
+
+static void test_mbox_sync_tail_run(const char *const *extra_input)
+{
+	struct test_mail_storage_settings set = {
+		.driver = "mbox",
+		.extra_input = extra_input,
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct event_filter *filter;
+	uint32_t uids[TEST_MBOX_SYNC_MAILS + 5];
+	const char *path, *error;
+	unsigned int i, count = TEST_MBOX_SYNC_MAILS;
+
+	filter = event_filter_create();
+	if (event_filter_parse("event=mbox_sync_finished", filter, &error) < 0)
+		i_fatal("event_filter_parse() failed: %s", error);
+	event_set_global_debug_send_filter(filter);
+	event_filter_unref(&filter);
+	event_register_callback(test_mbox_sync_event_callback);
+
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	ns = mail_namespace_find_inbox(ctx->user->namespaces);
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	path = t_strdup(mailbox_get_path(box));
+	test_mbox_sync_append(path, 0, count);
+	for (i = 0; i < count; i++)
+		uids[i] = i + 1;
+	test_assert(test_mbox_sync_verify_parsed(box, uids, count) >= count);
+
+	/* expunging a message near the end of the file moves only the
+	   messages after it. reading continues from the last message that
+	   is still in place. */
+	test_mbox_sync_remove(path, 40);
+	memmove(uids + 39, uids + 40, (count - 40) * sizeof(uids[0]));
+	test_assert(test_mbox_sync_verify_parsed(box, uids, count - 1) <=
+		    count - 39 + 1);
+	count--;
+
+	/* new messages are found after the expunge is synced */
+	test_mbox_sync_append(path, TEST_MBOX_SYNC_MAILS, 5);
+	for (i = 0; i < 5; i++)
+		uids[count++] = TEST_MBOX_SYNC_MAILS + i + 1;
+	/* only the last old message is read in addition to the new ones */
+	test_assert(test_mbox_sync_verify_parsed(box, uids, count) <= 5 + 2);
+
+	/* both at once: the expunge is in the middle of the file */
+	test_mbox_sync_remove(path, 10);
+	memmove(uids + 9, uids + 10, (count - 10) * sizeof(uids[0]));
+	test_assert(test_mbox_sync_verify_parsed(box, uids, count - 1) <=
+		    count - 9 + 1);
+	count--;
+	mailbox_free(&box);
+
+	/* the mailbox looks the same after a full resync */
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_mbox_sync_parsed_mails = 0;
+	test_assert(mailbox_sync(box, MAILBOX_SYNC_FLAG_FORCE_RESYNC) == 0);
+	test_assert(test_mbox_sync_parsed_mails >= count);
+	test_mbox_sync_verify(box, uids, count);
+	mailbox_free(&box);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+
+	event_unregister_callback(test_mbox_sync_event_callback);
+	event_unset_global_debug_send_filter();
+}
+
+static void test_mbox_sync_tail(void)
+{
+	const char *const no_lazy_writes_input[] = {
+		"mbox_lazy_writes=no", NULL
+	};
+
+	test_begin("mbox sync changed tail");
+	test_mbox_sync_tail_run(NULL);
+	test_mbox_sync_tail_run(no_lazy_writes_input);
+	test_end();
+}
+
 static void test_mail_parse_human_timestamp_iso(void)
 {
 	int ret;
@@ -752,7 +1868,13 @@ int main(int argc, char **argv)
 		test_mail_storage_last_error_push_pop,
 		test_mailbox_verify_name,
 		test_mailbox_list_maildir,
+		test_maildir_uidlist_binary,
+		test_mail_thread_tree_file,
+		test_mdbox_purge,
+		test_mdbox_shards,
+		test_mdbox_shards_unsharded_ids,
 		test_mailbox_list_mbox,
+		test_mbox_sync_tail,
 		test_mail_parse_human_timestamp_iso,
 		test_mail_parse_human_timestamp_imap,
 		test_mail_parse_human_timestamp_unix,
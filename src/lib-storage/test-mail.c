@@ -3,20 +3,27 @@
 #include "lib.h"
 #include "test-common.h"
 #include "istream.h"
+#include "istream-crlf.h"
+#include "str.h"
 #include "master-service.h"
 #include "message-size.h"
+#include "mail-search-build.h"
 #include "test-mail-storage-common.h"
 
+#include <sys/stat.h>
+
 static struct event *test_event;
 
 static int
 test_mail_save_trans(struct mailbox_transaction_context *trans,
-		     struct istream *input)
+		     struct istream *input, time_t received_date)
 {
 	struct mail_save_context *save_ctx;
 	int ret;
 
 	save_ctx = mailbox_save_alloc(trans);
+	if (received_date != (time_t)-1)
+		mailbox_save_set_received_date(save_ctx, received_date, 0);
 	if (mailbox_save_begin(&save_ctx, input) < 0)
 		return -1;
 	do {
@@ -31,7 +38,9 @@ test_mail_save_trans(struct mailbox_transaction_context *trans,
 	return mailbox_save_finish(&save_ctx);
 }
 
-static void test_mail_save(struct mailbox *box, const char *mail_input)
+static void
+test_mail_save_received(struct mailbox *box, const char *mail_input,
+			time_t received_date)
 {
 	struct mailbox_transaction_context *trans;
 	struct istream *input;
@@ -40,7 +49,7 @@ static void test_mail_save(struct mailbox *box, const char *mail_input)
 	input = i_stream_create_from_data(mail_input, strlen(mail_input));
 	trans = mailbox_transaction_begin(box,
 			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
-	ret = test_mail_save_trans(trans, input);
+	ret = test_mail_save_trans(trans, input, received_date);
 	i_stream_unref(&input);
 	if (ret < 0)
 		mailbox_transaction_rollback(&trans);
@@ -55,6 +64,11 @@ static void test_mail_save(struct mailbox *box, const char *mail_input)
 			mailbox_get_last_internal_error(box, NULL));
 }
 
+static void test_mail_save(struct mailbox *box, const char *mail_input)
+{
+	test_mail_save_received(box, mail_input, (time_t)-1);
+}
+
 static void test_mail_remove_keywords(struct mailbox *box)
 {
 	struct mailbox_transaction_context *trans;
@@ -725,6 +739,458 @@ static void test_mail_get_last_internal_error(void)
 	test_mail_storage_deinit(&ctx);
 }
 
+static void
+test_search_prefetch_window(struct mailbox *box, enum mail_search_arg_type type,
+			    unsigned int api_count, unsigned int expected_ahead)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *search_args;
+	struct mail_search_arg *arg;
+	struct mail *mail;
+	unsigned int prefetched, hits, found = 0;
+
+	search_args = mail_search_build_init();
+	arg = mail_search_build_add(search_args, type);
+	if (type == SEARCH_HEADER) {
+		arg->hdr_field_name = "Subject";
+		arg->value.str = "prefetch";
+	} else {
+		arg->value.str = "needle";
+	}
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_ctx = mailbox_search_init(trans, search_args, NULL, 0, NULL);
+	if (api_count > 0)
+		mailbox_search_set_prefetch_count(search_ctx, api_count);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		mailbox_search_get_prefetch_stats(search_ctx, &prefetched,
+						  &hits);
+		/* the window is kept full until the end of the mailbox */
+		if (found + expected_ahead < 10)
+			test_assert_idx(prefetched - hits == expected_ahead,
+					found);
+		test_assert_idx(mail->seq == found + 1, found);
+		found++;
+	}
+	test_assert(found == 10);
+	mailbox_search_get_prefetch_stats(search_ctx, &prefetched, &hits);
+	test_assert(prefetched == 10 && hits == 10);
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mail_search_args_unref(&search_args);
+}
+
+static void test_mail_search_prefetch_count(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "maildir",
+		.extra_input = (const char *const[]) {
+			"mail_search_prefetch_count=3",
+			NULL
+		},
+	};
+	struct mailbox *box;
+
+	test_begin("mail_search_prefetch_count");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	for (unsigned int i = 0; i < 10; i++) {
+		test_mail_save(box,
+			       "From: <test1@example.com>\n"
+			       "Subject: prefetch\n"
+			       "\n"
+			       "the needle is here\n");
+	}
+
+	/* BODY/TEXT searches keep the configured number of mails
+	   prefetched ahead of the returned one */
+	test_search_prefetch_window(box, SEARCH_BODY, 0, 3);
+	test_search_prefetch_window(box, SEARCH_TEXT, 0, 3);
+	/* a larger count requested by the caller wins */
+	test_search_prefetch_window(box, SEARCH_BODY, 5, 5);
+	test_search_prefetch_window(box, SEARCH_BODY, 2, 3);
+	/* other searches aren't affected by the setting */
+	test_search_prefetch_window(box, SEARCH_HEADER, 0, 0);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static void
+test_sort_check(struct mailbox *box, enum mail_sort_type sort_type,
+		bool search_all, const uint32_t *expected_seqs,
+		unsigned int expected_count)
+{
+	const enum mail_sort_type sort_program[] = { sort_type, MAIL_SORT_END };
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *search_args;
+	struct mail *mail;
+	unsigned int i = 0;
+
+	search_args = mail_search_build_init();
+	if (search_all)
+		mail_search_build_add_all(search_args);
+	else {
+		/* not simplified into ALL, so the stored sort order isn't
+		   used */
+		mail_search_build_add_seqset(search_args, 1, expected_count);
+	}
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_ctx = mailbox_search_init(trans, search_args, sort_program,
+					 0, NULL);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		test_assert_idx(i < expected_count &&
+				mail->seq == expected_seqs[i], i);
+		i++;
+	}
+	test_assert(i == expected_count);
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mail_search_args_unref(&search_args);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+static void
+test_sort_dates_check(struct mailbox *box, enum mail_sort_type sort_type,
+		      const uint32_t *expected_seqs)
+{
+	test_sort_check(box, sort_type, FALSE, expected_seqs, 3);
+}
+
+static uint32_t
+test_sort_dates_column_get(struct mailbox *box, const char *ext_name,
+			   uint32_t seq)
+{
+	struct mail_index_view *view;
+	const void *data;
+	uint32_t ext_id, value = 0;
+	bool expunged;
+
+	if (!mail_index_ext_lookup(box->index, ext_name, &ext_id))
+		return 0;
+	view = mail_index_view_open(box->index);
+	mail_index_lookup_ext(view, seq, ext_id, &data, &expunged);
+	if (data != NULL)
+		memcpy(&value, data, sizeof(value));
+	mail_index_view_close(&view);
+	return value;
+}
+
+static void
+test_sort_dates_column_set(struct mailbox *box, const char *ext_name,
+			   uint32_t seq, uint32_t value)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t ext_id;
+
+	test_assert(mail_index_ext_lookup(box->index, ext_name, &ext_id));
+	view = mail_index_view_open(box->index);
+	trans = mail_index_transaction_begin(view,
+				MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_ext(trans, seq, ext_id, &value, NULL);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+static void test_mail_sort_date_columns(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = (const char *const[]) {
+			"mail_cache_column_fields=date.received date.sent",
+			NULL
+		},
+	};
+	const uint32_t arrival_order[] = { 2, 3, 1 };
+	const uint32_t arrival_changed_order[] = { 1, 2, 3 };
+	const uint32_t date_order[] = { 3, 1, 2 };
+	struct mailbox_transaction_context *trans;
+	struct mailbox *box;
+	struct mail *mail;
+	time_t date;
+
+	test_begin("mail sort date columns");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	test_mail_save_received(box,
+		"Date: Thu, 01 Jan 2015 00:00:00 +0000\n\nbody\n", 300000);
+	test_mail_save_received(box,
+		"Date: Fri, 01 Jan 2016 00:00:00 +0000\n\nbody\n", 100000);
+	/* no Date: header, so DATE sorts using the received date */
+	test_mail_save_received(box, "Subject: no date\n\nbody\n", 200000);
+
+	/* the first sorts fill the columns */
+	test_sort_dates_check(box, MAIL_SORT_ARRIVAL, arrival_order);
+	test_sort_dates_check(box, MAIL_SORT_DATE, date_order);
+	test_assert(test_sort_dates_column_get(box,
+		"cache-column-date-received", 1) == 300000);
+	test_assert(test_sort_dates_column_get(box,
+		"cache-column-date-received", 3) == 200000);
+	test_assert(test_sort_dates_column_get(box,
+		"cache-column-date-sent", 1) == 1420070400);
+	test_assert(test_sort_dates_column_get(box,
+		"cache-column-date-sent", 3) == 0);
+
+	/* the following sorts use the column values */
+	test_sort_dates_column_set(box, "cache-column-date-received", 1, 50000);
+	test_sort_dates_check(box, MAIL_SORT_ARRIVAL, arrival_changed_order);
+
+	/* a corrupted cache record drops the mail's column values, so the
+	   next sort looks up the actual date again */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	test_expect_error_string("Broken #");
+	mail_set_cache_corrupted(mail, MAIL_FETCH_RECEIVED_DATE, "test");
+	test_expect_no_more_errors();
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert(test_sort_dates_column_get(box,
+		"cache-column-date-received", 1) == 0);
+
+	test_sort_dates_check(box, MAIL_SORT_ARRIVAL, arrival_order);
+	test_assert(test_sort_dates_column_get(box,
+		"cache-column-date-received", 1) == 300000);
+
+	/* and the values are still the same through the mail API */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	test_assert(mail_get_received_date(mail, &date) == 0 && date == 300000);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static off_t test_sort_order_file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+	return st.st_size;
+}
+
+static void test_mail_sort_stored_order(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+		.extra_input = (const char *const[]) {
+			"mail_cache_column_fields=date.received",
+			NULL
+		},
+	};
+	const uint32_t arrival_order[] = { 2, 3, 1 };
+	const uint32_t arrival_changed_order[] = { 1, 2, 3 };
+	const uint32_t arrival_appended_order[] = { 2, 4, 3, 1 };
+	const uint32_t arrival_expunged_order[] = { 3, 2, 1 };
+	struct mailbox_transaction_context *trans;
+	struct mailbox *box;
+	struct mail *mail;
+	const char *index_dir, *order_path;
+	int fd;
+
+	test_begin("mail sort stored order");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&index_dir) > 0);
+	order_path = t_strconcat(index_dir, "/dovecot.index.sort.0001", NULL);
+
+	test_mail_save_received(box, "Subject: 1\n\nbody\n", 300000);
+	test_mail_save_received(box, "Subject: 2\n\nbody\n", 100000);
+	test_mail_save_received(box, "Subject: 3\n\nbody\n", 200000);
+
+	/* sorting ALL messages stores the order */
+	test_sort_check(box, MAIL_SORT_ARRIVAL, TRUE, arrival_order, 3);
+	test_assert(test_sort_order_file_size(order_path) == 24 + 3*4);
+
+	/* the next ALL sort uses the stored order without looking up the
+	   sort keys again, while other searches still sort them */
+	test_sort_dates_column_set(box, "cache-column-date-received", 1, 50000);
+	test_sort_check(box, MAIL_SORT_ARRIVAL, TRUE, arrival_order, 3);
+	test_sort_check(box, MAIL_SORT_ARRIVAL, FALSE,
+			arrival_changed_order, 3);
+	test_sort_dates_column_set(box, "cache-column-date-received", 1,
+				   300000);
+
+	/* a new message is merged into the stored order */
+	test_mail_save_received(box, "Subject: 4\n\nbody\n", 150000);
+	test_sort_check(box, MAIL_SORT_ARRIVAL, TRUE,
+			arrival_appended_order, 4);
+	test_assert(test_sort_order_file_size(order_path) == 24 + 4*4);
+
+	/* an expunged message is dropped from it */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 2);
+	mail_expunge(mail);
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_sort_check(box, MAIL_SORT_ARRIVAL, TRUE,
+			arrival_expunged_order, 3);
+	test_assert(test_sort_order_file_size(order_path) == 24 + 3*4);
+
+	/* a corrupted file is rebuilt */
+	fd = open(order_path, O_WRONLY | O_TRUNC);
+	test_assert(fd != -1);
+	test_assert(write(fd, "garbage", 7) == 7);
+	i_close_fd(&fd);
+	test_expect_error_string("Corrupted sort order file");
+	test_sort_check(box, MAIL_SORT_ARRIVAL, TRUE,
+			arrival_expunged_order, 3);
+	test_expect_no_more_errors();
+	test_assert(test_sort_order_file_size(order_path) == 24 + 3*4);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+#define TEST_SAVE_CRLF_HDR "From: <test1@example.com>\nSubject: crlf\n\n"
+#define TEST_SAVE_CRLF_BODY "line 1\nline 2\r\n\nline 4\n"
+#define TEST_SAVE_CRLF_HDR_CRLF "From: <test1@example.com>\r\nSubject: crlf\r\n\r\n"
+#define TEST_SAVE_CRLF_BODY_CRLF "line 1\r\nline 2\r\n\r\nline 4\r\n"
+#define TEST_SAVE_CRLF_BODY_LF "line 1\nline 2\n\nline 4\n"
+
+static const char *test_read_stream(struct istream *input)
+{
+	string_t *str = t_str_new(128);
+	const unsigned char *data;
+	size_t size;
+
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+	return str_c(str);
+}
+
+static void test_mail_save_crlf_check(struct mailbox *box, uint32_t seq,
+				      bool saved_crlf)
+{
+	const char *full_crlf =
+		TEST_SAVE_CRLF_HDR_CRLF TEST_SAVE_CRLF_BODY_CRLF;
+	const char *full_lf = TEST_SAVE_CRLF_HDR TEST_SAVE_CRLF_BODY_LF;
+	struct mailbox_transaction_context *trans;
+	struct message_part *parts;
+	struct message_size hdr_size, body_size;
+	struct istream *input, *crlf_input;
+	struct mail *mail;
+	uoff_t size;
+	bool binary;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, seq);
+
+	/* the mail is stored with the configured linefeeds */
+	test_assert(mail_get_physical_size(mail, &size) == 0);
+	test_assert(size == strlen(saved_crlf ? full_crlf : full_lf));
+	test_assert(mail_get_virtual_size(mail, &size) == 0);
+	test_assert(size == strlen(full_crlf));
+
+	/* BODY[]: the literal is the CRLF stream of the mail */
+	test_assert(mail_get_stream(mail, &hdr_size, &body_size, &input) == 0);
+	test_assert(hdr_size.virtual_size + body_size.virtual_size ==
+		    strlen(full_crlf));
+	test_assert((hdr_size.physical_size == hdr_size.virtual_size) ==
+		    saved_crlf);
+	crlf_input = i_stream_create_crlf(input);
+	test_assert_strcmp(test_read_stream(crlf_input), full_crlf);
+	i_stream_unref(&crlf_input);
+
+	/* BINARY[] and BINARY[1] */
+	test_assert(mail_get_parts(mail, &parts) == 0);
+	test_assert(mail_get_binary_stream(mail, parts, TRUE, &size,
+					   &binary, &input) == 0);
+	test_assert(size == strlen(full_crlf) && !binary);
+	test_assert_strcmp(test_read_stream(input), full_crlf);
+	i_stream_unref(&input);
+	test_assert(mail_get_binary_stream(mail, parts, FALSE, &size,
+					   &binary, &input) == 0);
+	test_assert(size == strlen(TEST_SAVE_CRLF_BODY_CRLF) && !binary);
+	test_assert_strcmp(test_read_stream(input), TEST_SAVE_CRLF_BODY_CRLF);
+	i_stream_unref(&input);
+
+	mail_free(&mail);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static void test_mail_save_crlf_driver(const char *driver)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = driver,
+		.extra_input = (const char *const[]) {
+			"mail_save_crlf=no",
+			NULL
+		},
+	};
+	struct mailbox *box;
+
+	test_begin(t_strdup_printf("mail_save_crlf (%s)", driver));
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mail_save(box, TEST_SAVE_CRLF_HDR TEST_SAVE_CRLF_BODY);
+	test_mail_save_crlf_check(box, 1, FALSE);
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+
+	/* the LF-only mail saved earlier is still read correctly after
+	   enabling mail_save_crlf */
+	set.extra_input = (const char *const[]) {
+		"mail_save_crlf=yes",
+		NULL
+	};
+	set.keep_home = TRUE;
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mail_save(box, TEST_SAVE_CRLF_HDR TEST_SAVE_CRLF_BODY);
+	test_mail_save_crlf_check(box, 1, FALSE);
+	test_mail_save_crlf_check(box, 2, TRUE);
+	mailbox_free(&box);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static void test_mail_save_crlf(void)
+{
+	test_mail_save_crlf_driver("maildir");
+	test_mail_save_crlf_driver("sdbox");
+	test_mail_save_crlf_driver("mdbox");
+}
+
 int main(int argc, char **argv)
 {
 	void (*const tests[])(void) = {
@@ -735,6 +1201,10 @@ int main(int argc, char **argv)
 		test_mail_set_critical,
 		test_mail_set_critical_different_mailboxes,
 		test_mail_get_last_internal_error,
+		test_mail_search_prefetch_count,
+		test_mail_sort_date_columns,
+		test_mail_sort_stored_order,
+		test_mail_save_crlf,
 		NULL
 	};
 	int ret;
@@ -0,0 +1,104 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "fd-util.h"
+#include "time-util.h"
+#include "strnum.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/**
+ * Creates a number of mostly idle pipes, similar to idle IMAP connections,
+ * and keeps a fixed number of them active at any time. Each wakeup reads the
+ * byte and writes a new one to a random pipe, so every wakeup also changes
+ * which fds are ready. Prints the number of I/O callbacks per second handled
+ * by the ioloop backend that was selected at compile time.
+ */
+
+struct bench_pipe {
+	int fd_in, fd_out;
+	struct io *io;
+};
+
+static struct bench_pipe *pipes;
+static unsigned int pipe_count;
+static unsigned long long wakeups;
+
+static void bench_pipe_input(struct bench_pipe *pipe)
+{
+	char c;
+
+	if (read(pipe->fd_in, &c, 1) != 1)
+		i_fatal("read() failed: %m");
+	wakeups++;
+
+	pipe = &pipes[i_rand_limit(pipe_count)];
+	if (write(pipe->fd_out, "x", 1) != 1)
+		i_fatal("write() failed: %m");
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [pipes [active [secs]]]\n", prog);
+	fprintf(stderr, "Runs with 500 pipes, 50 active, for 5 seconds "
+		"if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct ioloop *ioloop;
+	struct timeout *to;
+	unsigned int i, active = 50, secs = 5;
+	uint64_t ts_0, ts_1;
+	int fd[2];
+
+	lib_init();
+	pipe_count = 500;
+	if (argc > 4)
+		print_usage(argv[0]);
+	if ((argc > 1 && str_to_uint(argv[1], &pipe_count) < 0) ||
+	    (argc > 2 && str_to_uint(argv[2], &active) < 0) ||
+	    (argc > 3 && str_to_uint(argv[3], &secs) < 0) ||
+	    pipe_count == 0 || active == 0) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	ioloop = io_loop_create();
+	pipes = i_new(struct bench_pipe, pipe_count);
+	for (i = 0; i < pipe_count; i++) {
+		if (pipe(fd) < 0)
+			i_fatal("pipe() failed: %m (increase ulimit -n?)");
+		pipes[i].fd_in = fd[0];
+		pipes[i].fd_out = fd[1];
+		pipes[i].io = io_add(fd[0], IO_READ, bench_pipe_input,
+				     &pipes[i]);
+	}
+	for (i = 0; i < active; i++) {
+		if (write(pipes[i_rand_limit(pipe_count)].fd_out, "x", 1) != 1)
+			i_fatal("write() failed: %m");
+	}
+
+	to = timeout_add(secs * 1000, io_loop_stop, ioloop);
+	ts_0 = i_nanoseconds();
+	io_loop_run(ioloop);
+	ts_1 = i_nanoseconds();
+	timeout_remove(&to);
+
+	printf("%u pipes, %u active: %llu wakeups in %.02lf s = %.0lf wakeups/s\n",
+	       pipe_count, active, wakeups, (double)(ts_1 - ts_0) / 1e9,
+	       (double)wakeups * 1e9 / (double)(ts_1 - ts_0));
+
+	for (i = 0; i < pipe_count; i++) {
+		io_remove(&pipes[i].io);
+		i_close_fd(&pipes[i].fd_in);
+		i_close_fd(&pipes[i].fd_out);
+	}
+	i_free(pipes);
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
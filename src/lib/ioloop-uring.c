@@ -0,0 +1,616 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "array.h"
+#include "sleep.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#if defined(IOLOOP_URING) || defined(IOLOOP_URING_TEST)
+
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Linux io_uring based ioloop handler.
+
+   Each fd with I/Os has a one-shot IORING_OP_POLL_ADD request armed in the
+   ring. A one-shot poll checks the current readiness when it's armed, so
+   re-arming it after each completion gives the same level-triggered
+   semantics as epoll. (Multishot polls only fire on new wakeups, which would
+   break callbacks that don't read all the available input.)
+
+   Poll re-arms, changes and removals aren't submitted immediately. They're
+   queued to the submission ring and submitted together with waiting for the
+   completions in a single io_uring_enter() call per ioloop run. This replaces
+   the epoll_ctl() call per changed fd + epoll_wait() call per run. */
+
+/* Maximum number of SQEs. The SQ is flushed when it gets full, so this
+   only limits how many changes can be batched into one syscall. */
+#define IOLOOP_URING_MAX_ENTRIES 4096
+#define IOLOOP_URING_MIN_ENTRIES 64
+
+#define IO_URING_POLL_ERROR (POLLERR | POLLHUP)
+#define IO_URING_POLL_INPUT (POLLIN | POLLPRI | IO_URING_POLL_ERROR)
+#define IO_URING_POLL_OUTPUT (POLLOUT | IO_URING_POLL_ERROR)
+
+/* user_data = fd << 32 | generation */
+#define IO_URING_USER_DATA(fd, gen) \
+	(((uint64_t)(unsigned int)(fd) << 32) | (gen))
+#define IO_URING_USER_DATA_FD(data) ((int)((data) >> 32))
+#define IO_URING_USER_DATA_GEN(data) ((uint32_t)((data) & 0xffffffffU))
+
+struct io_uring_fd {
+	struct io_list list;
+
+	/* Generation of the currently armed poll request. Completions with
+	   other generations are from already removed requests. */
+	uint32_t gen;
+	/* Poll mask of the currently armed request */
+	unsigned int armed_mask;
+
+	bool armed:1;
+	bool dirty:1;
+};
+
+struct io_uring_sq {
+	unsigned int *head, *tail, *ring_mask, *flags, *array;
+	struct io_uring_sqe *sqes;
+	unsigned int entries;
+	/* local tail not yet made visible to the kernel */
+	unsigned int sqe_tail;
+	unsigned int to_submit;
+
+	void *ring_ptr;
+	size_t ring_size;
+	size_t sqes_size;
+};
+
+struct io_uring_cq {
+	unsigned int *head, *tail, *ring_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_ptr;
+	size_t ring_size;
+};
+
+struct io_uring_event {
+	int fd;
+	uint32_t gen;
+	unsigned int revents;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+	/* value of io_uring_fork_count when the ring was created */
+	unsigned int fork_count;
+	struct io_uring_sq sq;
+	struct io_uring_cq cq;
+
+	ARRAY(struct io_uring_fd *) fd_index;
+	/* fds whose armed poll request doesn't match the wanted mask */
+	ARRAY(int) dirty_fds;
+	ARRAY(struct io_uring_event) events;
+};
+
+/* Incremented in the child process after each fork(). The ring memory is
+   mapped shared, so a forked child must never touch its parent's ring. */
+static unsigned int io_uring_fork_count = 0;
+static bool io_uring_atfork_registered = FALSE;
+
+static void io_uring_atfork_child(void)
+{
+	io_uring_fork_count++;
+}
+
+static int
+io_uring_setup_syscall(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter_syscall(int ring_fd, unsigned int to_submit,
+		       unsigned int min_complete, unsigned int flags,
+		       const void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			    min_complete, flags, arg, argsz);
+}
+
+static void
+io_uring_map_rings(struct ioloop_handler_context *ctx,
+		   const struct io_uring_params *p)
+{
+	struct io_uring_sq *sq = &ctx->sq;
+	struct io_uring_cq *cq = &ctx->cq;
+
+	sq->ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	cq->ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		sq->ring_size = I_MAX(sq->ring_size, cq->ring_size);
+		cq->ring_size = sq->ring_size;
+	}
+
+	sq->ring_ptr = mmap(NULL, sq->ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			    IORING_OFF_SQ_RING);
+	if (sq->ring_ptr == MAP_FAILED)
+		i_fatal("mmap(io_uring sq ring) failed: %m");
+
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0)
+		cq->ring_ptr = sq->ring_ptr;
+	else {
+		cq->ring_ptr = mmap(NULL, cq->ring_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+				    IORING_OFF_CQ_RING);
+		if (cq->ring_ptr == MAP_FAILED)
+			i_fatal("mmap(io_uring cq ring) failed: %m");
+	}
+
+	sq->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	sq->sqes = mmap(NULL, sq->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			IORING_OFF_SQES);
+	if (sq->sqes == MAP_FAILED)
+		i_fatal("mmap(io_uring sqes) failed: %m");
+
+	sq->head = PTR_OFFSET(sq->ring_ptr, p->sq_off.head);
+	sq->tail = PTR_OFFSET(sq->ring_ptr, p->sq_off.tail);
+	sq->ring_mask = PTR_OFFSET(sq->ring_ptr, p->sq_off.ring_mask);
+	sq->flags = PTR_OFFSET(sq->ring_ptr, p->sq_off.flags);
+	sq->array = PTR_OFFSET(sq->ring_ptr, p->sq_off.array);
+	sq->entries = p->sq_entries;
+	sq->sqe_tail = *sq->tail;
+
+	cq->head = PTR_OFFSET(cq->ring_ptr, p->cq_off.head);
+	cq->tail = PTR_OFFSET(cq->ring_ptr, p->cq_off.tail);
+	cq->ring_mask = PTR_OFFSET(cq->ring_ptr, p->cq_off.ring_mask);
+	cq->cqes = PTR_OFFSET(cq->ring_ptr, p->cq_off.cqes);
+}
+
+static void
+io_uring_ring_init(struct ioloop_handler_context *ctx,
+		   unsigned int initial_fd_count)
+{
+	struct io_uring_params params;
+	unsigned int entries;
+
+	entries = I_MAX(initial_fd_count, IOLOOP_URING_MIN_ENTRIES);
+	entries = I_MIN(nearest_power(entries), IOLOOP_URING_MAX_ENTRIES);
+
+	i_zero(&params);
+	ctx->ring_fd = io_uring_setup_syscall(entries, &params);
+	if (ctx->ring_fd < 0) {
+		if (errno == ENOSYS || errno == EPERM) {
+			i_fatal("io_uring_setup() failed: %m (io_uring may be "
+				"disabled in kernel - rebuild with "
+				"--with-ioloop=epoll)");
+		}
+		i_fatal("io_uring_setup(%u) failed: %m", entries);
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	/* EXT_ARG is needed for passing the wait timeout to io_uring_enter(),
+	   NODROP guarantees that completions aren't lost if the CQ ring
+	   overflows. Both exist since Linux v5.11. */
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0 ||
+	    (params.features & IORING_FEAT_NODROP) == 0) {
+		i_fatal("io_uring: Kernel is too old "
+			"(features=0x%x, need EXT_ARG and NODROP)",
+			params.features);
+	}
+	io_uring_map_rings(ctx, &params);
+	ctx->fork_count = io_uring_fork_count;
+}
+
+static void io_uring_ring_deinit(struct ioloop_handler_context *ctx)
+{
+	if (munmap(ctx->sq.sqes, ctx->sq.sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (ctx->cq.ring_ptr != ctx->sq.ring_ptr &&
+	    munmap(ctx->cq.ring_ptr, ctx->cq.ring_size) < 0)
+		i_error("munmap(io_uring cq ring) failed: %m");
+	if (munmap(ctx->sq.ring_ptr, ctx->sq.ring_size) < 0)
+		i_error("munmap(io_uring sq ring) failed: %m");
+	/* Closing the ring cancels all the pending poll requests. After
+	   fork() this only drops the child's reference to the parent's
+	   ring. */
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	i_zero(&ctx->sq);
+	i_zero(&ctx->cq);
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+
+	if (!io_uring_atfork_registered) {
+		if (pthread_atfork(NULL, NULL, io_uring_atfork_child) != 0)
+			i_fatal("pthread_atfork() failed");
+		io_uring_atfork_registered = TRUE;
+	}
+
+	ioloop->handler_context = ctx = i_new(struct ioloop_handler_context, 1);
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->dirty_fds, initial_fd_count);
+	i_array_init(&ctx->events, initial_fd_count);
+	io_uring_ring_init(ctx, initial_fd_count);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd **fds;
+	unsigned int i, count;
+
+	fds = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(fds[i]);
+
+	io_uring_ring_deinit(ctx);
+
+	array_free(&ctx->fd_index);
+	array_free(&ctx->dirty_fds);
+	array_free(&ctx->events);
+	i_free(ioloop->handler_context);
+}
+
+static int
+io_uring_submit(struct ioloop_handler_context *ctx, unsigned int min_complete,
+		unsigned int flags, const void *arg, size_t argsz)
+{
+	struct io_uring_sq *sq = &ctx->sq;
+	unsigned int to_submit = sq->to_submit;
+	int ret;
+
+	/* make the queued SQEs visible to kernel */
+	__atomic_store_n(sq->tail, sq->sqe_tail, __ATOMIC_RELEASE);
+	if (min_complete > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	ret = io_uring_enter_syscall(ctx->ring_fd, to_submit, min_complete,
+				     flags, arg, argsz);
+	if (ret >= 0) {
+		i_assert((unsigned int)ret <= to_submit);
+		sq->to_submit -= ret;
+	}
+	return ret;
+}
+
+static struct io_uring_sqe *io_uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sq *sq = &ctx->sq;
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(sq->head, __ATOMIC_ACQUIRE);
+	while (sq->sqe_tail - head >= sq->entries) {
+		/* SQ ring is full - flush it */
+		if (io_uring_submit(ctx, 0, 0, NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(submit) failed: %m");
+		head = __atomic_load_n(sq->head, __ATOMIC_ACQUIRE);
+	}
+
+	idx = sq->sqe_tail & *sq->ring_mask;
+	sq->array[idx] = idx;
+	sqe = &sq->sqes[idx];
+	i_zero(sqe);
+	sq->sqe_tail++;
+	sq->to_submit++;
+	return sqe;
+}
+
+static unsigned int io_uring_poll_mask(const struct io_list *list)
+{
+	unsigned int mask = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if ((io->io.condition & IO_READ) != 0)
+			mask |= IO_URING_POLL_INPUT;
+		if ((io->io.condition & IO_WRITE) != 0)
+			mask |= IO_URING_POLL_OUTPUT;
+		if ((io->io.condition & IO_ERROR) != 0)
+			mask |= IO_URING_POLL_ERROR;
+	}
+	return mask;
+}
+
+static void
+io_uring_queue_poll_remove(struct ioloop_handler_context *ctx, int fd,
+			   struct io_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+
+	i_assert(ufd->armed);
+
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = IO_URING_USER_DATA(fd, ufd->gen);
+	/* Generations of poll requests are always even, so the removal's
+	   own completion never matches any fd. */
+	sqe->user_data = IO_URING_USER_DATA(fd, ufd->gen) ^ 1;
+	ufd->armed = FALSE;
+	ufd->gen += 2;
+}
+
+static void
+io_uring_queue_poll_add(struct ioloop_handler_context *ctx, int fd,
+			struct io_uring_fd *ufd, unsigned int mask)
+{
+	struct io_uring_sqe *sqe;
+
+	i_assert(!ufd->armed);
+
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->user_data = IO_URING_USER_DATA(fd, ufd->gen);
+	ufd->armed = TRUE;
+	/* remember the mask in the same form io_uring_poll_mask() returns */
+	ufd->armed_mask = mask;
+#ifdef WORDS_BIGENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	sqe->poll32_events = mask;
+}
+
+static void io_uring_fd_set_dirty(struct ioloop_handler_context *ctx, int fd,
+				  struct io_uring_fd *ufd)
+{
+	if (!ufd->dirty) {
+		ufd->dirty = TRUE;
+		array_push_back(&ctx->dirty_fds, &fd);
+	}
+}
+
+static void io_uring_update_dirty(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_fd *ufd;
+	const int *fdp;
+	unsigned int mask;
+
+	array_foreach(&ctx->dirty_fds, fdp) {
+		ufd = array_idx_elem(&ctx->fd_index, *fdp);
+		i_assert(ufd->dirty);
+		ufd->dirty = FALSE;
+
+		mask = io_uring_poll_mask(&ufd->list);
+		if (ufd->armed && ufd->armed_mask == mask)
+			continue;
+		if (ufd->armed)
+			io_uring_queue_poll_remove(ctx, *fdp, ufd);
+		if (mask != 0)
+			io_uring_queue_poll_add(ctx, *fdp, ufd, mask);
+	}
+	array_clear(&ctx->dirty_fds);
+}
+
+static void io_uring_check_fork(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_fd **fds;
+	unsigned int i, count;
+
+	if (likely(ctx->fork_count == io_uring_fork_count))
+		return;
+
+	/* We're in a child process using an ioloop created by the parent.
+	   Create our own ring and re-arm all the polls in it. */
+	io_uring_ring_deinit(ctx);
+	io_uring_ring_init(ctx, array_count(&ctx->fd_index));
+
+	array_clear(&ctx->dirty_fds);
+	fds = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++) {
+		if (fds[i] == NULL)
+			continue;
+		fds[i]->armed = FALSE;
+		fds[i]->dirty = FALSE;
+		fds[i]->gen += 2;
+		if (io_uring_poll_mask(&fds[i]->list) != 0)
+			io_uring_fd_set_dirty(ctx, i, fds[i]);
+	}
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp;
+
+	io_uring_check_fork(ctx);
+	ufdp = array_idx_get_space(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL)
+		*ufdp = i_new(struct io_uring_fd, 1);
+
+	if (!ioloop_iolist_add(&(*ufdp)->list, io) || (*ufdp)->armed) {
+		io_uring_fd_set_dirty(ctx, io->fd, *ufdp);
+		return;
+	}
+
+	/* Submit new fds immediately, similar to epoll_ctl(ADD). Polling an
+	   already ready fd completes immediately, so this way the events are
+	   reported in the order the fds became ready, like with epoll. Only
+	   the re-arms and changes are batched. */
+	io_uring_queue_poll_add(ctx, io->fd, *ufdp,
+				io_uring_poll_mask(&(*ufdp)->list));
+	if (io_uring_submit(ctx, 0, 0, NULL, 0) < 0 &&
+	    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		i_fatal("io_uring_enter(submit) failed: %m");
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd *ufd;
+
+	io_uring_check_fork(ctx);
+	ufd = array_idx_elem(&ctx->fd_index, io->fd);
+	if (!ioloop_iolist_del(&ufd->list, io))
+		io_uring_fd_set_dirty(ctx, io->fd, ufd);
+	else if (ufd->armed) {
+		/* The poll request keeps a reference to the file even if the
+		   fd was already closed, so it always needs to be removed. */
+		io_uring_queue_poll_remove(ctx, io->fd, ufd);
+	} else {
+		/* Invalidate the generation, so any already received events
+		   for this fd are ignored in case the fd number gets
+		   reused. */
+		ufd->gen += 2;
+	}
+	i_free(io);
+}
+
+static void io_uring_reap_completions(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_cq *cq = &ctx->cq;
+	const struct io_uring_cqe *cqe;
+	struct io_uring_event *event;
+	struct io_uring_fd *ufd;
+	unsigned int head, tail;
+	int fd;
+
+	head = *cq->head;
+	tail = __atomic_load_n(cq->tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &cq->cqes[head & *cq->ring_mask];
+		fd = IO_URING_USER_DATA_FD(cqe->user_data);
+		if (fd < 0 || (unsigned int)fd >= array_count(&ctx->fd_index))
+			continue;
+		ufd = array_idx_elem(&ctx->fd_index, fd);
+		if (ufd == NULL || !ufd->armed ||
+		    ufd->gen != IO_URING_USER_DATA_GEN(cqe->user_data))
+			continue;
+
+		/* one-shot poll request finished - it needs to be re-armed
+		   before the next wait */
+		ufd->armed = FALSE;
+		ufd->gen += 2;
+		io_uring_fd_set_dirty(ctx, fd, ufd);
+		if (cqe->res < 0) {
+			if (cqe->res == -ECANCELED)
+				continue;
+			/* e.g. fd doesn't support polling */
+			errno = -cqe->res;
+			i_panic("io_uring poll(%d) failed: %m", fd);
+		}
+
+		event = array_append_space(&ctx->events);
+		event->fd = fd;
+		event->gen = ufd->gen;
+		event->revents = cqe->res;
+	}
+	__atomic_store_n(cq->head, head, __ATOMIC_RELEASE);
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	const struct io_uring_event *event;
+	struct io_uring_fd *ufd;
+	struct io_file *io;
+	struct timeval tv;
+	unsigned int i, count;
+	int msecs, ret, j;
+	bool call;
+
+	i_assert(ctx != NULL);
+	io_uring_check_fork(ctx);
+
+	/* get the time left for next timeout task */
+	msecs = io_loop_run_get_wait_time(ioloop, &tv);
+
+	/* queue all the poll changes done since the last run */
+	io_uring_update_dirty(ctx);
+
+	if (ioloop->io_files != NULL) {
+		i_zero(&arg);
+		if (msecs >= 0) {
+			ts.tv_sec = msecs / 1000;
+			ts.tv_nsec = (long)(msecs % 1000) * 1000000L;
+			arg.ts = (uintptr_t)&ts;
+		}
+		/* submit the changes and wait for completions with the same
+		   syscall */
+		ret = io_uring_submit(ctx, 1, IORING_ENTER_EXT_ARG,
+				      &arg, sizeof(arg));
+		if (ret < 0 && errno != EINTR && errno != ETIME &&
+		    errno != EBUSY)
+			i_fatal("io_uring_enter() failed: %m");
+	} else {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. Submit the poll removals first though,
+		   so the removed files' references are dropped. */
+		if (ctx->sq.to_submit > 0 &&
+		    io_uring_submit(ctx, 0, 0, NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(submit) failed: %m");
+		i_assert(msecs >= 0);
+		i_sleep_intr_msecs(msecs);
+	}
+
+	array_clear(&ctx->events);
+	io_uring_reap_completions(ctx);
+
+	/* execute timeout handlers */
+	io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running)
+		return;
+
+	count = array_count(&ctx->events);
+	for (i = 0; i < count; i++) {
+		/* io_loop_handle_add() may cause fd_index array
+		   reallocation, so we have use array_idx() */
+		event = array_idx(&ctx->events, i);
+		ufd = array_idx_elem(&ctx->fd_index, event->fd);
+		if (ufd->gen != event->gen) {
+			/* all of the fd's IOs were removed by an earlier
+			   callback */
+			continue;
+		}
+
+		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
+			io = ufd->list.ios[j];
+			if (io == NULL)
+				continue;
+
+			call = FALSE;
+			if ((event->revents & (POLLHUP | POLLERR)) != 0)
+				call = TRUE;
+			else if ((io->io.condition & IO_READ) != 0)
+				call = (event->revents & (POLLIN | POLLPRI)) != 0;
+			else if ((io->io.condition & IO_WRITE) != 0)
+				call = (event->revents & POLLOUT) != 0;
+			else if ((io->io.condition & IO_ERROR) != 0)
+				call = (event->revents & IO_URING_POLL_ERROR) != 0;
+
+			if (call) {
+				io_loop_call_io(&io->io);
+				if (!ioloop->running)
+					return;
+			}
+		}
+	}
+}
+
+#endif	/* IOLOOP_URING || IOLOOP_URING_TEST */
@@ -79,6 +79,14 @@ iostream_proxy_create(struct istream *left_input, struct ostream *left_output,
 	return proxy;
 }
 
+bool iostream_proxy_try_splice(struct iostream_proxy *proxy)
+{
+	bool ltr = iostream_pump_try_splice(proxy->ltr);
+	bool rtl = iostream_pump_try_splice(proxy->rtl);
+
+	return ltr && rtl;
+}
+
 void iostream_proxy_start(struct iostream_proxy *proxy)
 {
 	i_assert(proxy != NULL);
@@ -65,6 +65,10 @@ iostream_proxy_create(struct istream *left_input, struct ostream *left_output,
 struct istream *iostream_proxy_get_istream(struct iostream_proxy *proxy, enum iostream_proxy_side);
 struct ostream *iostream_proxy_get_ostream(struct iostream_proxy *proxy, enum iostream_proxy_side);
 
+/* Call iostream_pump_try_splice() for both directions. Returns TRUE if
+   splice() is going to be used for both of them. */
+bool iostream_proxy_try_splice(struct iostream_proxy *proxy);
+
 void iostream_proxy_start(struct iostream_proxy *proxy);
 void iostream_proxy_stop(struct iostream_proxy *proxy);
 
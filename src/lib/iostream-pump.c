@@ -1,12 +1,19 @@
 /* Copyright (c) 2002-2018 Dovecot authors, see the included COPYING file */
 
+#define _GNU_SOURCE /* for splice() */
 #include "lib.h"
 #include "buffer.h"
 #include "str.h"
+#include "ioloop.h"
 #include "iostream-pump.h"
-#include "istream.h"
-#include "ostream.h"
+#include "istream-private.h"
+#include "ostream-private.h"
 #include <unistd.h>
+#include <fcntl.h>
+
+/* How much to splice() at once. This is the default pipe capacity in Linux,
+   so a single call can fill the whole pipe. */
+#define IOSTREAM_PUMP_SPLICE_SIZE (64*1024)
 
 #undef iostream_pump_set_completion_callback
 
@@ -21,10 +28,149 @@ struct iostream_pump {
 	iostream_pump_callback_t *callback;
 	void *context;
 
+	/* Pipe for splice()ing data from input fd to output fd. Created
+	   when there's input to move and closed again once the input is
+	   drained, so idle pumps don't keep the two extra fds open. */
+	int splice_fd[2];
+	/* Number of bytes read into the pipe, but not yet written out */
+	size_t splice_pipe_used;
+
 	bool waiting_output;
 	bool completed;
+	bool splice;
 };
 
+#ifdef HAVE_SPLICE
+static bool iostream_pump_can_splice(struct iostream_pump *pump)
+{
+	struct istream_private *input = pump->input->real_stream;
+	struct ostream_private *output = pump->output->real_stream;
+
+	/* splice() only works when nothing else needs to see the data,
+	   i.e. there are no filter streams (e.g. SSL, rawlog) */
+	return input->parent == NULL && output->parent == NULL &&
+		pump->input->readable_fd && !pump->input->seekable &&
+		!pump->input->blocking && !pump->output->blocking &&
+		i_stream_get_fd(pump->input) != -1 &&
+		o_stream_get_fd(pump->output) != -1;
+}
+
+static void iostream_pump_splice_close(struct iostream_pump *pump)
+{
+	if (pump->splice_fd[0] == -1)
+		return;
+	i_close_fd(&pump->splice_fd[0]);
+	i_close_fd(&pump->splice_fd[1]);
+}
+
+static int iostream_pump_splice_flush(struct iostream_pump *pump)
+{
+	struct ostream *output = pump->output;
+	ssize_t ret;
+
+	while (pump->splice_pipe_used > 0) {
+		ret = splice(pump->splice_fd[0], NULL,
+			     o_stream_get_fd(output), NULL,
+			     pump->splice_pipe_used,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			io_stream_set_error(&output->real_stream->iostream,
+					    "splice() failed: %m");
+			output->stream_errno = errno;
+			return -1;
+		}
+		i_assert(ret > 0 && (size_t)ret <= pump->splice_pipe_used);
+		pump->splice_pipe_used -= ret;
+		output->offset += ret;
+		output->real_stream->last_write_timeval = ioloop_timeval;
+	}
+	return 1;
+}
+
+static enum ostream_send_istream_result
+iostream_pump_splice_more(struct iostream_pump *pump)
+{
+	struct istream *input = pump->input;
+	int ret;
+
+	if (pump->splice_fd[0] == -1) {
+		/* no pipe yet - fall back to copying if it can't be
+		   created (e.g. out of fds) */
+		if (pipe(pump->splice_fd) < 0) {
+			pump->splice_fd[0] = pump->splice_fd[1] = -1;
+			pump->splice = FALSE;
+			return io_stream_copy(pump->output, input);
+		}
+		fd_close_on_exec(pump->splice_fd[0], TRUE);
+		fd_close_on_exec(pump->splice_fd[1], TRUE);
+	}
+
+	for (;;) {
+		if ((ret = iostream_pump_splice_flush(pump)) <= 0) {
+			return ret == 0 ? OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT :
+				OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+		}
+		ssize_t ret2 = splice(i_stream_get_fd(input), NULL,
+				      pump->splice_fd[1], NULL,
+				      IOSTREAM_PUMP_SPLICE_SIZE,
+				      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret2 == 0) {
+			iostream_pump_splice_close(pump);
+			input->eof = TRUE;
+			return OSTREAM_SEND_ISTREAM_RESULT_FINISHED;
+		}
+		if (ret2 < 0) {
+			if (errno == EINTR)
+				continue;
+			/* the pipe is always empty here, so EAGAIN means
+			   there's no more input. Close the pipe until more
+			   input arrives. */
+			if (errno == EAGAIN) {
+				iostream_pump_splice_close(pump);
+				return OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT;
+			}
+			if (errno == EINVAL) {
+				/* splice() isn't supported for this fd. Nothing
+				   is buffered anywhere, so it's safe to switch
+				   to copying. */
+				iostream_pump_splice_close(pump);
+				pump->splice = FALSE;
+				return io_stream_copy(pump->output, input);
+			}
+			io_stream_set_error(&input->real_stream->iostream,
+					    "splice() failed: %m");
+			input->stream_errno = errno;
+			input->eof = TRUE;
+			return OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT;
+		}
+		pump->splice_pipe_used = ret2;
+		input->v_offset += ret2;
+		input->real_stream->last_read_timeval = ioloop_timeval;
+	}
+}
+#endif
+
+static enum ostream_send_istream_result
+iostream_pump_send(struct iostream_pump *pump)
+{
+#ifdef HAVE_SPLICE
+	/* Anything that was already read into the istream buffer or written
+	   to the ostream buffer must be sent first the usual way. After that
+	   nobody else reads or writes these streams, so the buffers stay
+	   empty and the data is moved only between the fds and the pipe. */
+	if (pump->splice &&
+	    (pump->splice_pipe_used > 0 ||
+	     (i_stream_get_data_size(pump->input) == 0 &&
+	      o_stream_get_buffer_used_size(pump->output) == 0)))
+		return iostream_pump_splice_more(pump);
+#endif
+	return o_stream_send_istream(pump->output, pump->input);
+}
+
 static void iostream_pump_copy(struct iostream_pump *pump)
 {
 	enum ostream_send_istream_result res;
@@ -35,7 +181,7 @@ static void iostream_pump_copy(struct iostream_pump *pump)
 	o_stream_set_max_buffer_size(pump->output,
 		I_MIN(IO_BLOCK_SIZE,
 		      o_stream_get_max_buffer_size(pump->output)));
-	res = o_stream_send_istream(pump->output, pump->input);
+	res = iostream_pump_send(pump);
 	o_stream_set_max_buffer_size(pump->output, old_size);
 	o_stream_uncork(pump->output);
 
@@ -54,6 +200,11 @@ static void iostream_pump_copy(struct iostream_pump *pump)
 		i_assert(!pump->output->blocking);
 		pump->waiting_output = TRUE;
 		io_remove(&pump->io);
+		if (pump->splice_pipe_used > 0) {
+			/* the ostream's buffer is empty, so it won't notice
+			   by itself when the fd becomes writable */
+			o_stream_set_flush_pending(pump->output, TRUE);
+		}
 		return;
 	case OSTREAM_SEND_ISTREAM_RESULT_FINISHED:
 		pump->waiting_output = FALSE;
@@ -127,10 +278,19 @@ iostream_pump_create(struct istream *input, struct ostream *output)
 	pump->refcount = 1;
 	pump->input = input;
 	pump->output = output;
+	pump->splice_fd[0] = pump->splice_fd[1] = -1;
 
 	return pump;
 }
 
+bool iostream_pump_try_splice(struct iostream_pump *pump)
+{
+#ifdef HAVE_SPLICE
+	pump->splice = iostream_pump_can_splice(pump);
+#endif
+	return pump->splice;
+}
+
 void iostream_pump_start(struct iostream_pump *pump)
 {
 	i_assert(pump != NULL);
@@ -198,6 +358,9 @@ void iostream_pump_unref(struct iostream_pump **_pump)
 
 	iostream_pump_stop(pump);
 
+#ifdef HAVE_SPLICE
+	iostream_pump_splice_close(pump);
+#endif
 	o_stream_unref(&pump->output);
 	i_stream_unref(&pump->input);
 	i_free(pump);
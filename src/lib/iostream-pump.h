@@ -40,6 +40,18 @@ iostream_pump_create(struct istream *input, struct ostream *output);
 struct istream *iostream_pump_get_input(struct iostream_pump *pump);
 struct ostream *iostream_pump_get_output(struct iostream_pump *pump);
 
+/* Move the data with splice() directly from the istream's fd to the
+   ostream's fd without copying it to userspace. This works only if both
+   streams are non-blocking fd streams without any filter streams (e.g. SSL
+   or rawlog), and the istream isn't seekable. Anything already in the
+   streams' buffers is sent the usual way first. After this the istream must
+   not be read and the ostream must not be written to by anyone else than
+   the pump. While there is input to move, the pump keeps a pipe open, i.e.
+   two extra fds per direction. The pipe is closed whenever the input is
+   drained, and if it can't be created (e.g. out of fds) the data is copied
+   the usual way instead. Returns TRUE if splice() is going to be used. */
+bool iostream_pump_try_splice(struct iostream_pump *pump);
+
 void iostream_pump_start(struct iostream_pump *pump);
 void iostream_pump_stop(struct iostream_pump *pump);
 
@@ -0,0 +1,39 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Runs the ioloop tests with the io_uring ioloop handler, which is linked
+   into this program instead of the one selected by configure. */
+
+static bool io_uring_is_usable(void)
+{
+	struct io_uring_params p;
+	int fd;
+
+	i_zero(&p);
+	fd = (int)syscall(__NR_io_uring_setup, 4, &p);
+	if (fd < 0)
+		return FALSE;
+	i_close_fd(&fd);
+	return (p.features & IORING_FEAT_EXT_ARG) != 0 &&
+		(p.features & IORING_FEAT_NODROP) != 0;
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_ioloop,
+		NULL
+	};
+
+	if (!io_uring_is_usable()) {
+		printf("io_uring isn't usable - skipping\n");
+		return 0;
+	}
+	return test_run(test_functions);
+}
@@ -21,11 +21,12 @@ void completed(enum iostream_proxy_side side ATTR_UNUSED,
 }
 
 static
-void test_iostream_proxy_simple(void)
+void test_iostream_proxy_simple(bool splice)
 {
 	size_t bytes;
 
-	test_begin("iostream_proxy");
+	test_begin(t_strdup_printf("iostream_proxy%s",
+				   splice ? " splice" : ""));
 	int sfdl[2];
 	int sfdr[2];
 
@@ -56,6 +57,8 @@ void test_iostream_proxy_simple(void)
 	o_stream_unref(&right_out);
 
 	iostream_proxy_set_completion_callback(proxy, completed, &counter);
+	if (splice)
+		(void)iostream_proxy_try_splice(proxy);
 	iostream_proxy_start(proxy);
 
 	left_in = i_stream_create_fd(sfdl[0], IO_BLOCK_SIZE);
@@ -89,6 +92,11 @@ void test_iostream_proxy_simple(void)
 	test_assert(strcmp((const char*)i_stream_get_data(left_in, &bytes), "hello, world") == 0);
 	i_stream_skip(left_in, bytes);
 
+	test_assert(iostream_proxy_get_ostream(proxy, IOSTREAM_PROXY_SIDE_LEFT)->offset == 12);
+	test_assert(iostream_proxy_get_ostream(proxy, IOSTREAM_PROXY_SIDE_RIGHT)->offset == 12);
+	test_assert(iostream_proxy_get_istream(proxy, IOSTREAM_PROXY_SIDE_LEFT)->v_offset == 12);
+	test_assert(iostream_proxy_get_istream(proxy, IOSTREAM_PROXY_SIDE_RIGHT)->v_offset == 12);
+
 	iostream_proxy_unref(&proxy);
 
 	io_loop_destroy(&ioloop);
@@ -105,9 +113,239 @@ void test_iostream_proxy_simple(void)
 	test_end();
 }
 
+struct test_large_ctx {
+	struct istream *input;
+	struct ostream *output;
+	struct io *io;
+	size_t sent, received;
+	int counter;
+	bool data_ok;
+};
+
+static unsigned char test_large_byte(size_t offset)
+{
+	return (offset * 31 + offset / 4099) & 0xff;
+}
+
+static int test_iostream_proxy_large_output(struct test_large_ctx *ctx)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	size_t i, size;
+	ssize_t ret;
+
+	if (o_stream_flush(ctx->output) <= 0)
+		return 0;
+	while (ctx->sent < 1024*1024) {
+		size = I_MIN(sizeof(buf), 1024*1024 - ctx->sent);
+		for (i = 0; i < size; i++)
+			buf[i] = test_large_byte(ctx->sent + i);
+		ret = o_stream_send(ctx->output, buf, size);
+		test_assert(ret >= 0);
+		if (ret <= 0)
+			return 0;
+		ctx->sent += ret;
+	}
+	if ((ret = o_stream_finish(ctx->output)) > 0)
+		test_assert(shutdown(o_stream_get_fd(ctx->output), SHUT_WR) == 0);
+	return ret;
+}
+
+static void test_iostream_proxy_large_input(struct test_large_ctx *ctx)
+{
+	const unsigned char *data;
+	size_t i, size;
+	int ret;
+
+	while ((ret = i_stream_read_more(ctx->input, &data, &size)) > 0) {
+		for (i = 0; i < size; i++) {
+			if (data[i] != test_large_byte(ctx->received + i))
+				ctx->data_ok = FALSE;
+		}
+		ctx->received += size;
+		i_stream_skip(ctx->input, size);
+	}
+	if (ctx->received == 1024*1024 && ctx->counter == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static void
+test_large_completed(enum iostream_proxy_side side ATTR_UNUSED,
+		     enum iostream_proxy_status status,
+		     struct test_large_ctx *ctx)
+{
+	test_assert(status == IOSTREAM_PROXY_STATUS_INPUT_EOF);
+	ctx->counter--;
+	if (ctx->received == 1024*1024)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_iostream_proxy_large(bool splice)
+{
+	struct test_large_ctx ctx = { .counter = 1, .data_ok = TRUE };
+	struct iostream_proxy *proxy;
+	struct istream *left_in, *right_in;
+	struct ostream *left_out, *right_out;
+	int sfdl[2], sfdr[2];
+
+	test_begin(t_strdup_printf("iostream_proxy large%s",
+				   splice ? " splice" : ""));
+
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sfdl) == 0);
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sfdr) == 0);
+	for (unsigned int i = 0; i < 2; i++) {
+		fd_set_nonblock(sfdl[i], TRUE);
+		fd_set_nonblock(sfdr[i], TRUE);
+	}
+
+	struct ioloop *ioloop = io_loop_create();
+
+	left_in = i_stream_create_fd(sfdl[1], IO_BLOCK_SIZE);
+	left_out = o_stream_create_fd(sfdl[1], IO_BLOCK_SIZE);
+	right_in = i_stream_create_fd(sfdr[1], IO_BLOCK_SIZE);
+	right_out = o_stream_create_fd(sfdr[1], IO_BLOCK_SIZE);
+	o_stream_set_no_error_handling(left_out, TRUE);
+	o_stream_set_no_error_handling(right_out, TRUE);
+	proxy = iostream_proxy_create(left_in, left_out, right_in, right_out);
+	i_stream_unref(&left_in);
+	o_stream_unref(&left_out);
+	i_stream_unref(&right_in);
+	o_stream_unref(&right_out);
+
+	iostream_proxy_set_completion_callback(proxy, test_large_completed,
+					       &ctx);
+	if (splice) {
+#ifdef HAVE_SPLICE
+		test_assert(iostream_proxy_try_splice(proxy));
+#else
+		(void)iostream_proxy_try_splice(proxy);
+#endif
+	}
+	iostream_proxy_start(proxy);
+
+	/* write to the left side and read from the right side */
+	ctx.output = o_stream_create_fd(sfdl[0], IO_BLOCK_SIZE);
+	o_stream_set_no_error_handling(ctx.output, TRUE);
+	o_stream_set_flush_callback(ctx.output,
+				    test_iostream_proxy_large_output, &ctx);
+	o_stream_set_flush_pending(ctx.output, TRUE);
+	ctx.input = i_stream_create_fd(sfdr[0], IO_BLOCK_SIZE);
+	ctx.io = io_add_istream(ctx.input, test_iostream_proxy_large_input,
+				&ctx);
+
+	struct timeout *to = timeout_add(5000, io_loop_stop, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+
+	test_assert(ctx.counter == 0);
+	test_assert(ctx.received == 1024*1024);
+	test_assert(ctx.data_ok);
+	test_assert(iostream_proxy_get_ostream(proxy, IOSTREAM_PROXY_SIDE_LEFT)->offset == 1024*1024);
+
+	io_remove(&ctx.io);
+	i_stream_unref(&ctx.input);
+	o_stream_unref(&ctx.output);
+	iostream_proxy_unref(&proxy);
+	io_loop_destroy(&ioloop);
+
+	i_close_fd(&sfdl[0]);
+	i_close_fd(&sfdl[1]);
+	i_close_fd(&sfdr[0]);
+	i_close_fd(&sfdr[1]);
+
+	test_end();
+}
+
+#ifdef HAVE_SPLICE
+static void test_iostream_proxy_splice_idle_input(struct istream *input)
+{
+	if (i_stream_read(input) < 0 || i_stream_get_data_size(input) >= 5)
+		io_loop_stop(current_ioloop);
+}
+
+static int test_lowest_free_fd(int open_fd)
+{
+	int fd = dup(open_fd), ret = fd;
+
+	test_assert(fd != -1);
+	i_close_fd(&fd);
+	return ret;
+}
+
+static void test_iostream_proxy_splice_idle(void)
+{
+	struct iostream_proxy *proxy;
+	struct istream *left_in, *right_in;
+	struct ostream *left_out, *right_out;
+	struct io *io;
+	int sfdl[2], sfdr[2], free_fd, counter = 1;
+
+	test_begin("iostream_proxy splice idle");
+
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sfdl) == 0);
+	test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sfdr) == 0);
+	for (unsigned int i = 0; i < 2; i++) {
+		fd_set_nonblock(sfdl[i], TRUE);
+		fd_set_nonblock(sfdr[i], TRUE);
+	}
+
+	struct ioloop *ioloop = io_loop_create();
+
+	left_in = i_stream_create_fd(sfdl[1], IO_BLOCK_SIZE);
+	left_out = o_stream_create_fd(sfdl[1], IO_BLOCK_SIZE);
+	right_in = i_stream_create_fd(sfdr[1], IO_BLOCK_SIZE);
+	right_out = o_stream_create_fd(sfdr[1], IO_BLOCK_SIZE);
+	o_stream_set_no_error_handling(left_out, TRUE);
+	o_stream_set_no_error_handling(right_out, TRUE);
+	proxy = iostream_proxy_create(left_in, left_out, right_in, right_out);
+	i_stream_unref(&left_in);
+	o_stream_unref(&left_out);
+	i_stream_unref(&right_in);
+	o_stream_unref(&right_out);
+
+	iostream_proxy_set_completion_callback(proxy, completed, &counter);
+	test_assert(iostream_proxy_try_splice(proxy));
+
+	/* adding the first io creates the ioloop's own fds */
+	right_in = i_stream_create_fd(sfdr[0], IO_BLOCK_SIZE);
+	io = io_add_istream(right_in, test_iostream_proxy_splice_idle_input,
+			    right_in);
+	free_fd = test_lowest_free_fd(sfdl[0]);
+	iostream_proxy_start(proxy);
+
+	/* move some data and leave the proxy waiting for more */
+	test_assert(write(sfdl[0], "hello", 5) == 5);
+	struct timeout *to = timeout_add(5000, io_loop_stop, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	io_remove(&io);
+	test_assert(i_stream_get_data_size(right_in) == 5);
+	test_assert(counter == 1);
+
+	/* the idle proxy doesn't keep the splice pipe open */
+	test_assert(test_lowest_free_fd(sfdl[0]) == free_fd);
+
+	i_stream_unref(&right_in);
+	iostream_proxy_unref(&proxy);
+	io_loop_destroy(&ioloop);
+
+	i_close_fd(&sfdl[0]);
+	i_close_fd(&sfdl[1]);
+	i_close_fd(&sfdr[0]);
+	i_close_fd(&sfdr[1]);
+
+	test_end();
+}
+#endif
+
 void test_iostream_proxy(void)
 {
 	T_BEGIN {
-		test_iostream_proxy_simple();
+		test_iostream_proxy_simple(FALSE);
+		test_iostream_proxy_simple(TRUE);
+		test_iostream_proxy_large(FALSE);
+		test_iostream_proxy_large(TRUE);
+#ifdef HAVE_SPLICE
+		test_iostream_proxy_splice_idle();
+#endif
 	} T_END;
 }
@@ -262,19 +262,12 @@ lmtp_local_rcpt_anvil_finish(struct lmtp_local_recipient *llrcpt)
 }
 
 static void
-lmtp_local_rcpt_anvil_cb(const char *reply, struct lmtp_local_recipient *llrcpt)
+lmtp_local_rcpt_anvil_check(struct lmtp_local_recipient *llrcpt,
+			    unsigned int parallel_count)
 {
 	struct client *client = llrcpt->rcpt->client;
 	struct smtp_server_recipient *rcpt = llrcpt->rcpt->rcpt;
 	const struct mail_storage_service_input *input;
-	unsigned int parallel_count = 0;
-
-	llrcpt->anvil_query = NULL;
-	if (reply == NULL) {
-		/* lookup failed */
-	} else if (str_to_uint(reply, &parallel_count) < 0) {
-		e_error(rcpt->event, "Invalid reply from anvil: %s", reply);
-	}
 
 	if (parallel_count >= client->lmtp_set->lmtp_user_concurrency_limit) {
 		smtp_server_recipient_reply(
@@ -292,6 +285,21 @@ lmtp_local_rcpt_anvil_cb(const char *reply, struct lmtp_local_recipient *llrcpt)
 	}
 }
 
+static void
+lmtp_local_rcpt_anvil_cb(const char *reply, struct lmtp_local_recipient *llrcpt)
+{
+	struct smtp_server_recipient *rcpt = llrcpt->rcpt->rcpt;
+	unsigned int parallel_count = 0;
+
+	llrcpt->anvil_query = NULL;
+	if (reply == NULL) {
+		/* lookup failed */
+	} else if (str_to_uint(reply, &parallel_count) < 0) {
+		e_error(rcpt->event, "Invalid reply from anvil: %s", reply);
+	}
+	lmtp_local_rcpt_anvil_check(llrcpt, parallel_count);
+}
+
 int lmtp_local_rcpt(struct client *client,
 		    struct smtp_server_cmd_ctx *cmd ATTR_UNUSED,
 		    struct lmtp_recipient *lrcpt)
@@ -358,6 +366,17 @@ int lmtp_local_rcpt(struct client *client,
 		   lookup. Look up the new one via service_user. */
 		const struct mail_storage_service_input *input =
 			mail_storage_service_user_get_input(llrcpt->service_user);
+		struct master_service_anvil_session anvil_session = {
+			.username = input->username,
+			.service_name = master_service_get_name(master_service),
+		};
+		unsigned int parallel_count;
+		if (master_service_anvil_lookup(master_service, &anvil_session,
+						&parallel_count)) {
+			lmtp_local_rcpt_anvil_check(llrcpt, parallel_count);
+			return 0;
+		}
+
 		const char *query = t_strconcat("LOOKUP\t",
 			str_tabescape(input->username), "\t",
 			master_service_get_name(master_service), "\t", NULL);
@@ -993,6 +993,10 @@ void login_proxy_detach(struct login_proxy *proxy)
 				      proxy->server_input, proxy->server_output);
 	iostream_proxy_set_completion_callback(proxy->iostream_proxy,
 					       login_proxy_finished, proxy);
+	/* Without SSL or rawlog on either side, the data can be moved
+	   between the sockets without copying it via userspace. */
+	if (iostream_proxy_try_splice(proxy->iostream_proxy))
+		e_debug(proxy->event, "Using splice() for proxying");
 	iostream_proxy_start(proxy->iostream_proxy);
 
 	if (proxy->notify_refresh_secs != 0) {
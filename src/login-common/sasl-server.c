@@ -214,25 +214,21 @@ static int master_send_request(struct anvil_request *anvil_request)
 	return 0;
 }
 
-static void ATTR_NULL(1)
-anvil_lookup_callback(const char *reply, struct anvil_request *req)
+static void
+anvil_lookup_finish(struct anvil_request *req, bool have_count,
+		    unsigned int conn_count)
 {
 	struct client *client = req->client;
 	const struct login_settings *set = client->set;
 	const char *errmsg;
-	unsigned int conn_count;
 	int ret;
 
 	client->anvil_query = NULL;
 	client->anvil_request = NULL;
 
-	conn_count = 0;
-	if (reply != NULL && str_to_uint(reply, &conn_count) < 0)
-		i_fatal("Received invalid reply from anvil: %s", reply);
-
-	/* reply=NULL if we didn't need to do anvil lookup,
+	/* have_count=FALSE if we didn't need to do anvil lookup,
 	   or if the anvil lookup failed. allow failed anvil lookups in. */
-	if (reply == NULL || conn_count < set->mail_max_userip_connections) {
+	if (!have_count || conn_count < set->mail_max_userip_connections) {
 		ret = master_send_request(req);
 		errmsg = NULL; /* client will see internal error */
 	} else {
@@ -249,6 +245,16 @@ anvil_lookup_callback(const char *reply, struct anvil_request *req)
 	i_free(req);
 }
 
+static void ATTR_NULL(1)
+anvil_lookup_callback(const char *reply, struct anvil_request *req)
+{
+	unsigned int conn_count = 0;
+
+	if (reply != NULL && str_to_uint(reply, &conn_count) < 0)
+		i_fatal("Received invalid reply from anvil: %s", reply);
+	anvil_lookup_finish(req, reply != NULL, conn_count);
+}
+
 static void
 anvil_check_too_many_connections(struct client *client,
 				 struct auth_client_request *request)
@@ -268,7 +274,19 @@ anvil_check_too_many_connections(struct client *client,
 
 	if (client->virtual_user == NULL ||
 	    client->set->mail_max_userip_connections == 0) {
-		anvil_lookup_callback(NULL, req);
+		anvil_lookup_finish(req, FALSE, 0);
+		return;
+	}
+
+	struct master_service_anvil_session anvil_session = {
+		.username = client->virtual_user,
+		.service_name = login_binary->protocol,
+		.ip = client->ip,
+	};
+	unsigned int conn_count;
+	if (master_service_anvil_lookup(master_service, &anvil_session,
+					&conn_count)) {
+		anvil_lookup_finish(req, TRUE, conn_count);
 		return;
 	}
 
@@ -710,6 +710,9 @@ static void print_build_options(void)
 #ifdef IOLOOP_SELECT
 		" ioloop=select"
 #endif
+#ifdef IOLOOP_URING
+		" ioloop=uring"
+#endif
 #ifdef IOLOOP_NOTIFY_INOTIFY
 		" notify=inotify"
 #endif
@@ -931,7 +934,7 @@ int main(int argc, char *argv[])
 	/* create service structures from settings. if there are any errors in
 	   service configuration we'll catch it here. */
 	service_pids_init();
-	service_anvil_global_init();
+	service_anvil_global_init(set);
 	if (services_create(set, &services, &error) < 0)
 		i_fatal("%s", error);
 
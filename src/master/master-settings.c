@@ -191,6 +191,7 @@ static const struct setting_define master_setting_defines[] = {
 	DEF(UINT, default_client_limit),
 	DEF(TIME, default_idle_kill),
 	DEF(SIZE, default_vsz_limit),
+	DEF(SIZE, anvil_connect_limit_shm_size),
 
 	DEF(BOOL, version_ignore),
 
@@ -219,6 +220,7 @@ static const struct master_settings master_default_settings = {
 	.default_client_limit = 1000,
 	.default_idle_kill = 60,
 	.default_vsz_limit = 256*1024*1024,
+	.anvil_connect_limit_shm_size = 0,
 
 	.version_ignore = FALSE,
 
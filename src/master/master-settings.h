@@ -18,6 +18,7 @@ struct master_settings {
 	unsigned int default_client_limit;
 	unsigned int default_idle_kill;
 	uoff_t default_vsz_limit;
+	uoff_t anvil_connect_limit_shm_size;
 
 	bool version_ignore;
 
@@ -7,6 +7,7 @@
 #include "service-process.h"
 #include "service-process-notify.h"
 #include "service-anvil.h"
+#include "connect-limit-shm.h"
 
 #include <unistd.h>
 
@@ -125,6 +126,10 @@ void service_anvil_process_destroyed(struct service_process *process)
 	if (service_anvil_global->pid == process->pid)
 		service_anvil_global->pid = 0;
 	service_anvil_global->restarted = TRUE;
+	/* The connection counts are no longer updated. The new anvil
+	   process resets them. */
+	if (service_anvil_global->shm != NULL)
+		connect_limit_shm_invalidate(service_anvil_global->shm);
 }
 
 void service_anvil_send_log_fd(void)
@@ -143,7 +148,33 @@ void service_anvil_send_log_fd(void)
 		i_error("fd_send(anvil log fd) failed: disconnected");
 }
 
-void service_anvil_global_init(void)
+static void
+service_anvil_shm_init(struct service_anvil_global *anvil,
+		       const struct master_settings *set)
+{
+	const char *error;
+
+	anvil->shm_rw_fd = anvil->shm_ro_fd = -1;
+	if (set->anvil_connect_limit_shm_size == 0)
+		return;
+
+	if (connect_limit_shm_create(set->base_dir,
+				     set->anvil_connect_limit_shm_size,
+				     &anvil->shm_rw_fd, &anvil->shm_ro_fd,
+				     &error) < 0) {
+		i_fatal("anvil_connect_limit_shm_size: "
+			"Failed to create shared memory: %s", error);
+	}
+	if (connect_limit_shm_open(anvil->shm_rw_fd, TRUE,
+				   &anvil->shm, &error) <= 0) {
+		i_fatal("anvil_connect_limit_shm_size: "
+			"Failed to map shared memory: %s", error);
+	}
+	fd_close_on_exec(anvil->shm_rw_fd, TRUE);
+	fd_close_on_exec(anvil->shm_ro_fd, TRUE);
+}
+
+void service_anvil_global_init(const struct master_settings *set)
 {
 	struct service_anvil_global *anvil;
 
@@ -169,6 +200,8 @@ void service_anvil_global_init(void)
 	fd_close_on_exec(anvil->log_fdpass_fd[0], TRUE);
 	fd_close_on_exec(anvil->log_fdpass_fd[1], TRUE);
 
+	service_anvil_shm_init(anvil, set);
+
 	anvil->kills =
 		service_process_notify_init(anvil->nonblocking_fd[1],
 					    service_process_write_anvil_kill);
@@ -197,6 +230,9 @@ void service_anvil_global_deinit(void)
 		i_error("close(anvil) failed: %m");
 	if (close(anvil->status_fd[1]) < 0)
 		i_error("close(anvil) failed: %m");
+	connect_limit_shm_close(&anvil->shm);
+	i_close_fd(&anvil->shm_rw_fd);
+	i_close_fd(&anvil->shm_ro_fd);
 	i_free(anvil);
 
 	service_anvil_global = NULL;
@@ -12,6 +12,10 @@ struct service_anvil_global {
 	int nonblocking_fd[2];
 	/* master process sends new log fds to anvil via this unix socket */
 	int log_fdpass_fd[2];
+	/* anvil_connect_limit_shm_size: read-write fd is passed to anvil,
+	   read-only fd to other processes. -1 if disabled. */
+	int shm_rw_fd, shm_ro_fd;
+	struct connect_limit_shm *shm;
 
 	struct service_process_notify *kills;
 	struct io *io_blocking, *io_nonblocking;
@@ -30,7 +34,7 @@ void service_anvil_process_destroyed(struct service_process *process);
 
 void service_anvil_send_log_fd(void);
 
-void service_anvil_global_init(void);
+void service_anvil_global_init(const struct master_settings *set);
 void service_anvil_global_deinit(void);
 
 #endif
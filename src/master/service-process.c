@@ -71,7 +71,7 @@ service_dup_fds(struct service *service)
 	struct service_listener *const *listeners;
 	ARRAY_TYPE(dup2) dups;
 	string_t *listener_settings;
-	int fd = MASTER_LISTEN_FD_FIRST;
+	int fd = MASTER_LISTEN_FD_FIRST, shm_fd = -1;
 	unsigned int i, count, socket_listener_count;
 
 	/* stdin/stdout is already redirected to /dev/null. Other master fds
@@ -193,6 +193,22 @@ service_dup_fds(struct service *service)
 			    MASTER_ANVIL_FD);
 		break;
 	}
+	switch (service->type) {
+	case SERVICE_TYPE_LOG:
+	case SERVICE_TYPE_CONFIG:
+		break;
+	case SERVICE_TYPE_ANVIL:
+		shm_fd = service_anvil_global->shm_rw_fd;
+		break;
+	case SERVICE_TYPE_UNKNOWN:
+	case SERVICE_TYPE_LOGIN:
+	case SERVICE_TYPE_STARTUP:
+	case SERVICE_TYPE_WORKER:
+		shm_fd = service_anvil_global->shm_ro_fd;
+		break;
+	}
+	dup2_append(&dups, shm_fd != -1 ? shm_fd : dev_null_fd,
+		    MASTER_ANVIL_SHM_FD);
 	dup2_append(&dups, service->status_fd[1], MASTER_STATUS_FD);
 	if (service->type != SERVICE_TYPE_ANVIL) {
 		dup2_append(&dups, service->master_dead_pipe_fd[1],
@@ -0,0 +1,356 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "master-service.h"
+#include "mail-namespace.h"
+#include "mail-search-build.h"
+#include "mail-storage-hooks.h"
+#include "fts-library.h"
+#include "fts-api-private.h"
+#include "fts-storage.h"
+#include "fts-user.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+
+/**
+ * Saves a number of text/plain messages into an sdbox INBOX and indexes them
+ * the way indexer-worker does, with fts_index_processes set to 1..N. The FTS
+ * backend only counts the tokens it receives, so the results show how fast
+ * the mails can be parsed, decoded and tokenized.
+ */
+
+#define BENCH_DEFAULT_PROCESSES 4
+#define BENCH_DEFAULT_MESSAGES 5000
+#define BENCH_BODY_WORDS 400
+
+struct bench_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+	struct mailbox *box;
+	uint32_t last_uid;
+};
+
+static const struct fts_backend fts_backend_bench;
+static uint64_t bench_token_count;
+
+static struct fts_backend *fts_backend_bench_alloc(void)
+{
+	struct fts_backend *backend;
+
+	backend = i_new(struct fts_backend, 1);
+	*backend = fts_backend_bench;
+	return backend;
+}
+
+static int
+fts_backend_bench_init(struct fts_backend *_backend ATTR_UNUSED,
+		       const char **error_r ATTR_UNUSED)
+{
+	return 0;
+}
+
+static void fts_backend_bench_deinit(struct fts_backend *_backend)
+{
+	i_free(_backend);
+}
+
+static int
+fts_backend_bench_get_last_uid(struct fts_backend *_backend ATTR_UNUSED,
+			       struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct fts_index_header hdr;
+
+	*last_uid_r = fts_index_get_header(box, &hdr) ?
+		hdr.last_indexed_uid : 0;
+	return 0;
+}
+
+static struct fts_backend_update_context *
+fts_backend_bench_update_init(struct fts_backend *_backend)
+{
+	struct bench_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct bench_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	return &ctx->ctx;
+}
+
+static void
+fts_backend_bench_update_flush(struct bench_fts_backend_update_context *ctx)
+{
+	if (ctx->box != NULL && ctx->last_uid != 0)
+		(void)fts_index_set_last_uid(ctx->box, ctx->last_uid);
+	ctx->last_uid = 0;
+}
+
+static int
+fts_backend_bench_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct bench_fts_backend_update_context *ctx =
+		(struct bench_fts_backend_update_context *)_ctx;
+
+	fts_backend_bench_update_flush(ctx);
+	i_free(ctx);
+	return 0;
+}
+
+static void
+fts_backend_bench_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				     struct mailbox *box)
+{
+	struct bench_fts_backend_update_context *ctx =
+		(struct bench_fts_backend_update_context *)_ctx;
+
+	fts_backend_bench_update_flush(ctx);
+	ctx->box = box;
+}
+
+static void
+fts_backend_bench_update_expunge(struct fts_backend_update_context *_ctx ATTR_UNUSED,
+				 uint32_t uid ATTR_UNUSED)
+{
+}
+
+static bool
+fts_backend_bench_update_set_build_key(struct fts_backend_update_context *_ctx,
+				       const struct fts_backend_build_key *key)
+{
+	struct bench_fts_backend_update_context *ctx =
+		(struct bench_fts_backend_update_context *)_ctx;
+
+	i_assert(key->uid >= ctx->last_uid);
+	ctx->last_uid = key->uid;
+	return TRUE;
+}
+
+static void
+fts_backend_bench_update_unset_build_key(struct fts_backend_update_context *_ctx ATTR_UNUSED)
+{
+}
+
+static int
+fts_backend_bench_update_build_more(struct fts_backend_update_context *_ctx ATTR_UNUSED,
+				    const unsigned char *data ATTR_UNUSED,
+				    size_t size ATTR_UNUSED)
+{
+	bench_token_count++;
+	return 0;
+}
+
+static int fts_backend_bench_refresh(struct fts_backend *_backend ATTR_UNUSED)
+{
+	return 0;
+}
+
+static int
+fts_backend_bench_lookup(struct fts_backend *_backend ATTR_UNUSED,
+			 struct mailbox *box ATTR_UNUSED,
+			 struct mail_search_arg *args ATTR_UNUSED,
+			 enum fts_lookup_flags flags ATTR_UNUSED,
+			 struct fts_result *result ATTR_UNUSED)
+{
+	return -1;
+}
+
+static const struct fts_backend fts_backend_bench = {
+	.name = "bench",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+	.v = {
+		.alloc = fts_backend_bench_alloc,
+		.init = fts_backend_bench_init,
+		.deinit = fts_backend_bench_deinit,
+		.get_last_uid = fts_backend_bench_get_last_uid,
+		.update_init = fts_backend_bench_update_init,
+		.update_deinit = fts_backend_bench_update_deinit,
+		.update_set_mailbox = fts_backend_bench_update_set_mailbox,
+		.update_expunge = fts_backend_bench_update_expunge,
+		.update_set_build_key = fts_backend_bench_update_set_build_key,
+		.update_unset_build_key = fts_backend_bench_update_unset_build_key,
+		.update_build_more = fts_backend_bench_update_build_more,
+		.refresh = fts_backend_bench_refresh,
+		.can_lookup = fts_backend_default_can_lookup,
+		.lookup = fts_backend_bench_lookup,
+	}
+};
+
+static struct mail_storage_hooks bench_fts_mail_storage_hooks = {
+	.mail_namespaces_added = fts_mail_namespaces_added,
+	.mailbox_list_created = fts_mailbox_list_created,
+	.mailbox_allocated = fts_mailbox_allocated,
+	.mail_allocated = fts_mail_allocated
+};
+
+static const char *const bench_words[] = {
+	"meeting", "tomorrow", "report", "quarterly", "budget", "project",
+	"deadline", "customer", "invoice", "attached", "please", "review",
+	"schedule", "conference", "update", "release", "server", "mailbox",
+	"question", "thanks", "regards", "following", "discussion", "agenda",
+};
+
+static void bench_append(struct mail_user *user, unsigned int count)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box = mailbox_alloc(ns->list, "INBOX", 0);
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	string_t *str = t_str_new(4096);
+	unsigned int i, j;
+	int ret;
+
+	if (mailbox_open(box) < 0)
+		i_fatal("mailbox_open() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL,
+					  __func__);
+	for (i = 0; i < count; i++) {
+		str_truncate(str, 0);
+		str_printfa(str, "From: user%u@example.com\n"
+			    "To: bench@example.com\n"
+			    "Subject: %s %s %u\n"
+			    "Message-ID: <%u@bench>\n\n",
+			    i % 50, bench_words[i % N_ELEMENTS(bench_words)],
+			    bench_words[(i / 3) % N_ELEMENTS(bench_words)],
+			    i, i);
+		for (j = 0; j < BENCH_BODY_WORDS; j++) {
+			str_append(str, bench_words[(i * 7 + j * 13) %
+						    N_ELEMENTS(bench_words)]);
+			str_append_c(str, j % 12 == 11 ? '\n' : ' ');
+		}
+		str_append_c(str, '\n');
+
+		input = i_stream_create_from_data(str_data(str), str_len(str));
+		save_ctx = mailbox_save_alloc(trans);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("mailbox_save_begin() failed");
+		do {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("mailbox_save_continue() failed");
+		} while ((ret = i_stream_read(input)) > 0);
+		i_assert(ret == -1);
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("mailbox_save_finish() failed: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&trans) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	mailbox_free(&box);
+}
+
+static uint64_t bench_index(struct mail_user *user, unsigned int count)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box = mailbox_alloc(ns->list, "INBOX", 0);
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	uint64_t ts_0, ts_1;
+	unsigned int indexed = 0;
+
+	if (mailbox_open(box) < 0 || mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_open() failed");
+
+	ts_0 = i_nanoseconds();
+	trans = mailbox_transaction_begin(box,
+					  MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC,
+					  __func__);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	ctx = mailbox_search_init(trans, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(ctx, &mail)) {
+		if (mail_precache(mail) < 0)
+			i_fatal("mail_precache() failed: %s",
+				mail_get_last_internal_error(mail, NULL));
+		indexed++;
+	}
+	if (mailbox_search_deinit(&ctx) < 0)
+		i_fatal("mailbox_search_deinit() failed");
+	if (mailbox_transaction_commit(&trans) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	ts_1 = i_nanoseconds();
+	i_assert(indexed == count);
+
+	mailbox_free(&box);
+	return ts_1 - ts_0;
+}
+
+int main(int argc, char **argv)
+{
+	struct test_mail_storage_ctx *ctx;
+	unsigned int i, process_count = BENCH_DEFAULT_PROCESSES;
+	unsigned int msg_count = BENCH_DEFAULT_MESSAGES;
+	uint64_t nsecs, tokens_1 = 0;
+	const char *error;
+
+	master_service = master_service_init("bench-fts-build",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (argc > 3 ||
+	    (argc > 1 && (str_to_uint(argv[1], &process_count) < 0 ||
+			  process_count == 0)) ||
+	    (argc > 2 && (str_to_uint(argv[2], &msg_count) < 0 ||
+			  msg_count == 0))) {
+		fprintf(stderr, "Usage: %s [<max processes> [<message count>]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	ctx = test_mail_storage_init();
+	fts_library_init();
+	fts_backend_register(&fts_backend_bench);
+	mail_storage_hooks_add_internal(&bench_fts_mail_storage_hooks);
+
+	for (i = 1; i <= process_count; i++) T_BEGIN {
+		const char *const extra_input[] = {
+			"plugin/fts=bench",
+			"plugin/fts_languages=en",
+			"plugin/fts_tokenizers=generic email-address",
+			t_strdup_printf("plugin/fts_index_processes=%u", i),
+			NULL
+		};
+		struct test_mail_storage_settings set = {
+			.driver = "sdbox",
+			.extra_input = extra_input,
+		};
+
+		test_mail_storage_init_user(ctx, &set);
+		if (fts_mail_user_init(ctx->user, TRUE, &error) < 0)
+			i_fatal("fts_mail_user_init() failed: %s", error);
+		bench_append(ctx->user, msg_count);
+		bench_token_count = 0;
+		nsecs = bench_index(ctx->user, msg_count);
+		fts_mail_user_deinit(ctx->user);
+		test_mail_storage_deinit_user(ctx);
+
+		/* every round must see the same tokens */
+		if (i == 1)
+			tokens_1 = bench_token_count;
+		else if (bench_token_count != tokens_1) {
+			i_fatal("%u processes indexed %"PRIu64" tokens, "
+				"expected %"PRIu64, i, bench_token_count,
+				tokens_1);
+		}
+		printf("%u processes: %.0lf mails/sec\n", i,
+		       (double)msg_count * 1e9 / nsecs);
+	} T_END;
+
+	mail_storage_hooks_remove_internal(&bench_fts_mail_storage_hooks);
+	fts_backend_unregister(fts_backend_bench.name);
+	fts_library_deinit();
+	test_mail_storage_deinit(&ctx);
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -0,0 +1,507 @@
+/* Copyright (c) 2024 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "write-full.h"
+#include "time-util.h"
+#include "master-service.h"
+#include "mail-storage-private.h"
+#include "fts-api-private.h"
+#include "fts-build-mail.h"
+#include "fts-build-parallel.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* Each worker process indexes this many mails at a time. The chunks are
+   assigned to the workers round-robin. */
+#define FTS_BUILD_PARALLEL_CHUNK_SIZE 32
+/* Write the records to the pipe after this much output */
+#define FTS_BUILD_PARALLEL_OUTPUT_FLUSH_SIZE (64*1024)
+/* Maximum size of a single record */
+#define FTS_BUILD_PARALLEL_MAX_RECORD_SIZE (1024*1024)
+
+/* The worker processes send the fts_backend_update_*() calls they would
+   have made to the parent process as records:
+   <uint32 size><type><size-1 bytes of data> */
+enum fts_build_record_type {
+	/* <uint32 uid><uint8 type><uint8 strings mask>[<string>\0..] */
+	FTS_BUILD_RECORD_SET_KEY = 'K',
+	FTS_BUILD_RECORD_UNSET_KEY = 'U',
+	/* <data> */
+	FTS_BUILD_RECORD_BUILD_MORE = 'D',
+	/* <uint32 seq> */
+	FTS_BUILD_RECORD_MAIL_DONE = 'M',
+	/* <uint32 seq> - the rest of the mails are left for the parent */
+	FTS_BUILD_RECORD_MAIL_FAILED = 'F',
+};
+
+enum fts_build_key_strings {
+	FTS_BUILD_KEY_HDR_NAME = 0x01,
+	FTS_BUILD_KEY_BODY_CONTENT_TYPE = 0x02,
+	FTS_BUILD_KEY_BODY_CONTENT_DISPOSITION = 0x04,
+};
+
+struct fts_build_record_context {
+	struct fts_backend_update_context ctx;
+	struct fts_backend backend;
+
+	int fd;
+	buffer_t *output;
+};
+
+struct fts_build_worker {
+	pid_t pid;
+	int fd;
+	struct istream *input;
+	size_t skip;
+};
+
+static void
+fts_build_record_append(struct fts_build_record_context *rctx,
+			enum fts_build_record_type type,
+			const void *data, size_t size)
+{
+	uint32_t rec_size = size + 1;
+	unsigned char type_chr = type;
+
+	buffer_append(rctx->output, &rec_size, sizeof(rec_size));
+	buffer_append_c(rctx->output, type_chr);
+	buffer_append(rctx->output, data, size);
+}
+
+static void
+fts_build_record_append_str(buffer_t *buf, const char *str,
+			    enum fts_build_key_strings bit, uint8_t *mask)
+{
+	if (str != NULL) {
+		buffer_append(buf, str, strlen(str) + 1);
+		*mask |= bit;
+	}
+}
+
+static bool
+fts_build_record_set_build_key(struct fts_backend_update_context *ctx,
+			       const struct fts_backend_build_key *key)
+{
+	struct fts_build_record_context *rctx =
+		container_of(ctx, struct fts_build_record_context, ctx);
+	buffer_t *buf = t_buffer_create(128);
+	uint8_t type = key->type, mask = 0;
+
+	buffer_append(buf, &key->uid, sizeof(key->uid));
+	buffer_append(buf, &type, sizeof(type));
+	buffer_append_c(buf, 0);
+	fts_build_record_append_str(buf, key->hdr_name,
+				    FTS_BUILD_KEY_HDR_NAME, &mask);
+	fts_build_record_append_str(buf, key->body_content_type,
+				    FTS_BUILD_KEY_BODY_CONTENT_TYPE, &mask);
+	fts_build_record_append_str(buf, key->body_content_disposition,
+				    FTS_BUILD_KEY_BODY_CONTENT_DISPOSITION,
+				    &mask);
+	buffer_write(buf, sizeof(key->uid) + sizeof(type), &mask, 1);
+	fts_build_record_append(rctx, FTS_BUILD_RECORD_SET_KEY,
+				buf->data, buf->used);
+	return TRUE;
+}
+
+static void
+fts_build_record_unset_build_key(struct fts_backend_update_context *ctx)
+{
+	struct fts_build_record_context *rctx =
+		container_of(ctx, struct fts_build_record_context, ctx);
+
+	fts_build_record_append(rctx, FTS_BUILD_RECORD_UNSET_KEY, NULL, 0);
+}
+
+static int
+fts_build_record_build_more(struct fts_backend_update_context *ctx,
+			    const unsigned char *data, size_t size)
+{
+	struct fts_build_record_context *rctx =
+		container_of(ctx, struct fts_build_record_context, ctx);
+
+	if (size >= FTS_BUILD_PARALLEL_MAX_RECORD_SIZE)
+		return -1;
+	fts_build_record_append(rctx, FTS_BUILD_RECORD_BUILD_MORE, data, size);
+	return 0;
+}
+
+static const struct fts_backend_vfuncs fts_build_record_vfuncs = {
+	.update_set_build_key = fts_build_record_set_build_key,
+	.update_unset_build_key = fts_build_record_unset_build_key,
+	.update_build_more = fts_build_record_build_more,
+};
+
+static int fts_build_record_flush(struct fts_build_record_context *rctx)
+{
+	if (write_full(rctx->fd, rctx->output->data, rctx->output->used) < 0)
+		return -1;
+	buffer_set_used_size(rctx->output, 0);
+	return 0;
+}
+
+static void ATTR_NORETURN
+fts_build_worker_run(struct fts_backend_update_context *update_ctx,
+		     struct mailbox *box, uint32_t seq1, uint32_t seq2,
+		     unsigned int worker_idx, unsigned int worker_count,
+		     int fd)
+{
+	struct fts_build_record_context rctx;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	uint32_t seq, chunk_seq, chunk_end;
+	int ret = 0;
+
+	master_service_forked_child(master_service);
+	/* the index files are shared with the parent process, which is the
+	   only one allowed to write to them. */
+	box->mail_cache_disabled = TRUE;
+
+	i_zero(&rctx);
+	rctx.backend = *update_ctx->backend;
+	rctx.backend.v = fts_build_record_vfuncs;
+	rctx.ctx.backend = &rctx.backend;
+	rctx.ctx.normalizer = update_ctx->normalizer;
+	rctx.ctx.cur_box = box;
+	rctx.ctx.backend_box = box;
+	rctx.fd = fd;
+	rctx.output = buffer_create_dynamic(default_pool,
+		FTS_BUILD_PARALLEL_OUTPUT_FLUSH_SIZE + 1024);
+
+	trans = mailbox_transaction_begin(box,
+		MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC, "fts parallel indexing");
+	mail = mail_alloc(trans, MAIL_FETCH_STREAM_HEADER |
+			  MAIL_FETCH_STREAM_BODY, NULL);
+	chunk_seq = seq1 + worker_idx * FTS_BUILD_PARALLEL_CHUNK_SIZE;
+	for (; chunk_seq <= seq2 && ret == 0;
+	     chunk_seq += worker_count * FTS_BUILD_PARALLEL_CHUNK_SIZE) {
+		chunk_end = I_MIN(seq2, chunk_seq +
+				  FTS_BUILD_PARALLEL_CHUNK_SIZE - 1);
+		for (seq = chunk_seq; seq <= chunk_end; seq++) {
+			enum fts_build_record_type type =
+				FTS_BUILD_RECORD_MAIL_DONE;
+
+			mail_set_seq(mail, seq);
+			if (fts_build_mail(&rctx.ctx, mail) < 0) {
+				/* let the parent process retry this and log
+				   the error */
+				type = FTS_BUILD_RECORD_MAIL_FAILED;
+				ret = -1;
+			}
+			fts_build_record_append(&rctx, type, &seq, sizeof(seq));
+			if (ret < 0 || rctx.output->used >=
+			    FTS_BUILD_PARALLEL_OUTPUT_FLUSH_SIZE) {
+				if (fts_build_record_flush(&rctx) < 0) {
+					/* parent stopped reading */
+					ret = -1;
+				}
+			}
+			if (ret < 0)
+				break;
+		}
+	}
+	if (ret == 0)
+		(void)fts_build_record_flush(&rctx);
+	/* Nothing is cleaned up, because everything is shared with the
+	   parent process. Especially atexit() callbacks must not be run. */
+	_exit(0);
+}
+
+static bool
+fts_build_worker_create(struct fts_backend_update_context *update_ctx,
+			struct mailbox *box, uint32_t seq1, uint32_t seq2,
+			struct fts_build_worker *workers,
+			unsigned int worker_idx, unsigned int worker_count)
+{
+	struct event *event = update_ctx->backend->event;
+	struct fts_build_worker *worker = &workers[worker_idx];
+	pid_t pid;
+	int fd[2];
+
+	if (pipe(fd) < 0) {
+		e_error(event, "pipe() failed: %m");
+		return FALSE;
+	}
+	if ((pid = fork()) == (pid_t)-1) {
+		e_error(event, "fork() failed: %m");
+		i_close_fd(&fd[0]);
+		i_close_fd(&fd[1]);
+		return FALSE;
+	}
+	if (pid == 0) {
+		for (unsigned int i = 0; i < worker_idx; i++)
+			i_close_fd(&workers[i].fd);
+		i_close_fd(&fd[0]);
+		fts_build_worker_run(update_ctx, box, seq1, seq2,
+				     worker_idx, worker_count, fd[1]);
+	}
+	i_close_fd(&fd[1]);
+	worker->pid = pid;
+	worker->fd = fd[0];
+	worker->input = i_stream_create_fd(worker->fd,
+		FTS_BUILD_PARALLEL_MAX_RECORD_SIZE + sizeof(uint32_t));
+	return TRUE;
+}
+
+static void
+fts_build_workers_destroy(struct fts_backend_update_context *update_ctx,
+			  struct fts_build_worker *workers,
+			  unsigned int worker_count, bool kill_workers)
+{
+	struct event *event = update_ctx->backend->event;
+	int status;
+
+	for (unsigned int i = 0; i < worker_count; i++) {
+		if (workers[i].pid == 0)
+			continue;
+		i_stream_destroy(&workers[i].input);
+		i_close_fd(&workers[i].fd);
+		if (kill_workers && kill(workers[i].pid, SIGKILL) < 0)
+			e_error(event, "kill(%ld) failed: %m", (long)workers[i].pid);
+		while (waitpid(workers[i].pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				if (errno != ECHILD) {
+					e_error(event, "waitpid(%ld) failed: %m",
+						(long)workers[i].pid);
+				}
+				break;
+			}
+		}
+	}
+}
+
+static int
+fts_build_worker_read_record(struct fts_build_worker *worker,
+			     enum fts_build_record_type *type_r,
+			     const unsigned char **data_r, size_t *size_r)
+{
+	const unsigned char *data;
+	size_t size;
+	uint32_t rec_size;
+	int ret;
+
+	i_stream_skip(worker->input, worker->skip);
+	worker->skip = 0;
+
+	while ((ret = i_stream_read_bytes(worker->input, &data, &size,
+					  sizeof(rec_size))) == 0) ;
+	if (ret < 0)
+		return -1;
+	memcpy(&rec_size, data, sizeof(rec_size));
+	if (rec_size == 0 || rec_size > FTS_BUILD_PARALLEL_MAX_RECORD_SIZE)
+		return -1;
+	while ((ret = i_stream_read_bytes(worker->input, &data, &size,
+					  sizeof(rec_size) + rec_size)) == 0) ;
+	if (ret < 0)
+		return -1;
+
+	*type_r = data[sizeof(rec_size)];
+	*data_r = data + sizeof(rec_size) + 1;
+	*size_r = rec_size - 1;
+	worker->skip = sizeof(rec_size) + rec_size;
+	return 0;
+}
+
+static bool
+fts_build_record_parse_str(const unsigned char **data, const unsigned char *end,
+			   uint8_t mask, enum fts_build_key_strings bit,
+			   const char **str_r)
+{
+	const unsigned char *p;
+
+	if ((mask & bit) == 0) {
+		*str_r = NULL;
+		return TRUE;
+	}
+	p = memchr(*data, '\0', end - *data);
+	if (p == NULL)
+		return FALSE;
+	*str_r = (const char *)*data;
+	*data = p + 1;
+	return TRUE;
+}
+
+static bool
+fts_build_record_parse_key(const unsigned char *data, size_t size,
+			   struct fts_backend_build_key *key_r)
+{
+	const unsigned char *end = data + size;
+	uint8_t mask;
+
+	i_zero(key_r);
+	if (size < sizeof(key_r->uid) + 2)
+		return FALSE;
+	memcpy(&key_r->uid, data, sizeof(key_r->uid));
+	data += sizeof(key_r->uid);
+	key_r->type = *data++;
+	mask = *data++;
+	return fts_build_record_parse_str(&data, end, mask,
+			FTS_BUILD_KEY_HDR_NAME, &key_r->hdr_name) &&
+		fts_build_record_parse_str(&data, end, mask,
+			FTS_BUILD_KEY_BODY_CONTENT_TYPE,
+			&key_r->body_content_type) &&
+		fts_build_record_parse_str(&data, end, mask,
+			FTS_BUILD_KEY_BODY_CONTENT_DISPOSITION,
+			&key_r->body_content_disposition);
+}
+
+/* Read the records of the mail into the buffer. Returns TRUE if the worker
+   indexed the whole mail, FALSE if it failed or died. */
+static bool
+fts_build_worker_read_mail(struct fts_backend_update_context *update_ctx,
+			   struct fts_build_worker *worker, uint32_t seq,
+			   buffer_t *records)
+{
+	struct event *event = update_ctx->backend->event;
+	struct fts_backend_build_key key;
+	enum fts_build_record_type type;
+	const unsigned char *data;
+	size_t size;
+	uint32_t rec_size, rec_seq;
+
+	for (;;) {
+		if (fts_build_worker_read_record(worker, &type,
+						 &data, &size) < 0) {
+			e_error(event, "Indexing worker process %ld died "
+				"unexpectedly while indexing seq=%u",
+				(long)worker->pid, seq);
+			return FALSE;
+		}
+
+		switch (type) {
+		case FTS_BUILD_RECORD_SET_KEY:
+			if (!fts_build_record_parse_key(data, size, &key))
+				return FALSE;
+			/* fall through */
+		case FTS_BUILD_RECORD_UNSET_KEY:
+		case FTS_BUILD_RECORD_BUILD_MORE:
+			rec_size = size + 1;
+			buffer_append(records, &rec_size, sizeof(rec_size));
+			buffer_append_c(records, type);
+			buffer_append(records, data, size);
+			break;
+		case FTS_BUILD_RECORD_MAIL_DONE:
+		case FTS_BUILD_RECORD_MAIL_FAILED:
+			if (size != sizeof(rec_seq))
+				return FALSE;
+			memcpy(&rec_seq, data, sizeof(rec_seq));
+			return rec_seq == seq &&
+				type == FTS_BUILD_RECORD_MAIL_DONE;
+		default:
+			return FALSE;
+		}
+	}
+}
+
+/* Returns 1 if the mail was indexed, 0 if the worker failed and -1 if the
+   backend failed. */
+static int
+fts_build_worker_replay_mail(struct fts_backend_update_context *update_ctx,
+			     struct fts_build_worker *worker, uint32_t seq,
+			     buffer_t *records)
+{
+	struct fts_backend_build_key key;
+	enum fts_build_record_type type;
+	const unsigned char *data, *end, *rec_data;
+	size_t size;
+	uint32_t rec_size;
+	bool key_set = FALSE;
+	int ret = 1;
+
+	/* Nothing is sent to the backend before the worker has finished the
+	   whole mail. Otherwise a failed mail would be partially indexed
+	   before the parent process indexes it again from the beginning. */
+	buffer_set_used_size(records, 0);
+	if (!fts_build_worker_read_mail(update_ctx, worker, seq, records))
+		return 0;
+
+	data = records->data;
+	end = data + records->used;
+	while (data < end && ret > 0) {
+		memcpy(&rec_size, data, sizeof(rec_size));
+		type = data[sizeof(rec_size)];
+		rec_data = data + sizeof(rec_size) + 1;
+		size = rec_size - 1;
+		data += sizeof(rec_size) + rec_size;
+
+		switch (type) {
+		case FTS_BUILD_RECORD_SET_KEY:
+			/* already checked by fts_build_worker_read_mail() */
+			if (!fts_build_record_parse_key(rec_data, size, &key))
+				i_unreached();
+			key_set = fts_backend_update_set_build_key(update_ctx,
+								   &key);
+			break;
+		case FTS_BUILD_RECORD_UNSET_KEY:
+			fts_backend_update_unset_build_key(update_ctx);
+			key_set = FALSE;
+			break;
+		case FTS_BUILD_RECORD_BUILD_MORE:
+			/* the backend didn't want this key */
+			if (!key_set)
+				break;
+			if (fts_backend_update_build_more(update_ctx, rec_data,
+							  size) < 0)
+				ret = -1;
+			break;
+		default:
+			i_unreached();
+		}
+	}
+	if (ret < 1)
+		fts_backend_update_unset_build_key(update_ctx);
+	return ret;
+}
+
+int fts_build_mails_parallel(struct fts_backend_update_context *update_ctx,
+			     struct mailbox *box, uint32_t seq1, uint32_t seq2,
+			     unsigned int process_count, uint32_t *next_seq_r)
+{
+	struct fts_build_worker *workers;
+	buffer_t *records;
+	struct timeval start_time, end_time;
+	unsigned int i, chunk_idx;
+	uint32_t seq;
+	int ret = 1;
+
+	i_assert(seq1 <= seq2);
+	i_assert(process_count > 0);
+
+	*next_seq_r = seq1;
+	workers = t_new(struct fts_build_worker, process_count);
+	i_gettimeofday(&start_time);
+	for (i = 0; i < process_count; i++) {
+		if (!fts_build_worker_create(update_ctx, box, seq1, seq2,
+					     workers, i, process_count)) {
+			fts_build_workers_destroy(update_ctx, workers,
+						  process_count, TRUE);
+			return 0;
+		}
+	}
+
+	records = buffer_create_dynamic(default_pool,
+					FTS_BUILD_PARALLEL_OUTPUT_FLUSH_SIZE);
+	for (seq = seq1; seq <= seq2; seq++) {
+		chunk_idx = (seq - seq1) / FTS_BUILD_PARALLEL_CHUNK_SIZE;
+		ret = fts_build_worker_replay_mail(update_ctx,
+			&workers[chunk_idx % process_count], seq, records);
+		if (ret <= 0)
+			break;
+	}
+	buffer_free(&records);
+	fts_build_workers_destroy(update_ctx, workers, process_count,
+				  seq <= seq2);
+	*next_seq_r = seq;
+
+	i_gettimeofday(&end_time);
+	long long usecs = timeval_diff_usecs(&end_time, &start_time);
+	e_debug(update_ctx->backend->event,
+		"%s: Indexed %u mails with %u processes in %lld ms "
+		"(%llu mails/sec)", mailbox_get_vname(box), seq - seq1,
+		process_count, usecs / 1000,
+		(unsigned long long)(seq - seq1) * 1000000 / I_MAX(usecs, 1));
+	return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef FTS_BUILD_PARALLEL_H
+#define FTS_BUILD_PARALLEL_H
+
+/* Don't bother creating worker processes for fewer mails than this */
+#define FTS_BUILD_PARALLEL_MIN_MAILS 100
+
+/* Build indexes for mails seq1..seq2 in the box. The mails are parsed,
+   decoded and tokenized by process_count child processes, while this
+   process stays the only one writing to the FTS backend. The mails are
+   written to the backend in sequence order. next_seq_r is set to the first
+   mail that wasn't indexed. Returns 0 if ok, -1 if the backend failed.
+   If the worker processes fail, 0 is returned and the caller should
+   continue indexing the rest of the mails from next_seq_r by itself. */
+int fts_build_mails_parallel(struct fts_backend_update_context *update_ctx,
+			     struct mailbox *box, uint32_t seq1, uint32_t seq2,
+			     unsigned int process_count, uint32_t *next_seq_r);
+
+#endif
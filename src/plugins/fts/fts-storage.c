@@ -12,6 +12,7 @@
 #include "fts-tokenizer.h"
 #include "fts-indexer.h"
 #include "fts-build-mail.h"
+#include "fts-build-parallel.h"
 #include "fts-search-serialize.h"
 #include "fts-plugin.h"
 #include "fts-user.h"
@@ -57,6 +58,7 @@ struct fts_transaction_context {
 	uint32_t next_index_seq;
 	uint32_t highest_virtual_uid;
 	unsigned int precache_extra_count;
+	unsigned int index_processes;
 
 	bool indexing:1;
 	bool precached:1;
@@ -486,6 +488,7 @@ static int fts_mail_precache_init(struct mail *_mail)
 {
 	struct fts_transaction_context *ft = FTS_CONTEXT_REQUIRE(_mail->transaction);
 	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT_REQUIRE(_mail->box->list);
+	const char *value;
 	uint32_t last_seq;
 
 	if (fts_mailbox_get_last_cached_seq(_mail->box, &last_seq) < 0) {
@@ -495,12 +498,30 @@ static int fts_mail_precache_init(struct mail *_mail)
 
 	ft->precached = TRUE;
 	ft->next_index_seq = last_seq + 1;
+	value = mail_user_plugin_getenv(_mail->box->storage->user,
+					"fts_index_processes");
+	if (value == NULL || str_to_uint(value, &ft->index_processes) < 0)
+		ft->index_processes = 0;
 	if (flist->update_ctx == NULL)
 		flist->update_ctx = fts_backend_update_init(flist->backend);
 	flist->update_ctx_refcount++;
 	return 0;
 }
 
+static bool fts_mailbox_can_index_parallel(struct mailbox *box)
+{
+	/* The worker processes need to be able to read the mails
+	   independently of this process. Remote storages would need their
+	   own connections, and mbox shares the open file with this process.
+	   Reading a renamed maildir file syncs the mailbox, which would make
+	   the worker write to the shared dovecot-uidlist and index files. */
+	if ((box->storage->class_flags &
+	     (MAIL_STORAGE_CLASS_FLAG_NO_ROOT |
+	      MAIL_STORAGE_CLASS_FLAG_OPEN_STREAMS)) != 0)
+		return FALSE;
+	return strcmp(box->storage->name, "maildir") != 0;
+}
+
 static int fts_mail_index(struct mail *_mail)
 {
 	struct fts_transaction_context *ft = FTS_CONTEXT_REQUIRE(_mail->transaction);
@@ -536,6 +557,31 @@ static int fts_mail_index(struct mail *_mail)
 		}
 	}
 
+	if (ft->index_processes > 1 && ft->next_index_seq <= _mail->seq &&
+	    fts_mailbox_can_index_parallel(_mail->box)) {
+		/* try this only once per transaction */
+		unsigned int process_count = ft->index_processes;
+		uint32_t msgs_count =
+			mail_index_view_get_messages_count(_mail->box->view);
+
+		ft->index_processes = 0;
+		if (msgs_count - ft->next_index_seq + 1 >=
+		    FTS_BUILD_PARALLEL_MIN_MAILS) {
+			fts_backend_update_set_mailbox(flist->update_ctx,
+						       _mail->box);
+			if (fts_build_mails_parallel(flist->update_ctx,
+						     _mail->box,
+						     ft->next_index_seq,
+						     msgs_count, process_count,
+						     &ft->next_index_seq) < 0)
+				return -1;
+			if (ft->next_index_seq > _mail->seq + 1) {
+				ft->precache_extra_count +=
+					ft->next_index_seq - _mail->seq - 1;
+			}
+		}
+	}
+
 	if (ft->next_index_seq < _mail->seq) {
 		/* we'll first need to index all the missing mails up to the
 		   current one. */
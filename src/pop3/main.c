@@ -440,6 +440,10 @@ int main(int argc, char *argv[])
 	/* NOTE: login_set.*_socket_path are now invalid due to data stack
 	   having been freed */
 
+	if (!IS_STANDALONE() &&
+	    mail_storage_service_prewarm(storage_service, &error) < 0)
+		i_error("%s", error);
+
 	/* fake that we're running, so we know if client was destroyed
 	   while handling its initial input */
 	io_loop_set_running(current_ioloop);